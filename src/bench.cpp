@@ -0,0 +1,413 @@
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <new>
+#include <algorithm>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "dbfutil.h"
+#include "shputil.h"
+#include "logging.h"
+
+//
+// synthetic layer generators and read/write benchmarks, one JSON object per line on stdout:
+//   bench [--features N] [--parts P] [--vertices V] [--columns C] [--reps R] [--dir D]
+//
+// every bench runs in a child process of its own, so peak_rss_kb is that bench's high
+// water mark (plus the small parent it forked from) rather than the largest of every
+// bench before it. diagnostics go to stderr, stdout is only the JSON.
+//
+
+static uint64_t alloc_count = 0;
+static uint64_t alloc_bytes = 0;
+
+void *operator new(size_t size) {
+  alloc_count += 1;
+  alloc_bytes += size;
+  void *ptr = malloc(size ? size : 1);
+  if(!ptr) {
+    throw std::bad_alloc();
+  }
+  return(ptr);
+}
+
+//
+// kept out of line so the free() never appears next to a builtin new after inlining
+//
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept {
+  free(ptr);
+}
+
+//
+// std::pmr::new_delete_resource goes through the aligned forms, and the nothrow forms
+// aren't guaranteed to land in the plain one, so all of them count
+//
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  alloc_count += 1;
+  alloc_bytes += size;
+  return(malloc(size ? size : 1));
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+  alloc_count += 1;
+  alloc_bytes += size;
+  void *ptr = 0;
+  size_t alignment = std::max((size_t) align, sizeof(void *));
+  if(posix_memalign(&ptr, alignment, size ? size : 1) != 0) {
+    throw std::bad_alloc();
+  }
+  return(ptr);
+}
+
+void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+  alloc_count += 1;
+  alloc_bytes += size;
+  void *ptr = 0;
+  size_t alignment = std::max((size_t) align, sizeof(void *));
+  if(posix_memalign(&ptr, alignment, size ? size : 1) != 0) {
+    return(0);
+  }
+  return(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, std::align_val_t) noexcept {
+  free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+  free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+  free(ptr);
+}
+
+
+struct bench_config {
+  uint32_t features;
+  uint32_t parts;
+  uint32_t vertices;
+  uint32_t columns;
+  uint32_t reps;
+  std::string dir;
+};
+
+
+struct bench_result {
+  double secs;
+  uint64_t allocs;
+  uint64_t alloc_bytes;
+};
+
+
+//
+// deterministic generator, same layers on every run and platform
+//
+class lcg {
+public:
+  lcg(uint64_t seed) { state = seed; }
+  double uniform() {
+    state = (state * 6364136223846793005ULL) + 1442695040888963407ULL;
+    return((double) (state >> 11) / 9007199254740992.0);
+  }
+  double range(double lo, double hi) { return(lo + ((hi - lo) * uniform())); }
+  uint64_t state;
+};
+
+
+static shputil::polypart make_ring(lcg &rng, double cx, double cy, double radius, uint32_t vertices) {
+
+  //
+  // closed, clockwise (outer ring orientation per the spec)
+  //
+  shputil::polypart ring;
+  uint32_t nverts = (vertices < 4) ? 4 : vertices;
+  for(uint32_t ii=0; ii < (nverts - 1); ++ii) {
+    double angle = -2.0 * M_PI * ii / (nverts - 1);
+    double r = radius * rng.range(0.7, 1.0);
+    ring.points.push_back(shputil::pointshape(cx + (r * cos(angle)), cy + (r * sin(angle))));
+  }
+  ring.points.push_back(ring.points.front());
+  return(ring);
+}
+
+
+static shputil::polypart make_line(lcg &rng, double x, double y, uint32_t vertices) {
+  shputil::polypart line;
+  for(uint32_t ii=0; ii < vertices; ++ii) {
+    line.points.push_back(shputil::pointshape(x, y));
+    x += rng.range(-0.01, 0.01);
+    y += rng.range(-0.01, 0.01);
+  }
+  return(line);
+}
+
+
+static void generate_layer(shputil::shape_type stype, const bench_config &config, shputil::shapefile &shp) {
+
+  lcg rng(0x5eed + (uint64_t) stype);
+  shp.shapes.clear();
+  shp.shapes.reserve(config.features);
+
+  for(uint32_t ii=0; ii < config.features; ++ii) {
+    double x = rng.range(-180.0, 180.0);
+    double y = rng.range(-90.0, 90.0);
+
+    if(stype == shputil::shape_type::point) {
+      shp.shapes.push_back(std::make_shared<shputil::pointshape>(x, y));
+    }
+    else if(stype == shputil::shape_type::multipoint) {
+      auto mp = std::make_shared<shputil::multipointshape>();
+      for(uint32_t jj=0; jj < config.vertices; ++jj) {
+	mp->points.push_back(shputil::pointshape(x + rng.range(-0.1, 0.1), y + rng.range(-0.1, 0.1)));
+      }
+      shp.shapes.push_back(mp);
+    }
+    else if(stype == shputil::shape_type::polyline) {
+      auto pl = std::make_shared<shputil::polyline>();
+      for(uint32_t jj=0; jj < config.parts; ++jj) {
+	pl->parts.push_back(make_line(rng, x + (jj * 0.05), y, config.vertices));
+      }
+      shp.shapes.push_back(pl);
+    }
+    else if(stype == shputil::shape_type::polygon) {
+      auto pg = std::make_shared<shputil::polygon>();
+      for(uint32_t jj=0; jj < config.parts; ++jj) {
+	pg->rings.push_back(make_ring(rng, x + (jj * 0.25), y, 0.1, config.vertices));
+      }
+      shp.shapes.push_back(pg);
+    }
+  }
+}
+
+
+static void generate_table(const bench_config &config, dbfutil::dbftable &table) {
+
+  lcg rng(0xdbf);
+  static const char *categories[] = { "residential", "commercial", "industrial", "agricultural", "public" };
+
+  table.header.fields.clear();
+  table.rows.clear();
+  for(uint32_t col=0; col < config.columns; ++col) {
+    char name[16];
+    snprintf(name, sizeof(name), "COL%u", col);
+    switch(col % 3) {
+    case 0: table.header.fields.push_back(dbfutil::dbffield_def(name, "C", 24)); break;
+    case 1: table.header.fields.push_back(dbfutil::dbffield_def(name, "N", 10)); break;
+    default: table.header.fields.push_back(dbfutil::dbffield_def(name, 19, 11)); break;
+    }
+  }
+
+  table.rows.reserve(config.features);
+  for(uint32_t ii=0; ii < config.features; ++ii) {
+    dbfutil::dbfrow row;
+    for(uint32_t col=0; col < config.columns; ++col) {
+      switch(col % 3) {
+      case 0: row.values.push_back(dbfutil::dbffield_value(std::string(categories[(ii + col) % 5]))); break;
+      case 1: row.values.push_back(dbfutil::dbffield_value((uint32_t) (rng.uniform() * 1000000))); break;
+      default: row.values.push_back(dbfutil::dbffield_value(rng.range(-1000.0, 1000.0))); break;
+      }
+    }
+    table.rows.push_back(row);
+  }
+}
+
+
+static uint64_t file_size(const std::string &path) {
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0) {
+    return(0);
+  }
+  return(st.st_size);
+}
+
+
+static long peak_rss_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return(usage.ru_maxrss / 1024); // bytes on darwin
+#else
+  return(usage.ru_maxrss);
+#endif
+}
+
+
+template <class F> static bool run_bench(const bench_config &config, F fn, bench_result &best) {
+
+  //
+  // keeps the fastest of config.reps runs
+  //
+  best.secs = -1.0;
+  for(uint32_t rep=0; rep < config.reps; ++rep) {
+    uint64_t allocs = alloc_count;
+    uint64_t bytes = alloc_bytes;
+    auto start = std::chrono::steady_clock::now();
+    if(!fn()) {
+      return(false);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if((best.secs < 0.0) || (elapsed.count() < best.secs)) {
+      best.secs = elapsed.count();
+      best.allocs = alloc_count - allocs;
+      best.alloc_bytes = alloc_bytes - bytes;
+    }
+  }
+
+  return(true);
+}
+
+
+static void report(const char *bench, const char *layer, const bench_config &config, uint64_t bytes, const bench_result &result) {
+  double secs = (result.secs > 0.0) ? result.secs : 1e-9;
+  printf("{\"bench\":\"%s\",\"layer\":\"%s\",\"features\":%u,\"parts\":%u,\"vertices\":%u,\"columns\":%u,"
+	 "\"bytes\":%llu,\"secs\":%.6f,\"mb_per_s\":%.3f,\"features_per_s\":%.1f,"
+	 "\"allocs\":%llu,\"alloc_bytes\":%llu,\"peak_rss_kb\":%ld}\n",
+	 bench, layer, config.features, config.parts, config.vertices, config.columns,
+	 (unsigned long long) bytes, result.secs, (bytes / (1024.0 * 1024.0)) / secs, config.features / secs,
+	 (unsigned long long) result.allocs, (unsigned long long) result.alloc_bytes, peak_rss_kb());
+  fflush(stdout);
+}
+
+
+template <class F> static bool run_isolated(F fn) {
+  fflush(stdout); // or the child writes out the parent's buffered lines again
+  pid_t pid = fork();
+  if(pid < 0) {
+    log_error("couldn't fork a bench process\n");
+    return(false);
+  }
+
+  if(pid == 0) {
+    bool ok = fn();
+    fflush(stdout);
+    _exit(ok ? 0 : 1);
+  }
+
+  int status = 0;
+  return((waitpid(pid, &status, 0) == pid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+}
+
+
+static bool bench_write_layer(shputil::shape_type stype, const char *name, const bench_config &config) {
+
+  shputil::shapefile shp;
+  generate_layer(stype, config, shp);
+  std::string path = config.dir + "/bench_" + name + ".shp";
+
+  bench_result result;
+  if(!run_bench(config, [&]() { return(shputil::write_shp(path, shp)); }, result)) {
+    log_error("write_shp failed for %s\n", name);
+    return(false);
+  }
+  report("write_shp", name, config, file_size(path), result);
+  return(true);
+}
+
+
+static bool bench_read_layer(const char *name, const bench_config &config) {
+
+  std::string path = config.dir + "/bench_" + name + ".shp";
+  shputil::shapefile readback;
+  bench_result result;
+  if(!run_bench(config, [&]() { return(shputil::read_shp(path, readback)); }, result)) {
+    log_error("read_shp failed for %s\n", name);
+    return(false);
+  }
+  report("read_shp", name, config, file_size(path), result);
+  return(true);
+}
+
+
+static bool bench_write_table(const bench_config &config) {
+
+  dbfutil::dbftable table;
+  generate_table(config, table);
+  std::string path = config.dir + "/bench_table.dbf";
+
+  bench_result result;
+  if(!run_bench(config, [&]() { return(dbfutil::write_dbf(path, table)); }, result)) {
+    log_error("write_dbf failed\n");
+    return(false);
+  }
+  report("write_dbf", "table", config, file_size(path), result);
+  return(true);
+}
+
+
+static bool bench_read_table(const bench_config &config) {
+
+  std::string path = config.dir + "/bench_table.dbf";
+  dbfutil::dbftable readback;
+  bench_result result;
+  if(!run_bench(config, [&]() { return(dbfutil::read_dbf(path, readback)); }, result)) {
+    log_error("read_dbf failed\n");
+    return(false);
+  }
+  report("read_dbf", "table", config, file_size(path), result);
+  return(true);
+}
+
+
+int main(int argc, char **argv) {
+
+  bench_config config;
+  config.features = 100000;
+  config.parts = 2;
+  config.vertices = 32;
+  config.columns = 24;
+  config.reps = 3;
+  config.dir = ".";
+
+  for(int ii=1; ii < (argc - 1); ii += 2) {
+    std::string arg = argv[ii];
+    if(arg == "--features") config.features = atoi(argv[ii + 1]);
+    else if(arg == "--parts") config.parts = atoi(argv[ii + 1]);
+    else if(arg == "--vertices") config.vertices = atoi(argv[ii + 1]);
+    else if(arg == "--columns") config.columns = atoi(argv[ii + 1]);
+    else if(arg == "--reps") config.reps = atoi(argv[ii + 1]);
+    else if(arg == "--dir") config.dir = argv[ii + 1];
+    else {
+      std::cerr << "unknown option: " << arg << std::endl;
+      exit(1);
+    }
+  }
+
+  if((config.features == 0) || (config.parts == 0) || (config.vertices == 0) || (config.columns == 0) || (config.reps == 0)) {
+    std::cerr << "features, parts, vertices, columns and reps must be > 0" << std::endl;
+    exit(1);
+  }
+
+  set_log_enabled(false);
+  set_log_stream(stderr);
+
+  const shputil::shape_type types[] = { shputil::shape_type::point, shputil::shape_type::multipoint,
+					shputil::shape_type::polyline, shputil::shape_type::polygon };
+  const char *names[] = { "point", "multipoint", "polyline", "polygon" };
+  for(int ii=0; ii < 4; ++ii) {
+    if(!run_isolated([&]() { return(bench_write_layer(types[ii], names[ii], config)); }) ||
+       !run_isolated([&]() { return(bench_read_layer(names[ii], config)); })) {
+      exit(1);
+    }
+  }
+
+  if(!run_isolated([&]() { return(bench_write_table(config)); }) ||
+     !run_isolated([&]() { return(bench_read_table(config)); })) {
+    exit(1);
+  }
+
+  return(0);
+}
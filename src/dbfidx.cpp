@@ -0,0 +1,69 @@
+
+#include <iostream>
+#include <cstdlib>
+#include "dbfutil.h"
+#include "dbfindex.h"
+
+//
+// dbfidx build <table.dbf> <field> <index>
+// dbfidx lookup <table.dbf> <index> <key> [<hikey>]
+//
+
+static void usage() {
+  std::cout << "usage: dbfidx build <table.dbf> <field> <index>" << std::endl;
+  std::cout << "       dbfidx lookup <table.dbf> <index> <key> [<hikey>]" << std::endl;
+  exit(1);
+}
+
+
+int main(int argc, char **argv) {
+
+  if(argc < 5) {
+    usage();
+  }
+
+  std::string cmd = argv[1];
+  if(cmd == "build") {
+    if(!dbfutil::build_dbf_index(argv[2], argv[3], argv[4])) {
+      std::cout << "build_dbf_index failed..." << std::endl;
+      exit(1);
+    }
+    return(0);
+  }
+
+  if(cmd != "lookup") {
+    usage();
+  }
+
+  dbfutil::dbfindex index;
+  if(!index.open(argv[3], argv[2])) {
+    std::cout << "couldn't open index..." << std::endl;
+    exit(1);
+  }
+
+  std::string lo = argv[4];
+  std::string hi = (argc > 5) ? argv[5] : lo;
+  std::vector<uint32_t> recnos;
+  bool status = index.numeric ? index.range(atof(lo.c_str()), atof(hi.c_str()), recnos) : index.range(lo, hi, recnos);
+  if(!status) {
+    std::cout << "lookup failed..." << std::endl;
+    exit(1);
+  }
+
+  dbfutil::dbftable table;
+  std::vector<uint32_t> row_recnos; // deleted records drop out of table.rows
+  if(!dbfutil::read_dbf_records(argv[2], recnos, table, row_recnos)) {
+    std::cout << "read_dbf_records failed..." << std::endl;
+    exit(1);
+  }
+
+  for(size_t ii=0; ii < table.rows.size(); ++ii) {
+    std::cout << row_recnos[ii];
+    for(const dbfutil::dbffield_value &val : table.rows[ii].values) {
+      std::cout << "\t" << val.value;
+    }
+    std::cout << std::endl;
+  }
+
+  return(0);
+}
@@ -0,0 +1,410 @@
+
+#include "dbfindex.h"
+#include "dbfutil.h"
+#include "logging.h"
+#include "iostats.h"
+#include <cstring>
+#include <algorithm>
+
+#ifdef __APPLE__
+  #include <machine/endian.h>
+#else
+  #include <endian.h>
+#endif
+
+namespace dbfutil {
+
+  static const char DBFINDEX_MAGIC[8] = { 'D', 'B', 'F', 'I', 'D', 'X', '0', '1' };
+  static const uint32_t DBFINDEX_VERSION = 2; // 2: source dbf stamp
+  static const uint32_t DBFINDEX_FENCE_STRIDE = 256; // entries per block
+  static const uint32_t NUMERIC_KEY_WIDTH = 8;
+
+  struct dbfindex_header {
+    char magic[8];         // DBFIDX01
+    uint32_t version;      // (LE)
+    uint32_t numeric;      // (LE)
+    uint32_t key_width;    // (LE)
+    uint32_t entry_count;  // (LE)
+    uint32_t fence_stride; // (LE)
+    uint32_t fence_count;  // (LE)
+    char field_name[12];
+    uint32_t dbf_records;  // (LE) source validation, as read when the index was built
+    uint64_t dbf_bytes;    // (LE)
+    int64_t dbf_mtime;     // (LE) nanoseconds
+  };
+
+
+  static void handle_endianness(dbfindex_header &header) {
+
+    #if BYTE_ORDER == BIG_ENDIAN
+      header.version = __builtin_bswap32(header.version);
+      header.numeric = __builtin_bswap32(header.numeric);
+      header.key_width = __builtin_bswap32(header.key_width);
+      header.entry_count = __builtin_bswap32(header.entry_count);
+      header.fence_stride = __builtin_bswap32(header.fence_stride);
+      header.fence_count = __builtin_bswap32(header.fence_count);
+      header.dbf_records = __builtin_bswap32(header.dbf_records);
+      header.dbf_bytes = __builtin_bswap64(header.dbf_bytes);
+      header.dbf_mtime = __builtin_bswap64(header.dbf_mtime);
+    #endif
+
+  }
+
+
+  static uint32_t fetch_LEuint32(const uint8_t *content) {
+    uint32_t val = 0;
+    memcpy(&val, content, sizeof(uint32_t));
+    #if BYTE_ORDER == BIG_ENDIAN
+      val = __builtin_bswap32(val);
+    #endif
+    return(val);
+  }
+
+
+  static void encode_numeric_key(double dbl, uint8_t *key) {
+
+    //
+    // map the double onto a big-endian uint64 that sorts with memcmp:
+    // negatives get all bits flipped, positives just the sign bit
+    //
+
+    uint64_t bits = 0;
+    memcpy(&bits, &dbl, sizeof(double));
+    if(bits & 0x8000000000000000ULL) {
+      bits = ~bits;
+    }
+    else {
+      bits |= 0x8000000000000000ULL;
+    }
+
+    for(int ii=0; ii < 8; ++ii) {
+      key[ii] = (uint8_t) (bits >> (56 - (8 * ii)));
+    }
+  }
+
+
+  static void encode_string_key(std::string_view str, uint32_t key_width, uint8_t *key) {
+    memset(key, 0, key_width);
+    memcpy(key, str.data(), std::min((size_t) key_width, str.size()));
+  }
+
+
+  static bool encode_value_key(const dbffield_value &val, bool numeric, uint32_t key_width, uint8_t *key) {
+
+    if(!numeric) {
+      if(val.value.size() > key_width) {
+	return(false); // a truncated key would match other values sharing its prefix
+      }
+      encode_string_key(val.value, key_width, key);
+      return(true);
+    }
+
+    switch(val._vtype) {
+    case dbffield_value::vtype::sint: encode_numeric_key(val._s32_val, key); break;
+    case dbffield_value::vtype::uint: encode_numeric_key(val._u32_val, key); break;
+    case dbffield_value::vtype::dbl: encode_numeric_key(val._dbl_val, key); break;
+    default:
+      return(false);
+    }
+
+    return(true);
+  }
+
+
+  bool build_dbf_index(const std::string &dbf_path, const std::string &field_name, const std::string &index_path) {
+
+    //
+    // stamped before the read, a change while we build makes the index stale on open
+    //
+    uint64_t dbf_bytes = 0;
+    int64_t dbf_mtime = 0;
+    if(!file_stamp(dbf_path, dbf_bytes, dbf_mtime)) {
+      return(false);
+    }
+
+    dbfreader reader;
+    if(!reader.open(dbf_path)) {
+      return(false);
+    }
+
+    int col = find_field(reader.header, field_name);
+    if(col < 0) {
+      log_error("no such field: %s\n", field_name.c_str());
+      return(false);
+    }
+
+    const dbffield_def &fdef = reader.header.fields[col];
+    bool numeric = (fdef.field_type != "C");
+    uint32_t key_width = numeric ? NUMERIC_KEY_WIDTH : fdef.field_length;
+    uint32_t entry_size = key_width + sizeof(uint32_t);
+
+    //
+    // gather (key, recno) for every live record
+    //
+    std::vector<uint8_t> keys;
+    std::vector<uint32_t> recnos;
+    keys.reserve((size_t) reader.record_count * key_width);
+    recnos.reserve(reader.record_count);
+    std::vector<uint8_t> key(key_width);
+    for(uint32_t recno=0; recno < reader.record_count; ++recno) {
+      dbfrow row;
+      bool deleted = false;
+      if(!reader.read(recno, row, deleted)) {
+	return(false);
+      }
+
+      if(deleted) {
+	continue;
+      }
+
+      if(!encode_value_key(row.values[col], numeric, key_width, key.data())) {
+	log_error("couldn't encode key for record %u\n", recno);
+	return(false);
+      }
+
+      keys.insert(keys.end(), key.begin(), key.end());
+      recnos.push_back(recno);
+    }
+
+    std::vector<uint32_t> order(recnos.size());
+    for(uint32_t ii=0; ii < order.size(); ++ii) {
+      order[ii] = ii;
+    }
+
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+	int cmp = memcmp(keys.data() + ((size_t) a * key_width), keys.data() + ((size_t) b * key_width), key_width);
+	return((cmp < 0) || ((cmp == 0) && (recnos[a] < recnos[b])));
+      });
+
+    FILE *fp = fopen(index_path.c_str(), "wb");
+    if(!fp) {
+      log_error("couldn't create index: %s\n", index_path.c_str());
+      return(false);
+    }
+
+    dbfindex_header header;
+    memset(&header, 0, sizeof(dbfindex_header));
+    memcpy(header.magic, DBFINDEX_MAGIC, sizeof(header.magic));
+    header.version = DBFINDEX_VERSION;
+    header.numeric = numeric ? 1 : 0;
+    header.key_width = key_width;
+    header.entry_count = order.size();
+    header.fence_stride = DBFINDEX_FENCE_STRIDE;
+    header.fence_count = (order.size() + DBFINDEX_FENCE_STRIDE - 1) / DBFINDEX_FENCE_STRIDE;
+    snprintf(header.field_name, sizeof(header.field_name), "%.11s", field_name.c_str());
+    header.dbf_records = reader.record_count;
+    header.dbf_bytes = dbf_bytes;
+    header.dbf_mtime = dbf_mtime;
+    handle_endianness(header);
+
+    bool status = (io_fwrite(&header, sizeof(dbfindex_header), 1, fp) == 1);
+
+    std::vector<uint8_t> entry(entry_size);
+    std::vector<uint8_t> fences;
+    for(uint32_t ii=0; status && (ii < order.size()); ++ii) {
+      const uint8_t *kptr = keys.data() + ((size_t) order[ii] * key_width);
+      uint32_t recno = recnos[order[ii]];
+      #if BYTE_ORDER == BIG_ENDIAN
+        recno = __builtin_bswap32(recno);
+      #endif
+      memcpy(entry.data(), kptr, key_width);
+      memcpy(entry.data() + key_width, &recno, sizeof(uint32_t));
+      status = (io_fwrite(entry.data(), entry_size, 1, fp) == 1);
+
+      if((ii % DBFINDEX_FENCE_STRIDE) == 0) {
+	fences.insert(fences.end(), kptr, kptr + key_width);
+      }
+    }
+
+    if(status && !fences.empty()) {
+      status = (io_fwrite(fences.data(), fences.size(), 1, fp) == 1);
+    }
+
+    if(!status) {
+      log_error("error while writing the index...\n");
+    }
+
+    fclose(fp);
+    return(status);
+  }
+
+
+  bool dbfindex::open(const std::string &path, const std::string &dbf_path) {
+
+    close();
+
+    fp = fopen(path.c_str(), "rb");
+    if(!fp) {
+      log_error("couldn't open index: %s\n", path.c_str());
+      return(false);
+    }
+
+    dbfindex_header header;
+    if(io_fread(&header, sizeof(dbfindex_header), 1, fp) != 1) {
+      log_error("couldn't read index header...\n");
+      close();
+      return(false);
+    }
+
+    handle_endianness(header);
+    if((memcmp(header.magic, DBFINDEX_MAGIC, sizeof(header.magic)) != 0) ||
+       (header.version != DBFINDEX_VERSION) || (header.key_width == 0) || (header.fence_stride == 0)) {
+      log_error("not a dbf index (or unsupported version): %s\n", path.c_str());
+      close();
+      return(false);
+    }
+
+    //
+    // record numbers are physical, any append, delete + vacuum or rewrite of the dbf
+    // since the build moves them
+    //
+    uint64_t dbf_bytes = 0;
+    int64_t dbf_mtime = 0;
+    dbfreader reader;
+    if(!file_stamp(dbf_path, dbf_bytes, dbf_mtime) || !reader.open(dbf_path) ||
+       (dbf_bytes != header.dbf_bytes) || (dbf_mtime != header.dbf_mtime) || (reader.record_count != header.dbf_records)) {
+      log_error("index %s is stale, rebuild it from %s\n", path.c_str(), dbf_path.c_str());
+      close();
+      return(false);
+    }
+
+    char fname[13];
+    memcpy(fname, header.field_name, 12);
+    fname[12] = 0;
+    field_name = fname;
+    numeric = (header.numeric != 0);
+    key_width = header.key_width;
+    entry_count = header.entry_count;
+    fence_stride = header.fence_stride;
+    entries_offset = sizeof(dbfindex_header);
+
+    long fences_offset = entries_offset + ((long) entry_count * (key_width + sizeof(uint32_t)));
+    fences.resize((size_t) header.fence_count * key_width);
+    if(!fences.empty() &&
+       ((fseek(fp, fences_offset, SEEK_SET) != 0) || (io_fread(fences.data(), fences.size(), 1, fp) != 1))) {
+      log_error("couldn't read index fences...\n");
+      close();
+      return(false);
+    }
+
+    block_buf.resize((size_t) fence_stride * (key_width + sizeof(uint32_t)));
+
+    return(true);
+  }
+
+
+  static bool scan_index(dbfindex &index, const uint8_t *lo, const uint8_t *hi, bool lo_exclusive, std::vector<uint32_t> &recnos) {
+
+    recnos.clear();
+
+    if(!index.fp) {
+      return(false);
+    }
+
+    if(memcmp(lo, hi, index.key_width) > 0) {
+      return(true);
+    }
+
+    //
+    // first fence >= lo, the first matching entry can't be earlier than the block before it
+    //
+    uint32_t fence_count = index.fences.size() / index.key_width;
+    uint32_t first = 0;
+    uint32_t last = fence_count;
+    while(first < last) {
+      uint32_t mid = first + ((last - first) / 2);
+      if(memcmp(index.fences.data() + ((size_t) mid * index.key_width), lo, index.key_width) < 0) {
+	first = mid + 1;
+      }
+      else {
+	last = mid;
+      }
+    }
+
+    uint32_t entry_size = index.key_width + sizeof(uint32_t);
+    for(uint32_t block = (first > 0) ? (first - 1) : 0; block < fence_count; ++block) {
+
+      uint32_t block_start = block * index.fence_stride;
+      uint32_t block_entries = std::min(index.fence_stride, index.entry_count - block_start);
+      long offset = index.entries_offset + ((long) block_start * entry_size);
+      if((fseek(index.fp, offset, SEEK_SET) != 0) ||
+	 (io_fread(index.block_buf.data(), (size_t) block_entries * entry_size, 1, index.fp) != 1)) {
+	log_error("couldn't read index block %u\n", block);
+	return(false);
+      }
+
+      for(uint32_t ii=0; ii < block_entries; ++ii) {
+	const uint8_t *entry = index.block_buf.data() + ((size_t) ii * entry_size);
+	int locmp = memcmp(entry, lo, index.key_width);
+	if((locmp < 0) || ((locmp == 0) && lo_exclusive)) {
+	  continue;
+	}
+
+	if(memcmp(entry, hi, index.key_width) > 0) {
+	  return(true);
+	}
+
+	recnos.push_back(fetch_LEuint32(entry + index.key_width));
+      }
+    }
+
+    return(true);
+  }
+
+
+  bool dbfindex::lookup(const std::string &key, std::vector<uint32_t> &recnos) {
+    return(range(key, key, recnos));
+  }
+
+
+  bool dbfindex::lookup(double key, std::vector<uint32_t> &recnos) {
+    return(range(key, key, recnos));
+  }
+
+
+  bool dbfindex::range(const std::string &lo, const std::string &hi, std::vector<uint32_t> &recnos) {
+
+    if(numeric) {
+      log_error("index on %s is numeric, expected a numeric key\n", field_name.c_str());
+      return(false);
+    }
+
+    std::vector<uint8_t> lokey(key_width);
+    std::vector<uint8_t> hikey(key_width);
+    encode_string_key(lo, key_width, lokey.data());
+    encode_string_key(hi, key_width, hikey.data());
+
+    //
+    // no stored value is longer than key_width, so one equal to a truncated lo is still
+    // below lo and drops out. a truncated hi stays inclusive: its prefix is below hi too.
+    //
+    return(scan_index(*this, lokey.data(), hikey.data(), lo.size() > key_width, recnos));
+  }
+
+
+  bool dbfindex::range(double lo, double hi, std::vector<uint32_t> &recnos) {
+
+    if(!numeric) {
+      log_error("index on %s is character, expected a string key\n", field_name.c_str());
+      return(false);
+    }
+
+    uint8_t lokey[NUMERIC_KEY_WIDTH];
+    uint8_t hikey[NUMERIC_KEY_WIDTH];
+    encode_numeric_key(lo, lokey);
+    encode_numeric_key(hi, hikey);
+    return(scan_index(*this, lokey, hikey, false, recnos));
+  }
+
+
+  void dbfindex::close() {
+    if(fp) {
+      fclose(fp);
+      fp = 0;
+    }
+
+    fences.clear();
+    entry_count = 0;
+  }
+
+} // namespace dbfutil
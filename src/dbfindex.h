@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+
+namespace dbfutil {
+
+  //
+  // sorted-key sidecar index over one dbf column, maps keys to physical record numbers (0-based).
+  // the entries are a sorted array of fixed width keys, every fence_stride'th key is kept in
+  // memory so a lookup costs one binary search plus one block read.
+  //
+  // the header keeps the dbf's size, mtime and record count from build time, open()
+  // refuses the index once any of them changed (append, vacuum, rewrite).
+  //
+  class dbfindex {
+  public:
+    dbfindex() { fp = 0; numeric = false; key_width = 0; entry_count = 0; fence_stride = 0; entries_offset = 0; }
+    ~dbfindex() { close(); }
+    bool open(const std::string &path, const std::string &dbf_path); // dbf_path: the table it was built from
+    bool lookup(const std::string &key, std::vector<uint32_t> &recnos);
+    bool lookup(double key, std::vector<uint32_t> &recnos);
+    bool range(const std::string &lo, const std::string &hi, std::vector<uint32_t> &recnos); // inclusive
+    bool range(double lo, double hi, std::vector<uint32_t> &recnos); // inclusive
+    void close();
+    std::string field_name;
+    bool numeric; // 'N'/'F' columns, otherwise keys are the trimmed 'C' text
+    uint32_t key_width;
+    uint32_t entry_count;
+    uint32_t fence_stride;
+    std::vector<uint8_t> fences; // fence keys, key_width bytes each
+    std::vector<uint8_t> block_buf;
+    long entries_offset;
+    FILE *fp;
+  };
+
+  bool build_dbf_index(const std::string &dbf_path, const std::string &field_name, const std::string &index_path);
+
+} // dbfutil namespace
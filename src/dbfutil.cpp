@@ -1,9 +1,13 @@
 
 #include "dbfutil.h"
 #include "logging.h"
+#include "iostats.h"
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 
 #ifdef __APPLE__
   #include <machine/endian.h>
@@ -113,87 +117,133 @@ namespace dbfutil {
       
   }
   
-  static bool read_table_rows(dBASE_header raw_header, FILE *fp, dbftable &table) {
+  static bool parse_record(const uint8_t *record_buf, uint16_t read_size, const dbfheader &header,
+			   std::vector<dbfdictionary> *dictionaries, dbfrow &row) {
+
+    //
+    // record_buf includes the leading status byte, dictionaries is non-null in dictionary_encode mode
+    //
+    
+    row.values.clear();
+    int foffset = 1;
+    size_t col = 0;
+    for(const dbffield_def &fdef : header.fields) {
+      
+      if(foffset >= read_size) {
+	log_error("read past record buffer...\n");
+	return(false);
+      }
+      
+      //
+      // trimmed in place, the value string is the only copy (made in row's resource)
+      //
+      char vbuf[512];
+      memcpy(vbuf, record_buf + foffset, fdef.field_length);
+      vbuf[fdef.field_length] = 0;
+      char *str = vbuf;
+      char *str_end = vbuf + strlen(vbuf);
+      while((str < str_end) && (*str == ' ')) {
+	++str;
+      }
+      while((str_end > str) && (str_end[-1] == ' ')) {
+	--str_end;
+      }
+      *str_end = 0;
+
+      if(dictionaries && (fdef.field_type == "C")) {
+	dbfdictionary &dict = (*dictionaries)[col];
+	dict.codes.push_back(dict.intern(std::string(str, str_end))); // the column, not the row
+	foffset += fdef.field_length;
+	col += 1;
+	continue;
+      }
+
+      row.values.emplace_back();
+      dbffield_value &fval = row.values.back();
+      if(fdef.field_type == "N") {
+	bool parsed = false;
+	if(strchr(str, '-')) {
+	  int32_t sval = 0;
+	  parsed = parse_int32(str, &sval);
+	  fval._vtype = dbffield_value::vtype::sint;
+	  fval._s32_val = sval;
+	}
+	else {
+	  uint32_t uval = 0;
+	  parsed = parse_uint32(str, &uval);
+	  fval._vtype = dbffield_value::vtype::uint;
+	  fval._u32_val = uval;
+	}
+	
+	fval.value.assign(str, str_end);
+	
+	if(!parsed) {
+	  log_error("couldn't parse numeric value for column: %s\n", fdef.field_name.c_str());
+	  return(false);
+	}
+      }
+      else if(fdef.field_type == "F") {
+	double dbl = 0.0;
+	bool parsed = parse_dbl(str, &dbl);
+	if(!parsed) {
+	  log_error("couldn't parse double value for column: %s\n", fdef.field_name.c_str());
+	  return(false);
+	}
+	fval._vtype = dbffield_value::vtype::dbl;
+	fval._dbl_val = dbl;
+	fval.value.assign(str, str_end);
+      }
+      else {
+	fval.value.assign(str, str_end);
+      }
+      
+      foffset += fdef.field_length;
+      col += 1;
+    }
+
+    return(true);
+  }
+
+  
+  static bool read_table_rows(dBASE_header raw_header, FILE *fp, const dbfreadopts &opts, dbftable &table) {
     
     uint16_t read_size = raw_header.record_bytes; // includes leading byte with record status
-    uint8_t *record_buf = (uint8_t *) malloc(read_size); 
-    if(!record_buf) {
-      log_error("couldn't allocate record memory...\n");
-      return(false);
+    std::pmr::vector<uint8_t> buf(read_size, table.rows.get_allocator().resource());
+    uint8_t *record_buf = buf.data();
+    io_stats_add(io_counter::allocations, 1);
+    
+    std::vector<dbfdictionary> *dictionaries = 0;
+    if(opts.dictionary_encode) {
+      table.dictionaries.resize(table.header.fields.size());
+      dictionaries = &table.dictionaries;
     }
     
     for(uint32_t ii=0; ii < raw_header.table_records; ++ii) {
       memset(record_buf, 0, read_size);
-      if(fread(record_buf, read_size, 1, fp) != 1) {
-	free(record_buf);
+      if(io_fread(record_buf, read_size, 1, fp) != 1) {
 	return(false);
       }
       
       if(record_buf[0] != 0x20) {
 	log_warn("record deleted, skipping...\n");
+	io_stats_add(io_counter::records_skipped, 1);
 	continue;
       }
       
-      dbfrow row;
-      int foffset = 1;
-      for(const dbffield_def &fdef : table.header.fields) {
-	
-	if(foffset >= read_size) {
-	  log_error("read past record buffer...\n");
-	  free(record_buf);
-	  return(false);
-	}
-	
-	char vbuf[512];
-	memcpy(vbuf, record_buf + foffset, fdef.field_length);
-	vbuf[fdef.field_length] = 0;
-	std::string str;
-	str = trim_leading_and_trailing_whitespace(std::string(vbuf));
-	dbffield_value fval(str);
-	if(fdef.field_type == "N") {
-	  bool parsed = false;
-	  if(str.find("-") != std::string::npos) {
-	    int32_t sval = 0;
-	    parsed = parse_int32(str.c_str(), &sval);
-	    fval = dbffield_value(sval);
-	  }
-	  else {
-	    uint32_t uval = 0;
-	    parsed = parse_uint32(str.c_str(), &uval);
-	    fval = dbffield_value(uval);
-	  }
-
-	  fval.value = str;
-	  
-	  if(!parsed) {
-	    log_error("couldn't parse numeric value for column: %s\n", fdef.field_name.c_str());
-	    return(false);
-	  }
-	}
-	else if(fdef.field_type == "F") {
-	  double dbl = 0.0;
-	  bool parsed = parse_dbl(str.c_str(), &dbl);
-	  if(!parsed) {
-	    log_error("couldn't parse double value for column: %s\n", fdef.field_name.c_str());
-	    return(false);
-	  }
-	  fval = dbffield_value(dbl);
-	  fval.value = str;
-	}
-	
-	row.values.push_back(fval);
-	foffset += fdef.field_length;
+      io_phase_timer timer(io_phase::dbf_parse);
+      table.rows.emplace_back(); // parsed in place, in the table's resource
+      if(!parse_record(record_buf, read_size, table.header, dictionaries, table.rows.back())) {
+	return(false);
       }
       
-      table.rows.push_back(row);
+      io_stats_add(io_counter::records_decoded, 1);
     }
     
-    free(record_buf);
     return(true);
   }
   
   
-  static bool read_field_descriptors(dBASE_header &raw_header, FILE *fp, dbftable &table) {
+  static bool read_field_descriptors(dBASE_header &raw_header, FILE *fp, dbfheader &header) {
     
     int number_fields = (raw_header.header_bytes - sizeof(dBASE_header) - 1) / sizeof(dBASE_fielddesc); // -1 for the terminator
     //log("number_fields: %d\n", number_fields);
@@ -201,7 +251,7 @@ namespace dbfutil {
     for(int ii=0; ii < number_fields; ++ii) {
       dBASE_fielddesc fdesc;
       memset(&fdesc, 0, sizeof(dBASE_fielddesc));
-      if(fread(&fdesc, sizeof(dBASE_fielddesc), 1, fp) != 1) {
+      if(io_fread(&fdesc, sizeof(dBASE_fielddesc), 1, fp) != 1) {
 	log_error("trouble while reading field descriptors...\n");
 	return(false);
       }
@@ -229,11 +279,11 @@ namespace dbfutil {
       fdef.field_type = std::string(ftype);
       fdef.field_length = fdesc.field_length;
       fdef.field_decimal_count = fdesc.field_decimal_count;
-      table.header.fields.push_back(fdef);
+      header.fields.push_back(fdef);
     }
     
     uint8_t terminator = 0;
-    if((fread(&terminator, 1, 1, fp) != 1) || (terminator != 0x0d)) {
+    if((io_fread(&terminator, 1, 1, fp) != 1) || (terminator != 0x0d)) {
       log_error("didn't find field desc terminator\n");
       return(false);
     }
@@ -244,11 +294,17 @@ namespace dbfutil {
   
   
   bool read_dbf(const std::string &path, dbftable &table) {
+    return(read_dbf(path, table, dbfreadopts()));
+  }
+
+  
+  bool read_dbf(const std::string &path, dbftable &table, const dbfreadopts &opts) {
     
     //log("reading dbf table: %s\n", path.c_str());
     
     table.header.fields.clear();
     table.rows.clear();
+    table.dictionaries.clear();
     
     FILE *fp = fopen(path.c_str(), "rb");
     if(!fp) {
@@ -258,13 +314,23 @@ namespace dbfutil {
     
     dBASE_header raw_header;
     memset(&raw_header, 0, sizeof(dBASE_header));
-    if(fread(&raw_header, sizeof(dBASE_header), 1, fp) != 1) {
-      log_error("couldn't read dbf header...\n");
-      return(false);
+    {
+      io_phase_timer timer(io_phase::header);
+      if(io_fread(&raw_header, sizeof(dBASE_header), 1, fp) != 1) {
+	log_error("couldn't read dbf header...\n");
+	fclose(fp);
+	return(false);
+      }
+      
+      handle_endianess(raw_header);
+      
+      if(!read_field_descriptors(raw_header, fp, table.header)) {
+	log_error("trouble reading field descriptors...\n");
+	fclose(fp);
+	return(false);
+      }
     }
-
-    handle_endianess(raw_header);
-  
+    
     //log("version: %d\n", raw_header.version);
     //log("lastupdate: %d/%d/%d\n", 1900 + raw_header.lastupdate[0],
     //	raw_header.lastupdate[1],raw_header.lastupdate[2]);
@@ -272,13 +338,7 @@ namespace dbfutil {
     //log("header_bytes: %u\n", raw_header.header_bytes);
     //log("record_bytes: %u\n", raw_header.record_bytes);
       
-    if(!read_field_descriptors(raw_header, fp, table)) {
-      log_error("trouble reading field descriptors...\n");
-      fclose(fp);
-      return(false);
-    }
-  
-    if(!read_table_rows(raw_header, fp, table)) {
+    if(!read_table_rows(raw_header, fp, opts, table)) {
       log_error("trouble reading table rows...\n");
       fclose(fp);
       return(false);
@@ -319,14 +379,14 @@ namespace dbfutil {
       fdesc.field_type = fielddef.field_type.c_str()[0];
       fdesc.field_length = fielddef.field_length;
       fdesc.field_decimal_count = fielddef.field_decimal_count;
-      if(fwrite(&fdesc, sizeof(dBASE_fielddesc), 1, fp) != 1) {
+      if(io_fwrite(&fdesc, sizeof(dBASE_fielddesc), 1, fp) != 1) {
 	log_error("couldn't write field descriptor\n");
 	return(false);
       }
     }
 
     uint8_t terminator = 0x0d;
-    if(fwrite(&terminator, 1, 1, fp) != 1) {
+    if(io_fwrite(&terminator, 1, 1, fp) != 1) {
       log_error("couldn't write field desc terminator\n");
       return(false);
     }
@@ -335,76 +395,106 @@ namespace dbfutil {
   }
 
   
-  bool write_table_rows(FILE *fp, uint16_t record_bytes, const dbftable &table) {
+  static bool encode_row(const dbftable &table, const dbfrow &row, size_t rowidx, uint8_t *record_buf, uint16_t record_bytes) {
 
-    if(record_bytes == 0) {
-      return(false);
-    }
-    
-    uint8_t *record_buf = (uint8_t *) malloc(record_bytes); 
-    if(!record_buf) {
-      log_error("couldn't allocate record memory...\n");
+    //
+    // rowidx finds the row's codes for dictionary encoded fields, row.values holds the rest
+    //
+    memset(record_buf, 0, record_bytes);
+    record_buf[0] = ' '; // active status
+    uint16_t recoff = 1;
+    uint32_t ridx = 0;
+    uint32_t vidx = 0;
+
+    if(row.values.size() != (table.header.fields.size() - table.coded_count())) {
+      log_error("row length / header length mismatch\n");
       return(false);
     }
     
-    for(const dbfrow &row : table.rows) {
-      memset(record_buf, 0, record_bytes);
-      record_buf[0] = ' '; // active status
-      uint16_t recoff = 1;
-      uint32_t ridx = 0;
+    for(const dbffield_def &fielddef : table.header.fields) {
 
-      if(row.values.size() != table.header.fields.size()) {
-	log_error("row length / header length mismatch\n");
-	return(false);
-      }
-      
-      for(const dbffield_def &fielddef : table.header.fields) {
+      char buf[512];
+      memset(buf, 0x20, 512);
 
-	char buf[512];
-	memset(buf, 0x20, 512);
+      if(table.coded(ridx)) {
+	const dbfdictionary &dict = table.dictionaries[ridx];
+	if((rowidx >= dict.codes.size()) || (dict.codes[rowidx] >= dict.strings.size())) {
+	  log_error("no dictionary code for row %zu at column %s\n", rowidx, fielddef.field_name.c_str());
+	  return(false);
+	}
+	const std::string &str = dict.str(dict.codes[rowidx]);
+	sprintf(buf, "%*.*s", fielddef.field_length, (int) str.size(), str.data());
+	memcpy(record_buf + recoff, buf, fielddef.field_length);
+	ridx += 1;
+	recoff += fielddef.field_length;
+	continue;
+      }
 
-	const dbffield_value &val = row.values[ridx];
-	
-	if(fielddef.field_type == "C") {
-	  if(val._vtype != dbffield_value::vtype::str) {
-	    log_error("field value type mismatch at column %s (expected str)\n", fielddef.field_name.c_str());
-	    return(false);
-	  }
-	  sprintf(buf, "%*s", fielddef.field_length, val.value.c_str());
+      const dbffield_value &val = row.values[vidx++];
+      
+      if(fielddef.field_type == "C") {
+	if(val._vtype != dbffield_value::vtype::str) {
+	  log_error("field value type mismatch at column %s (expected str)\n", fielddef.field_name.c_str());
+	  return(false);
+	}
+	sprintf(buf, "%*.*s", fielddef.field_length, (int) val.value.size(), val.value.data());
+      }
+      else if(fielddef.field_type == "N") {
+	char temp[512];
+	if(val._vtype == dbffield_value::vtype::sint) {
+	  sprintf(temp, "%d", val._s32_val);
+	}
+	else if(val._vtype == dbffield_value::vtype::uint) {
+	  sprintf(temp, "%u", val._u32_val);
+	}
+	else {
+	  log_error("field value type mismatch at column %s (expected sint/uint)\n", fielddef.field_name.c_str());
+	  return(false);
 	}
-	else if(fielddef.field_type == "N") {
-	  char temp[512];
-	  if(val._vtype == dbffield_value::vtype::sint) {
-	    sprintf(temp, "%d", val._s32_val);
-	  }
-	  else if(val._vtype == dbffield_value::vtype::uint) {
-	    sprintf(temp, "%u", val._u32_val);
-	  }
-	  else {
-	    log_error("field value type mismatch at column %s (expected sint/uint)\n", fielddef.field_name.c_str());
-	    return(false);
-	  }
 
+	sprintf(buf, "%*s", fielddef.field_length, temp);
+      }
+      else if(fielddef.field_type == "F") {
+	if(val._vtype == dbffield_value::vtype::dbl) {
+	  char temp[512];
+	  sprintf(temp, "%.*e", fielddef.field_decimal_count, val._dbl_val);
 	  sprintf(buf, "%*s", fielddef.field_length, temp);
 	}
-	else if(fielddef.field_type == "F") {
-	  if(val._vtype == dbffield_value::vtype::dbl) {
-	    char temp[512];
-	    sprintf(temp, "%.*e", fielddef.field_decimal_count, val._dbl_val);
-	    sprintf(buf, "%*s", fielddef.field_length, temp);
-	  }
-	  else {
-	    log_error("field value type mismatch at column %s (expected dbl)\n", fielddef.field_name.c_str());
-	    return(false);
-	  }
+	else {
+	  log_error("field value type mismatch at column %s (expected dbl)\n", fielddef.field_name.c_str());
+	  return(false);
 	}
-	
-	memcpy(record_buf + recoff, buf, fielddef.field_length);
-	ridx += 1;
-	recoff += fielddef.field_length;
+      }
+      
+      memcpy(record_buf + recoff, buf, fielddef.field_length);
+      ridx += 1;
+      recoff += fielddef.field_length;
+    }
+
+    return(true);
+  }
+
+  
+  bool write_table_rows(FILE *fp, uint16_t record_bytes, const dbftable &table, const std::vector<uint32_t> *order) {
+
+    if(record_bytes == 0) {
+      return(false);
+    }
+    
+    uint8_t *record_buf = (uint8_t *) malloc(record_bytes); 
+    if(!record_buf) {
+      log_error("couldn't allocate record memory...\n");
+      return(false);
+    }
+    
+    for(size_t rowidx=0; rowidx < table.rows.size(); ++rowidx) {
+      size_t srcidx = order ? (*order)[rowidx] : rowidx;
+      if(!encode_row(table, table.rows[srcidx], srcidx, record_buf, record_bytes)) {
+	free(record_buf);
+	return(false);
       }
 
-      if(fwrite(record_buf, record_bytes, 1, fp) != 1) {
+      if(io_fwrite(record_buf, record_bytes, 1, fp) != 1) {
 	log_error("failed to write record...\n");
 	free(record_buf);
 	return(false);
@@ -414,7 +504,7 @@ namespace dbfutil {
     free(record_buf);
 
     uint8_t terminator = 0x1a;
-    if(fwrite(&terminator, 1, 1, fp) != 1) {
+    if(io_fwrite(&terminator, 1, 1, fp) != 1) {
       log_error("couldn't write file terminator\n");
       return(false);
     }
@@ -423,7 +513,37 @@ namespace dbfutil {
   }
 
   
+  static void set_lastupdate(dBASE_header &raw_header) {
+    time_t t = time(NULL);
+    struct tm *tm = localtime(&t);
+    raw_header.lastupdate[0] = tm ? tm->tm_year : (2022 - 1900); 
+    raw_header.lastupdate[1] = tm ? (tm->tm_mon + 1) : 1;
+    raw_header.lastupdate[2] = tm ? tm->tm_mday : 1;
+  }
+
+  
+  static void init_raw_header(const dbfheader &header, uint32_t table_records, dBASE_header &raw_header) {
+
+    memset(&raw_header, 0, sizeof(dBASE_header));  
+
+    raw_header.version = 0x03;
+    set_lastupdate(raw_header);
+
+    raw_header.table_records = table_records;
+    raw_header.header_bytes = 1 + sizeof(dBASE_header) + (sizeof(dBASE_fielddesc) * header.fields.size()); // +1 for the terminator
+    raw_header.record_bytes = 1; // first byte is the record status
+    for(const dbffield_def &fielddef : header.fields) {
+      raw_header.record_bytes += fielddef.field_length;
+    }
+  }
+
+  
   bool write_dbf(const std::string &path, const dbftable &table) {
+    return(write_dbf(path, table, std::vector<uint32_t>()));
+  }
+
+  
+  bool write_dbf(const std::string &path, const dbftable &table, const std::vector<uint32_t> &order) {
     
     if(table.header.fields.empty()) {
       log_error("can't write a table that doesn't have columns...\n");
@@ -435,6 +555,22 @@ namespace dbfutil {
       return(false);
     }
 
+    if(!order.empty()) {
+      if(order.size() != table.rows.size()) {
+	log_error("row order has %zu entries for %zu rows\n", order.size(), table.rows.size());
+	return(false);
+      }
+
+      std::vector<bool> seen(order.size(), false);
+      for(uint32_t rowidx : order) {
+	if((rowidx >= seen.size()) || seen[rowidx]) {
+	  log_error("row order isn't a permutation of the table rows\n");
+	  return(false);
+	}
+	seen[rowidx] = true;
+      }
+    }
+
     FILE *fp = fopen(path.c_str(), "wb");
     if(!fp) {
       log_error("can't open dbf for writing: %s\n", path.c_str());
@@ -442,29 +578,15 @@ namespace dbfutil {
     }
 
     dBASE_header raw_header;
-    memset(&raw_header, 0, sizeof(dBASE_header));  
-
-    raw_header.version = 0x03;
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    raw_header.lastupdate[0] = tm ? tm->tm_year : (2022 - 1900); 
-    raw_header.lastupdate[1] = tm ? (tm->tm_mon + 1) : 1;
-    raw_header.lastupdate[2] = tm ? tm->tm_mday : 1;
-
-    raw_header.table_records = table.rows.size();
-    raw_header.header_bytes = 1 + sizeof(dBASE_header) + (sizeof(dBASE_fielddesc) * table.header.fields.size()); // +1 for the terminator
-    raw_header.record_bytes = 1; // first byte is the record status
-    for(const dbffield_def &fielddef : table.header.fields) {
-      raw_header.record_bytes += fielddef.field_length;
-    }
+    init_raw_header(table.header, table.rows.size(), raw_header);
 
     uint16_t record_bytes = raw_header.record_bytes;
     handle_endianess(raw_header);
 
     bool status = true;
-    if((fwrite(&raw_header, sizeof(dBASE_header), 1, fp) != 1) ||
+    if((io_fwrite(&raw_header, sizeof(dBASE_header), 1, fp) != 1) ||
        !write_field_descriptors(fp, table) ||
-       !write_table_rows(fp, record_bytes, table)) {
+       !write_table_rows(fp, record_bytes, table, order.empty() ? 0 : &order)) {
       log_error("error while writing the dbf...\n");
       status = false;
     }
@@ -473,4 +595,774 @@ namespace dbfutil {
     return(status);
   }
 
+
+  static bool same_field(const dbffield_def &ondisk, const dbffield_def &fdef) {
+
+    // compare the way read_field_descriptors reports fields: trimmed 11 char names, N with decimals is F
+    std::string name = trim_leading_and_trailing_whitespace(fdef.field_name.substr(0, 11));
+    std::string ftype = fdef.field_type;
+    if((ftype == "N") && (fdef.field_decimal_count > 0)) {
+      ftype = "F";
+    }
+
+    return((ondisk.field_name == name) && (ondisk.field_type == ftype) &&
+	   (ondisk.field_length == fdef.field_length) &&
+	   ((ftype != "F") || (ondisk.field_decimal_count == fdef.field_decimal_count)));
+  }
+
+
+  bool dbfwriter::create(const std::string &path, const dbfheader &header) {
+
+    close();
+    
+    if(header.fields.empty()) {
+      log_error("can't write a table that doesn't have columns...\n");
+      return(false);
+    }
+
+    fp = fopen(path.c_str(), "w+b"); // close() rereads the header
+    if(!fp) {
+      log_error("can't open dbf for writing: %s\n", path.c_str());
+      return(false);
+    }
+
+    schema.header = header;
+    dBASE_header raw_header;
+    init_raw_header(header, 0, raw_header);
+    record_count = 0;
+    record_bytes = raw_header.record_bytes;
+    record_buf.resize(record_bytes);
+    handle_endianess(raw_header);
+
+    if((io_fwrite(&raw_header, sizeof(dBASE_header), 1, fp) != 1) ||
+       !write_field_descriptors(fp, schema)) {
+      log_error("couldn't write dbf header: %s\n", path.c_str());
+      fclose(fp);
+      fp = 0;
+      return(false);
+    }
+
+    return(true);
+  }
+
+
+  bool dbfwriter::open_append(const std::string &path, const dbfheader &header) {
+
+    close();
+
+    fp = fopen(path.c_str(), "r+b");
+    if(!fp) {
+      log_error("can't open dbf for appending: %s\n", path.c_str());
+      return(false);
+    }
+
+    dBASE_header raw_header;
+    dbfheader ondisk;
+    if(io_fread(&raw_header, sizeof(dBASE_header), 1, fp) != 1) {
+      log_error("couldn't read dbf header...\n");
+      fclose(fp);
+      fp = 0;
+      return(false);
+    }
+
+    handle_endianess(raw_header);
+    if(!read_field_descriptors(raw_header, fp, ondisk)) {
+      fclose(fp);
+      fp = 0;
+      return(false);
+    }
+
+    bool same = (ondisk.fields.size() == header.fields.size());
+    for(size_t col=0; same && (col < header.fields.size()); ++col) {
+      same = same_field(ondisk.fields[col], header.fields[col]);
+    }
+
+    if(!same) {
+      log_error("dbf schema doesn't match the rows being appended: %s\n", path.c_str());
+      fclose(fp);
+      fp = 0;
+      return(false);
+    }
+
+    schema.header = header;
+    record_count = raw_header.table_records;
+    record_bytes = raw_header.record_bytes;
+    record_buf.resize(record_bytes);
+
+    //
+    // new rows go over the old 0x1a terminator. keep the header and whatever follows the
+    // records so abandon() can put the file back byte for byte
+    //
+    long end = (long) raw_header.header_bytes + ((long) record_count * record_bytes);
+    long file_end = 0;
+    bool status = (fseek(fp, 0, SEEK_END) == 0) && ((file_end = ftell(fp)) >= end);
+    if(status) {
+      append_offset = end;
+      append_tail.resize(file_end - end);
+      append_header.resize(sizeof(dBASE_header));
+      status = (fseek(fp, 0, SEEK_SET) == 0) && (io_fread(append_header.data(), append_header.size(), 1, fp) == 1) &&
+	(fseek(fp, end, SEEK_SET) == 0) && (append_tail.empty() || (io_fread(append_tail.data(), append_tail.size(), 1, fp) == 1)) &&
+	(fseek(fp, end, SEEK_SET) == 0);
+    }
+
+    if(!status) {
+      log_error("couldn't seek to the end of the dbf records\n");
+      fclose(fp);
+      fp = 0;
+      append_header.clear();
+      return(false);
+    }
+
+    return(true);
+  }
+
+  
+  bool dbfwriter::write(const dbftable &table, size_t row) {
+
+    if(!fp || (row >= table.rows.size())) {
+      return(false);
+    }
+
+    if(!encode_row(table, table.rows[row], row, record_buf.data(), record_bytes)) {
+      return(false);
+    }
+
+    if(io_fwrite(record_buf.data(), record_bytes, 1, fp) != 1) {
+      log_error("failed to write record...\n");
+      return(false);
+    }
+
+    record_count += 1;
+    return(true);
+  }
+
+
+  bool dbfwriter::write(const dbfrow &row) {
+
+    if(!fp) {
+      return(false);
+    }
+
+    if(!encode_row(schema, row, 0, record_buf.data(), record_bytes)) {
+      return(false);
+    }
+
+    if(io_fwrite(record_buf.data(), record_bytes, 1, fp) != 1) {
+      log_error("failed to write record...\n");
+      return(false);
+    }
+
+    record_count += 1;
+    return(true);
+  }
+
+  
+  bool dbfwriter::close() {
+
+    if(!fp) {
+      return(true);
+    }
+
+    //
+    // terminator after the last row, then only the header's count and date change
+    //
+    bool status = true;
+    uint8_t terminator = 0x1a;
+    if(io_fwrite(&terminator, 1, 1, fp) != 1) {
+      log_error("couldn't write file terminator\n");
+      status = false;
+    }
+
+    dBASE_header raw_header;
+    if(status && ((fseek(fp, 0, SEEK_SET) != 0) || (io_fread(&raw_header, sizeof(dBASE_header), 1, fp) != 1))) {
+      log_error("couldn't reread the dbf header\n");
+      status = false;
+    }
+
+    if(status) {
+      handle_endianess(raw_header);
+      raw_header.table_records = record_count;
+      set_lastupdate(raw_header);
+      handle_endianess(raw_header);
+      if((fseek(fp, 0, SEEK_SET) != 0) || (io_fwrite(&raw_header, sizeof(dBASE_header), 1, fp) != 1)) {
+	log_error("couldn't update the dbf header\n");
+	status = false;
+      }
+    }
+
+    if(!status && !append_header.empty()) {
+      abandon(); // a half written header would count rows that aren't committed
+      return(false);
+    }
+
+    fclose(fp);
+    fp = 0;
+    append_header.clear();
+    return(status);
+  }
+
+
+  void dbfwriter::abandon() {
+
+    if(!fp) {
+      return;
+    }
+
+    //
+    // an append goes back to the original header, tail and length. a new file is just
+    // closed without its terminator, the caller removes it.
+    //
+    if(!append_header.empty()) {
+      fflush(fp);
+      if((fseek(fp, 0, SEEK_SET) != 0) || (io_fwrite(append_header.data(), append_header.size(), 1, fp) != 1) ||
+	 (fseek(fp, append_offset, SEEK_SET) != 0) ||
+	 (!append_tail.empty() && (io_fwrite(append_tail.data(), append_tail.size(), 1, fp) != 1)) ||
+	 (fflush(fp) != 0) || (ftruncate(fileno(fp), append_offset + append_tail.size()) != 0)) {
+	log_error("couldn't roll back the partial dbf append\n");
+      }
+    }
+
+    fclose(fp);
+    fp = 0;
+    append_header.clear();
+    append_tail.clear();
+  }
+
+
+  bool append_dbf(const std::string &path, const dbftable &table) {
+
+    dbfwriter writer;
+    if(!writer.open_append(path, table.header)) {
+      return(false);
+    }
+
+    for(size_t row=0; row < table.rows.size(); ++row) {
+      if(!writer.write(table, row)) {
+	writer.abandon();
+	return(false);
+      }
+    }
+
+    return(writer.close());
+  }
+
+  
+  static FILE *open_dbf_header(const std::string &path, const char *mode, dBASE_header &raw_header) {
+
+    FILE *fp = fopen(path.c_str(), mode);
+    if(!fp) {
+      log_error("couldn't open dbf: %s\n", path.c_str());
+      return(0);
+    }
+
+    if(io_fread(&raw_header, sizeof(dBASE_header), 1, fp) != 1) {
+      log_error("couldn't read dbf header...\n");
+      fclose(fp);
+      return(0);
+    }
+
+    handle_endianess(raw_header);
+    if(raw_header.record_bytes == 0) {
+      log_error("dbf has zero length records: %s\n", path.c_str());
+      fclose(fp);
+      return(0);
+    }
+
+    return(fp);
+  }
+
+  
+  bool mark_deleted(const std::string &path, const std::vector<uint32_t> &recnos, bool deleted) {
+
+    dBASE_header raw_header;
+    FILE *fp = open_dbf_header(path, "r+b", raw_header);
+    if(!fp) {
+      return(false);
+    }
+
+    //
+    // the whole list is checked before the first write, a bad recno changes nothing
+    //
+    for(uint32_t recno : recnos) {
+      if(recno >= raw_header.table_records) {
+	log_error("record %u out of range\n", recno);
+	fclose(fp);
+	return(false);
+      }
+    }
+
+    bool status = true;
+    uint8_t flag = deleted ? '*' : ' ';
+    for(uint32_t recno : recnos) {
+      long offset = (long) raw_header.header_bytes + ((long) recno * raw_header.record_bytes);
+      if((fseek(fp, offset, SEEK_SET) != 0) || (io_fwrite(&flag, 1, 1, fp) != 1)) {
+	log_error("couldn't update record %u\n", recno);
+	status = false;
+	break;
+      }
+    }
+
+    if(fclose(fp) != 0) {
+      status = false;
+    }
+    
+    return(status);
+  }
+
+
+  bool deleted_records(const std::string &path, std::vector<bool> &deleted) {
+
+    deleted.clear();
+    
+    dBASE_header raw_header;
+    FILE *fp = open_dbf_header(path, "rb", raw_header);
+    if(!fp) {
+      return(false);
+    }
+
+    //
+    // whole records in large reads, only the status byte is looked at
+    //
+    static const size_t BATCH_RECORDS = 4096;
+    std::vector<uint8_t> buf((size_t) raw_header.record_bytes * BATCH_RECORDS);
+    bool status = (fseek(fp, raw_header.header_bytes, SEEK_SET) == 0);
+    uint32_t remaining = raw_header.table_records;
+    deleted.reserve(remaining);
+    while(status && (remaining > 0)) {
+      size_t batch = std::min((size_t) remaining, BATCH_RECORDS);
+      if(io_fread(buf.data(), raw_header.record_bytes, batch, fp) != batch) {
+	log_error("couldn't read dbf records...\n");
+	status = false;
+	break;
+      }
+
+      for(size_t idx=0; idx < batch; ++idx) {
+	deleted.push_back(buf[idx * raw_header.record_bytes] != 0x20);
+      }
+      remaining -= batch;
+    }
+
+    fclose(fp);
+    return(status);
+  }
+
+
+  bool write_vacuumed_dbf(const std::string &path, const std::string &tmppath) {
+
+    dBASE_header raw_header;
+    FILE *fp = open_dbf_header(path, "rb", raw_header);
+    if(!fp) {
+      return(false);
+    }
+
+    FILE *outfp = fopen(tmppath.c_str(), "wb");
+    if(!outfp) {
+      log_error("couldn't create %s\n", tmppath.c_str());
+      fclose(fp);
+      return(false);
+    }
+
+    //
+    // header and field descriptors are copied as-is, the record count is fixed up at the end
+    //
+    std::vector<uint8_t> buf(std::max((size_t) raw_header.header_bytes, (size_t) raw_header.record_bytes));
+    bool status = (fseek(fp, 0, SEEK_SET) == 0) &&
+      (io_fread(buf.data(), raw_header.header_bytes, 1, fp) == 1) &&
+      (io_fwrite(buf.data(), raw_header.header_bytes, 1, outfp) == 1);
+
+    uint32_t kept = 0;
+    for(uint32_t recno=0; status && (recno < raw_header.table_records); ++recno) {
+      if(io_fread(buf.data(), raw_header.record_bytes, 1, fp) != 1) {
+	log_error("couldn't read dbf record %u\n", recno);
+	status = false;
+	break;
+      }
+
+      if(buf[0] != 0x20) {
+	continue;
+      }
+
+      if(io_fwrite(buf.data(), raw_header.record_bytes, 1, outfp) != 1) {
+	status = false;
+	break;
+      }
+      kept += 1;
+    }
+
+    fclose(fp);
+
+    uint8_t terminator = 0x1a;
+    status = status && (io_fwrite(&terminator, 1, 1, outfp) == 1);
+    if(status) {
+      dBASE_header out_header = raw_header;
+      out_header.table_records = kept;
+      set_lastupdate(out_header);
+      handle_endianess(out_header);
+      status = (fseek(outfp, 0, SEEK_SET) == 0) && (io_fwrite(&out_header, sizeof(dBASE_header), 1, outfp) == 1);
+    }
+
+    status = (fclose(outfp) == 0) && status;
+    if(!status) {
+      log_error("couldn't vacuum dbf: %s\n", path.c_str());
+      remove(tmppath.c_str());
+    }
+    
+    return(status);
+  }
+
+
+  bool vacuum_dbf(const std::string &path) {
+
+    std::string tmppath = path + ".vacuum";
+    if(!write_vacuumed_dbf(path, tmppath)) {
+      return(false);
+    }
+
+    if(rename(tmppath.c_str(), path.c_str()) != 0) {
+      log_error("couldn't replace %s with its compacted copy\n", path.c_str());
+      remove(tmppath.c_str());
+      return(false);
+    }
+
+    return(true);
+  }
+
+  
+  bool dbf_text_is_utf8(const std::string &path) {
+
+    if(path.size() < 4) {
+      return(false);
+    }
+
+    //
+    // the .cpg holds the codepage name on one line, "UTF-8" (or 65001) for utf8
+    //
+    std::string base = path.substr(0, path.size() - 3);
+    FILE *fp = fopen((base + "cpg").c_str(), "r");
+    if(!fp) {
+      fp = fopen((base + "CPG").c_str(), "r");
+    }
+    if(!fp) {
+      return(false);
+    }
+
+    char line[64];
+    std::string name;
+    if(fgets(line, sizeof(line), fp)) {
+      for(const char *c = line; *c; ++c) {
+	if(isalnum((unsigned char) *c)) { // skips a BOM, spaces and separators
+	  name += (char) toupper((unsigned char) *c);
+	}
+      }
+    }
+    fclose(fp);
+
+    return((name == "UTF8") || (name == "65001"));
+  }
+
+
+  bool file_stamp(const std::string &path, uint64_t &bytes, int64_t &mtime) {
+
+    bytes = 0;
+    mtime = 0;
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {
+      log_error("couldn't stat %s\n", path.c_str());
+      return(false);
+    }
+
+    //
+    // nanoseconds, a same size rewrite within the same second still changes it
+    //
+    bytes = st.st_size;
+#ifdef __APPLE__
+    mtime = ((int64_t) st.st_mtimespec.tv_sec * 1000000000) + st.st_mtimespec.tv_nsec;
+#else
+    mtime = ((int64_t) st.st_mtim.tv_sec * 1000000000) + st.st_mtim.tv_nsec;
+#endif
+    return(true);
+  }
+
+
+  bool dbfreader::open(const std::string &path) {
+
+    close();
+    
+    fp = fopen(path.c_str(), "rb");
+    if(!fp) {
+      log_error("couldn't open dbf for reading: %s\n", path.c_str());
+      return(false);
+    }
+    
+    dBASE_header raw_header;
+    memset(&raw_header, 0, sizeof(dBASE_header));
+    if(io_fread(&raw_header, sizeof(dBASE_header), 1, fp) != 1) {
+      log_error("couldn't read dbf header...\n");
+      close();
+      return(false);
+    }
+
+    handle_endianess(raw_header);
+
+    if(!read_field_descriptors(raw_header, fp, header)) {
+      log_error("trouble reading field descriptors...\n");
+      close();
+      return(false);
+    }
+
+    record_count = raw_header.table_records;
+    header_bytes = raw_header.header_bytes;
+    record_bytes = raw_header.record_bytes;
+    record_buf.resize(record_bytes);
+    
+    return(true);
+  }
+
+  
+  bool dbfreader::read(uint32_t recno, dbfrow &row, bool &deleted) {
+
+    if(!fp || (recno >= record_count)) {
+      return(false);
+    }
+
+    long offset = (long) header_bytes + ((long) recno * record_bytes);
+    if((fseek(fp, offset, SEEK_SET) != 0) ||
+       (io_fread(record_buf.data(), record_bytes, 1, fp) != 1)) {
+      log_error("couldn't read dbf record %u\n", recno);
+      return(false);
+    }
+
+    deleted = (record_buf[0] != 0x20);
+    if(deleted) {
+      row.values.clear();
+      return(true);
+    }
+
+    return(parse_record(record_buf.data(), record_bytes, header, 0, row));
+  }
+
+  
+  void dbfreader::close() {
+    if(fp) {
+      fclose(fp);
+      fp = 0;
+    }
+
+    header.fields.clear();
+    record_count = 0;
+  }
+
+  
+  bool read_dbf_records(const std::string &path, const std::vector<uint32_t> &recnos, dbftable &table,
+			std::vector<uint32_t> &row_recnos) {
+
+    table.header.fields.clear();
+    table.rows.clear();
+    table.dictionaries.clear();
+    row_recnos.clear();
+    
+    dbfreader reader;
+    if(!reader.open(path)) {
+      return(false);
+    }
+
+    table.header = reader.header;
+    for(uint32_t recno : recnos) {
+      dbfrow row;
+      bool deleted = false;
+      if(!reader.read(recno, row, deleted)) {
+	return(false);
+      }
+
+      if(deleted) {
+	log_warn("record deleted, skipping...\n");
+	continue;
+      }
+
+      table.rows.push_back(row);
+      row_recnos.push_back(recno);
+    }
+    
+    return(true);
+  }
+
+  
+  uint32_t dbfdictionary::intern(const std::string &s) {
+    
+    auto it = index.find(s);
+    if(it != index.end()) {
+      return(it->second);
+    }
+
+    uint32_t code = strings.size();
+    strings.push_back(s);
+    index[s] = code;
+    return(code);
+  }
+
+  
+  bool dbfdictionary::find(const std::string &s, uint32_t &code) const {
+    
+    auto it = index.find(s);
+    if(it == index.end()) {
+      return(false);
+    }
+
+    code = it->second;
+    return(true);
+  }
+
+  
+  bool dbftable::coded(size_t col) const {
+    return((col < dictionaries.size()) && (header.fields[col].field_type == "C"));
+  }
+
+
+  size_t dbftable::coded_count() const {
+
+    size_t count = 0;
+    for(size_t col=0; col < dictionaries.size(); ++col) {
+      count += coded(col) ? 1 : 0;
+    }
+    return(count);
+  }
+
+
+  size_t dbftable::value_slot(size_t col) const {
+
+    size_t slot = col;
+    for(size_t prev=0; prev < std::min(col, dictionaries.size()); ++prev) {
+      slot -= coded(prev) ? 1 : 0;
+    }
+    return(slot);
+  }
+
+
+  std::string_view dbftable::str(size_t row, size_t col) const {
+    
+    if(coded(col)) {
+      return(dictionaries[col].str(dictionaries[col].codes[row]));
+    }
+    
+    return(rows[row].values[value_slot(col)].value);
+  }
+
+
+  dbffield_value dbftable::value(size_t row, size_t col) const {
+
+    if(coded(col)) {
+      return(dbffield_value(dictionaries[col].str(dictionaries[col].codes[row])));
+    }
+
+    return(rows[row].values[value_slot(col)]);
+  }
+
+  
+  int find_field(const dbfheader &header, const std::string &field_name) {
+    
+    for(size_t ii=0; ii < header.fields.size(); ++ii) {
+      if(header.fields[ii].field_name == field_name) {
+	return((int) ii);
+      }
+    }
+
+    return(-1);
+  }
+
+  
+  bool add_column(dbftable &table, const dbffield_def &field, const std::vector<double> &values) {
+
+    if((field.field_type != "F") || field.field_name.empty() || (field.field_name.size() > 10)) {
+      log_error("add_column needs an 'F' field with a name of 1 to 10 characters\n");
+      return(false);
+    }
+
+    if(find_field(table.header, field.field_name) >= 0) {
+      log_error("field already exists: %s\n", field.field_name.c_str());
+      return(false);
+    }
+
+    if(values.size() != table.rows.size()) {
+      log_error("add_column: %zu values for %zu rows\n", values.size(), table.rows.size());
+      return(false);
+    }
+
+    table.header.fields.push_back(field);
+    if(!table.dictionaries.empty()) {
+      table.dictionaries.resize(table.header.fields.size());
+    }
+
+    for(size_t row=0; row < values.size(); ++row) {
+      table.rows[row].values.push_back(dbffield_value(values[row]));
+    }
+
+    return(true);
+  }
+
+  
+  bool filter_equals(const dbftable &table, const std::string &field_name, const std::string &value, std::vector<uint32_t> &row_indices) {
+
+    row_indices.clear();
+    
+    int col = find_field(table.header, field_name);
+    if(col < 0) {
+      log_error("no such field: %s\n", field_name.c_str());
+      return(false);
+    }
+
+    if(table.coded(col)) {
+      
+      //
+      // resolve the value once, then the scan is a plain integer compare over the column
+      //
+      const dbfdictionary &dict = table.dictionaries[col];
+      uint32_t code = 0;
+      if(!dict.find(value, code)) {
+	return(true);
+      }
+      
+      for(uint32_t ii=0; ii < dict.codes.size(); ++ii) {
+	if(dict.codes[ii] == code) {
+	  row_indices.push_back(ii);
+	}
+      }
+      
+      return(true);
+    }
+    
+    size_t slot = table.value_slot(col);
+    for(uint32_t ii=0; ii < table.rows.size(); ++ii) {
+      if(std::string_view(table.rows[ii].values[slot].value) == value) {
+	row_indices.push_back(ii);
+      }
+    }
+    
+    return(true);
+  }
+
+  
+  bool group_counts(const dbftable &table, const std::string &field_name, std::vector<uint32_t> &counts) {
+
+    counts.clear();
+    
+    int col = find_field(table.header, field_name);
+    if(col < 0) {
+      log_error("no such field: %s\n", field_name.c_str());
+      return(false);
+    }
+
+    if(!table.coded(col)) {
+      log_error("field %s isn't dictionary encoded\n", field_name.c_str());
+      return(false);
+    }
+
+    const dbfdictionary &dict = table.dictionaries[col];
+    counts.resize(dict.strings.size(), 0);
+    for(uint32_t code : dict.codes) {
+      counts[code] += 1;
+    }
+    
+    return(true);
+  }
+
 } // namespace dbfutil
@@ -2,8 +2,12 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <memory_resource>
 
 namespace dbfutil {
 
@@ -21,13 +25,20 @@ namespace dbfutil {
   
   class dbfheader {
   public:
-    std::vector<dbffield_def> fields;
+    dbfheader() { }
+    explicit dbfheader(std::pmr::memory_resource *mr) : fields(mr) { }
+    std::pmr::vector<dbffield_def> fields; // names and types fit std::string's inline buffer
   };
   
 
+  //
+  // rows, values and value strings are std::pmr containers (see shapefile in shputil.h):
+  // read_dbf parses into the resource of table.rows, a default table uses new/delete
+  //
   class dbffield_value {
   public:
     enum class vtype  { str, sint, uint, dbl };
+    typedef std::pmr::polymorphic_allocator<dbffield_value> allocator_type;
     
     dbffield_value() { _vtype = vtype::str; value = ""; }
     dbffield_value(const std::string &s) { _vtype = vtype::str; value = s; }
@@ -35,25 +46,146 @@ namespace dbfutil {
     dbffield_value(uint32_t u32) { _vtype = vtype::uint; _u32_val = u32; value = "";}
     dbffield_value(double dbl) { _vtype = vtype::dbl; _dbl_val = dbl; value = "";}
 
+    dbffield_value(const dbffield_value &other) = default;
+    dbffield_value(dbffield_value &&other) = default;
+    explicit dbffield_value(const allocator_type &alloc) : value(alloc) { _vtype = vtype::str; }
+    dbffield_value(const dbffield_value &other, const allocator_type &alloc) :
+      _vtype(other._vtype), _s32_val(other._s32_val), _u32_val(other._u32_val), _dbl_val(other._dbl_val), value(other.value, alloc) { }
+    dbffield_value(dbffield_value &&other, const allocator_type &alloc) :
+      _vtype(other._vtype), _s32_val(other._s32_val), _u32_val(other._u32_val), _dbl_val(other._dbl_val), value(std::move(other.value), alloc) { }
+    dbffield_value &operator=(const dbffield_value &other) = default;
+    dbffield_value &operator=(dbffield_value &&other) = default;
+
     vtype _vtype;
     int32_t _s32_val;
     uint32_t _u32_val;
     double _dbl_val;
-    std::string value;
+    std::pmr::string value;
   };
   
   class dbfrow {
   public:
-    std::vector<dbffield_value> values;
+    typedef std::pmr::polymorphic_allocator<dbfrow> allocator_type;
+    dbfrow() { }
+    dbfrow(const dbfrow &other) = default;
+    dbfrow(dbfrow &&other) = default;
+    explicit dbfrow(const allocator_type &alloc) : values(alloc) { }
+    dbfrow(const dbfrow &other, const allocator_type &alloc) : values(other.values, alloc) { }
+    dbfrow(dbfrow &&other, const allocator_type &alloc) : values(std::move(other.values), alloc) { }
+    dbfrow &operator=(const dbfrow &other) = default;
+    dbfrow &operator=(dbfrow &&other) = default;
+    std::pmr::vector<dbffield_value> values;
+  };
+  
+  //
+  // dictionary encoded 'C' fields are stored by column, outside the rows: each distinct
+  // string once in strings, and codes[row] for every row. a coded value costs 4 bytes
+  // instead of a 64 byte dbffield_value (plus its heap string past 15 chars), and
+  // filter_equals/group_counts compare integers. rows of such a table hold only the
+  // uncoded fields, in field order, so go through dbftable::str()/value() by field.
+  //
+  class dbfdictionary {
+  public:
+    uint32_t intern(const std::string &s);
+    bool find(const std::string &s, uint32_t &code) const;
+    const std::string &str(uint32_t code) const { return(strings[code]); }
+    std::vector<std::string> strings;
+    std::vector<uint32_t> codes; // the column, one per row
+    std::unordered_map<std::string, uint32_t> index;
   };
   
   class dbftable {
   public:
+    dbftable() { }
+    explicit dbftable(std::pmr::memory_resource *mr) : header(mr), rows(mr) { }
+    bool coded(size_t col) const; // field col lives in dictionaries[col].codes, not in the rows
+    size_t coded_count() const;
+    size_t value_slot(size_t col) const; // where an uncoded field sits in row.values
+    std::string_view str(size_t row, size_t col) const; // 'C' fields, coded or not
+    dbffield_value value(size_t row, size_t col) const; // any field, codes resolved to strings
     dbfheader header;
-    std::vector<dbfrow> rows;
+    std::pmr::vector<dbfrow> rows;
+    std::vector<dbfdictionary> dictionaries; // one per field when read with dictionary_encode, empty otherwise
+  };
+
+  class dbfreadopts {
+  public:
+    dbfreadopts() { dictionary_encode = false; }
+    bool dictionary_encode; // 'C' fields go to table.dictionaries by column, see dbfdictionary
   };
   
   bool read_dbf(const std::string &path, dbftable &table);
+  bool read_dbf(const std::string &path, dbftable &table, const dbfreadopts &opts);
   bool write_dbf(const std::string &path, const dbftable &table);
+  bool write_dbf(const std::string &path, const dbftable &table, const std::vector<uint32_t> &order); // row i is table.rows[order[i]]
+
+  //
+  // streaming writer: rows go straight to the file, close() writes the terminator and
+  // patches the header's record count. open_append() continues an existing file after
+  // checking that its schema matches, so appending costs O(new rows). the header isn't
+  // touched until close(): abandon() drops the rows written since open_append() and puts
+  // the file back as it was, as does a close() that fails partway.
+  //
+  class dbfwriter {
+  public:
+    dbfwriter() { fp = 0; record_count = 0; record_bytes = 0; append_offset = 0; }
+    ~dbfwriter() { close(); }
+    bool create(const std::string &path, const dbfheader &header);
+    bool open_append(const std::string &path, const dbfheader &header);
+    bool write(const dbfrow &row);
+    bool write(const dbftable &table, size_t row); // table.rows[row], with its dictionary codes
+    bool close();
+    void abandon(); // no terminator, no header update
+    dbftable schema; // header only
+    uint32_t record_count;
+    uint16_t record_bytes;
+    std::vector<uint8_t> record_buf;
+    std::vector<uint8_t> append_header; // open_append: the original header and the bytes after
+    std::vector<uint8_t> append_tail;   // the original records (the terminator), for abandon()
+    long append_offset;
+    FILE *fp;
+  };
+
+  bool append_dbf(const std::string &path, const dbftable &table); // all rows or none
+
+  //
+  // soft delete: mark_deleted only flips each record's status byte ('*' deleted, ' ' live),
+  // every recno is range checked before the first flip. vacuum_dbf is not incremental: it
+  // streams all live records into a new file (one record in memory) and renames it over
+  // the old one, so its cost is the whole table, but a failure never leaves a torn file.
+  //
+  bool mark_deleted(const std::string &path, const std::vector<uint32_t> &recnos, bool deleted = true); // 0-based
+  bool deleted_records(const std::string &path, std::vector<bool> &deleted); // status bytes only
+  bool vacuum_dbf(const std::string &path);
+  bool write_vacuumed_dbf(const std::string &path, const std::string &out_path); // the copy alone, nothing renamed
+
+  bool dbf_text_is_utf8(const std::string &path); // a .cpg next to the dbf names UTF-8
+  bool file_stamp(const std::string &path, uint64_t &bytes, int64_t &mtime); // size and mtime in nanoseconds, for sidecar staleness checks
+
+  //
+  // record-at-a-time access by physical record number (0-based, deleted records included)
+  //
+  class dbfreader {
+  public:
+    dbfreader() { fp = 0; record_count = 0; header_bytes = 0; record_bytes = 0; }
+    ~dbfreader() { close(); }
+    bool open(const std::string &path);
+    bool read(uint32_t recno, dbfrow &row, bool &deleted); // fixed-offset seek
+    void close();
+    dbfheader header;
+    uint32_t record_count;
+    uint16_t header_bytes;
+    uint16_t record_bytes;
+    std::vector<uint8_t> record_buf;
+    FILE *fp;
+  };
+
+  bool read_dbf_records(const std::string &path, const std::vector<uint32_t> &recnos, dbftable &table,
+			std::vector<uint32_t> &row_recnos); // skips deleted records, row_recnos[i] is table.rows[i]'s recno
+  
+  int find_field(const dbfheader &header, const std::string &field_name); // -1 if not found
+  bool add_column(dbftable &table, const dbffield_def &field, const std::vector<double> &values); // new 'F' column, one value per row
+  bool filter_equals(const dbftable &table, const std::string &field_name, const std::string &value, std::vector<uint32_t> &row_indices);
+  bool group_counts(const dbftable &table, const std::string &field_name, std::vector<uint32_t> &counts); // counts[code], a 'C' field read with dictionary_encode
   
 } // dbfutil namespace
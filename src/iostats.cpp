@@ -0,0 +1,148 @@
+
+#include "iostats.h"
+#include <mutex>
+#include <set>
+#include <cstring>
+
+std::atomic<bool> io_stats_on(false);
+
+static const int NUM_COUNTERS = (int) io_counter::count;
+static const int NUM_PHASES = (int) io_phase::count;
+
+//
+// only the owning thread writes its counters (relaxed load + store, no locked rmw),
+// other threads may read them while aggregating
+//
+struct io_thread_counters {
+  io_thread_counters();
+  ~io_thread_counters();
+  std::atomic<uint64_t> counters[NUM_COUNTERS];
+  std::atomic<uint64_t> phase_nanos[NUM_PHASES];
+};
+
+static std::mutex registry_mutex;
+static std::set<io_thread_counters *> registry;
+static uint64_t retired_counters[NUM_COUNTERS];
+static uint64_t retired_phase_nanos[NUM_PHASES];
+
+
+io_thread_counters::io_thread_counters() {
+  for(int ii=0; ii < NUM_COUNTERS; ++ii) {
+    counters[ii].store(0, std::memory_order_relaxed);
+  }
+
+  for(int ii=0; ii < NUM_PHASES; ++ii) {
+    phase_nanos[ii].store(0, std::memory_order_relaxed);
+  }
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.insert(this);
+}
+
+
+io_thread_counters::~io_thread_counters() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for(int ii=0; ii < NUM_COUNTERS; ++ii) {
+    retired_counters[ii] += counters[ii].load(std::memory_order_relaxed);
+  }
+
+  for(int ii=0; ii < NUM_PHASES; ++ii) {
+    retired_phase_nanos[ii] += phase_nanos[ii].load(std::memory_order_relaxed);
+  }
+
+  registry.erase(this);
+}
+
+
+static io_thread_counters &local_counters() {
+  thread_local io_thread_counters local;
+  return(local);
+}
+
+
+static void bump(std::atomic<uint64_t> &counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+
+static io_stats to_stats(const uint64_t *counters, const uint64_t *phase_nanos) {
+  io_stats stats;
+  stats.bytes_read = counters[(int) io_counter::bytes_read];
+  stats.bytes_written = counters[(int) io_counter::bytes_written];
+  stats.read_calls = counters[(int) io_counter::read_calls];
+  stats.write_calls = counters[(int) io_counter::write_calls];
+  stats.records_decoded = counters[(int) io_counter::records_decoded];
+  stats.records_skipped = counters[(int) io_counter::records_skipped];
+  stats.null_shapes = counters[(int) io_counter::null_shapes];
+  stats.vertices = counters[(int) io_counter::vertices];
+  stats.allocations = counters[(int) io_counter::allocations];
+  stats.header_secs = phase_nanos[(int) io_phase::header] / 1e9;
+  stats.records_secs = phase_nanos[(int) io_phase::records] / 1e9;
+  stats.bbox_secs = phase_nanos[(int) io_phase::bbox] / 1e9;
+  stats.dbf_parse_secs = phase_nanos[(int) io_phase::dbf_parse] / 1e9;
+  return(stats);
+}
+
+
+void io_stats_enable(bool enabled) {
+  io_stats_on.store(enabled, std::memory_order_relaxed);
+}
+
+
+void io_stats_reset() {
+  io_thread_counters &local = local_counters();
+  for(int ii=0; ii < NUM_COUNTERS; ++ii) {
+    local.counters[ii].store(0, std::memory_order_relaxed);
+  }
+
+  for(int ii=0; ii < NUM_PHASES; ++ii) {
+    local.phase_nanos[ii].store(0, std::memory_order_relaxed);
+  }
+}
+
+
+io_stats io_stats_get() {
+  io_thread_counters &local = local_counters();
+  uint64_t counters[NUM_COUNTERS];
+  uint64_t phase_nanos[NUM_PHASES];
+  for(int ii=0; ii < NUM_COUNTERS; ++ii) {
+    counters[ii] = local.counters[ii].load(std::memory_order_relaxed);
+  }
+
+  for(int ii=0; ii < NUM_PHASES; ++ii) {
+    phase_nanos[ii] = local.phase_nanos[ii].load(std::memory_order_relaxed);
+  }
+
+  return(to_stats(counters, phase_nanos));
+}
+
+
+io_stats io_stats_aggregate() {
+  uint64_t counters[NUM_COUNTERS];
+  uint64_t phase_nanos[NUM_PHASES];
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  memcpy(counters, retired_counters, sizeof(counters));
+  memcpy(phase_nanos, retired_phase_nanos, sizeof(phase_nanos));
+  for(io_thread_counters *thread_counters : registry) {
+    for(int ii=0; ii < NUM_COUNTERS; ++ii) {
+      counters[ii] += thread_counters->counters[ii].load(std::memory_order_relaxed);
+    }
+
+    for(int ii=0; ii < NUM_PHASES; ++ii) {
+      phase_nanos[ii] += thread_counters->phase_nanos[ii].load(std::memory_order_relaxed);
+    }
+  }
+
+  return(to_stats(counters, phase_nanos));
+}
+
+
+void io_stats_count(io_counter counter, uint64_t n) {
+  bump(local_counters().counters[(int) counter], n);
+}
+
+
+void io_stats_time(io_phase phase, uint64_t nanos) {
+  bump(local_counters().phase_nanos[(int) phase], nanos);
+}
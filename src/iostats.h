@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+
+//
+// per-thread i/o and decode counters for the shp/dbf readers and writers.
+// disabled by default, when off every hook is a single relaxed load.
+//
+//   io_stats_enable(true);
+//   io_stats_reset();
+//   shputil::read_shp(path, shp);
+//   io_stats stats = io_stats_get(); // what this thread just did
+//
+
+struct io_stats {
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t read_calls;      // fread/pread calls, not necessarily syscalls
+  uint64_t write_calls;     // fwrite/pwrite calls, not necessarily syscalls
+  uint64_t records_decoded;
+  uint64_t records_skipped; // null shapes and deleted dbf rows
+  uint64_t null_shapes;
+  uint64_t vertices;
+  uint64_t allocations;     // record buffers and shape nodes made by the library
+  double header_secs;
+  double records_secs;
+  double bbox_secs;
+  double dbf_parse_secs;
+};
+
+enum class io_counter {
+  bytes_read, bytes_written, read_calls, write_calls, records_decoded,
+  records_skipped, null_shapes, vertices, allocations, count
+};
+
+enum class io_phase { header, records, bbox, dbf_parse, count };
+
+extern std::atomic<bool> io_stats_on;
+
+void io_stats_enable(bool enabled);
+void io_stats_reset();          // this thread's counters
+io_stats io_stats_get();        // this thread's counters
+io_stats io_stats_aggregate();  // every live thread plus threads that have exited
+
+void io_stats_count(io_counter counter, uint64_t n);
+void io_stats_time(io_phase phase, uint64_t nanos);
+
+
+inline void io_stats_add(io_counter counter, uint64_t n) {
+  if(io_stats_on.load(std::memory_order_relaxed)) {
+    io_stats_count(counter, n);
+  }
+}
+
+
+inline size_t io_fread(void *ptr, size_t size, size_t nitems, FILE *fp) {
+  size_t nread = fread(ptr, size, nitems, fp);
+  if(io_stats_on.load(std::memory_order_relaxed)) {
+    io_stats_count(io_counter::read_calls, 1);
+    io_stats_count(io_counter::bytes_read, nread * size);
+  }
+  return(nread);
+}
+
+
+inline size_t io_fwrite(const void *ptr, size_t size, size_t nitems, FILE *fp) {
+  size_t nwritten = fwrite(ptr, size, nitems, fp);
+  if(io_stats_on.load(std::memory_order_relaxed)) {
+    io_stats_count(io_counter::write_calls, 1);
+    io_stats_count(io_counter::bytes_written, nwritten * size);
+  }
+  return(nwritten);
+}
+
+
+//
+// adds the wall time of its scope to a phase
+//
+class io_phase_timer {
+public:
+  io_phase_timer(io_phase p) {
+    phase = p;
+    enabled = io_stats_on.load(std::memory_order_relaxed);
+    if(enabled) {
+      start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~io_phase_timer() {
+    if(enabled) {
+      std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+      io_stats_time(phase, elapsed.count());
+    }
+  }
+
+  io_phase phase;
+  bool enabled;
+  std::chrono::steady_clock::time_point start;
+};
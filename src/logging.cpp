@@ -1,8 +1,30 @@
 
 #include "logging.h"
 #include <stdarg.h>
+#include <atomic>
+
+static std::atomic<bool> log_enabled(true); // read by every reader thread, flipped from any
+static std::atomic<FILE *> log_stream(0);   // null means stdout
+
+void set_log_enabled(bool enabled) {
+  log_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void set_log_stream(FILE *fp) {
+  log_stream.store(fp, std::memory_order_relaxed);
+}
+
+static FILE *diagnostics() {
+  FILE *fp = log_stream.load(std::memory_order_relaxed);
+  return(fp ? fp : stdout);
+}
+
 
 void log(const char *format, ... ) {
+  if(!log_enabled.load(std::memory_order_relaxed)) {
+    return;
+  }
+  
   va_list arglist;
   va_start(arglist, format);
   vprintf(format, arglist);
@@ -12,21 +34,23 @@ void log(const char *format, ... ) {
 
 
 void log_warn(const char *format, ... ) {
-  printf("WARNING -->  ");
+  FILE *fp = diagnostics();
+  fprintf(fp, "WARNING -->  ");
   va_list arglist;
   va_start(arglist, format);
-  vprintf(format, arglist);
+  vfprintf(fp, format, arglist);
   va_end(arglist);
-  fflush(stdout);
+  fflush(fp);
 }
  
 
 void log_error(const char *format, ... ) {
-  printf("ERROR --> ");
+  FILE *fp = diagnostics();
+  fprintf(fp, "ERROR --> ");
   va_list arglist;
   va_start(arglist, format);
-  vprintf(format, arglist);
+  vfprintf(fp, format, arglist);
   va_end(arglist);
-  fflush(stdout);
+  fflush(fp);
 }
 
@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 
+void set_log_enabled(bool enabled); // only affects log(), warnings and errors always print
+void set_log_stream(FILE *fp);      // where warnings and errors print, stdout by default
 void log(const char *format, ... );
 void log_warn(const char *format, ... );
 void log_error(const char *format, ... );
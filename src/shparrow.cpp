@@ -0,0 +1,499 @@
+
+#include "shparrow.h"
+#include "shpshared.h"
+#include "dbfutil.h"
+#include "logging.h"
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#ifdef __APPLE__
+  #include <machine/endian.h>
+#else
+  #include <endian.h>
+#endif
+
+namespace shputil {
+
+  //
+  // a layer as flat columns, either pointing into a snapshot mapping or into a
+  // decoded_layer. same layout in both cases (see shpsnapshot.h)
+  //
+  class arrow_source {
+  public:
+    arrow_source() { stype = shape_type::null_shape; record_count = part_count = point_count = 0; record_parts = part_points = 0; coords = 0; validity = 0; utf8_text = false; }
+    shape_type stype;
+    uint64_t record_count, part_count, point_count;
+    const int32_t *record_parts;
+    const int32_t *part_points;
+    const double *coords;
+    const uint8_t *validity;
+    std::vector<snapshot_field> fields;
+    std::vector<const void *> data;   // per field: int64 / double values, int32 string offsets
+    std::vector<const char *> chars;  // per field, 'C' only
+    bool utf8_text;                   // the dbf's codepage is known to be UTF-8
+  };
+
+  class decoded_layer {
+  public:
+    std::vector<int32_t> record_parts;
+    std::vector<int32_t> part_points;
+    std::vector<double> coords;
+    std::vector<uint8_t> validity;
+    std::vector<snapshot_field> fields;
+    std::vector<std::vector<uint8_t> > column_data;
+    std::vector<std::vector<char> > column_chars;
+  };
+
+
+  //
+  // private_data of every exported array / schema. an array node holds a reference on
+  // the decoded storage, so a child moved out by the consumer outlives its parent safely
+  //
+  class arrow_array_node {
+  public:
+    std::shared_ptr<void> keep;
+    std::vector<std::vector<uint64_t> > owned; // buffers computed for the export
+    std::vector<const void *> buffers;
+    std::vector<ArrowArray> child_arrays;
+    std::vector<ArrowArray *> children;
+  };
+
+  class arrow_schema_node {
+  public:
+    std::string format, name, metadata;
+    std::vector<ArrowSchema> child_schemas;
+    std::vector<ArrowSchema *> children;
+  };
+
+
+  static void release_array(ArrowArray *array) {
+    arrow_array_node *node = (arrow_array_node *) array->private_data;
+    for(ArrowArray *child : node->children) {
+      if(child->release) {
+	child->release(child);
+      }
+    }
+    delete node;
+    array->release = 0;
+  }
+
+
+  static void release_schema(ArrowSchema *schema) {
+    arrow_schema_node *node = (arrow_schema_node *) schema->private_data;
+    for(ArrowSchema *child : node->children) {
+      if(child->release) {
+	child->release(child);
+      }
+    }
+    delete node;
+    schema->release = 0;
+  }
+
+
+  //
+  // one field: the array and its schema together, children left for the caller to
+  // init through array->children[i] / schema->children[i]
+  //
+  static arrow_array_node *init_level(ArrowArray *array, ArrowSchema *schema, const std::shared_ptr<void> &keep, const char *format,
+				      const std::string &name, int64_t length, int n_buffers, int n_children,
+				      const std::string &metadata = std::string()) {
+
+    arrow_array_node *node = new arrow_array_node;
+    node->keep = keep;
+    node->buffers.assign(n_buffers, 0);
+    node->child_arrays.resize(n_children);
+    for(ArrowArray &child : node->child_arrays) {
+      memset(&child, 0, sizeof(ArrowArray));
+      node->children.push_back(&child);
+    }
+
+    array->length = length;
+    array->null_count = 0;
+    array->offset = 0;
+    array->n_buffers = n_buffers;
+    array->n_children = n_children;
+    array->buffers = node->buffers.data();
+    array->children = n_children ? node->children.data() : 0;
+    array->dictionary = 0;
+    array->release = release_array;
+    array->private_data = node;
+
+    arrow_schema_node *snode = new arrow_schema_node;
+    snode->format = format;
+    snode->name = name;
+    snode->metadata = metadata;
+    snode->child_schemas.resize(n_children);
+    for(ArrowSchema &child : snode->child_schemas) {
+      memset(&child, 0, sizeof(ArrowSchema));
+      snode->children.push_back(&child);
+    }
+
+    schema->format = snode->format.c_str();
+    schema->name = snode->name.c_str();
+    schema->metadata = metadata.empty() ? 0 : snode->metadata.data();
+    schema->flags = ARROW_FLAG_NULLABLE;
+    schema->n_children = n_children;
+    schema->children = n_children ? snode->children.data() : 0;
+    schema->dictionary = 0;
+    schema->release = release_schema;
+    schema->private_data = snode;
+
+    return(node);
+  }
+
+
+  template<typename T> static T *own(arrow_array_node *node, uint64_t count) {
+    node->owned.push_back(std::vector<uint64_t>(((count * sizeof(T)) + sizeof(uint64_t)) / sizeof(uint64_t), 0));
+    return((T *) node->owned.back().data());
+  }
+
+
+  static void append_i32(std::string &out, int32_t val) {
+    out.append((const char *) &val, sizeof(int32_t)); // native endian per the spec
+  }
+
+
+  static std::string extension_metadata(const char *extension) {
+    static const char *keys[2] = { "ARROW:extension:name", "ARROW:extension:metadata" };
+    const char *values[2] = { extension, "{}" };
+    std::string out;
+    append_i32(out, 2);
+    for(int idx=0; idx < 2; ++idx) {
+      append_i32(out, strlen(keys[idx]));
+      out += keys[idx];
+      append_i32(out, strlen(values[idx]));
+      out += values[idx];
+    }
+    return(out);
+  }
+
+
+  static int64_t count_nulls(const uint8_t *validity, uint64_t count) {
+    int64_t nulls = 0;
+    for(uint64_t idx=0; validity && (idx < count); ++idx) {
+      nulls += ((validity[idx >> 3] >> (idx & 7)) & 1) ? 0 : 1;
+    }
+    return(nulls);
+  }
+
+
+  // fixed_size_list<xy: double>[2] over interleaved coordinates
+  static arrow_array_node *xy_level(ArrowArray *array, ArrowSchema *schema, const std::shared_ptr<void> &keep, const std::string &name,
+				    uint64_t points, const double *coords, const std::string &metadata = std::string()) {
+    arrow_array_node *node = init_level(array, schema, keep, "+w:2", name, points, 1, 1, metadata);
+    arrow_array_node *values = init_level(array->children[0], schema->children[0], keep, "g", "xy", 2 * points, 2, 0);
+    values->buffers[1] = coords;
+    return(node);
+  }
+
+
+  //
+  // shapefile rings -> polygons: a clockwise ring (negative signed area) opens a polygon,
+  // anything else joins the open one. the first ring of a record always opens one
+  //
+  static void group_rings(const arrow_source &src, std::vector<int32_t> &record_polygons, std::vector<int32_t> &polygon_rings) {
+
+    record_polygons.assign(1, 0);
+    polygon_rings.clear();
+    for(uint64_t recno=0; recno < src.record_count; ++recno) {
+      for(int32_t ring=src.record_parts[recno]; ring < src.record_parts[recno + 1]; ++ring) {
+	const double *xy = src.coords + (2 * (uint64_t) src.part_points[ring]);
+	uint32_t count = src.part_points[ring + 1] - src.part_points[ring];
+	double area2 = 0.0;
+	for(uint32_t pt=1; (pt + 1) < count; ++pt) {
+	  area2 += ((xy[2 * pt] - xy[0]) * (xy[(2 * pt) + 3] - xy[1])) - ((xy[(2 * pt) + 2] - xy[0]) * (xy[(2 * pt) + 1] - xy[1]));
+	}
+	if((ring == src.record_parts[recno]) || (area2 < 0.0)) {
+	  polygon_rings.push_back(ring);
+	}
+      }
+      record_polygons.push_back(polygon_rings.size());
+    }
+    polygon_rings.push_back(src.part_count);
+  }
+
+
+  static bool geometry_column(const arrow_source &src, const std::shared_ptr<void> &keep, ArrowArray *array, ArrowSchema *schema) {
+
+    const uint64_t records = src.record_count;
+    const int32_t *rparts = src.record_parts;
+    const int32_t *ppoints = src.part_points;
+    arrow_array_node *node = 0;
+    switch(xy_type(src.stype)) {
+    case shape_type::point: {
+      const double *xy = src.coords;
+      node = xy_level(array, schema, keep, "geometry", records, xy, extension_metadata("geoarrow.point"));
+      if(src.point_count != records) {
+	arrow_array_node *xy_node = (arrow_array_node *) array->children[0]->private_data; // owned by the child that points at it
+	double *slots = own<double>(xy_node, 2 * records); // a slot per row, null records included
+	for(uint64_t recno=0; recno < records; ++recno) {
+	  bool has_point = (rparts[recno] < rparts[recno + 1]);
+	  slots[2 * recno] = has_point ? src.coords[2 * (uint64_t) ppoints[rparts[recno]]] : NAN;
+	  slots[(2 * recno) + 1] = has_point ? src.coords[(2 * (uint64_t) ppoints[rparts[recno]]) + 1] : NAN;
+	}
+	xy_node->buffers[1] = slots;
+      }
+      break;
+    }
+
+    case shape_type::multipoint: {
+      node = init_level(array, schema, keep, "+l", "geometry", records, 2, 1, extension_metadata("geoarrow.multipoint"));
+      if(src.part_count == records) {
+	node->buffers[1] = ppoints; // a part per record, so the part offsets are the record offsets
+      }
+      else {
+	int32_t *offsets = own<int32_t>(node, records + 1);
+	for(uint64_t recno=0; recno <= records; ++recno) {
+	  offsets[recno] = ppoints[rparts[recno]];
+	}
+	node->buffers[1] = offsets;
+      }
+      xy_level(array->children[0], schema->children[0], keep, "points", src.point_count, src.coords);
+      break;
+    }
+
+    case shape_type::polyline: {
+      node = init_level(array, schema, keep, "+l", "geometry", records, 2, 1, extension_metadata("geoarrow.multilinestring"));
+      node->buffers[1] = rparts;
+      arrow_array_node *lines = init_level(array->children[0], schema->children[0], keep, "+l", "linestrings", src.part_count, 2, 1);
+      lines->buffers[1] = ppoints;
+      xy_level(array->children[0]->children[0], schema->children[0]->children[0], keep, "vertices", src.point_count, src.coords);
+      break;
+    }
+
+    case shape_type::polygon: {
+      std::vector<int32_t> record_polygons, polygon_rings;
+      group_rings(src, record_polygons, polygon_rings);
+      node = init_level(array, schema, keep, "+l", "geometry", records, 2, 1, extension_metadata("geoarrow.multipolygon"));
+      int32_t *offsets = own<int32_t>(node, record_polygons.size());
+      memcpy(offsets, record_polygons.data(), record_polygons.size() * sizeof(int32_t));
+      node->buffers[1] = offsets;
+
+      ArrowArray *polygons = array->children[0];
+      ArrowSchema *polygons_schema = schema->children[0];
+      arrow_array_node *pnode = init_level(polygons, polygons_schema, keep, "+l", "polygons", polygon_rings.size() - 1, 2, 1);
+      offsets = own<int32_t>(pnode, polygon_rings.size());
+      memcpy(offsets, polygon_rings.data(), polygon_rings.size() * sizeof(int32_t));
+      pnode->buffers[1] = offsets;
+
+      arrow_array_node *rings = init_level(polygons->children[0], polygons_schema->children[0], keep, "+l", "rings", src.part_count, 2, 1);
+      rings->buffers[1] = ppoints;
+      xy_level(polygons->children[0]->children[0], polygons_schema->children[0]->children[0], keep, "vertices", src.point_count, src.coords);
+      break;
+    }
+
+    default:
+      log_error("no geoarrow type for shape type %d\n", (int) src.stype);
+      return(false);
+    }
+
+    //
+    // null records as well as deleted rows are null geometries
+    //
+    bool null_records = false;
+    for(uint64_t recno=0; !null_records && (recno < records); ++recno) {
+      null_records = (rparts[recno] == rparts[recno + 1]);
+    }
+
+    if(!null_records) {
+      array->null_count = count_nulls(src.validity, records);
+      node->buffers[0] = array->null_count ? src.validity : 0;
+      return(true);
+    }
+
+    uint8_t *validity = own<uint8_t>(node, (records + 7) / 8);
+    for(uint64_t recno=0; recno < records; ++recno) {
+      bool valid = (rparts[recno] < rparts[recno + 1]) && (!src.validity || ((src.validity[recno >> 3] >> (recno & 7)) & 1));
+      validity[recno >> 3] |= valid ? (1 << (recno & 7)) : 0;
+    }
+    array->null_count = count_nulls(validity, records);
+    node->buffers[0] = validity;
+    return(true);
+  }
+
+
+  //
+  // 7-bit text reads the same in UTF-8 and every ascii based codepage
+  //
+  static bool ascii_only(const char *chars, int32_t nbytes) {
+    uint8_t high = 0;
+    for(int32_t idx=0; idx < nbytes; ++idx) {
+      high |= (uint8_t) chars[idx];
+    }
+    return((high & 0x80) == 0);
+  }
+
+
+  static bool export_source(const arrow_source &src, const std::shared_ptr<void> &keep, ArrowArray *array, ArrowSchema *schema) {
+
+    size_t nfields = src.fields.size();
+    init_level(array, schema, keep, "+s", "", src.record_count, 1, 1 + nfields);
+    schema->flags = 0;
+
+    if(!geometry_column(src, keep, array->children[0], schema->children[0])) {
+      array->release(array);
+      schema->release(schema);
+      return(false);
+    }
+
+    // deleted rows are the only nulls in the dbf columns
+    int64_t deleted = count_nulls(src.validity, src.record_count);
+    const uint8_t *validity = deleted ? src.validity : 0;
+    for(size_t col=0; col < nfields; ++col) {
+      const snapshot_field &field = src.fields[col];
+      ArrowArray *child = array->children[1 + col];
+      ArrowSchema *child_schema = schema->children[1 + col];
+      arrow_array_node *node = 0;
+      if(field.type == 'N') {
+	node = init_level(child, child_schema, keep, "l", field.name, src.record_count, 2, 0);
+      }
+      else if(field.type == 'F') {
+	node = init_level(child, child_schema, keep, "g", field.name, src.record_count, 2, 0);
+      }
+      else {
+	const int32_t *offsets = (const int32_t *) src.data[col];
+	bool utf8 = src.utf8_text || ascii_only(src.chars[col], offsets[src.record_count]);
+	node = init_level(child, child_schema, keep, utf8 ? "u" : "z", field.name, src.record_count, 3, 0);
+	node->buffers[2] = src.chars[col];
+      }
+      node->buffers[0] = validity;
+      node->buffers[1] = src.data[col];
+      child->null_count = deleted;
+    }
+
+    return(true);
+  }
+
+
+  bool export_snapshot(const layer_snapshot &snapshot, ArrowArray *array, ArrowSchema *schema, bool utf8_text) {
+
+    array->release = 0;
+    schema->release = 0;
+    if(!snapshot.base) {
+      log_error("snapshot isn't open\n");
+      return(false);
+    }
+
+    arrow_source src;
+    src.stype = snapshot.stype();
+    src.record_count = snapshot.record_count();
+    src.part_count = snapshot.part_count();
+    src.point_count = snapshot.point_count();
+    src.record_parts = snapshot.record_parts();
+    src.part_points = snapshot.part_points();
+    src.coords = snapshot.coords();
+    src.validity = snapshot.validity();
+    src.utf8_text = utf8_text;
+    for(uint32_t col=0; col < snapshot.field_count(); ++col) {
+      src.fields.push_back(snapshot.field(col));
+      src.fields.back().name[sizeof(src.fields.back().name) - 1] = '\0';
+      switch(snapshot.field(col).type) {
+      case 'N': src.data.push_back(snapshot.int_column(col)); break;
+      case 'F': src.data.push_back(snapshot.double_column(col)); break;
+      default:  src.data.push_back(snapshot.string_offsets(col)); break;
+      }
+      src.chars.push_back(snapshot.string_chars(col));
+    }
+
+    return(export_source(src, std::shared_ptr<void>(), array, schema));
+  }
+
+
+  static void append_points(std::vector<double> &coords, const uint8_t *points, uint32_t count) {
+    size_t at = coords.size();
+    coords.resize(at + (2 * (size_t) count));
+    memcpy(coords.data() + at, points, 16 * (size_t) count);
+#if BYTE_ORDER == BIG_ENDIAN
+    for(size_t idx=at; idx < coords.size(); ++idx) {
+      uint64_t bits;
+      memcpy(&bits, &coords[idx], sizeof(uint64_t));
+      bits = __builtin_bswap64(bits);
+      memcpy(&coords[idx], &bits, sizeof(uint64_t));
+    }
+#endif
+  }
+
+
+  //
+  // one raw record onto the flat arrays: the point run goes in with a single copy and
+  // the parts become offsets into it
+  //
+  static bool flatten_record(const uint8_t *content, uint32_t content_bytes, decoded_layer &layer) {
+
+    parts_view view;
+    if(!parse_record_parts(content, content_bytes, view)) {
+      return(false);
+    }
+
+    int32_t base = layer.coords.size() / 2;
+    for(uint32_t part=0; part < view.numparts; ++part) {
+      layer.part_points.push_back(base + view.part_end(part));
+    }
+    append_points(layer.coords, view.points, view.numparts ? view.numpoints : 0);
+    return(true);
+  }
+
+
+  bool export_layer(const std::string &shp_path, const std::string &dbf_path, ArrowArray *array, ArrowSchema *schema) {
+
+    array->release = 0;
+    schema->release = 0;
+
+    shared_shapefile layer;
+    if(!layer.open(shp_path)) {
+      return(false);
+    }
+
+    std::shared_ptr<decoded_layer> decoded = std::make_shared<decoded_layer>();
+    decoded->record_parts.reserve(layer.record_count() + 1);
+    decoded->record_parts.push_back(0);
+    decoded->part_points.push_back(0);
+
+    shp_cursor cursor(layer);
+    for(uint32_t recno=0; recno < layer.record_count(); ++recno) {
+      const uint8_t *content = 0;
+      uint32_t content_bytes = 0;
+      if(!cursor.read_raw(recno, content, content_bytes)) {
+	return(false);
+      }
+
+      if(!flatten_record(content, content_bytes, *decoded)) {
+	log_error("malformed record %u in %s\n", recno, shp_path.c_str());
+	return(false);
+      }
+
+      if((decoded->coords.size() / 2) > (uint64_t) INT32_MAX) {
+	log_error("too many points for arrow list offsets (int32)\n");
+	return(false);
+      }
+
+      decoded->record_parts.push_back(decoded->part_points.size() - 1);
+    }
+
+    if(!read_snapshot_columns(dbf_path, layer.record_count(), decoded->validity, decoded->fields,
+			      decoded->column_data, decoded->column_chars)) {
+      return(false);
+    }
+
+    arrow_source src;
+    src.stype = layer.info.stype;
+    src.record_count = layer.record_count();
+    src.part_count = decoded->part_points.size() - 1;
+    src.point_count = decoded->coords.size() / 2;
+    src.record_parts = decoded->record_parts.data();
+    src.part_points = decoded->part_points.data();
+    src.coords = decoded->coords.data();
+    src.validity = decoded->validity.data();
+    src.utf8_text = !dbf_path.empty() && dbfutil::dbf_text_is_utf8(dbf_path);
+    src.fields = decoded->fields;
+    for(size_t col=0; col < decoded->fields.size(); ++col) {
+      src.data.push_back(decoded->column_data[col].data());
+      src.chars.push_back(decoded->column_chars[col].data());
+    }
+
+    return(export_source(src, decoded, array, schema));
+  }
+
+} // namespace shputil
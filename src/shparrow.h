@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include "shputil.h"
+#include "shpsnapshot.h"
+
+//
+// Arrow C data interface (https://arrow.apache.org/docs/format/CDataInterface.html),
+// declared here so there's no arrow dependency. the guard is the one arrow's own
+// abi.h uses, whichever is included first wins.
+//
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+extern "C" {
+
+  struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release)(struct ArrowSchema *);
+    void *private_data;
+  };
+
+  struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release)(struct ArrowArray *);
+    void *private_data;
+  };
+
+}
+
+#endif // ARROW_C_DATA_INTERFACE
+
+namespace shputil {
+
+  //
+  // a layer as one arrow struct array (a record batch): "geometry" first, then a typed
+  // column per dbf field ('N' int64, 'F' float64, 'C' utf8 or binary). row i is record i, null
+  // records have a null geometry and deleted dbf rows are null in every column.
+  //
+  // dbf text is usually in a legacy codepage, so a 'C' column is binary ("z") unless the
+  // codepage is known to be UTF-8 (a .cpg saying so) or the column is plain 7-bit ascii.
+  // nothing is transcoded, consumers with the codepage can decode the bytes themselves.
+  //
+  // geometry is GeoArrow with interleaved coordinates, tagged through the
+  // ARROW:extension:name field metadata:
+  //
+  //   point       geoarrow.point            fixed_size_list<xy: double>[2]
+  //   multipoint  geoarrow.multipoint       list<points: point>
+  //   polyline    geoarrow.multilinestring  list<linestrings: list<vertices: point>>
+  //   polygon     geoarrow.multipolygon     list<polygons: list<rings: list<vertices: point>>>
+  //
+  // shapefile rings aren't grouped into polygons, so every clockwise (outer) ring starts
+  // a new polygon and counter-clockwise rings (holes) join the one before them. that is
+  // the order every common writer uses, a file with holes ahead of their outer ring
+  // needs the wkb path (shpwkb.h) for an exact grouping.
+  //
+  // the caller owns the returned structs and must call their release callbacks. on
+  // failure both are left released (release == 0).
+  //
+
+  //
+  // zero copy: coordinates, part/ring offsets, the validity bitmap and every dbf column
+  // point into the snapshot's mapping, only the polygon grouping offsets and (for layers
+  // with null records) a few per-record arrays are computed. the snapshot must stay open
+  // until both structs are released.
+  //
+  bool export_snapshot(const layer_snapshot &snapshot, ArrowArray *array, ArrowSchema *schema, bool utf8_text = false); // see dbf_text_is_utf8
+
+  //
+  // without a snapshot: raw .shp records are decoded straight into the arrow buffers
+  // (point runs are copied as bytes, no shape objects), the buffers are owned by the
+  // exported arrays. dbf_path may be empty.
+  //
+  bool export_layer(const std::string &shp_path, const std::string &dbf_path, ArrowArray *array, ArrowSchema *schema);
+
+} // shputil namespace
@@ -0,0 +1,548 @@
+
+#include "shpasync.h"
+#include "logging.h"
+#include "iostats.h"
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+  #include <linux/io_uring.h>
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+#endif
+
+namespace shputil {
+
+  static bool check_record_header(const uint8_t *record, const shx_entry &entry) {
+
+    int32_t content_length = load_BEint32(record + sizeof(int32_t));
+    if((2 * (uint32_t) content_length) != entry.content_bytes) {
+      log_error("record at offset %llu doesn't match its shx entry\n", (unsigned long long) entry.offset);
+      return(false);
+    }
+
+    return(true);
+  }
+
+
+  static bool pread_full(int fd, uint8_t *buf, size_t nbytes, uint64_t offset) {
+
+    while(nbytes > 0) {
+      ssize_t nread = pread(fd, buf, nbytes, offset);
+      if(nread < 0) {
+	if(errno == EINTR) {
+	  continue;
+	}
+	return(false);
+      }
+
+      if(nread == 0) {
+	return(false);
+      }
+
+      io_stats_add(io_counter::read_calls, 1);
+      io_stats_add(io_counter::bytes_read, nread);
+      buf += nread;
+      nbytes -= nread;
+      offset += nread;
+    }
+
+    return(true);
+  }
+
+
+  bool read_record_content(int fd, const shx_entry &entry, std::vector<uint8_t> &buf) {
+
+    size_t record_bytes = SHP_RECORD_HEADER_BYTES + entry.content_bytes;
+    if(buf.size() < record_bytes) {
+      buf.resize(record_bytes);
+      io_stats_add(io_counter::allocations, 1);
+    }
+
+    if(!pread_full(fd, buf.data(), record_bytes, entry.offset)) {
+      log_error("couldn't read record at offset %llu\n", (unsigned long long) entry.offset);
+      return(false);
+    }
+
+    return(check_record_header(buf.data(), entry));
+  }
+
+
+  static bool decode_fetched(const uint8_t *record, const shx_entry &entry, shape_ptr &shp) {
+    if(!check_record_header(record, entry) ||
+       !decode_shape(record + SHP_RECORD_HEADER_BYTES, entry.content_bytes, shp)) {
+      return(false);
+    }
+
+    io_stats_add(io_counter::records_decoded, 1);
+    return(true);
+  }
+
+
+#ifdef __linux__
+
+  //
+  // minimal raw io_uring (no liburing): one sq/cq pair, IORING_OP_READ
+  //
+  struct uring_state {
+    int ring_fd;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    io_uring_cqe *cqes;
+    uint32_t entries;
+  };
+
+
+  static void uring_destroy(uring_state *ring) {
+    if(!ring) {
+      return;
+    }
+
+    if(ring->sqes) {
+      munmap(ring->sqes, ring->sqes_len);
+    }
+
+    if(ring->cq_ptr && (ring->cq_ptr != ring->sq_ptr)) {
+      munmap(ring->cq_ptr, ring->cq_len);
+    }
+
+    if(ring->sq_ptr) {
+      munmap(ring->sq_ptr, ring->sq_len);
+    }
+
+    if(ring->ring_fd >= 0) {
+      ::close(ring->ring_fd);
+    }
+
+    delete ring;
+  }
+
+
+  static uring_state *uring_create(uint32_t entries) {
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(io_uring_params));
+    int ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring_fd < 0) {
+      return(0);
+    }
+
+    uring_state *ring = new uring_state;
+    memset(ring, 0, sizeof(uring_state));
+    ring->ring_fd = ring_fd;
+    ring->entries = params.sq_entries;
+
+    ring->sq_len = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+    ring->cq_len = params.cq_off.cqes + (params.cq_entries * sizeof(io_uring_cqe));
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single_mmap) {
+      ring->sq_len = ring->cq_len = std::max(ring->sq_len, ring->cq_len);
+    }
+
+    void *sq_ptr = mmap(0, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if(sq_ptr == MAP_FAILED) {
+      uring_destroy(ring);
+      return(0);
+    }
+    ring->sq_ptr = sq_ptr;
+
+    void *cq_ptr = sq_ptr;
+    if(!single_mmap) {
+      cq_ptr = mmap(0, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+      if(cq_ptr == MAP_FAILED) {
+	uring_destroy(ring);
+	return(0);
+      }
+    }
+    ring->cq_ptr = cq_ptr;
+
+    ring->sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(0, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+      uring_destroy(ring);
+      return(0);
+    }
+    ring->sqes = (io_uring_sqe *) sqes;
+
+    uint8_t *sq = (uint8_t *) sq_ptr;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+    uint8_t *cq = (uint8_t *) cq_ptr;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return(ring);
+  }
+
+
+  static void uring_queue_read(uring_state *ring, int fd, uint8_t *buf, uint32_t nbytes, uint64_t offset, uint64_t user_data) {
+
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = nbytes;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  }
+
+
+  static int uring_enter(uring_state *ring, unsigned to_submit, unsigned min_complete) {
+    int rc = 0;
+    do {
+      rc = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, 0, 0);
+    } while((rc < 0) && (errno == EINTR));
+    return(rc);
+  }
+
+
+  bool async_reader::fetch_uring(const std::vector<uint32_t> &recnos, const fetch_callback &callback) {
+
+    //
+    // one buffer per slot, slots are recycled as completions come back so up to
+    // queue_depth reads are always in flight
+    //
+    uint32_t depth = std::min(queue_depth, uring->entries);
+    std::vector<std::vector<uint8_t> > slot_bufs(depth);
+    std::vector<uint32_t> slot_recno(depth);
+    std::vector<bool> slot_busy(depth, false);
+    std::vector<uint32_t> free_slots;
+    for(uint32_t slot=0; slot < depth; ++slot) {
+      free_slots.push_back(slot);
+    }
+
+    bool status = true;
+    bool failed = false;      // hard io_uring_enter error, nothing new gets queued
+    size_t next = 0;
+    size_t inflight = 0;      // taken by the kernel, completion not reaped yet
+    unsigned unsubmitted = 0; // in the sq, not taken by the kernel yet
+    while((!failed && (next < recnos.size())) || (inflight > 0)) {
+
+      while(!failed && (next < recnos.size()) && !free_slots.empty()) {
+	uint32_t recno = recnos[next++];
+	if(recno >= index.size()) {
+	  log_error("record %u out of range\n", recno);
+	  callback(recno, false, shape_ptr());
+	  status = false;
+	  continue;
+	}
+
+	uint32_t slot = free_slots.back();
+	free_slots.pop_back();
+	const shx_entry &entry = index[recno];
+	uint32_t record_bytes = SHP_RECORD_HEADER_BYTES + entry.content_bytes;
+	if(slot_bufs[slot].size() < record_bytes) {
+	  slot_bufs[slot].resize(record_bytes);
+	  io_stats_add(io_counter::allocations, 1);
+	}
+	slot_recno[slot] = recno;
+	slot_busy[slot] = true;
+	uring_queue_read(uring, fd, slot_bufs[slot].data(), record_bytes, entry.offset, slot);
+	unsubmitted += 1;
+      }
+
+      if((inflight == 0) && (unsubmitted == 0)) {
+	break;
+      }
+
+      //
+      // EAGAIN/EBUSY mean the kernel is short on resources or the cq is full: reap and
+      // try again. any other error stops submitting, but what's in flight still writes
+      // into slot_bufs, so it's reaped before anything is freed
+      //
+      int submitted = uring_enter(uring, failed ? 0 : unsubmitted, (inflight > 0) ? 1 : 0);
+      if(submitted < 0) {
+	if((errno != EAGAIN) && (errno != EBUSY)) {
+	  log_error("io_uring_enter failed: %s\n", strerror(errno));
+	  if(failed) {
+	    break; // can't even wait for completions
+	  }
+	  failed = true;
+	  continue;
+	}
+	if(inflight == 0) {
+	  std::this_thread::yield();
+	}
+      }
+      else if(!failed) {
+	unsubmitted -= submitted;
+	inflight += submitted;
+      }
+
+      unsigned head = *uring->cq_head;
+      unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+      while(head != tail) {
+	io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+	uint32_t slot = (uint32_t) cqe->user_data;
+	int res = cqe->res;
+	head += 1;
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	inflight -= 1;
+
+	uint32_t recno = slot_recno[slot];
+	const shx_entry &entry = index[recno];
+	uint32_t record_bytes = SHP_RECORD_HEADER_BYTES + entry.content_bytes;
+	uint8_t *buf = slot_bufs[slot].data();
+
+	bool ok = (res >= 0);
+	if(ok) {
+	  io_stats_add(io_counter::read_calls, 1);
+	  io_stats_add(io_counter::bytes_read, res);
+	  if((uint32_t) res < record_bytes) {
+	    ok = pread_full(fd, buf + res, record_bytes - res, entry.offset + res); // short read, finish it inline
+	  }
+	}
+	else if(res == -EINVAL) {
+	  ok = pread_full(fd, buf, record_bytes, entry.offset); // kernel without IORING_OP_READ
+	}
+
+	shape_ptr shp;
+	ok = ok && decode_fetched(buf, entry, shp);
+	if(!ok) {
+	  log_error("couldn't fetch record %u\n", recno);
+	  status = false;
+	}
+
+	callback(recno, ok, shp);
+	slot_busy[slot] = false;
+	free_slots.push_back(slot);
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+      }
+    }
+
+    if(!failed) {
+      return(status);
+    }
+
+    //
+    // the ring is done for: unsubmitted sqes would go out with the next fetch and map
+    // onto the wrong slots. reads that couldn't be reaped may still land in their
+    // buffers while the kernel tears the ring down, so the reader keeps them until close()
+    //
+    if(inflight > 0) {
+      orphaned_bufs = std::move(slot_bufs);
+    }
+    uring_destroy(uring);
+    uring = 0;
+
+    std::vector<uint32_t> remaining;
+    for(uint32_t slot=0; slot < depth; ++slot) {
+      if(slot_busy[slot]) {
+	remaining.push_back(slot_recno[slot]);
+      }
+    }
+    remaining.insert(remaining.end(), recnos.begin() + next, recnos.end());
+
+    log_error("io_uring disabled, %zu record(s) go through the pread pool\n", remaining.size());
+    start_pool();
+    bool pool_ok = remaining.empty() || fetch_pool(remaining, callback);
+    return(status && pool_ok);
+  }
+
+#else
+
+  struct uring_state {
+    uint32_t entries;
+  };
+
+  static void uring_destroy(uring_state *ring) {
+    delete ring;
+  }
+
+  static uring_state *uring_create(uint32_t entries) {
+    return(0);
+  }
+
+  bool async_reader::fetch_uring(const std::vector<uint32_t> &recnos, const fetch_callback &callback) {
+    return(false);
+  }
+
+#endif
+
+
+  async_reader::async_reader() {
+    fd = -1;
+    queue_depth = 0;
+    pool_threads = 1;
+    uring = 0;
+    batch = 0;
+    batch_callback = 0;
+    batch_next = 0;
+    batch_remaining = 0;
+    batch_ok = true;
+    stopping = false;
+  }
+
+
+  async_reader::~async_reader() {
+    close();
+  }
+
+
+  bool async_reader::open(const std::string &path, uint32_t depth, uint32_t threads, bool allow_io_uring) {
+
+    close();
+
+    if(!read_shx(path, index)) {
+      return(false);
+    }
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+      log_error("couldn't open shapefile: %s\n", path.c_str());
+      return(false);
+    }
+
+    queue_depth = (depth > 0) ? depth : 1;
+    if(allow_io_uring) {
+      uring = uring_create(queue_depth);
+    }
+
+    pool_threads = (threads > 0) ? threads : 1;
+    if(!uring) {
+      start_pool();
+    }
+
+    return(true);
+  }
+
+
+  void async_reader::start_pool() {
+    stopping = false;
+    for(uint32_t ii=0; ii < pool_threads; ++ii) {
+      workers.push_back(std::thread(&async_reader::worker, this));
+    }
+  }
+
+
+  void async_reader::worker() {
+
+    std::vector<uint8_t> buf;
+
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    while(true) {
+      work_cv.wait(lock, [&]() { return(stopping || (batch && (batch_next < batch->size()))); });
+      if(stopping) {
+	return;
+      }
+
+      while(batch_next < batch->size()) {
+	uint32_t recno = (*batch)[batch_next++];
+	const fetch_callback &callback = *batch_callback;
+	lock.unlock();
+
+	shape_ptr shp;
+	bool ok = (recno < index.size()) &&
+	  read_record_content(fd, index[recno], buf) &&
+	  decode_fetched(buf.data(), index[recno], shp);
+	if(!ok) {
+	  log_error("couldn't fetch record %u\n", recno);
+	}
+
+	{
+	  std::lock_guard<std::mutex> cblock(callback_mutex);
+	  callback(recno, ok, shp);
+	}
+
+	lock.lock();
+	if(!ok) {
+	  batch_ok = false;
+	}
+
+	batch_remaining -= 1;
+	if(batch_remaining == 0) {
+	  done_cv.notify_all();
+	}
+      }
+    }
+  }
+
+
+  bool async_reader::fetch_pool(const std::vector<uint32_t> &recnos, const fetch_callback &callback) {
+
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    batch = &recnos;
+    batch_callback = &callback;
+    batch_next = 0;
+    batch_remaining = recnos.size();
+    batch_ok = true;
+    work_cv.notify_all();
+
+    done_cv.wait(lock, [&]() { return(batch_remaining == 0); });
+    batch = 0;
+    batch_callback = 0;
+    return(batch_ok);
+  }
+
+
+  bool async_reader::fetch(const std::vector<uint32_t> &recnos, const fetch_callback &callback) {
+
+    if(fd < 0) {
+      log_error("async_reader isn't open...\n");
+      return(false);
+    }
+
+    if(recnos.empty()) {
+      return(true);
+    }
+
+    if(uring) {
+      return(fetch_uring(recnos, callback));
+    }
+
+    return(fetch_pool(recnos, callback));
+  }
+
+
+  void async_reader::close() {
+
+    {
+      std::lock_guard<std::mutex> lock(pool_mutex);
+      stopping = true;
+    }
+    work_cv.notify_all();
+
+    for(std::thread &thread : workers) {
+      thread.join();
+    }
+    workers.clear();
+
+    if(uring) {
+      uring_destroy(uring);
+      uring = 0;
+    }
+
+    if(fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+
+    orphaned_bufs.clear();
+    index.clear();
+  }
+
+} // namespace shputil
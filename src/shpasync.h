@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "shputil.h"
+
+namespace shputil {
+
+  //
+  // batched random access: record offsets come from the .shx, every read in a batch is
+  // submitted at once through io_uring (linux), or spread over a pool of pread threads
+  // where io_uring isn't available. recno is the 0-based record index.
+  //
+  // callbacks are serialized, but arrive in completion order, not batch order.
+  //
+  typedef std::function<void(uint32_t recno, bool ok, const shape_ptr &shp)> fetch_callback;
+
+  class async_reader {
+  public:
+    async_reader();
+    ~async_reader();
+    bool open(const std::string &path, uint32_t queue_depth = 64, uint32_t threads = 4, bool allow_io_uring = true);
+    bool fetch(const std::vector<uint32_t> &recnos, const fetch_callback &callback); // returns once every callback ran
+    void close();
+    bool using_io_uring() const { return(uring != 0); }
+    std::vector<shx_entry> index;
+
+  private:
+    bool fetch_uring(const std::vector<uint32_t> &recnos, const fetch_callback &callback);
+    bool fetch_pool(const std::vector<uint32_t> &recnos, const fetch_callback &callback);
+    void start_pool();
+    void worker();
+
+    int fd;
+    uint32_t queue_depth;
+    struct uring_state *uring;
+    std::vector<std::vector<uint8_t> > orphaned_bufs; // a failed ring's unreaped read buffers, freed by close()
+
+    // pread pool, also what a failed ring falls back to
+    uint32_t pool_threads;
+    std::vector<std::thread> workers;
+    std::mutex pool_mutex;
+    std::mutex callback_mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    const std::vector<uint32_t> *batch;
+    const fetch_callback *batch_callback;
+    size_t batch_next;
+    size_t batch_remaining;
+    bool batch_ok;
+    bool stopping;
+  };
+
+  bool read_record_content(int fd, const shx_entry &entry, std::vector<uint8_t> &buf); // pread, checks the record header
+
+} // shputil namespace
@@ -0,0 +1,156 @@
+
+#include "shpcache.h"
+
+namespace shputil {
+
+  static uint64_t cache_key(uint32_t layer_id, uint32_t recno) {
+    return((((uint64_t) layer_id) << 32) | recno);
+  }
+
+  
+  feature_cache::feature_cache(uint64_t capacity_bytes, uint32_t nshards) {
+    nshards = (nshards > 0) ? nshards : 1;
+    for(uint32_t ii=0; ii < nshards; ++ii) {
+      shards.push_back(std::unique_ptr<shard>(new shard));
+    }
+    shard_capacity = capacity_bytes / nshards;
+  }
+
+
+  feature_cache::shard &feature_cache::shard_for(uint64_t key) {
+    // mix the bits so neighbouring records spread over the shards
+    uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+    return(*shards[(hash >> 32) % shards.size()]);
+  }
+
+  
+  bool feature_cache::get(uint32_t layer_id, uint32_t recno, shape_ptr &shp) {
+
+    uint64_t key = cache_key(layer_id, recno);
+    shard &sh = shard_for(key);
+    std::lock_guard<std::mutex> lock(sh.mutex);
+
+    auto found = sh.lookup.find(key);
+    if(found == sh.lookup.end()) {
+      sh.misses += 1;
+      return(false);
+    }
+
+    sh.lru.splice(sh.lru.begin(), sh.lru, found->second);
+    shp = found->second->shp;
+    sh.hits += 1;
+    return(true);
+  }
+
+
+  void feature_cache::put(uint32_t layer_id, uint32_t recno, const shape_ptr &shp) {
+
+    uint64_t bytes = shape_bytes(shp);
+    if(bytes > shard_capacity) {
+      return;
+    }
+
+    uint64_t key = cache_key(layer_id, recno);
+    shard &sh = shard_for(key);
+    std::lock_guard<std::mutex> lock(sh.mutex);
+
+    auto found = sh.lookup.find(key);
+    if(found != sh.lookup.end()) {
+      sh.bytes -= found->second->bytes;
+      sh.lru.erase(found->second);
+      sh.lookup.erase(found);
+    }
+
+    while(!sh.lru.empty() && ((sh.bytes + bytes) > shard_capacity)) {
+      const entry &victim = sh.lru.back();
+      sh.bytes -= victim.bytes;
+      sh.lookup.erase(victim.key);
+      sh.lru.pop_back();
+      sh.evictions += 1;
+    }
+
+    entry ent;
+    ent.key = key;
+    ent.bytes = bytes;
+    ent.shp = shp;
+    sh.lru.push_front(ent);
+    sh.lookup[key] = sh.lru.begin();
+    sh.bytes += bytes;
+  }
+
+
+  void feature_cache::clear() {
+    for(auto &sh : shards) {
+      std::lock_guard<std::mutex> lock(sh->mutex);
+      sh->lru.clear();
+      sh->lookup.clear();
+      sh->bytes = 0;
+    }
+  }
+
+
+  feature_cache_stats feature_cache::stats() const {
+    feature_cache_stats total;
+    for(auto &sh : shards) {
+      std::lock_guard<std::mutex> lock(sh->mutex);
+      total.hits += sh->hits;
+      total.misses += sh->misses;
+      total.evictions += sh->evictions;
+      total.entries += sh->lru.size();
+      total.bytes += sh->bytes;
+    }
+    return(total);
+  }
+
+
+  static uint64_t parts_bytes(const std::pmr::vector<polypart> &parts) {
+    uint64_t bytes = parts.capacity() * sizeof(polypart);
+    for(const polypart &part : parts) {
+      bytes += part.points.capacity() * sizeof(pointshape);
+    }
+    return(bytes);
+  }
+
+  
+  uint64_t shape_bytes(const shape_ptr &shp) {
+
+    static const uint64_t ENTRY_OVERHEAD = 96; // control block, lru node and map slot, roughly
+
+    uint64_t bytes = ENTRY_OVERHEAD;
+    switch(xy_type(shp->stype())) {
+    case shape_type::point:
+      bytes += sizeof(pointshape);
+      break;
+    case shape_type::multipoint:
+      bytes += sizeof(multipointshape) + (((multipointshape *) shp.get())->points.capacity() * sizeof(pointshape));
+      break;
+    case shape_type::polyline:
+      bytes += sizeof(polyline) + parts_bytes(((polyline *) shp.get())->parts);
+      break;
+    case shape_type::polygon:
+      bytes += sizeof(polygon) + parts_bytes(((polygon *) shp.get())->rings);
+      break;
+    default:
+      bytes += sizeof(shape);
+      break;
+    }
+
+    return(bytes);
+  }
+
+
+  bool cached_cursor::read(uint32_t recno, shape_ptr &shp) {
+
+    if(cache.get(cursor.layer.layer_id, recno, shp)) {
+      return(true);
+    }
+
+    if(!cursor.read(recno, shp)) {
+      return(false);
+    }
+
+    cache.put(cursor.layer.layer_id, recno, shp);
+    return(true);
+  }
+
+} // namespace shputil
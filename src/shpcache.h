@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+#include "shputil.h"
+#include "shpshared.h"
+
+namespace shputil {
+
+  //
+  // decoded features keyed by (layer, record number), bounded by an estimate of their
+  // heap bytes. entries are spread over independently locked shards, each with its own
+  // lru list, so concurrent readers rarely meet on a mutex. cached shapes are shared
+  // with every reader and must be treated as read-only.
+  //
+  class feature_cache_stats {
+  public:
+    feature_cache_stats() { hits = 0; misses = 0; evictions = 0; entries = 0; bytes = 0; }
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t bytes;
+  };
+
+  class feature_cache {
+  public:
+    feature_cache(uint64_t capacity_bytes = 256 * 1024 * 1024, uint32_t shards = 16);
+    bool get(uint32_t layer_id, uint32_t recno, shape_ptr &shp);
+    void put(uint32_t layer_id, uint32_t recno, const shape_ptr &shp); // larger than a shard isn't cached
+    void clear();
+    feature_cache_stats stats() const;
+
+  private:
+    class entry {
+    public:
+      uint64_t key;
+      uint64_t bytes;
+      shape_ptr shp;
+    };
+
+    class shard {
+    public:
+      shard() { bytes = 0; hits = 0; misses = 0; evictions = 0; }
+      std::mutex mutex;
+      std::list<entry> lru; // most recent first
+      std::unordered_map<uint64_t, std::list<entry>::iterator> lookup;
+      uint64_t bytes;
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+    };
+
+    shard &shard_for(uint64_t key);
+
+    std::vector<std::unique_ptr<shard> > shards;
+    uint64_t shard_capacity;
+  };
+
+  uint64_t shape_bytes(const shape_ptr &shp); // heap estimate used for the cache bound
+
+  //
+  // shp_cursor with the cache in front: hits skip both the pread and the decode
+  //
+  class cached_cursor {
+  public:
+    cached_cursor(const shared_shapefile &layer, feature_cache &cache) : cursor(layer), cache(cache) { }
+    bool read(uint32_t recno, shape_ptr &shp);
+
+    shp_cursor cursor;
+    feature_cache &cache;
+  };
+
+} // shputil namespace
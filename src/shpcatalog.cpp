@@ -0,0 +1,216 @@
+
+#include "shpcatalog.h"
+#include "logging.h"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace shputil {
+
+  static const uint64_t SHX_ENTRY_BYTES = 8;
+
+
+  //
+  // foo.shp -> foo.shx, FOO.SHP -> FOO.SHX, falling back to the other case
+  //
+  static bool companion(const std::string &shp_path, const char *ext, std::string &path) {
+
+    bool upper = (shp_path[shp_path.size() - 1] == 'P');
+    std::string base = shp_path.substr(0, shp_path.size() - 3);
+    for(int attempt=0; attempt < 2; ++attempt) {
+      path = base;
+      for(const char *c = ext; *c; ++c) {
+	path += (upper == (attempt == 0)) ? (char) toupper(*c) : *c;
+      }
+      if(access(path.c_str(), R_OK) == 0) {
+	return(true);
+      }
+    }
+
+    path.clear();
+    return(false);
+  }
+
+
+  bool probe_shapefile(const std::string &shp_path, catalog_entry &entry) {
+
+    entry = catalog_entry();
+    entry.shp_path = shp_path;
+    if(!read_shp_info(shp_path, entry.info)) {
+      entry.error = "couldn't read the .shp header";
+      return(false);
+    }
+    entry.ok = true;
+
+    std::string shx;
+    struct stat st;
+    if(companion(shp_path, "shx", shx) && (stat(shx.c_str(), &st) == 0) && ((uint64_t) st.st_size >= SHP_HEADER_BYTES)) {
+      entry.record_count = (st.st_size - SHP_HEADER_BYTES) / SHX_ENTRY_BYTES;
+    }
+    else {
+      entry.error = "no readable .shx";
+    }
+
+    std::string dbf;
+    if(companion(shp_path, "dbf", dbf)) {
+      dbfutil::dbfreader reader; // header and field descriptors only
+      if(reader.open(dbf)) {
+	entry.dbf_path = dbf;
+	entry.schema = reader.header;
+	entry.dbf_records = reader.record_count;
+      }
+      else {
+	entry.error = "couldn't read the .dbf header";
+      }
+    }
+
+    return(true);
+  }
+
+
+  static bool is_shp(const char *name) {
+    size_t len = strlen(name);
+    return((len > 4) && (strcasecmp(name + len - 4, ".shp") == 0));
+  }
+
+
+  static void read_directory(const std::string &directory, bool recursive, std::vector<std::string> &subdirs, std::vector<std::string> &files) {
+
+    DIR *dir = opendir(directory.c_str());
+    if(!dir) {
+      log_error("couldn't open directory: %s\n", directory.c_str());
+      return;
+    }
+
+    while(struct dirent *ent = readdir(dir)) {
+      if((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0)) {
+	continue;
+      }
+
+      // d_type saves a stat per entry, it's only missing on a few filesystems
+      bool shp = is_shp(ent->d_name);
+      bool is_dir = (ent->d_type == DT_DIR);
+      bool is_file = (ent->d_type == DT_REG);
+      struct stat st;
+      if((ent->d_type == DT_UNKNOWN) && (lstat((directory + "/" + ent->d_name).c_str(), &st) == 0)) {
+	is_dir = S_ISDIR(st.st_mode);
+	is_file = S_ISREG(st.st_mode);
+      }
+      else if((ent->d_type == DT_LNK) && shp && (stat((directory + "/" + ent->d_name).c_str(), &st) == 0)) {
+	is_file = S_ISREG(st.st_mode); // linked files count, linked directories aren't followed
+      }
+
+      if(is_dir && recursive) {
+	subdirs.push_back(directory + "/" + ent->d_name);
+      }
+      else if(is_file && shp) {
+	files.push_back(directory + "/" + ent->d_name);
+      }
+    }
+
+    closedir(dir);
+  }
+
+
+  bool find_shapefiles(const std::string &root, const catalog_opts &opts, std::vector<std::string> &shp_paths) {
+
+    shp_paths.clear();
+
+    DIR *dir = opendir(root.c_str());
+    if(!dir) {
+      log_error("couldn't open directory: %s\n", root.c_str());
+      return(false);
+    }
+    closedir(dir);
+
+    //
+    // directories are shared work: a thread takes one, reads it and hands back the
+    // subdirectories. done when nothing is pending and nobody is reading
+    //
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<std::string> pending(1, root);
+    uint32_t busy = 0;
+
+    auto worker = [&]() {
+      std::vector<std::string> subdirs, files;
+      for(;;) {
+	std::string directory;
+	{
+	  std::unique_lock<std::mutex> guard(lock);
+	  wake.wait(guard, [&]() { return(!pending.empty() || (busy == 0)); });
+	  if(pending.empty()) {
+	    wake.notify_all();
+	    return;
+	  }
+	  directory.swap(pending.back());
+	  pending.pop_back();
+	  busy += 1;
+	}
+
+	subdirs.clear();
+	files.clear();
+	read_directory(directory, opts.recursive, subdirs, files);
+
+	{
+	  std::lock_guard<std::mutex> guard(lock);
+	  pending.insert(pending.end(), subdirs.begin(), subdirs.end());
+	  shp_paths.insert(shp_paths.end(), files.begin(), files.end());
+	  busy -= 1;
+	}
+	wake.notify_all();
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for(uint32_t idx=0; idx < std::max(opts.threads, 1u); ++idx) {
+      workers.push_back(std::thread(worker));
+    }
+
+    for(std::thread &thread : workers) {
+      thread.join();
+    }
+
+    std::sort(shp_paths.begin(), shp_paths.end());
+    return(true);
+  }
+
+
+  bool scan_catalog(const std::string &root, const catalog_opts &opts, std::vector<catalog_entry> &entries) {
+
+    entries.clear();
+
+    std::vector<std::string> shp_paths;
+    if(!find_shapefiles(root, opts, shp_paths)) {
+      return(false);
+    }
+
+    entries.resize(shp_paths.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+      for(size_t idx = next++; idx < shp_paths.size(); idx = next++) {
+	probe_shapefile(shp_paths[idx], entries[idx]);
+      }
+    };
+
+    std::vector<std::thread> workers;
+    size_t nthreads = std::min((size_t) std::max(opts.threads, 1u), std::max(shp_paths.size(), (size_t) 1));
+    for(size_t idx=0; idx < nthreads; ++idx) {
+      workers.push_back(std::thread(worker));
+    }
+
+    for(std::thread &thread : workers) {
+      thread.join();
+    }
+
+    return(true);
+  }
+
+} // namespace shputil
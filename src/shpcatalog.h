@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include "shputil.h"
+#include "dbfutil.h"
+
+namespace shputil {
+
+  //
+  // metadata of a shapefile from its fixed headers only: the 100 byte .shp header, the
+  // .shx size (every record is an 8 byte entry after its own header) and the dbf header
+  // with its field descriptors. no record is read or decoded.
+  //
+  // companions are looked up with the extension in the .shp's case (.shx/.SHX).
+  //
+  class catalog_entry {
+  public:
+    catalog_entry() { ok = false; record_count = -1; dbf_records = 0; }
+    std::string shp_path;
+    std::string dbf_path;     // empty without a .dbf
+    bool ok;                  // false if the .shp header couldn't be read, see error
+    std::string error;        // also set for a missing/unreadable .shx or .dbf with ok == true
+    shpinfo info;             // shape type, bbox, file length
+    int64_t record_count;     // from the .shx size, -1 without one
+    dbfutil::dbfheader schema;
+    uint32_t dbf_records;     // rows in the dbf header, deleted ones included
+  };
+
+  class catalog_opts {
+  public:
+    catalog_opts() { threads = 16; recursive = true; }
+    uint32_t threads;  // probes are a few small reads each, latency bound, so well past the core count pays
+    bool recursive;
+  };
+
+  bool probe_shapefile(const std::string &shp_path, catalog_entry &entry); // entry.ok
+
+  //
+  // every *.shp (any case) under root, the tree walked and the files probed on
+  // opts.threads threads. symlinked directories aren't followed. entries are sorted by
+  // path, a broken file is an entry with ok == false rather than a failure. returns
+  // false only if root can't be read.
+  //
+  bool scan_catalog(const std::string &root, const catalog_opts &opts, std::vector<catalog_entry> &entries);
+  bool find_shapefiles(const std::string &root, const catalog_opts &opts, std::vector<std::string> &shp_paths); // sorted
+
+} // shputil namespace
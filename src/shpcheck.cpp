@@ -0,0 +1,572 @@
+
+#include <iostream>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <dirent.h>
+#include <unistd.h>
+#include "shputil.h"
+#include "shpjoin.h"
+#include "shpraster.h"
+#include "shpwkb.h"
+#include "shpedit.h"
+#include "shpshard.h"
+#include "shpdataset.h"
+#include "shpsnapshot.h"
+#include "shppipeline.h"
+#include "logging.h"
+
+//
+// shpcheck: self-checks that need no input files, exits 1 on the first failure. the
+// layer checks write to a scratch directory under /tmp that is removed afterwards.
+//
+//   wkb: .shp record -> WKB -> record gives back the same bytes for a polygon with a
+//        hole and a multipolygon, and big-endian WKB decodes to the same record
+//   raster: polygon_raster::find agrees with polygon_index::find on random points
+//   append: append_layer onto a layer reads back as the whole layer, shp and dbf
+//   vacuum: delete_features then vacuum_layer reads back without the deleted features
+//   shards: write_sharded read back through shpdataset::open_manifest is the layer
+//   snapshot: a snapshot turns stale when its source is rewritten and rebuilds from it
+//   pipelined: read_shp_pipelined matches read_shp, and both reject a truncated .shp
+//
+
+shputil::polypart make_ring(double cx, double cy, double radius, uint32_t count, bool clockwise, std::mt19937 &rng);
+std::vector<uint8_t> record_content(const shputil::shape_ptr &shp);
+bool convert(shputil::wkb_converter &converter, const std::vector<uint8_t> &in, bool to_wkb, std::vector<uint8_t> &out);
+bool swap_wkb(const uint8_t *wkb, size_t &offset, std::vector<uint8_t> &out);
+bool check_wkb();
+bool check_raster();
+void make_layer(uint32_t first, uint32_t count, shputil::shapefile &shpfile, dbfutil::dbftable &table);
+bool same_shapes(const std::pmr::vector<shputil::shape_ptr> &found, const std::pmr::vector<shputil::shape_ptr> &expected);
+uint32_t row_id(const dbfutil::dbfrow &row);
+void remove_scratch(const std::string &dir);
+bool check_append(const std::string &dir);
+bool check_vacuum(const std::string &dir);
+bool check_shards(const std::string &dir);
+bool check_snapshot(const std::string &dir);
+bool check_pipelined(const std::string &dir);
+
+
+int main(int argc, char **argv) {
+
+  if(!check_wkb()) {
+    std::cout << "wkb check failed..." << std::endl;
+    exit(1);
+  }
+
+  if(!check_raster()) {
+    std::cout << "raster check failed..." << std::endl;
+    exit(1);
+  }
+
+  set_log_enabled(false); // the writers' progress output, errors still print
+  char scratch[] = "/tmp/shpcheck.XXXXXX";
+  if(!mkdtemp(scratch)) {
+    std::cout << "couldn't create a scratch directory" << std::endl;
+    exit(1);
+  }
+
+  const char *names[] = { "append", "vacuum", "shards", "snapshot", "pipelined" };
+  bool (*checks[])(const std::string &) = { check_append, check_vacuum, check_shards, check_snapshot, check_pipelined };
+  for(int ii=0; ii < 5; ++ii) {
+    if(!checks[ii](scratch)) {
+      std::cout << names[ii] << " check failed..." << std::endl;
+      remove_scratch(scratch);
+      exit(1);
+    }
+  }
+  remove_scratch(scratch);
+
+  std::cout << "all checks passed" << std::endl;
+  return(0);
+}
+
+
+shputil::polypart make_ring(double cx, double cy, double radius, uint32_t count, bool clockwise, std::mt19937 &rng) {
+
+  //
+  // a star-ish ring around (cx, cy), closed. shapefile outers are clockwise, holes not
+  //
+  std::uniform_real_distribution<double> jitter(0.6, 1.0);
+  shputil::polypart ring;
+  for(uint32_t ii=0; ii < count; ++ii) {
+    double angle = 2.0 * M_PI * ii / count;
+    if(clockwise) {
+      angle = -angle;
+    }
+    double rr = radius * jitter(rng);
+    ring.points.push_back(shputil::pointshape(cx + (rr * cos(angle)), cy + (rr * sin(angle))));
+  }
+
+  ring.points.push_back(ring.points.front());
+  return(ring);
+}
+
+
+std::vector<uint8_t> record_content(const shputil::shape_ptr &shp) {
+
+  std::vector<uint8_t> record(shputil::encoded_content_bytes(shp) + 8);
+  shputil::encode_record(shp, 1, record.data());
+  return(std::vector<uint8_t>(record.begin() + 8, record.end())); // drop the record header
+}
+
+
+bool convert(shputil::wkb_converter &converter, const std::vector<uint8_t> &in, bool to_wkb, std::vector<uint8_t> &out) {
+
+  out.resize(64);
+  while(true) {
+    uint64_t bytes = 0;
+    bool status = to_wkb ? converter.to_wkb(in.data(), in.size(), out.data(), out.size(), bytes) :
+      converter.to_record(in.data(), in.size(), out.data(), out.size(), bytes);
+    if(status) {
+      out.resize(bytes);
+      return(true);
+    }
+
+    if(bytes <= out.size()) {
+      return(false);
+    }
+    out.resize(bytes);
+  }
+}
+
+
+bool swap_wkb(const uint8_t *wkb, size_t &offset, std::vector<uint8_t> &out) {
+
+  //
+  // rewrites little-endian Polygon/MultiPolygon WKB as big-endian
+  //
+  auto swap_word = [&](size_t bytes) {
+    for(size_t ii=0; ii < bytes; ++ii) {
+      out.push_back(wkb[offset + bytes - 1 - ii]);
+    }
+    offset += bytes;
+  };
+
+  auto fetch_count = [&]() {
+    uint32_t count = 0;
+    memcpy(&count, wkb + offset, sizeof(uint32_t));
+    swap_word(sizeof(uint32_t));
+    return(count);
+  };
+
+  if(wkb[offset] != 1) {
+    return(false);
+  }
+  out.push_back(0);
+  offset += 1;
+
+  uint32_t type = fetch_count();
+  if(type == 6) {
+    uint32_t polygons = fetch_count();
+    for(uint32_t ii=0; ii < polygons; ++ii) {
+      if(!swap_wkb(wkb, offset, out)) {
+	return(false);
+      }
+    }
+    return(true);
+  }
+
+  if(type != 3) {
+    return(false);
+  }
+
+  uint32_t rings = fetch_count();
+  for(uint32_t ii=0; ii < rings; ++ii) {
+    uint32_t points = fetch_count();
+    for(uint32_t jj=0; jj < (2 * points); ++jj) {
+      swap_word(sizeof(double));
+    }
+  }
+
+  return(true);
+}
+
+
+bool check_wkb() {
+
+  std::mt19937 rng(46);
+  shputil::wkb_converter converter;
+
+  //
+  // one outer with a hole, then two outers where the second has a hole of its own
+  //
+  auto holed = std::make_shared<shputil::polygon>();
+  holed->rings.push_back(make_ring(0.0, 0.0, 10.0, 12, true, rng));
+  holed->rings.push_back(make_ring(0.0, 0.0, 3.0, 6, false, rng));
+
+  auto multi = std::make_shared<shputil::polygon>();
+  multi->rings.push_back(make_ring(0.0, 0.0, 10.0, 9, true, rng));
+  multi->rings.push_back(make_ring(50.0, 50.0, 10.0, 7, true, rng));
+  multi->rings.push_back(make_ring(50.0, 50.0, 2.0, 5, false, rng));
+
+  const uint32_t expected_types[] = { 3, 6 };
+  const shputil::shape_ptr shapes[] = { holed, multi };
+  for(int ii=0; ii < 2; ++ii) {
+    std::vector<uint8_t> content = record_content(shapes[ii]);
+    std::vector<uint8_t> wkb;
+    std::vector<uint8_t> back;
+    if(!convert(converter, content, true, wkb) || !convert(converter, wkb, false, back)) {
+      std::cout << "conversion failed for shape " << ii << std::endl;
+      return(false);
+    }
+
+    uint32_t type = 0;
+    memcpy(&type, wkb.data() + 1, sizeof(uint32_t));
+    if(type != expected_types[ii]) {
+      std::cout << "shape " << ii << " became WKB type " << type << std::endl;
+      return(false);
+    }
+
+    if(back != content) {
+      std::cout << "shape " << ii << " didn't survive the round trip" << std::endl;
+      return(false);
+    }
+
+    std::vector<uint8_t> big_endian;
+    size_t offset = 0;
+    if(!swap_wkb(wkb.data(), offset, big_endian) || (offset != wkb.size()) ||
+       !convert(converter, big_endian, false, back) || (back != content)) {
+      std::cout << "big-endian WKB of shape " << ii << " decoded differently" << std::endl;
+      return(false);
+    }
+  }
+
+  return(true);
+}
+
+
+bool check_raster() {
+
+  //
+  // overlapping polygons, some with holes and some in two parts
+  //
+  std::mt19937 rng(45);
+  std::uniform_real_distribution<double> coord(0.0, 100.0);
+  std::uniform_real_distribution<double> size(2.0, 12.0);
+  shputil::shapefile polygons;
+  for(int ii=0; ii < 60; ++ii) {
+    auto pg = std::make_shared<shputil::polygon>();
+    double cx = coord(rng);
+    double cy = coord(rng);
+    double radius = size(rng);
+    pg->rings.push_back(make_ring(cx, cy, radius, 5 + (ii % 9), true, rng));
+    if((ii % 3) == 0) {
+      pg->rings.push_back(make_ring(cx, cy, radius * 0.4, 4 + (ii % 5), false, rng));
+    }
+    if((ii % 7) == 0) {
+      pg->rings.push_back(make_ring(coord(rng), coord(rng), size(rng), 6, true, rng));
+    }
+    polygons.shapes.push_back(pg);
+  }
+
+  shputil::polygon_index index;
+  shputil::polygon_raster raster;
+  shputil::raster_opts opts;
+  opts.cells = 1 << 12;
+  if(!index.build(polygons) || !raster.build(polygons, opts)) {
+    std::cout << "couldn't build the index/raster" << std::endl;
+    return(false);
+  }
+
+  std::uniform_real_distribution<double> point(-10.0, 110.0);
+  for(int ii=0; ii < 200000; ++ii) {
+    double x = point(rng);
+    double y = point(rng);
+    int32_t expected = index.find(x, y);
+    int32_t found = raster.find(x, y);
+    if(found != expected) {
+      std::cout << "raster found " << found << " at " << x << "," << y << ", index found " << expected << std::endl;
+      return(false);
+    }
+  }
+
+  return(true);
+}
+
+
+void make_layer(uint32_t first, uint32_t count, shputil::shapefile &shpfile, dbfutil::dbftable &table) {
+
+  //
+  // polygons first..first+count, the same feature for the same id on every call
+  //
+  shpfile.shapes.clear();
+  table.header.fields.clear();
+  table.header.fields.push_back(dbfutil::dbffield_def("ID", "N", 10));
+  table.header.fields.push_back(dbfutil::dbffield_def("NAME", 16));
+  table.rows.clear();
+  for(uint32_t id=first; id < (first + count); ++id) {
+    std::mt19937 rng(id);
+    auto pg = std::make_shared<shputil::polygon>();
+    pg->rings.push_back(make_ring((id % 20) * 10.0, (id / 20) * 10.0, 4.0, 5 + (id % 7), true, rng));
+    if((id % 4) == 0) {
+      pg->rings.push_back(make_ring((id % 20) * 10.0, (id / 20) * 10.0, 1.0, 4, false, rng));
+    }
+    shpfile.shapes.push_back(pg);
+
+    dbfutil::dbfrow row;
+    row.values.push_back(dbfutil::dbffield_value(id));
+    row.values.push_back(dbfutil::dbffield_value("feature " + std::to_string(id)));
+    table.rows.push_back(row);
+  }
+}
+
+
+bool same_shapes(const std::pmr::vector<shputil::shape_ptr> &found, const std::pmr::vector<shputil::shape_ptr> &expected) {
+
+  if(found.size() != expected.size()) {
+    std::cout << found.size() << " features where " << expected.size() << " were expected" << std::endl;
+    return(false);
+  }
+
+  for(size_t idx=0; idx < found.size(); ++idx) {
+    if(record_content(found[idx]) != record_content(expected[idx])) {
+      std::cout << "feature " << idx << " differs" << std::endl;
+      return(false);
+    }
+  }
+
+  return(true);
+}
+
+
+uint32_t row_id(const dbfutil::dbfrow &row) {
+  const dbfutil::dbffield_value &val = row.values[0];
+  return((val._vtype == dbfutil::dbffield_value::vtype::sint) ? (uint32_t) val._s32_val : val._u32_val);
+}
+
+
+void remove_scratch(const std::string &dir) {
+
+  DIR *dp = opendir(dir.c_str());
+  if(dp) {
+    while(struct dirent *ent = readdir(dp)) {
+      if(ent->d_name[0] != '.') {
+	unlink((dir + "/" + ent->d_name).c_str());
+      }
+    }
+    closedir(dp);
+  }
+  rmdir(dir.c_str());
+}
+
+
+bool check_append(const std::string &dir) {
+
+  std::string shp_path = dir + "/append.shp", dbf_path = dir + "/append.dbf";
+  shputil::shapefile head, tail, all;
+  dbfutil::dbftable head_rows, tail_rows, all_rows;
+  make_layer(0, 40, head, head_rows);
+  make_layer(40, 25, tail, tail_rows);
+  make_layer(0, 65, all, all_rows);
+  if(!shputil::write_shp(shp_path, head) || !dbfutil::write_dbf(dbf_path, head_rows) ||
+     !shputil::append_layer(shp_path, dbf_path, tail, tail_rows)) {
+    std::cout << "couldn't write and append the layer" << std::endl;
+    return(false);
+  }
+
+  shputil::shapefile readback;
+  dbfutil::dbftable rows;
+  if(!shputil::read_shp(shp_path, readback) || !dbfutil::read_dbf(dbf_path, rows) ||
+     !same_shapes(readback.shapes, all.shapes) || (rows.rows.size() != all_rows.rows.size())) {
+    return(false);
+  }
+
+  for(size_t idx=0; idx < rows.rows.size(); ++idx) {
+    if(row_id(rows.rows[idx]) != idx) {
+      std::cout << "dbf row " << idx << " has id " << row_id(rows.rows[idx]) << std::endl;
+      return(false);
+    }
+  }
+
+  return(true);
+}
+
+
+bool check_vacuum(const std::string &dir) {
+
+  std::string shp_path = dir + "/vacuum.shp", dbf_path = dir + "/vacuum.dbf";
+  shputil::shapefile shpfile;
+  dbfutil::dbftable table;
+  make_layer(0, 50, shpfile, table);
+  if(!shputil::write_shp(shp_path, shpfile) || !dbfutil::write_dbf(dbf_path, table)) {
+    std::cout << "couldn't write the layer" << std::endl;
+    return(false);
+  }
+
+  const std::vector<uint32_t> deleted = { 0, 7, 8, 31, 49 };
+  uint32_t removed = 0;
+  if(!shputil::delete_features(shp_path, dbf_path, deleted) || !shputil::vacuum_layer(shp_path, dbf_path, shputil::vacuum_opts(), &removed) ||
+     (removed != deleted.size())) {
+    std::cout << "delete/vacuum failed, " << removed << " removed" << std::endl;
+    return(false);
+  }
+
+  std::pmr::vector<shputil::shape_ptr> kept;
+  std::vector<uint32_t> kept_ids;
+  for(uint32_t id=0; id < shpfile.shapes.size(); ++id) {
+    if(std::find(deleted.begin(), deleted.end(), id) == deleted.end()) {
+      kept.push_back(shpfile.shapes[id]);
+      kept_ids.push_back(id);
+    }
+  }
+
+  shputil::shapefile readback;
+  dbfutil::dbftable rows;
+  if(!shputil::read_shp(shp_path, readback) || !dbfutil::read_dbf(dbf_path, rows) ||
+     !same_shapes(readback.shapes, kept) || (rows.rows.size() != kept_ids.size())) {
+    return(false);
+  }
+
+  for(size_t idx=0; idx < rows.rows.size(); ++idx) {
+    if(row_id(rows.rows[idx]) != kept_ids[idx]) {
+      std::cout << "vacuumed row " << idx << " has id " << row_id(rows.rows[idx]) << std::endl;
+      return(false);
+    }
+  }
+
+  return(true);
+}
+
+
+bool check_shards(const std::string &dir) {
+
+  std::string shp_path = dir + "/sharded.shp";
+  shputil::shapefile shpfile;
+  dbfutil::dbftable table;
+  make_layer(0, 120, shpfile, table);
+
+  shputil::shard_opts opts;
+  opts.max_shard_bytes = 4096; // several shards out of a small layer
+  std::vector<std::string> shard_paths;
+  std::string manifest;
+  if(!shputil::write_sharded(shp_path, shpfile, &table, opts, shard_paths) || (shard_paths.size() < 2) ||
+     !shputil::manifest_path(shp_path, manifest)) {
+    std::cout << "couldn't write the shards" << std::endl;
+    return(false);
+  }
+
+  shputil::shpdataset dataset;
+  if(!dataset.open_manifest(manifest) || (dataset.files.size() != shard_paths.size())) {
+    std::cout << "couldn't open the manifest" << std::endl;
+    return(false);
+  }
+
+  //
+  // files interleave in a scan, so features are put back in shard then record order
+  //
+  std::vector<std::vector<shputil::dataset_feature> > by_file(dataset.files.size());
+  if(!dataset.scan(shputil::scan_opts(), [&](const shputil::dataset_feature &feature) {
+	std::vector<shputil::dataset_feature> &features = by_file[feature.file];
+	if(features.size() <= feature.recno) {
+	  features.resize(feature.recno + 1);
+	}
+	features[feature.recno] = feature;
+	return(true);
+      })) {
+    std::cout << "scan failed" << std::endl;
+    return(false);
+  }
+
+  std::pmr::vector<shputil::shape_ptr> shapes;
+  for(const std::vector<shputil::dataset_feature> &features : by_file) {
+    for(const shputil::dataset_feature &feature : features) {
+      if(!feature.shp || (row_id(feature.row) != shapes.size())) {
+	std::cout << "shard feature " << shapes.size() << " is missing or has the wrong row" << std::endl;
+	return(false);
+      }
+      shapes.push_back(feature.shp);
+    }
+  }
+
+  return(same_shapes(shapes, shpfile.shapes));
+}
+
+
+bool check_snapshot(const std::string &dir) {
+
+  std::string shp_path = dir + "/snap.shp", dbf_path = dir + "/snap.dbf", snap_path = dir + "/snap.snapshot";
+  shputil::shapefile shpfile;
+  dbfutil::dbftable table;
+  make_layer(0, 30, shpfile, table);
+  shputil::layer_snapshot snapshot;
+  if(!shputil::write_shp(shp_path, shpfile) || !dbfutil::write_dbf(dbf_path, table) ||
+     !shputil::open_or_build_snapshot(snap_path, shp_path, dbf_path, snapshot) || (snapshot.record_count() != 30)) {
+    std::cout << "couldn't build the snapshot" << std::endl;
+    return(false);
+  }
+  snapshot.close();
+
+  make_layer(100, 45, shpfile, table);
+  if(!shputil::write_shp(shp_path, shpfile) || !dbfutil::write_dbf(dbf_path, table)) {
+    std::cout << "couldn't rewrite the layer" << std::endl;
+    return(false);
+  }
+
+  if(snapshot.open(snap_path, shp_path, dbf_path)) {
+    std::cout << "snapshot of the old layer opened against the new one" << std::endl;
+    return(false);
+  }
+
+  if(!shputil::open_or_build_snapshot(snap_path, shp_path, dbf_path, snapshot) || (snapshot.record_count() != shpfile.shapes.size())) {
+    std::cout << "couldn't rebuild the snapshot" << std::endl;
+    return(false);
+  }
+
+  std::pmr::vector<shputil::shape_ptr> shapes;
+  for(uint64_t recno=0; recno < snapshot.record_count(); ++recno) {
+    shapes.push_back(snapshot.shape_at(recno));
+    if(snapshot.int_column(0)[recno] != (int64_t) (100 + recno)) {
+      std::cout << "snapshot row " << recno << " has id " << snapshot.int_column(0)[recno] << std::endl;
+      return(false);
+    }
+  }
+
+  return(same_shapes(shapes, shpfile.shapes));
+}
+
+
+bool check_pipelined(const std::string &dir) {
+
+  std::string shp_path = dir + "/pipelined.shp", cut_path = dir + "/cut.shp";
+  shputil::shapefile shpfile;
+  dbfutil::dbftable table;
+  make_layer(0, 400, shpfile, table);
+  if(!shputil::write_shp(shp_path, shpfile)) {
+    std::cout << "couldn't write the layer" << std::endl;
+    return(false);
+  }
+
+  shputil::pipeline_opts opts;
+  opts.chunk_bytes = 4096; // records straddle chunks
+  opts.batch_bytes = 1024;
+  shputil::shapefile serial, pipelined;
+  if(!shputil::read_shp(shp_path, serial) || !shputil::read_shp_pipelined(shp_path, pipelined, opts) ||
+     !same_shapes(serial.shapes, shpfile.shapes) || !same_shapes(pipelined.shapes, shpfile.shapes)) {
+    std::cout << "serial and pipelined reads disagree" << std::endl;
+    return(false);
+  }
+
+  //
+  // the same file cut short in the middle of a record, its header still claims the full length
+  //
+  FILE *in = fopen(shp_path.c_str(), "rb");
+  FILE *out = fopen(cut_path.c_str(), "wb");
+  std::vector<uint8_t> bytes(20000);
+  bool copied = in && out && (fread(bytes.data(), bytes.size(), 1, in) == 1) && (fwrite(bytes.data(), bytes.size() - 37, 1, out) == 1);
+  if(in) fclose(in);
+  if(out) fclose(out);
+  if(!copied) {
+    std::cout << "couldn't write the truncated copy" << std::endl;
+    return(false);
+  }
+
+  if(shputil::read_shp(cut_path, serial) || shputil::read_shp_pipelined(cut_path, pipelined, opts)) {
+    std::cout << "a truncated shapefile read without an error" << std::endl;
+    return(false);
+  }
+
+  return(true);
+}
+
@@ -0,0 +1,332 @@
+
+#include "shpclip.h"
+
+namespace shputil {
+
+  //
+  // the kernels are written once against a point source, either shape points or
+  // interleaved x,y
+  //
+  class xy_source {
+  public:
+    xy_source(const double *xy) : xy(xy) { }
+    double x(uint32_t idx) const { return(xy[2 * idx]); }
+    double y(uint32_t idx) const { return(xy[(2 * idx) + 1]); }
+    const double *xy;
+  };
+
+  class points_source {
+  public:
+    points_source(const pointshape *points) : points(points) { }
+    double x(uint32_t idx) const { return(points[idx].x); }
+    double y(uint32_t idx) const { return(points[idx].y); }
+    const pointshape *points;
+  };
+
+
+  static void end_part(clip_buffer &out, uint32_t min_points) {
+    uint32_t start = out.part_starts.back();
+    if((out.point_count() - start) < min_points) {
+      out.xy.resize(2 * start); // degenerate, drop it
+    }
+    else if(out.point_count() > start) {
+      out.part_starts.push_back(out.point_count());
+    }
+  }
+
+  
+  static bool liang_barsky(double x0, double y0, double dx, double dy, const clip_rect &rect, double &t0, double &t1) {
+
+    const double p[4] = { -dx, dx, -dy, dy };
+    const double q[4] = { x0 - rect.xmin, rect.xmax - x0, y0 - rect.ymin, rect.ymax - y0 };
+    for(int edge=0; edge < 4; ++edge) {
+      if(p[edge] == 0.0) {
+	if(q[edge] < 0.0) {
+	  return(false); // parallel and outside
+	}
+	continue;
+      }
+
+      double t = q[edge] / p[edge];
+      if(p[edge] < 0.0) {
+	if(t > t1) return(false);
+	if(t > t0) t0 = t;
+      }
+      else {
+	if(t < t0) return(false);
+	if(t < t1) t1 = t;
+      }
+    }
+
+    return(true);
+  }
+
+  
+  template <class source>
+  static void clip_polyline_points(const source &src, uint32_t count, const clip_rect &rect, clip_buffer &out) {
+
+    bool open = false;
+    for(uint32_t idx=1; idx < count; ++idx) {
+      double x0 = src.x(idx - 1), y0 = src.y(idx - 1);
+      double dx = src.x(idx) - x0, dy = src.y(idx) - y0;
+      double t0 = 0.0, t1 = 1.0;
+      if(!liang_barsky(x0, y0, dx, dy, rect, t0, t1)) {
+	if(open) {
+	  end_part(out, 2);
+	  open = false;
+	}
+	continue;
+      }
+
+      if(!open || (t0 > 0.0)) {
+	if(open) {
+	  end_part(out, 2);
+	}
+	out.xy.push_back(x0 + (t0 * dx));
+	out.xy.push_back(y0 + (t0 * dy));
+	open = true;
+      }
+
+      out.xy.push_back(x0 + (t1 * dx));
+      out.xy.push_back(y0 + (t1 * dy));
+      if(t1 < 1.0) {
+	end_part(out, 2);
+	open = false;
+      }
+    }
+
+    if(open) {
+      end_part(out, 2);
+    }
+  }
+
+
+  enum class clip_edge { left, right, bottom, top };
+
+  static bool inside(double x, double y, clip_edge edge, const clip_rect &rect) {
+    switch(edge) {
+    case clip_edge::left: return(x >= rect.xmin);
+    case clip_edge::right: return(x <= rect.xmax);
+    case clip_edge::bottom: return(y >= rect.ymin);
+    default: return(y <= rect.ymax);
+    }
+  }
+
+  static void intersect(double x0, double y0, double x1, double y1, clip_edge edge, const clip_rect &rect, std::vector<double> &dst) {
+    double t = 0.0;
+    switch(edge) {
+    case clip_edge::left: t = (rect.xmin - x0) / (x1 - x0); break;
+    case clip_edge::right: t = (rect.xmax - x0) / (x1 - x0); break;
+    case clip_edge::bottom: t = (rect.ymin - y0) / (y1 - y0); break;
+    default: t = (rect.ymax - y0) / (y1 - y0); break;
+    }
+    dst.push_back(x0 + (t * (x1 - x0)));
+    dst.push_back(y0 + (t * (y1 - y0)));
+  }
+
+  
+  static void clip_against_edge(const std::vector<double> &src, clip_edge edge, const clip_rect &rect, std::vector<double> &dst) {
+
+    dst.clear();
+    size_t count = src.size() / 2;
+    if(count == 0) {
+      return;
+    }
+
+    double px = src[2 * (count - 1)], py = src[(2 * (count - 1)) + 1];
+    bool pin = inside(px, py, edge, rect);
+    for(size_t idx=0; idx < count; ++idx) {
+      double cx = src[2 * idx], cy = src[(2 * idx) + 1];
+      bool cin = inside(cx, cy, edge, rect);
+      if(cin != pin) {
+	intersect(px, py, cx, cy, edge, rect, dst);
+      }
+      if(cin) {
+	dst.push_back(cx);
+	dst.push_back(cy);
+      }
+      px = cx;
+      py = cy;
+      pin = cin;
+    }
+  }
+
+  
+  template <class source>
+  static void clip_ring_points(const source &src, uint32_t count, const clip_rect &rect, clip_buffer &out) {
+
+    // work on the open ring, the closing point is put back at the end
+    if((count > 1) && (src.x(0) == src.x(count - 1)) && (src.y(0) == src.y(count - 1))) {
+      count -= 1;
+    }
+
+    if(count < 3) {
+      return;
+    }
+
+    std::vector<double> &a = out.scratch[0];
+    std::vector<double> &b = out.scratch[1];
+    a.clear();
+    for(uint32_t idx=0; idx < count; ++idx) {
+      a.push_back(src.x(idx));
+      a.push_back(src.y(idx));
+    }
+
+    clip_against_edge(a, clip_edge::left, rect, b);
+    clip_against_edge(b, clip_edge::right, rect, a);
+    clip_against_edge(a, clip_edge::bottom, rect, b);
+    clip_against_edge(b, clip_edge::top, rect, a);
+
+    if(a.size() < 6) {
+      return;
+    }
+
+    out.xy.insert(out.xy.end(), a.begin(), a.end());
+    out.xy.push_back(a[0]);
+    out.xy.push_back(a[1]);
+    end_part(out, 4);
+  }
+
+
+  template <class source>
+  static void copy_part(const source &src, uint32_t count, clip_buffer &out) {
+    for(uint32_t idx=0; idx < count; ++idx) {
+      out.xy.push_back(src.x(idx));
+      out.xy.push_back(src.y(idx));
+    }
+    end_part(out, 1);
+  }
+
+  
+  void clip_polyline_xy(const double *xy, uint32_t count, const clip_rect &rect, clip_buffer &out) {
+    clip_polyline_points(xy_source(xy), count, rect, out);
+  }
+
+
+  void clip_ring_xy(const double *xy, uint32_t count, const clip_rect &rect, clip_buffer &out) {
+    clip_ring_points(xy_source(xy), count, rect, out);
+  }
+
+
+  static const std::pmr::vector<polypart> *shape_parts(const shape_ptr &shp, bool &rings) {
+    switch(xy_type(shp->stype())) {
+    case shape_type::polyline:
+      rings = false;
+      return(&((polyline *) shp.get())->parts);
+    case shape_type::polygon:
+      rings = true;
+      return(&((polygon *) shp.get())->rings);
+    default:
+      break;
+    }
+    return(0);
+  }
+
+
+  static clip_rect part_bounds(const polypart &part) {
+    clip_rect bb;
+    bool first = true;
+    for(const pointshape &pt : part.points) {
+      if(first || (pt.x < bb.xmin)) bb.xmin = pt.x;
+      if(first || (pt.y < bb.ymin)) bb.ymin = pt.y;
+      if(first || (pt.x > bb.xmax)) bb.xmax = pt.x;
+      if(first || (pt.y > bb.ymax)) bb.ymax = pt.y;
+      first = false;
+    }
+    return(bb);
+  }
+
+
+  static void clip_part(const polypart &part, const clip_rect &bb, bool ring, const clip_rect &rect, clip_buffer &out) {
+
+    if(part.points.empty() ||
+       (bb.xmax < rect.xmin) || (bb.xmin > rect.xmax) || (bb.ymax < rect.ymin) || (bb.ymin > rect.ymax)) {
+      return;
+    }
+
+    points_source src(part.points.data());
+    uint32_t count = part.points.size();
+    if((bb.xmin >= rect.xmin) && (bb.xmax <= rect.xmax) && (bb.ymin >= rect.ymin) && (bb.ymax <= rect.ymax)) {
+      copy_part(src, count, out);
+    }
+    else if(ring) {
+      clip_ring_points(src, count, rect, out);
+    }
+    else {
+      clip_polyline_points(src, count, rect, out);
+    }
+  }
+
+  
+  bool clip_shape(const shape_ptr &shp, const clip_rect &rect, clip_buffer &out) {
+
+    bool rings = false;
+    const std::pmr::vector<polypart> *parts = shape_parts(shp, rings);
+    if(!parts) {
+      return(false);
+    }
+
+    for(const polypart &part : *parts) {
+      clip_part(part, part_bounds(part), rings, rect, out);
+    }
+
+    return(true);
+  }
+
+
+  bool clip_shape_tiles(const shape_ptr &shp, const std::vector<clip_rect> &tiles, std::vector<clip_buffer> &out) {
+
+    out.resize(tiles.size());
+    for(clip_buffer &buf : out) {
+      buf.clear();
+    }
+
+    bool rings = false;
+    const std::pmr::vector<polypart> *parts = shape_parts(shp, rings);
+    if(!parts) {
+      return(false);
+    }
+
+    std::vector<clip_rect> bounds;
+    bounds.reserve(parts->size());
+    for(const polypart &part : *parts) {
+      bounds.push_back(part_bounds(part));
+    }
+
+    for(size_t tile=0; tile < tiles.size(); ++tile) {
+      for(size_t idx=0; idx < parts->size(); ++idx) {
+	clip_part((*parts)[idx], bounds[idx], rings, tiles[tile], out[tile]);
+      }
+    }
+
+    return(true);
+  }
+
+
+  shape_ptr clip_to_shape(const clip_buffer &clipped, shputil::shape_type stype) {
+
+    if(clipped.part_count() == 0) {
+      return(std::make_shared<shape>());
+    }
+
+    std::pmr::vector<polypart> parts(clipped.part_count());
+    for(uint32_t part=0; part < clipped.part_count(); ++part) {
+      std::pmr::vector<pointshape> &points = parts[part].points;
+      points.reserve(clipped.part_starts[part + 1] - clipped.part_starts[part]);
+      for(uint32_t idx=clipped.part_starts[part]; idx < clipped.part_starts[part + 1]; ++idx) {
+	points.push_back(pointshape(clipped.xy[2 * idx], clipped.xy[(2 * idx) + 1]));
+      }
+    }
+
+    if(xy_type(stype) == shape_type::polygon) {
+      std::shared_ptr<polygon> pg = std::make_shared<polygon>();
+      pg->rings.swap(parts);
+      return(pg);
+    }
+
+    std::shared_ptr<polyline> pl = std::make_shared<polyline>();
+    pl->parts.swap(parts);
+    return(pl);
+  }
+
+} // namespace shputil
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "shputil.h"
+
+namespace shputil {
+
+  //
+  // rectangle clipping for tile generation. polyline parts go through liang-barsky
+  // segment by segment (a part leaving and re-entering the rect becomes several parts),
+  // polygon rings through sutherland-hodgman against the four edges. concave rings can
+  // come out with zero-area spans along the rect edges, which is fine for rendering.
+  //
+  // input is either shapes or contiguous interleaved x,y (layer_snapshot::coords), output
+  // is appended to a clip_buffer that's meant to be cleared and reused, not reallocated.
+  //
+  class clip_rect {
+  public:
+    clip_rect() { xmin = 0.0; ymin = 0.0; xmax = 0.0; ymax = 0.0; }
+    clip_rect(double x0, double y0, double x1, double y1) { xmin = x0; ymin = y0; xmax = x1; ymax = y1; }
+    double xmin, ymin, xmax, ymax;
+  };
+
+  class clip_buffer {
+  public:
+    clip_buffer() { part_starts.push_back(0); }
+    void clear() { xy.clear(); part_starts.assign(1, 0); }
+    uint32_t part_count() const { return(part_starts.size() - 1); }
+    uint32_t point_count() const { return(xy.size() / 2); }
+    std::vector<double> xy;             // interleaved x,y
+    std::vector<uint32_t> part_starts;  // part i is points [part_starts[i], part_starts[i+1])
+    std::vector<double> scratch[2];     // sutherland-hodgman ping-pong
+  };
+
+  void clip_polyline_xy(const double *xy, uint32_t count, const clip_rect &rect, clip_buffer &out);
+  void clip_ring_xy(const double *xy, uint32_t count, const clip_rect &rect, clip_buffer &out);
+
+  bool clip_shape(const shape_ptr &shp, const clip_rect &rect, clip_buffer &out); // polyline/polygon, false for other types
+
+  //
+  // one feature against many tiles: bboxes for the feature and its parts are computed
+  // once, then per tile a part is dropped (disjoint), copied (contained) or clipped.
+  // out is resized to tiles.size().
+  //
+  bool clip_shape_tiles(const shape_ptr &shp, const std::vector<clip_rect> &tiles, std::vector<clip_buffer> &out);
+
+  shape_ptr clip_to_shape(const clip_buffer &clipped, shputil::shape_type stype); // polyline or polygon, 0 parts gives a null shape
+
+} // shputil namespace
@@ -0,0 +1,212 @@
+
+#include "shpdataset.h"
+#include "shpshard.h"
+#include "shpcatalog.h"
+#include "logging.h"
+#include "iostats.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <unistd.h>
+
+namespace shputil {
+
+  bool shpdataset::open(const std::string &directory) {
+
+    catalog_opts opts;
+    opts.threads = 1;
+    opts.recursive = false;
+    std::vector<std::string> shp_paths;
+    if(!find_shapefiles(directory, opts, shp_paths)) {
+      return(false);
+    }
+
+    return(open(shp_paths));
+  }
+
+
+  bool shpdataset::open(const std::vector<std::string> &shp_paths) {
+
+    files.clear();
+    files.reserve(shp_paths.size());
+    for(const std::string &path : shp_paths) {
+      dataset_file file;
+      file.shp_path = path;
+      if(!read_shp_info(path, file.info)) {
+	files.clear();
+	return(false);
+      }
+
+      if(xy_type(file.info.stype) == shape_type::null_shape) {
+	log_error("unsupported shape_type %d in %s\n", (int) file.info.stype, path.c_str());
+	files.clear();
+	return(false);
+      }
+
+      std::string dbf_path = path.substr(0, path.size() - 4) + ".dbf";
+      if(access(dbf_path.c_str(), R_OK) == 0) {
+	file.dbf_path = dbf_path;
+      }
+      
+      files.push_back(file);
+    }
+
+    return(true);
+  }
+
+
+  bool shpdataset::open_manifest(const std::string &manifest_path) {
+
+    std::vector<std::string> shp_paths;
+    if(!read_manifest(manifest_path, shp_paths)) {
+      files.clear();
+      return(false);
+    }
+
+    return(open(shp_paths));
+  }
+
+
+  void shpdataset::candidates(const extent &query, std::vector<uint32_t> &file_indices) const {
+    file_indices.clear();
+    for(uint32_t idx=0; idx < files.size(); ++idx) {
+      const shpinfo &info = files[idx].info;
+      if(query.intersects(info.xmin, info.ymin, info.xmax, info.ymax)) {
+	file_indices.push_back(idx);
+      }
+    }
+  }
+
+
+  //
+  // one file, front to back. records whose bbox misses the query aren't decoded and
+  // their dbf rows aren't parsed
+  //
+  static bool scan_file(uint32_t file_idx, const dataset_file &file, const scan_opts &opts,
+			const std::function<bool(const dataset_feature &)> &emit, const std::atomic<bool> &stop) {
+
+    std::vector<shx_entry> index;
+    if(!read_shx(file.shp_path, index)) {
+      return(false);
+    }
+
+    FILE *fp = fopen(file.shp_path.c_str(), "rb");
+    if(!fp) {
+      log_error("couldn't open shapefile: %s\n", file.shp_path.c_str());
+      return(false);
+    }
+
+    dbfutil::dbfreader dbf;
+    bool attributes = opts.attributes && !file.dbf_path.empty();
+    if(attributes && !dbf.open(file.dbf_path)) {
+      fclose(fp);
+      return(false);
+    }
+
+    if(attributes && (dbf.record_count != index.size())) {
+      log_error("dbf has %u rows but %s has %zu records\n", dbf.record_count, file.shp_path.c_str(), index.size());
+      fclose(fp);
+      return(false);
+    }
+
+    bool status = true;
+    std::vector<uint8_t> content;
+    dataset_feature feature;
+    feature.file = file_idx;
+    for(uint32_t recno=0; status && !stop && (recno < index.size()); ++recno) {
+      const shx_entry &entry = index[recno];
+      content.resize(std::max(entry.content_bytes, (uint32_t) sizeof(int32_t)));
+      if((fseek(fp, entry.offset + SHP_RECORD_HEADER_BYTES, SEEK_SET) != 0) ||
+	 (io_fread(content.data(), entry.content_bytes, 1, fp) != 1)) {
+	log_error("couldn't read record %u of %s\n", recno, file.shp_path.c_str());
+	status = false;
+	break;
+      }
+
+      double bb[4];
+      if(!record_bounds(content.data(), entry.content_bytes, bb) || !opts.query.intersects(bb[0], bb[1], bb[2], bb[3])) {
+	io_stats_add(io_counter::records_skipped, 1);
+	continue; // null shapes included
+      }
+
+      feature.row.values.clear();
+      if(attributes) {
+	bool deleted = false;
+	if(!dbf.read(recno, feature.row, deleted)) {
+	  status = false;
+	  break;
+	}
+	if(deleted) {
+	  io_stats_add(io_counter::records_skipped, 1);
+	  continue;
+	}
+      }
+
+      if(!decode_shape(content.data(), entry.content_bytes, feature.shp)) {
+	status = false;
+	break;
+      }
+
+      io_stats_add(io_counter::records_decoded, 1);
+      feature.recno = recno;
+      if(!emit(feature)) {
+	break;
+      }
+    }
+
+    fclose(fp);
+    return(status);
+  }
+
+  
+  bool shpdataset::scan(const scan_opts &opts, const dataset_callback &callback) const {
+
+    std::vector<uint32_t> todo;
+    candidates(opts.query, todo);
+    if(todo.empty()) {
+      return(true);
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> stop(false);
+    std::atomic<bool> ok(true);
+    std::mutex callback_mutex;
+    auto emit = [&](const dataset_feature &feature) {
+      std::lock_guard<std::mutex> lock(callback_mutex);
+      if(stop) {
+	return(false);
+      }
+      if(!callback(feature)) {
+	stop = true;
+      }
+      return(!stop);
+    };
+
+    auto worker = [&]() {
+      while(!stop) {
+	size_t idx = next.fetch_add(1);
+	if(idx >= todo.size()) {
+	  return;
+	}
+	if(!scan_file(todo[idx], files[todo[idx]], opts, emit, stop)) {
+	  ok = false;
+	  stop = true;
+	}
+      }
+    };
+
+    uint32_t nthreads = std::max((uint32_t) 1, std::min(opts.threads, (uint32_t) todo.size()));
+    std::vector<std::thread> workers;
+    for(uint32_t ii=1; ii < nthreads; ++ii) {
+      workers.push_back(std::thread(worker));
+    }
+    worker();
+    for(std::thread &thread : workers) {
+      thread.join();
+    }
+
+    return(ok);
+  }
+
+} // namespace shputil
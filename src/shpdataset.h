@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <functional>
+#include "shputil.h"
+#include "dbfutil.h"
+
+namespace shputil {
+
+  //
+  // many .shp/.shx/.dbf triples (one per county, tile, ...) treated as one layer. open()
+  // only reads the 100 byte main headers to build the catalog, scan() skips files whose
+  // header bbox misses the query, then reads the rest on a bounded pool of threads.
+  //
+  // the callback sees one feature stream: calls are serialized, records of a file arrive
+  // in file order but files interleave. return false from it to stop the scan.
+  //
+  class extent {
+  public:
+    extent() { xmin = -1.0e308; ymin = -1.0e308; xmax = 1.0e308; ymax = 1.0e308; } // everything
+    extent(double x0, double y0, double x1, double y1) { xmin = x0; ymin = y0; xmax = x1; ymax = y1; }
+    bool intersects(double x0, double y0, double x1, double y1) const { return((x0 <= xmax) && (x1 >= xmin) && (y0 <= ymax) && (y1 >= ymin)); }
+    double xmin, ymin, xmax, ymax;
+  };
+
+  class dataset_file {
+  public:
+    std::string shp_path;
+    std::string dbf_path; // empty if the file has no .dbf
+    shpinfo info;
+  };
+
+  class dataset_feature {
+  public:
+    uint32_t file;   // index into shpdataset::files
+    uint32_t recno;  // 0-based record within the file
+    shape_ptr shp;
+    dbfutil::dbfrow row; // empty without a .dbf or when attributes weren't asked for
+  };
+
+  typedef std::function<bool(const dataset_feature &feature)> dataset_callback;
+
+  class scan_opts {
+  public:
+    scan_opts() { threads = 4; attributes = true; }
+    extent query;
+    uint32_t threads;
+    bool attributes;
+  };
+
+  class shpdataset {
+  public:
+    bool open(const std::string &directory);             // every *.shp (any case) directly inside it
+    bool open(const std::vector<std::string> &shp_paths);
+    bool open_manifest(const std::string &manifest_path); // the shards of write_sharded() as one layer
+    void candidates(const extent &query, std::vector<uint32_t> &file_indices) const; // header bbox pruning only
+    bool scan(const scan_opts &opts, const dataset_callback &callback) const;
+
+    std::vector<dataset_file> files;
+  };
+
+} // shputil namespace
@@ -0,0 +1,259 @@
+
+#include "shpedit.h"
+#include "dbfutil.h"
+#include "logging.h"
+#include "iostats.h"
+#include <cstring>
+#include <unistd.h>
+
+namespace shputil {
+
+  bool delete_features(const std::string &shp_path, const std::string &dbf_path, const std::vector<uint32_t> &recnos, bool null_shapes) {
+
+    if(!dbf_path.empty() && !dbfutil::mark_deleted(dbf_path, recnos)) {
+      return(false);
+    }
+
+    if(null_shapes || dbf_path.empty()) {
+      return(null_records(shp_path, recnos));
+    }
+
+    return(true);
+  }
+
+
+  static bool null_record_mask(const std::string &shp_path, const std::vector<shx_entry> &index, std::vector<bool> &keep) {
+
+    FILE *fp = fopen(shp_path.c_str(), "rb");
+    if(!fp) {
+      log_error("couldn't open shapefile: %s\n", shp_path.c_str());
+      return(false);
+    }
+
+    keep.assign(index.size(), true);
+    for(size_t recno=0; recno < index.size(); ++recno) {
+      uint8_t content[sizeof(int32_t)];
+      if((fseek(fp, index[recno].offset + SHP_RECORD_HEADER_BYTES, SEEK_SET) != 0) ||
+	 (io_fread(content, sizeof(content), 1, fp) != 1)) {
+	log_error("couldn't read record %zu\n", recno);
+	fclose(fp);
+	return(false);
+      }
+
+      int32_t stype = 0;
+      memcpy(&stype, content, sizeof(int32_t));
+      keep[recno] = (stype != 0); // 0 reads the same in either byte order
+    }
+
+    fclose(fp);
+    return(true);
+  }
+
+  
+  //
+  // all three compacted copies are written before any of them replaces an original, so a
+  // failed copy leaves the layer as it was instead of a .shp out of step with its .dbf
+  //
+  static bool replace_layer(const std::string &shp_path, const std::string &dbf_path, const std::vector<bool> &keep) {
+
+    std::string shxpath, tmpshxpath;
+    std::string tmppath = shp_path + ".vacuum", tmpdbfpath = dbf_path + ".vacuum";
+    if(!shx_path(shp_path, shxpath) || !shx_path(tmppath, tmpshxpath)) {
+      return(false);
+    }
+
+    if(!write_compacted_shp(shp_path, keep, tmppath)) {
+      return(false);
+    }
+
+    if(!dbfutil::write_vacuumed_dbf(dbf_path, tmpdbfpath)) {
+      remove(tmppath.c_str());
+      remove(tmpshxpath.c_str());
+      return(false);
+    }
+
+    if((rename(tmpdbfpath.c_str(), dbf_path.c_str()) != 0) ||
+       (rename(tmppath.c_str(), shp_path.c_str()) != 0) ||
+       (rename(tmpshxpath.c_str(), shxpath.c_str()) != 0)) {
+      log_error("couldn't replace %s with its compacted copy\n", shp_path.c_str());
+      remove(tmpdbfpath.c_str());
+      remove(tmppath.c_str());
+      remove(tmpshxpath.c_str());
+      return(false);
+    }
+
+    return(true);
+  }
+
+  
+  bool vacuum_layer(const std::string &shp_path, const std::string &dbf_path, const vacuum_opts &opts, uint32_t *removed) {
+
+    if(removed) {
+      *removed = 0;
+    }
+    
+    std::vector<shx_entry> index;
+    if(!read_shx(shp_path, index)) {
+      return(false);
+    }
+
+    std::vector<bool> keep;
+    if(dbf_path.empty()) {
+      if(!null_record_mask(shp_path, index, keep)) {
+	return(false);
+      }
+    }
+    else {
+      std::vector<bool> deleted;
+      if(!dbfutil::deleted_records(dbf_path, deleted)) {
+	return(false);
+      }
+
+      if(deleted.size() != index.size()) {
+	log_error("dbf has %zu rows but the shapefile has %zu records\n", deleted.size(), index.size());
+	return(false);
+      }
+
+      keep.resize(deleted.size());
+      for(size_t recno=0; recno < deleted.size(); ++recno) {
+	keep[recno] = !deleted[recno];
+      }
+    }
+
+    uint32_t dropped = 0;
+    for(bool k : keep) {
+      dropped += k ? 0 : 1;
+    }
+
+    if((dropped == 0) || (dropped < (opts.min_deleted_fraction * keep.size()))) {
+      return(true);
+    }
+
+    if(dbf_path.empty()) {
+      if(!compact_shp(shp_path, keep)) {
+	return(false);
+      }
+    }
+    else if(!replace_layer(shp_path, dbf_path, keep)) {
+      return(false);
+    }
+
+    if(removed) {
+      *removed = dropped;
+    }
+    
+    return(true);
+  }
+
+
+  //
+  // a file's header and length, enough to undo an append that only added records at the
+  // end and patched the header
+  //
+  class file_mark {
+  public:
+    std::string path;
+    std::vector<uint8_t> header;
+    uint64_t bytes;
+  };
+
+
+  static bool mark_file(const std::string &path, file_mark &mark) {
+
+    int64_t mtime = 0;
+    mark.path = path;
+    mark.header.resize(SHP_HEADER_BYTES);
+    FILE *fp = fopen(path.c_str(), "rb");
+    bool status = fp && dbfutil::file_stamp(path, mark.bytes, mtime) &&
+      (io_fread(mark.header.data(), SHP_HEADER_BYTES, 1, fp) == 1);
+    if(fp) {
+      fclose(fp);
+    }
+
+    if(!status) {
+      log_error("couldn't read %s\n", path.c_str());
+    }
+    return(status);
+  }
+
+
+  static bool restore_file(const file_mark &mark) {
+
+    FILE *fp = fopen(mark.path.c_str(), "r+b");
+    bool status = fp && (io_fwrite(mark.header.data(), mark.header.size(), 1, fp) == 1) &&
+      (fflush(fp) == 0) && (ftruncate(fileno(fp), mark.bytes) == 0);
+    if(fp) {
+      fclose(fp);
+    }
+
+    if(!status) {
+      log_error("couldn't roll back %s\n", mark.path.c_str());
+    }
+    return(status);
+  }
+
+
+  bool append_layer(const std::string &shp_path, const std::string &dbf_path, const shapefile &shpfile, const dbfutil::dbftable &table) {
+
+    if(shpfile.shapes.size() != table.rows.size()) {
+      log_error("%zu shapes but %zu rows to append\n", shpfile.shapes.size(), table.rows.size());
+      return(false);
+    }
+
+    //
+    // everything that can be checked without writing: types, record counts, schema
+    // (open_append), and the marks to roll the shp/shx back to
+    //
+    std::string shxpath;
+    shpinfo info;
+    file_mark shp_mark, shx_mark;
+    if(!shx_path(shp_path, shxpath) || !read_shp_info(shp_path, info) ||
+       !mark_file(shp_path, shp_mark) || !mark_file(shxpath, shx_mark)) {
+      return(false);
+    }
+
+    for(const shape_ptr &shp : shpfile.shapes) {
+      if((shp->stype() != info.stype) && (shp->stype() != shape_type::null_shape)) {
+	log_error("record shape_type mismatch, expected %d...\n", (int) info.stype);
+	return(false);
+      }
+    }
+
+    dbfutil::dbfwriter writer;
+    if(!writer.open_append(dbf_path, table.header)) {
+      return(false);
+    }
+
+    uint64_t shx_records = (shx_mark.bytes - SHP_HEADER_BYTES) / SHP_RECORD_HEADER_BYTES;
+    if(shx_records != writer.record_count) {
+      log_error("dbf has %u rows but the shapefile has %llu records\n", writer.record_count, (unsigned long long) shx_records);
+      writer.abandon();
+      return(false);
+    }
+
+    //
+    // dbf rows first, uncommitted until close(), then the shp/shx (which undo themselves
+    // on failure), then the dbf header
+    //
+    for(size_t row=0; row < table.rows.size(); ++row) {
+      if(!writer.write(table, row)) {
+	writer.abandon();
+	return(false);
+      }
+    }
+
+    if(!append_shp(shp_path, shpfile)) {
+      writer.abandon();
+      return(false);
+    }
+
+    if(!writer.close()) {
+      restore_file(shp_mark);
+      restore_file(shx_mark);
+      return(false);
+    }
+
+    return(true);
+  }
+
+} // namespace shputil
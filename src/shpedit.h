@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include "shputil.h"
+#include "dbfutil.h"
+
+namespace shputil {
+
+  //
+  // layer-level soft delete and vacuum over a .shp/.shx and its .dbf (record i is row i).
+  // a delete is one status byte per row in the dbf, plus optionally a 4 byte null shape
+  // type in the .shp for readers that only look at geometry. vacuum drops the deleted
+  // rows and their records, streaming both files with one record in memory at a time.
+  // it rewrites the whole layer into copies rather than compacting in place, which costs
+  // a full pass per vacuum but means a failed vacuum leaves the layer untouched.
+  //
+  class vacuum_opts {
+  public:
+    vacuum_opts() { min_deleted_fraction = 0.0; }
+    double min_deleted_fraction; // leave the files alone below this, vacuum is a full copy
+  };
+
+  bool delete_features(const std::string &shp_path, const std::string &dbf_path, const std::vector<uint32_t> &recnos, bool null_shapes = false);
+  bool vacuum_layer(const std::string &shp_path, const std::string &dbf_path, const vacuum_opts &opts = vacuum_opts(), uint32_t *removed = 0); // no dbf: null records are dropped
+
+  //
+  // adds features to a layer as one unit: the shape types, the dbf schema and the
+  // shp/shx/dbf record counts are checked before anything is written, and if any of
+  // the three files fails the others are rolled back to their original bytes.
+  //
+  bool append_layer(const std::string &shp_path, const std::string &dbf_path, const shapefile &shpfile, const dbfutil::dbftable &table);
+
+} // shputil namespace
@@ -0,0 +1,371 @@
+
+#include "shpgeom.h"
+#include "logging.h"
+#include <atomic>
+#include <thread>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+namespace shputil {
+
+  static const double EARTH_RADIUS_M = 6371008.8; // mean radius
+  static const double DEG_TO_RAD = 3.14159265358979323846 / 180.0;
+
+
+  //
+  // point sources for the kernels: shape points, or the little-endian x,y pairs of an
+  // encoded record (4-byte aligned at best, so loaded with memcpy)
+  //
+  class shape_points {
+  public:
+    shape_points(const pointshape *points) : points(points) { }
+    double x(uint32_t idx) const { return(points[idx].x); }
+    double y(uint32_t idx) const { return(points[idx].y); }
+    const pointshape *points;
+  };
+
+  class le_points {
+  public:
+    le_points(const uint8_t *xy) : xy(xy) { }
+    double x(uint32_t idx) const { return(load_LEdouble(xy + (16 * (size_t) idx))); }
+    double y(uint32_t idx) const { return(load_LEdouble(xy + (16 * (size_t) idx) + sizeof(double))); }
+    const uint8_t *xy;
+  };
+
+
+  class path_sums {
+  public:
+    path_sums() { area2 = 0.0; ax = 0.0; ay = 0.0; length = 0.0; lx = 0.0; ly = 0.0; geodesic = 0.0; }
+    void add(const path_sums &other) {
+      area2 += other.area2; ax += other.ax; ay += other.ay;
+      length += other.length; lx += other.lx; ly += other.ly;
+      geodesic += other.geodesic;
+    }
+    double area2;     // twice the signed area
+    double ax, ay;    // area moments, 6 * area * centroid
+    double length;
+    double lx, ly;    // length moments, 2 * length * centroid
+    double geodesic;
+  };
+
+
+  //
+  // coordinates are relative to the first point of the shape so the cross products
+  // don't cancel away the precision of large projected coordinates
+  //
+  template<bool ring> static inline void add_edge(double x0, double y0, double x1, double y1, path_sums &sums) {
+    double dx = x1 - x0, dy = y1 - y0;
+    double seg = sqrt((dx * dx) + (dy * dy));
+    sums.length += seg;
+    sums.lx += seg * (x0 + x1);
+    sums.ly += seg * (y0 + y1);
+    if(ring) {
+      double cross = (x0 * y1) - (x1 * y0);
+      sums.area2 += cross;
+      sums.ax += (x0 + x1) * cross;
+      sums.ay += (y0 + y1) * cross;
+    }
+  }
+
+
+  static double haversine(double lon0, double lat0, double lon1, double lat1) {
+    double p0 = lat0 * DEG_TO_RAD, p1 = lat1 * DEG_TO_RAD;
+    double sdlat = sin((p1 - p0) / 2.0), sdlon = sin((lon1 - lon0) * DEG_TO_RAD / 2.0);
+    double h = (sdlat * sdlat) + (cos(p0) * cos(p1) * sdlon * sdlon);
+    return(2.0 * EARTH_RADIUS_M * asin(std::min(1.0, sqrt(h))));
+  }
+
+
+  template<bool ring, class source>
+  static void measure_path(const source &src, uint32_t count, double ox, double oy, bool geodesic, path_sums &sums) {
+
+    if(count < 2) {
+      return;
+    }
+
+    //
+    // without -ffast-math the compiler may not reorder a floating point sum, so even
+    // and odd edges go to separate accumulators to keep two dependency chains in flight
+    //
+    path_sums even, odd;
+    uint32_t idx = 0;
+    for(; (idx + 2) < count; idx += 2) {
+      double x0 = src.x(idx) - ox, y0 = src.y(idx) - oy;
+      double x1 = src.x(idx + 1) - ox, y1 = src.y(idx + 1) - oy;
+      double x2 = src.x(idx + 2) - ox, y2 = src.y(idx + 2) - oy;
+      add_edge<ring>(x0, y0, x1, y1, even);
+      add_edge<ring>(x1, y1, x2, y2, odd);
+    }
+
+    for(; (idx + 1) < count; ++idx) {
+      add_edge<ring>(src.x(idx) - ox, src.y(idx) - oy, src.x(idx + 1) - ox, src.y(idx + 1) - oy, even);
+    }
+
+    if(ring) {
+      add_edge<ring>(src.x(count - 1) - ox, src.y(count - 1) - oy, src.x(0) - ox, src.y(0) - oy, even); // 0 for closed rings
+    }
+
+    if(geodesic) {
+      for(idx=0; (idx + 1) < count; ++idx) {
+	even.geodesic += haversine(src.x(idx), src.y(idx), src.x(idx + 1), src.y(idx + 1));
+      }
+      if(ring) {
+	even.geodesic += haversine(src.x(count - 1), src.y(count - 1), src.x(0), src.y(0));
+      }
+    }
+
+    sums.add(even);
+    sums.add(odd);
+  }
+
+
+  static void finish_path(const path_sums &sums, bool polygon, double ox, double oy, geom_measures &measures, size_t idx) {
+
+    measures.length[idx] = sums.length;
+    if(!measures.geodesic_length.empty()) {
+      measures.geodesic_length[idx] = sums.geodesic;
+    }
+
+    double cx = ox, cy = oy;
+    if(polygon && (fabs(sums.area2) > (1.0e-12 * sums.length * sums.length))) {
+      measures.area[idx] = fabs(sums.area2) / 2.0; // outer rings are clockwise, holes counter-clockwise
+      cx += sums.ax / (3.0 * sums.area2);
+      cy += sums.ay / (3.0 * sums.area2);
+    }
+    else if(sums.length > 0.0) {
+      cx += sums.lx / (2.0 * sums.length);
+      cy += sums.ly / (2.0 * sums.length);
+    }
+
+    measures.centroid_x[idx] = cx;
+    measures.centroid_y[idx] = cy;
+  }
+
+
+  static void measure_shape(const shape_ptr &shp, bool geodesic, geom_measures &measures, size_t idx) {
+
+    double xmin, ymin, xmax, ymax;
+    if(!shape_bounds(shp, xmin, ymin, xmax, ymax)) {
+      return; // null or empty, stays zero
+    }
+
+    measures.xmin[idx] = xmin;
+    measures.ymin[idx] = ymin;
+    measures.xmax[idx] = xmax;
+    measures.ymax[idx] = ymax;
+
+    shape_type stype = xy_type(shp->stype());
+    if(stype == shape_type::point) {
+      const pointshape *ps = (const pointshape *) shp.get();
+      measures.centroid_x[idx] = ps->x;
+      measures.centroid_y[idx] = ps->y;
+      return;
+    }
+
+    if(stype == shape_type::multipoint) {
+      const std::pmr::vector<pointshape> &points = ((const multipointshape *) shp.get())->points;
+      double sx = 0.0, sy = 0.0;
+      for(const pointshape &ps : points) {
+	sx += ps.x;
+	sy += ps.y;
+      }
+      measures.centroid_x[idx] = sx / points.size();
+      measures.centroid_y[idx] = sy / points.size();
+      return;
+    }
+
+    bool polygon = (stype == shape_type::polygon);
+    const std::pmr::vector<polypart> &parts = polygon ? ((const shputil::polygon *) shp.get())->rings : ((const polyline *) shp.get())->parts;
+    double ox = 0.0, oy = 0.0;
+    for(const polypart &part : parts) {
+      if(!part.points.empty()) {
+	ox = part.points[0].x;
+	oy = part.points[0].y;
+	break;
+      }
+    }
+
+    path_sums sums;
+    for(const polypart &part : parts) {
+      shape_points src(part.points.data());
+      if(polygon) {
+	measure_path<true>(src, part.points.size(), ox, oy, geodesic, sums);
+      }
+      else {
+	measure_path<false>(src, part.points.size(), ox, oy, geodesic, sums);
+      }
+    }
+
+    finish_path(sums, polygon, ox, oy, measures, idx);
+  }
+
+
+  static bool measure_record(const uint8_t *content, uint32_t content_bytes, bool geodesic, geom_measures &measures, size_t idx) {
+
+    double bb[4];
+    if((content_bytes < sizeof(int32_t)) || !record_bounds(content, content_bytes, bb)) {
+      return(true); // null, stays zero
+    }
+
+    parts_view view;
+    if(!parse_record_parts(content, content_bytes, view)) {
+      return(false);
+    }
+
+    measures.xmin[idx] = bb[0];
+    measures.ymin[idx] = bb[1];
+    measures.xmax[idx] = bb[2];
+    measures.ymax[idx] = bb[3];
+
+    if(view.stype == shape_type::point) {
+      measures.centroid_x[idx] = bb[0];
+      measures.centroid_y[idx] = bb[1];
+      return(true);
+    }
+
+    if(view.numpoints == 0) {
+      return(true);
+    }
+
+    le_points src(view.points);
+    if(view.stype == shape_type::multipoint) {
+      double sx = 0.0, sy = 0.0;
+      for(uint32_t pt=0; pt < view.numpoints; ++pt) {
+	sx += src.x(pt);
+	sy += src.y(pt);
+      }
+      measures.centroid_x[idx] = sx / view.numpoints;
+      measures.centroid_y[idx] = sy / view.numpoints;
+      return(true);
+    }
+
+    double ox = src.x(0), oy = src.y(0);
+    bool polygon = (view.stype == shape_type::polygon);
+    path_sums sums;
+    for(uint32_t part=0; part < view.numparts; ++part) {
+      le_points part_src(view.part_points(part));
+      if(polygon) {
+	measure_path<true>(part_src, view.part_end(part) - view.part_start(part), ox, oy, geodesic, sums);
+      }
+      else {
+	measure_path<false>(part_src, view.part_end(part) - view.part_start(part), ox, oy, geodesic, sums);
+      }
+    }
+
+    finish_path(sums, polygon, ox, oy, measures, idx);
+    return(true);
+  }
+
+
+  template<class func> static void run_workers(uint32_t threads, const func &worker) {
+    std::vector<std::thread> pool;
+    for(uint32_t t=1; t < threads; ++t) {
+      pool.emplace_back(worker);
+    }
+    worker();
+    for(std::thread &th : pool) {
+      th.join();
+    }
+  }
+
+
+  void geom_measures::reset(size_t count, bool geodesic) {
+    area.assign(count, 0.0);
+    length.assign(count, 0.0);
+    geodesic_length.assign(geodesic ? count : 0, 0.0);
+    centroid_x.assign(count, 0.0);
+    centroid_y.assign(count, 0.0);
+    xmin.assign(count, 0.0);
+    ymin.assign(count, 0.0);
+    xmax.assign(count, 0.0);
+    ymax.assign(count, 0.0);
+  }
+
+
+  bool measure_shapes(const shapefile &shpfile, const measure_opts &opts, geom_measures &measures) {
+
+    size_t count = shpfile.shapes.size();
+    size_t chunk = std::max(1u, opts.chunk);
+    measures.reset(count, opts.geodesic);
+
+    std::atomic<size_t> next(0);
+    run_workers(std::max(1u, opts.threads), [&]() {
+	for(size_t begin = next.fetch_add(chunk); begin < count; begin = next.fetch_add(chunk)) {
+	  size_t end = std::min(count, begin + chunk);
+	  for(size_t idx=begin; idx < end; ++idx) {
+	    measure_shape(shpfile.shapes[idx], opts.geodesic, measures, idx);
+	  }
+	}
+      });
+
+    return(true);
+  }
+
+
+  bool measure_layer(const shared_shapefile &layer, const measure_opts &opts, geom_measures &measures) {
+
+    size_t count = layer.record_count();
+    size_t chunk = std::max(1u, opts.chunk);
+    measures.reset(count, opts.geodesic);
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    run_workers(std::max(1u, opts.threads), [&]() {
+	shp_cursor cursor(layer);
+	for(size_t begin = next.fetch_add(chunk); ok && (begin < count); begin = next.fetch_add(chunk)) {
+	  size_t end = std::min(count, begin + chunk);
+	  for(size_t idx=begin; ok && (idx < end); ++idx) {
+	    const uint8_t *content = 0;
+	    uint32_t content_bytes = 0;
+	    if(!cursor.read_raw(idx, content, content_bytes)) {
+	      ok = false;
+	    }
+	    else if(!measure_record(content, content_bytes, opts.geodesic, measures, idx)) {
+	      log_error("malformed record %zu\n", idx);
+	      ok = false;
+	    }
+	  }
+	}
+      });
+
+    return(ok);
+  }
+
+
+  bool add_measure_columns(dbfutil::dbftable &table, const geom_measures &measures) {
+
+    std::vector<std::pair<const char *, const std::vector<double> *> > columns;
+    columns.push_back(std::make_pair("AREA", &measures.area));
+    columns.push_back(std::make_pair("LENGTH", &measures.length));
+    if(!measures.geodesic_length.empty()) {
+      columns.push_back(std::make_pair("GEOD_LEN", &measures.geodesic_length));
+    }
+    columns.push_back(std::make_pair("CENTROID_X", &measures.centroid_x));
+    columns.push_back(std::make_pair("CENTROID_Y", &measures.centroid_y));
+
+    //
+    // check everything first so a failure leaves the table untouched
+    //
+    for(auto &column : columns) {
+      if(dbfutil::find_field(table.header, column.first) >= 0) {
+	log_error("field already exists: %s\n", column.first);
+	return(false);
+      }
+    }
+
+    if(measures.size() != table.rows.size()) {
+      log_error("%zu measures for %zu rows\n", measures.size(), table.rows.size());
+      return(false);
+    }
+
+    for(auto &column : columns) {
+      if(!dbfutil::add_column(table, dbfutil::dbffield_def(column.first, 19, 11), *column.second)) {
+	return(false);
+      }
+    }
+
+    return(true);
+  }
+
+} // namespace shputil
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "shputil.h"
+#include "shpshared.h"
+#include "dbfutil.h"
+
+namespace shputil {
+
+  //
+  // per-feature measures for a whole layer, written into one array per measure instead
+  // of being computed shape by shape. features are claimed by worker threads in chunks
+  // off a shared counter, so a few huge polygons don't hold up a thread's static share.
+  //
+  //   area      shoelace over all rings, holes (counter-clockwise rings) subtract
+  //   length    polyline length, or polygon perimeter (every ring)
+  //   geodesic  same paths in metres with x/y read as lon/lat degrees on a sphere
+  //   centroid  area weighted for polygons, length weighted for polylines, the mean
+  //             for points; degenerate polygons fall back to the length weighted one
+  //
+  // null and empty shapes measure as all zeros. measure_layer() works from the encoded
+  // records (no shape objects), its arrays are indexed by 0-based record number.
+  //
+  class measure_opts {
+  public:
+    measure_opts() { threads = 4; chunk = 1024; geodesic = false; }
+    uint32_t threads;
+    uint32_t chunk;    // features claimed at once
+    bool geodesic;     // also fill geodesic_length
+  };
+
+  class geom_measures {
+  public:
+    void reset(size_t count, bool geodesic); // zero filled
+    size_t size() const { return(area.size()); }
+    std::vector<double> area;
+    std::vector<double> length;
+    std::vector<double> geodesic_length; // empty unless measure_opts::geodesic
+    std::vector<double> centroid_x, centroid_y;
+    std::vector<double> xmin, ymin, xmax, ymax;
+  };
+
+  bool measure_shapes(const shapefile &shpfile, const measure_opts &opts, geom_measures &measures);
+  bool measure_layer(const shared_shapefile &layer, const measure_opts &opts, geom_measures &measures);
+
+  // AREA, LENGTH, GEOD_LEN (when measured), CENTROID_X, CENTROID_Y as 'F' columns
+  bool add_measure_columns(dbfutil::dbftable &table, const geom_measures &measures);
+
+} // shputil namespace
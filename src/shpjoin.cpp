@@ -0,0 +1,292 @@
+
+#include "shpjoin.h"
+#include "logging.h"
+#include <atomic>
+#include <thread>
+#include <cmath>
+#include <algorithm>
+
+namespace shputil {
+
+  bool polygon_index::build(const shapefile &polygons, uint32_t cell_load) {
+
+    xy.clear();
+    ring_starts.assign(1, 0);
+    polygon_rings.assign(1, 0);
+    bboxes.clear();
+    cell_starts.clear();
+    cell_ids.clear();
+    nx = ny = 0;
+
+    if(polygons.shapes.size() > (size_t) INT32_MAX) {
+      log_error("too many polygons: %zu\n", polygons.shapes.size());
+      return(false);
+    }
+
+    //
+    // flatten: rings back to back, so the containment test streams plain doubles
+    //
+    bool first = true;
+    double exmin = 0.0, eymin = 0.0, exmax = 0.0, eymax = 0.0;
+    for(const shape_ptr &shp : polygons.shapes) {
+      shape_type stype = xy_type(shp->stype());
+      double bb[4] = { HUGE_VAL, HUGE_VAL, -HUGE_VAL, -HUGE_VAL }; // empty, never matches
+      if(stype == shape_type::polygon) {
+	for(const polypart &ring : ((const polygon *) shp.get())->rings) {
+	  for(const pointshape &ps : ring.points) {
+	    xy.push_back(ps.x);
+	    xy.push_back(ps.y);
+	  }
+	  if((xy.size() / 2) > UINT32_MAX) {
+	    log_error("polygon layer has too many points to index\n");
+	    return(false);
+	  }
+	  ring_starts.push_back(xy.size() / 2);
+	}
+	shape_bounds(shp, bb[0], bb[1], bb[2], bb[3]);
+      }
+      else if(stype != shape_type::null_shape) {
+	log_error("unsupported shape_type for polygon_index: %d\n", (int) shp->stype());
+	return(false);
+      }
+
+      polygon_rings.push_back(ring_starts.size() - 1);
+      bboxes.insert(bboxes.end(), bb, bb + 4);
+      if(bb[0] > bb[2]) {
+	continue;
+      }
+      if(first || (bb[0] < exmin)) exmin = bb[0];
+      if(first || (bb[1] < eymin)) eymin = bb[1];
+      if(first || (bb[2] > exmax)) exmax = bb[2];
+      if(first || (bb[3] > eymax)) eymax = bb[3];
+      first = false;
+    }
+
+    if(first) {
+      return(true); // nothing to find
+    }
+
+    //
+    // grid shaped like the extent with about cell_load polygons per cell
+    //
+    double width = std::max(exmax - exmin, 1.0e-12), height = std::max(eymax - eymin, 1.0e-12);
+    double cells = std::max(1.0, (double) polygon_count() / std::max(1u, cell_load));
+    nx = (uint32_t) std::min(4096.0, std::max(1.0, ceil(sqrt(cells * width / height))));
+    ny = (uint32_t) std::min(4096.0, std::max(1.0, ceil(cells / nx)));
+    x0 = exmin;
+    y0 = eymin;
+    cell_w = width / nx;
+    cell_h = height / ny;
+
+    //
+    // two passes, count then fill, so each cell's ids are contiguous and ascending
+    //
+    cell_starts.assign(((size_t) nx * ny) + 1, 0);
+    for(int pass=0; pass < 2; ++pass) {
+      for(uint32_t poly=0; poly < polygon_count(); ++poly) {
+	const double *bb = &bboxes[4 * poly];
+	if(bb[0] > bb[2]) {
+	  continue;
+	}
+	uint32_t ix0 = std::min(nx - 1, (uint32_t) ((bb[0] - x0) / cell_w)), ix1 = std::min(nx - 1, (uint32_t) ((bb[2] - x0) / cell_w));
+	uint32_t iy0 = std::min(ny - 1, (uint32_t) ((bb[1] - y0) / cell_h)), iy1 = std::min(ny - 1, (uint32_t) ((bb[3] - y0) / cell_h));
+	for(uint32_t iy=iy0; iy <= iy1; ++iy) {
+	  for(uint32_t ix=ix0; ix <= ix1; ++ix) {
+	    size_t cell = ((size_t) iy * nx) + ix;
+	    if(pass == 0) {
+	      cell_starts[cell + 1] += 1;
+	    }
+	    else {
+	      cell_ids[cell_starts[cell]++] = poly;
+	    }
+	  }
+	}
+      }
+
+      if(pass == 0) {
+	for(size_t cell=0; cell < ((size_t) nx * ny); ++cell) {
+	  cell_starts[cell + 1] += cell_starts[cell];
+	}
+	cell_ids.resize(cell_starts.back());
+      }
+      else {
+	for(size_t cell=((size_t) nx * ny); cell > 0; --cell) { // fill advanced each start to the next cell's
+	  cell_starts[cell] = cell_starts[cell - 1];
+	}
+	cell_starts[0] = 0;
+      }
+    }
+
+    return(true);
+  }
+
+
+  bool polygon_index::contains(uint32_t poly, double x, double y) const {
+
+    bool inside = false;
+    for(uint32_t ring=polygon_rings[poly]; ring < polygon_rings[poly + 1]; ++ring) {
+      uint32_t start = ring_starts[ring], end = ring_starts[ring + 1];
+      if(start == end) {
+	continue;
+      }
+      const double *pts = &xy[2 * (size_t) start];
+      uint32_t count = end - start;
+      for(uint32_t i=0, j=count - 1; i < count; j = i++) {
+	double xi = pts[2 * i], yi = pts[(2 * i) + 1];
+	double xj = pts[2 * j], yj = pts[(2 * j) + 1];
+	if(((yi > y) != (yj > y)) && (x < (((xj - xi) * (y - yi) / (yj - yi)) + xi))) {
+	  inside = !inside;
+	}
+      }
+    }
+
+    return(inside);
+  }
+
+
+  int32_t polygon_index::find(double x, double y) const {
+
+    if((nx == 0) || !(x >= x0) || !(y >= y0)) {
+      return(-1);
+    }
+
+    uint32_t ix = (uint32_t) std::min((double) nx, (x - x0) / cell_w);
+    uint32_t iy = (uint32_t) std::min((double) ny, (y - y0) / cell_h);
+    if(ix == nx) ix = nx - 1;
+    if(iy == ny) iy = ny - 1;
+
+    size_t cell = ((size_t) iy * nx) + ix;
+    for(uint32_t pos=cell_starts[cell]; pos < cell_starts[cell + 1]; ++pos) {
+      uint32_t poly = cell_ids[pos];
+      const double *bb = &bboxes[4 * poly];
+      if((x < bb[0]) || (x > bb[2]) || (y < bb[1]) || (y > bb[3])) {
+	continue;
+      }
+
+      if(contains(poly, x, y)) {
+	return((int32_t) poly);
+      }
+    }
+
+    return(-1);
+  }
+
+
+  bool join_points(const shapefile &points, const polygon_index &index, const join_opts &opts, std::vector<int32_t> &matches) {
+
+    size_t count = points.shapes.size();
+    size_t chunk = std::max(1u, opts.chunk);
+    matches.assign(count, -1);
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+      for(size_t begin = next.fetch_add(chunk); begin < count; begin = next.fetch_add(chunk)) {
+	size_t end = std::min(count, begin + chunk);
+	for(size_t idx=begin; idx < end; ++idx) {
+	  const shape_ptr &shp = points.shapes[idx];
+	  if(xy_type(shp->stype()) == shape_type::point) {
+	    const pointshape *ps = (const pointshape *) shp.get();
+	    matches[idx] = index.find(ps->x, ps->y);
+	  }
+	}
+      }
+    };
+
+    std::vector<std::thread> pool;
+    for(uint32_t t=1; t < std::max(1u, opts.threads); ++t) {
+      pool.emplace_back(worker);
+    }
+    worker();
+    for(std::thread &th : pool) {
+      th.join();
+    }
+
+    return(true);
+  }
+
+
+  static dbfutil::dbffield_value empty_value(const dbfutil::dbffield_def &field) {
+    if(field.field_type == "N") {
+      return(dbfutil::dbffield_value((uint32_t) 0));
+    }
+    if(field.field_type == "F") {
+      return(dbfutil::dbffield_value(0.0));
+    }
+    return(dbfutil::dbffield_value(std::string()));
+  }
+
+
+  bool join_attributes(const shapefile &points, const dbfutil::dbftable &point_table,
+		       const shapefile &polygons, const dbfutil::dbftable &polygon_table,
+		       const std::string &dbf_path, const join_opts &opts) {
+
+    if((points.shapes.size() != point_table.rows.size()) || (polygons.shapes.size() != polygon_table.rows.size())) {
+      log_error("join_attributes: shapes and dbf rows don't line up\n");
+      return(false);
+    }
+
+    //
+    // output schema: point fields, JOIN_FID, then the polygon fields asked for
+    //
+    std::vector<size_t> polygon_cols;
+    if(opts.fields.empty()) {
+      for(size_t col=0; col < polygon_table.header.fields.size(); ++col) {
+	polygon_cols.push_back(col);
+      }
+    }
+    else {
+      for(const std::string &name : opts.fields) {
+	int col = dbfutil::find_field(polygon_table.header, name);
+	if(col < 0) {
+	  log_error("polygon layer has no field: %s\n", name.c_str());
+	  return(false);
+	}
+	polygon_cols.push_back(col);
+      }
+    }
+
+    dbfutil::dbfheader header = point_table.header;
+    header.fields.push_back(dbfutil::dbffield_def("JOIN_FID", "N", 10));
+    for(size_t col : polygon_cols) {
+      const dbfutil::dbffield_def &field = polygon_table.header.fields[col];
+      if(dbfutil::find_field(header, field.field_name) >= 0) {
+	log_error("field %s is on both layers, pick the polygon fields with join_opts::fields\n", field.field_name.c_str());
+	return(false);
+      }
+      header.fields.push_back(field);
+    }
+
+    polygon_index index;
+    std::vector<int32_t> matches;
+    if(!index.build(polygons) || !join_points(points, index, opts, matches)) {
+      return(false);
+    }
+
+    dbfutil::dbfwriter writer;
+    if(!writer.create(dbf_path, header)) {
+      return(false);
+    }
+
+    dbfutil::dbfrow row;
+    for(size_t idx=0; idx < matches.size(); ++idx) {
+      row.values.clear();
+      for(size_t col=0; col < point_table.header.fields.size(); ++col) {
+	row.values.push_back(point_table.value(idx, col)); // the writer has no dictionaries
+      }
+
+      int32_t match = matches[idx];
+      row.values.push_back(dbfutil::dbffield_value(match));
+      for(size_t col : polygon_cols) {
+	row.values.push_back((match < 0) ? empty_value(polygon_table.header.fields[col]) :
+			     polygon_table.value(match, col));
+      }
+
+      if(!writer.write(row)) {
+	return(false);
+      }
+    }
+
+    return(writer.close());
+  }
+
+} // namespace shputil
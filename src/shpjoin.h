@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include "shputil.h"
+#include "dbfutil.h"
+
+namespace shputil {
+
+  //
+  // point in polygon join. the polygon layer is flattened into contiguous ring
+  // coordinates and bucketed into a uniform grid (about cell_load polygons per cell,
+  // by bbox), so a point only runs the exact even-odd test against the few polygons
+  // whose bbox holds it. holes are rings like any other under even-odd.
+  //
+  // overlapping polygons resolve to the lowest polygon index. points on an edge may go
+  // either way, as with any crossing number test.
+  //
+  class polygon_index {
+  public:
+    polygon_index() { nx = ny = 0; x0 = y0 = 0.0; cell_w = cell_h = 1.0; }
+    bool build(const shapefile &polygons, uint32_t cell_load = 2);
+    int32_t find(double x, double y) const; // polygon index, -1 if none
+    bool contains(uint32_t poly, double x, double y) const; // exact even-odd test, no bbox check
+    size_t polygon_count() const { return(bboxes.size() / 4); }
+
+    std::vector<double> xy;               // interleaved x,y of every ring
+    std::vector<uint32_t> ring_starts;    // ring r is points [ring_starts[r], ring_starts[r+1])
+    std::vector<uint32_t> polygon_rings;  // polygon p is rings [polygon_rings[p], polygon_rings[p+1])
+    std::vector<double> bboxes;           // xmin, ymin, xmax, ymax per polygon
+    std::vector<uint32_t> cell_starts;    // grid cells, row major, ids [cell_starts[c], cell_starts[c+1])
+    std::vector<uint32_t> cell_ids;       // ascending within a cell
+    uint32_t nx, ny;
+    double x0, y0, cell_w, cell_h;
+  };
+
+  class join_opts {
+  public:
+    join_opts() { threads = 4; chunk = 16384; }
+    uint32_t threads;
+    uint32_t chunk;                   // points claimed at once
+    std::vector<std::string> fields;  // polygon fields copied onto the points, empty = all
+  };
+
+  // matches[i] is the polygon containing points.shapes[i], -1 if none (or not a point)
+  bool join_points(const shapefile &points, const polygon_index &index, const join_opts &opts, std::vector<int32_t> &matches);
+
+  //
+  // point rows + JOIN_FID (matched polygon index, -1 if none) + the polygon fields, written
+  // through dbfwriter one row at a time. unmatched points get blank strings and zeros.
+  //
+  bool join_attributes(const shapefile &points, const dbfutil::dbftable &point_table,
+		       const shapefile &polygons, const dbfutil::dbftable &polygon_table,
+		       const std::string &dbf_path, const join_opts &opts = join_opts());
+
+} // shputil namespace
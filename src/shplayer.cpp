@@ -0,0 +1,361 @@
+
+#include "shplayer.h"
+#include "logging.h"
+#include "iostats.h"
+#include <cstring>
+
+namespace shputil {
+
+  static const size_t WRITE_CHUNK_BYTES = 1 << 20;
+
+
+  //
+  // new features take the layer's resource, points have nothing to allocate
+  //
+  static void add_feature(std::pmr::vector<pointshape> &features) {
+    features.emplace_back();
+  }
+
+  template <class T>
+  static void add_feature(std::pmr::vector<T> &features) {
+    features.emplace_back(features.get_allocator().resource());
+  }
+
+  template <class T>
+  static T &next_feature(layer<T> &lyr, bool null) {
+    if(null || !lyr.nulls.empty()) {
+      lyr.nulls.resize(lyr.features.size(), false); // the first null fills in the ones before it
+      lyr.nulls.push_back(null);
+    }
+    add_feature(lyr.features);
+    return(lyr.features.back());
+  }
+
+
+  template <class T>
+  static bool read_records(FILE *fp, const shpinfo &info, layer<T> &lyr) {
+
+    std::pmr::vector<uint8_t> content(lyr.features.get_allocator().resource());
+    uint64_t offset = SHP_HEADER_BYTES;
+    uint8_t record_header[SHP_RECORD_HEADER_BYTES];
+    while((offset + SHP_RECORD_HEADER_BYTES) <= info.file_bytes) {
+      if(io_fread(record_header, SHP_RECORD_HEADER_BYTES, 1, fp) != 1) {
+	log_error("couldn't read record header at offset %llu\n", (unsigned long long) offset);
+	return(false);
+      }
+
+      int32_t content_length = load_BEint32(record_header + sizeof(int32_t));
+      uint64_t content_bytes = 2 * (uint64_t) content_length; // # 16-bit words
+      if((content_length < 2) || ((offset + SHP_RECORD_HEADER_BYTES + content_bytes) > info.file_bytes)) {
+	log_error("bogus record content length: %d\n", content_length);
+	return(false);
+      }
+
+      content.resize(content_bytes);
+      if(io_fread(content.data(), content_bytes, 1, fp) != 1) {
+	log_error("couldn't read record content\n");
+	return(false);
+      }
+      offset += SHP_RECORD_HEADER_BYTES + content_bytes;
+
+      if(load_LEint32(content.data()) == (int32_t) shape_type::null_shape) {
+	next_feature(lyr, true);
+	io_stats_add(io_counter::null_shapes, 1);
+	continue;
+      }
+
+      if(!decode_record(content.data(), content_bytes, next_feature(lyr, false))) {
+	log_error("couldn't decode record %zu\n", lyr.features.size());
+	return(false);
+      }
+      io_stats_add(io_counter::records_decoded, 1);
+    }
+
+    return(true);
+  }
+
+
+  template <class T>
+  bool read_layer(const std::string &path, layer<T> &lyr) {
+
+    lyr.features.clear();
+    lyr.nulls.clear();
+    lyr.stype = layer_type<T>();
+
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(!fp) {
+      log_error("couldn't open shapefile: %s\n", path.c_str());
+      return(false);
+    }
+
+    shpinfo info;
+    uint8_t header[SHP_HEADER_BYTES];
+    {
+      io_phase_timer timer(io_phase::header);
+      if((io_fread(header, SHP_HEADER_BYTES, 1, fp) != 1) || !parse_shp_header(header, info)) {
+	log_error("couldn't read shapefile header...\n");
+	fclose(fp);
+	return(false);
+      }
+    }
+
+    if(xy_type(info.stype) != layer_type<T>()) {
+      log_error("%s has shape_type %d, the layer wants %d\n", path.c_str(), (int) info.stype, (int) layer_type<T>());
+      fclose(fp);
+      return(false);
+    }
+    lyr.stype = info.stype;
+
+    io_phase_timer timer(io_phase::records);
+    bool status = read_records(fp, info, lyr);
+    fclose(fp);
+
+    return(status);
+  }
+
+
+  //
+  // bbox and byte counts first, so both headers go out before any record
+  //
+  template <class T>
+  static bool layout_layer(const layer<T> &lyr, shpinfo &info, std::vector<uint64_t> &content_bytes) {
+
+    memset(&info, 0, sizeof(shpinfo));
+    info.stype = layer_type<T>();
+    info.file_bytes = SHP_HEADER_BYTES;
+    content_bytes.resize(lyr.features.size());
+
+    io_phase_timer timer(io_phase::bbox);
+    bool first = true;
+    for(size_t idx=0; idx < lyr.features.size(); ++idx) {
+      const T &feature = lyr.features[idx];
+      content_bytes[idx] = lyr.is_null(idx) ? sizeof(int32_t) : encoded_content_bytes(feature);
+      info.file_bytes += SHP_RECORD_HEADER_BYTES + content_bytes[idx];
+
+      double xmin, ymin, xmax, ymax;
+      if(lyr.is_null(idx) || !shape_bounds(feature, xmin, ymin, xmax, ymax)) {
+	continue;
+      }
+      if(first || (xmin < info.xmin)) info.xmin = xmin;
+      if(first || (ymin < info.ymin)) info.ymin = ymin;
+      if(first || (xmax > info.xmax)) info.xmax = xmax;
+      if(first || (ymax > info.ymax)) info.ymax = ymax;
+      first = false;
+    }
+
+    if((info.file_bytes / 2) > (uint64_t) INT32_MAX) {
+      log_error("layer too large for a shapefile: %llu bytes\n", (unsigned long long) info.file_bytes);
+      return(false);
+    }
+
+    return(true);
+  }
+
+
+  template <class T>
+  static bool write_records(FILE *fp, FILE *shxfp, const layer<T> &lyr, const shpinfo &info, const std::vector<uint64_t> &content_bytes) {
+
+    uint8_t header[SHP_HEADER_BYTES];
+    encode_shp_header(info, header);
+    if(io_fwrite(header, SHP_HEADER_BYTES, 1, fp) != 1) {
+      log_error("couldn't write shapefile main header\n");
+      return(false);
+    }
+
+    std::vector<uint64_t> offsets(lyr.features.size());
+
+    //
+    // records are encoded back to back into one buffer and written a chunk at a time
+    //
+    std::vector<uint8_t> chunk;
+    chunk.reserve(WRITE_CHUNK_BYTES);
+    uint64_t offset = SHP_HEADER_BYTES;
+    for(size_t idx=0; idx < lyr.features.size(); ++idx) {
+      size_t record_bytes = SHP_RECORD_HEADER_BYTES + content_bytes[idx];
+      if(!chunk.empty() && ((chunk.size() + record_bytes) > WRITE_CHUNK_BYTES)) {
+	if(io_fwrite(chunk.data(), chunk.size(), 1, fp) != 1) {
+	  log_error("couldn't write shape records\n");
+	  return(false);
+	}
+	chunk.clear();
+      }
+
+      size_t pos = chunk.size();
+      chunk.resize(pos + record_bytes);
+      uint8_t *record = chunk.data() + pos;
+      if(lyr.is_null(idx)) {
+	store_BEint32(record, idx + 1);
+	store_BEint32(record + sizeof(int32_t), sizeof(int32_t) / 2);
+	store_LEint32(record + SHP_RECORD_HEADER_BYTES, (int32_t) shape_type::null_shape);
+      }
+      else if(!encode_record(lyr.features[idx], idx + 1, record)) {
+	return(false);
+      }
+
+      offsets[idx] = offset;
+      offset += record_bytes;
+    }
+
+    if(!chunk.empty() && (io_fwrite(chunk.data(), chunk.size(), 1, fp) != 1)) {
+      log_error("couldn't write shape records\n");
+      return(false);
+    }
+
+    shpinfo shxinfo = info;
+    shxinfo.file_bytes = SHP_HEADER_BYTES + (SHP_RECORD_HEADER_BYTES * (uint64_t) lyr.features.size());
+    encode_shp_header(shxinfo, header);
+    if(io_fwrite(header, SHP_HEADER_BYTES, 1, shxfp) != 1) {
+      log_error("couldn't write shx index\n");
+      return(false);
+    }
+
+    return(write_shx(shxfp, offsets, content_bytes));
+  }
+
+
+  template <class T>
+  bool write_layer(const std::string &path, const layer<T> &lyr) {
+
+    if(!lyr.nulls.empty() && (lyr.nulls.size() != lyr.features.size())) {
+      log_error("write_layer: nulls doesn't match the features\n");
+      return(false);
+    }
+
+    shpinfo info;
+    std::vector<uint64_t> content_bytes;
+    if(!layout_layer(lyr, info, content_bytes)) {
+      return(false);
+    }
+
+    std::string shxpath;
+    if(!shx_path(path, shxpath)) {
+      return(false);
+    }
+
+    FILE *fp = fopen(path.c_str(), "wb");
+    if(!fp) {
+      log_error("couldn't create shapefile: %s\n", path.c_str());
+      return(false);
+    }
+
+    FILE *shxfp = fopen(shxpath.c_str(), "wb");
+    if(!shxfp) {
+      log_error("couldn't create shx index file\n");
+      fclose(fp);
+      return(false);
+    }
+
+    io_phase_timer timer(io_phase::records);
+    bool status = write_records(fp, shxfp, lyr, info, content_bytes);
+    status = (fclose(fp) == 0) && status;
+    status = (fclose(shxfp) == 0) && status;
+
+    return(status);
+  }
+
+
+  template <class T>
+  bool from_shapefile(const shapefile &shpfile, layer<T> &lyr) {
+
+    lyr.features.clear();
+    lyr.nulls.clear();
+    lyr.stype = layer_type<T>();
+    lyr.features.reserve(shpfile.shapes.size());
+
+    bool first = true;
+    for(const shape_ptr &shp : shpfile.shapes) {
+      shape_type stype = shp->stype();
+      if(stype == shape_type::null_shape) {
+	next_feature(lyr, true);
+	continue;
+      }
+
+      if(xy_type(stype) != layer_type<T>()) {
+	log_error("shape_type %d in a layer of %d\n", (int) stype, (int) layer_type<T>());
+	return(false);
+      }
+
+      if(first) {
+	lyr.stype = stype;
+	first = false;
+      }
+      next_feature(lyr, false) = *(const T *) shp.get(); // assignment keeps the layer's resource
+    }
+
+    return(true);
+  }
+
+
+  static shape_ptr copy_feature(const pointshape &pt, std::pmr::memory_resource *mr) {
+    return(std::allocate_shared<pointshape>(std::pmr::polymorphic_allocator<pointshape>(mr), pt));
+  }
+
+  template <class T>
+  static shape_ptr copy_feature(const T &feature, std::pmr::memory_resource *mr) {
+    std::shared_ptr<T> shp = std::allocate_shared<T>(std::pmr::polymorphic_allocator<T>(mr), mr);
+    *shp = feature;
+    return(shp);
+  }
+
+
+  template <class T>
+  void to_shapefile(const layer<T> &lyr, shapefile &shpfile) {
+
+    std::pmr::memory_resource *mr = shpfile.shapes.get_allocator().resource();
+    shpfile.shapes.clear();
+    shpfile.shapes.reserve(lyr.features.size());
+    for(size_t idx=0; idx < lyr.features.size(); ++idx) {
+      if(lyr.is_null(idx)) {
+	shpfile.shapes.push_back(std::allocate_shared<shape>(std::pmr::polymorphic_allocator<shape>(mr)));
+      }
+      else {
+	shpfile.shapes.push_back(copy_feature(lyr.features[idx], mr));
+      }
+    }
+  }
+
+
+  bool read_any_layer(const std::string &path, any_layer &lyr) {
+
+    shpinfo info;
+    if(!read_shp_info(path, info)) {
+      return(false);
+    }
+
+    switch(xy_type(info.stype)) {
+    case shape_type::point: lyr.emplace<layer<pointshape>>(); break;
+    case shape_type::multipoint: lyr.emplace<layer<multipointshape>>(); break;
+    case shape_type::polyline: lyr.emplace<layer<polyline>>(); break;
+    case shape_type::polygon: lyr.emplace<layer<polygon>>(); break;
+    default:
+      log_error("unsupported shape_type: %d\n", (int) info.stype);
+      return(false);
+    }
+
+    return(std::visit([&](auto &typed) { return(read_layer(path, typed)); }, lyr));
+  }
+
+
+  bool write_any_layer(const std::string &path, const any_layer &lyr) {
+    return(std::visit([&](const auto &typed) { return(write_layer(path, typed)); }, lyr));
+  }
+
+
+  template bool read_layer(const std::string &path, layer<pointshape> &lyr);
+  template bool read_layer(const std::string &path, layer<multipointshape> &lyr);
+  template bool read_layer(const std::string &path, layer<polyline> &lyr);
+  template bool read_layer(const std::string &path, layer<polygon> &lyr);
+  template bool write_layer(const std::string &path, const layer<pointshape> &lyr);
+  template bool write_layer(const std::string &path, const layer<multipointshape> &lyr);
+  template bool write_layer(const std::string &path, const layer<polyline> &lyr);
+  template bool write_layer(const std::string &path, const layer<polygon> &lyr);
+  template bool from_shapefile(const shapefile &shpfile, layer<pointshape> &lyr);
+  template bool from_shapefile(const shapefile &shpfile, layer<multipointshape> &lyr);
+  template bool from_shapefile(const shapefile &shpfile, layer<polyline> &lyr);
+  template bool from_shapefile(const shapefile &shpfile, layer<polygon> &lyr);
+  template void to_shapefile(const layer<pointshape> &lyr, shapefile &shpfile);
+  template void to_shapefile(const layer<multipointshape> &lyr, shapefile &shpfile);
+  template void to_shapefile(const layer<polyline> &lyr, shapefile &shpfile);
+  template void to_shapefile(const layer<polygon> &lyr, shapefile &shpfile);
+
+} // namespace shputil
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <variant>
+#include <memory_resource>
+#include "shputil.h"
+
+namespace shputil {
+
+  //
+  // a shapefile holds a single shape type, so a layer of it can be a vector of that class:
+  // features by value (no shared_ptr node per feature, no stype() call, no casts) with
+  // read_layer/write_layer picking the record codec at compile time.
+  //
+  //   layer<polygon> parcels;
+  //   read_layer("parcels.shp", parcels); // fails unless the file is polygon/z/m
+  //   for(const polygon &pg : parcels.features) ...
+  //
+  // records keep their positions, so feature i lines up with dbf row i. a null record is a
+  // default constructed feature with nulls[i] set, nulls stays empty while there are none.
+  // z/m files read into the xy class (stype keeps the file's type), writes are always xy.
+  //
+  // a layer(mr) puts the features and everything they hold in mr, like shapefile(mr).
+  //
+  template <class T> constexpr shputil::shape_type layer_type();
+  template <> constexpr shputil::shape_type layer_type<pointshape>() { return(shape_type::point); }
+  template <> constexpr shputil::shape_type layer_type<multipointshape>() { return(shape_type::multipoint); }
+  template <> constexpr shputil::shape_type layer_type<polyline>() { return(shape_type::polyline); }
+  template <> constexpr shputil::shape_type layer_type<polygon>() { return(shape_type::polygon); }
+
+  template <class T>
+  class layer {
+  public:
+    typedef T feature_type;
+    layer() { stype = layer_type<T>(); }
+    explicit layer(std::pmr::memory_resource *mr) : features(mr), nulls(mr) { stype = layer_type<T>(); }
+    bool is_null(size_t idx) const { return(!nulls.empty() && nulls[idx]); }
+    shputil::shape_type stype;
+    std::pmr::vector<T> features;
+    std::pmr::vector<bool> nulls; // empty, or one per feature
+  };
+
+  template <class T> bool read_layer(const std::string &path, layer<T> &lyr);
+  template <class T> bool write_layer(const std::string &path, const layer<T> &lyr);
+
+  //
+  // the boundary with the shape_ptr api. from_shapefile checks every shape's type once,
+  // read_shp has already dropped null records so nulls stays empty.
+  //
+  template <class T> bool from_shapefile(const shapefile &shpfile, layer<T> &lyr);
+  template <class T> void to_shapefile(const layer<T> &lyr, shapefile &shpfile); // nulls become plain shapes
+
+  //
+  // for callers that only learn the type from the file: the header picks the alternative,
+  // after that it's one std::visit per layer rather than a virtual call per feature.
+  //
+  //   any_layer lyr;
+  //   read_any_layer(path, lyr);
+  //   if(layer<polygon> *pg = std::get_if<layer<polygon>>(&lyr)) ...
+  //   std::visit([](auto &typed) { ... typed.features ... }, lyr);
+  //
+  typedef std::variant<layer<pointshape>, layer<multipointshape>, layer<polyline>, layer<polygon>> any_layer;
+
+  bool read_any_layer(const std::string &path, any_layer &lyr);
+  bool write_any_layer(const std::string &path, const any_layer &lyr);
+
+} // shputil namespace
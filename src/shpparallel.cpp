@@ -0,0 +1,238 @@
+
+#include "shpparallel.h"
+#include "logging.h"
+#include "iostats.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace shputil {
+
+  static bool pwrite_full(int fd, const uint8_t *buf, size_t nbytes, uint64_t offset) {
+
+    while(nbytes > 0) {
+      ssize_t nwritten = pwrite(fd, buf, nbytes, offset);
+      if(nwritten < 0) {
+	if(errno == EINTR) {
+	  continue;
+	}
+	return(false);
+      }
+
+      io_stats_add(io_counter::write_calls, 1);
+      io_stats_add(io_counter::bytes_written, nwritten);
+      buf += nwritten;
+      nbytes -= nwritten;
+      offset += nwritten;
+    }
+
+    return(true);
+  }
+
+
+  //
+  // runs work(begin, end) over [0, count) in chunks handed out through an atomic cursor
+  //
+  template <class func>
+  static void run_chunks(uint32_t threads, size_t count, size_t chunk, const func &work) {
+
+    std::atomic<size_t> next(0);
+    auto loop = [&]() {
+      while(true) {
+	size_t begin = next.fetch_add(chunk);
+	if(begin >= count) {
+	  return;
+	}
+	work(begin, std::min(count, begin + chunk));
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for(uint32_t ii=1; ii < threads; ++ii) {
+      workers.push_back(std::thread(loop));
+    }
+    loop();
+    for(std::thread &worker : workers) {
+      worker.join();
+    }
+  }
+
+
+  static bool layer_shape_type(const shapefile &shpfile, shputil::shape_type &stype) {
+
+    stype = shape_type::null_shape;
+    for(const shape_ptr &shp : shpfile.shapes) {
+      shputil::shape_type st = shp->stype();
+      if(st == shape_type::null_shape) {
+	continue;
+      }
+
+      if((st != shape_type::point) && (st != shape_type::multipoint) &&
+	 (st != shape_type::polyline) && (st != shape_type::polygon)) {
+	log_error("unsupported shape_type: %d\n", (int) st);
+	return(false);
+      }
+
+      if((stype != shape_type::null_shape) && (st != stype)) {
+	log_error("found multiple shape types...\n");
+	return(false);
+      }
+      stype = st;
+    }
+
+    if(stype == shape_type::null_shape) {
+      log_error("unsupported shape_type: %d\n", (int) stype);
+      return(false);
+    }
+
+    return(true);
+  }
+
+  
+  bool write_shp_parallel(const std::string &path, const shapefile &shpfile, const parallel_write_opts &opts) {
+
+    static const size_t MEASURE_CHUNK = 4096;
+    
+    uint32_t threads = (opts.threads > 0) ? opts.threads : 1;
+    size_t count = shpfile.shapes.size();
+
+    shpinfo info;
+    memset(&info, 0, sizeof(shpinfo));
+    if(!layer_shape_type(shpfile, info.stype)) {
+      return(false);
+    }
+
+    std::string shxpath;
+    if(!shx_path(path, shxpath)) {
+      return(false);
+    }
+
+    //
+    // measure: record sizes plus per-chunk extents, reduced afterwards
+    //
+    std::vector<uint64_t> offsets(count + 1, 0);
+    std::vector<uint64_t> content_bytes(count, 0);
+    size_t nchunks = (count + MEASURE_CHUNK - 1) / MEASURE_CHUNK;
+    std::vector<double> chunk_bb(4 * nchunks, 0.0);
+    std::vector<uint8_t> chunk_has_bb(nchunks, 0);
+    {
+      io_phase_timer timer(io_phase::bbox);
+      run_chunks(threads, count, MEASURE_CHUNK, [&](size_t begin, size_t end) {
+	  double *bb = &chunk_bb[4 * (begin / MEASURE_CHUNK)];
+	  bool first = true;
+	  for(size_t idx=begin; idx < end; ++idx) {
+	    const shape_ptr &shp = shpfile.shapes[idx];
+	    content_bytes[idx] = encoded_content_bytes(shp);
+	    offsets[idx + 1] = SHP_RECORD_HEADER_BYTES + content_bytes[idx];
+	    double xmin, ymin, xmax, ymax;
+	    if(!shape_bounds(shp, xmin, ymin, xmax, ymax)) {
+	      continue;
+	    }
+	    if(first || (xmin < bb[0])) bb[0] = xmin;
+	    if(first || (ymin < bb[1])) bb[1] = ymin;
+	    if(first || (xmax > bb[2])) bb[2] = xmax;
+	    if(first || (ymax > bb[3])) bb[3] = ymax;
+	    first = false;
+	  }
+	  chunk_has_bb[begin / MEASURE_CHUNK] = !first;
+	});
+    }
+
+    bool first = true;
+    for(size_t chunk=0; chunk < nchunks; ++chunk) {
+      if(!chunk_has_bb[chunk]) {
+	continue;
+      }
+      const double *bb = &chunk_bb[4 * chunk];
+      if(first || (bb[0] < info.xmin)) info.xmin = bb[0];
+      if(first || (bb[1] < info.ymin)) info.ymin = bb[1];
+      if(first || (bb[2] > info.xmax)) info.xmax = bb[2];
+      if(first || (bb[3] > info.ymax)) info.ymax = bb[3];
+      first = false;
+    }
+
+    offsets[0] = SHP_HEADER_BYTES;
+    for(size_t idx=0; idx < count; ++idx) {
+      offsets[idx + 1] += offsets[idx];
+    }
+
+    info.file_bytes = offsets[count];
+    if((info.file_bytes / 2) > (uint64_t) INT32_MAX) {
+      log_error("layer is too large for a shapefile: %llu bytes\n", (unsigned long long) info.file_bytes);
+      return(false);
+    }
+
+    //
+    // cut the records into runs of about batch_bytes, each is encoded and written at once
+    //
+    std::vector<size_t> runs(1, 0);
+    for(size_t idx=1; idx <= count; ++idx) {
+      if(((offsets[idx] - offsets[runs.back()]) >= opts.batch_bytes) || (idx == count)) {
+	runs.push_back(idx);
+      }
+    }
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+      log_error("couldn't create shapefile: %s\n", path.c_str());
+      return(false);
+    }
+
+    uint8_t header[SHP_HEADER_BYTES];
+    encode_shp_header(info, header);
+    std::atomic<bool> ok(pwrite_full(fd, header, SHP_HEADER_BYTES, 0));
+
+    {
+      io_phase_timer timer(io_phase::records);
+      run_chunks(threads, runs.size() - 1, 1, [&](size_t begin, size_t end) {
+	  thread_local std::vector<uint8_t> buf;
+	  for(size_t run=begin; ok && (run < end); ++run) {
+	    size_t first_rec = runs[run], last_rec = runs[run + 1];
+	    uint64_t base = offsets[first_rec];
+	    buf.resize(offsets[last_rec] - base);
+	    for(size_t idx=first_rec; idx < last_rec; ++idx) {
+	      if(!encode_record(shpfile.shapes[idx], idx + 1, buf.data() + (offsets[idx] - base))) {
+		ok = false;
+		return;
+	      }
+	    }
+	    if(!pwrite_full(fd, buf.data(), buf.size(), base)) {
+	      log_error("couldn't write records at offset %llu\n", (unsigned long long) base);
+	      ok = false;
+	    }
+	  }
+	});
+    }
+
+    close(fd);
+    if(!ok) {
+      return(false);
+    }
+
+    //
+    // the .shx straight from the offset table
+    //
+    FILE *shxfp = fopen(shxpath.c_str(), "wb");
+    if(!shxfp) {
+      log_error("couldn't create shx index file\n");
+      return(false);
+    }
+
+    shpinfo shxinfo = info;
+    shxinfo.file_bytes = SHP_HEADER_BYTES + (SHP_RECORD_HEADER_BYTES * (uint64_t) count);
+    encode_shp_header(shxinfo, header);
+    bool status = (io_fwrite(header, SHP_HEADER_BYTES, 1, shxfp) == 1) && write_shx(shxfp, offsets, content_bytes);
+    status = (fclose(shxfp) == 0) && status;
+    if(!status) {
+      log_error("couldn't write shx index file\n");
+    }
+
+    return(status);
+  }
+
+} // namespace shputil
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include "shputil.h"
+
+namespace shputil {
+
+  //
+  // parallel write: record sizes only depend on part/point counts, so they're measured
+  // first, a prefix sum gives every record's final offset, and then workers encode
+  // contiguous runs of records and pwrite them in place. the .shx is built from the
+  // same offset table. output is byte-identical to write_shp.
+  //
+  class parallel_write_opts {
+  public:
+    parallel_write_opts() { threads = 4; batch_bytes = 1024 * 1024; }
+    uint32_t threads;
+    uint32_t batch_bytes; // encoded bytes per pwrite, a single larger record still goes alone
+  };
+
+  bool write_shp_parallel(const std::string &path, const shapefile &shpfile, const parallel_write_opts &opts = parallel_write_opts());
+
+} // shputil namespace
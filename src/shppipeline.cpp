@@ -0,0 +1,472 @@
+
+#include "shppipeline.h"
+#include "logging.h"
+#include "iostats.h"
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace shputil {
+
+  static const uint32_t MIN_CHUNK_BYTES = 4096;
+
+  //
+  // blocking fifo with a fixed capacity, close() wakes everybody up.
+  // pop() keeps draining after close and fails once empty, push() fails once closed.
+  //
+  template <class T> class bounded_queue {
+  public:
+    bounded_queue(size_t cap) { capacity = (cap > 0) ? cap : 1; closed = false; }
+
+    bool push(T item) {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_full.wait(lock, [&]() { return(closed || (items.size() < capacity)); });
+      if(closed) {
+	return(false);
+      }
+      items.push_back(std::move(item));
+      not_empty.notify_one();
+      return(true);
+    }
+
+    bool pop(T &item) {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_empty.wait(lock, [&]() { return(closed || !items.empty()); });
+      if(items.empty()) {
+	return(false);
+      }
+      item = std::move(items.front());
+      items.pop_front();
+      not_full.notify_one();
+      return(true);
+    }
+
+    void close() {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+      not_full.notify_all();
+      not_empty.notify_all();
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+  };
+
+
+  struct read_chunk {
+    std::vector<uint8_t> data;
+    size_t len;
+  };
+
+
+  struct record_batch {
+    uint64_t seq;
+    std::vector<uint8_t> bytes;    // record contents back to back
+    std::vector<uint32_t> offsets; // into bytes
+    std::vector<uint32_t> lengths;
+  };
+
+
+  struct decoded_batch {
+    std::vector<shape_ptr> shapes;
+  };
+
+
+  struct pipeline_state {
+    pipeline_state(const pipeline_opts &opts) :
+      free_chunks(opts.buffers), filled_chunks(opts.buffers), batches(2 * opts.decode_threads) {
+      active_decoders = opts.decode_threads;
+      failed = false;
+    }
+
+    void fail() {
+      failed = true;
+      free_chunks.close();
+      filled_chunks.close();
+      batches.close();
+      std::lock_guard<std::mutex> lock(results_mutex);
+      results_cv.notify_all();
+    }
+
+    bounded_queue<std::unique_ptr<read_chunk> > free_chunks;
+    bounded_queue<std::unique_ptr<read_chunk> > filled_chunks;
+    bounded_queue<std::unique_ptr<record_batch> > batches;
+    std::mutex results_mutex;
+    std::condition_variable results_cv;
+    std::map<uint64_t, decoded_batch> results;
+    uint32_t active_decoders;
+    std::atomic<bool> failed;
+    shputil::shape_type stype;
+  };
+
+
+  static void io_stage(int fd, uint32_t chunk_bytes, pipeline_state &state) {
+
+    std::unique_ptr<read_chunk> chunk;
+    while(!state.failed && state.free_chunks.pop(chunk)) {
+
+      size_t filled = 0;
+      while(filled < chunk_bytes) {
+	ssize_t nread = read(fd, chunk->data.data() + filled, chunk_bytes - filled);
+	if((nread < 0) && (errno == EINTR)) {
+	  continue;
+	}
+
+	if(nread < 0) {
+	  log_error("read failed: %s\n", strerror(errno));
+	  state.fail();
+	  return;
+	}
+
+	if(nread == 0) {
+	  break;
+	}
+
+	io_stats_add(io_counter::read_calls, 1);
+	io_stats_add(io_counter::bytes_read, nread);
+	filled += nread;
+      }
+
+      chunk->len = filled;
+      bool eof = (filled < chunk_bytes);
+      if((filled > 0) && !state.filled_chunks.push(std::move(chunk))) {
+	return;
+      }
+
+      if(eof) {
+	break;
+      }
+    }
+
+    state.filled_chunks.close();
+  }
+
+
+  class record_splitter {
+  public:
+    record_splitter(pipeline_state &s, uint32_t bbytes) : state(s) {
+      batch_bytes = bbytes;
+      next_seq = 0;
+      carry_total = 0;
+      file_bytes = 0;
+      position = 0;
+      have_header = false;
+    }
+
+    bool consume(const uint8_t *data, size_t len);
+    bool finish();
+
+    pipeline_state &state;
+    std::unique_ptr<record_batch> batch;
+    std::vector<uint8_t> carry; // a record that straddles two chunks
+    uint64_t carry_total;       // record header + content, 0 until the record header is complete
+    uint64_t file_bytes;
+    uint64_t position;
+    uint64_t next_seq;
+    uint32_t batch_bytes;
+    bool have_header;
+
+  private:
+    bool add_record(const uint8_t *content, uint32_t content_bytes);
+    bool flush();
+  };
+
+
+  bool record_splitter::add_record(const uint8_t *content, uint32_t content_bytes) {
+
+    if(!batch) {
+      batch.reset(new record_batch);
+      batch->seq = next_seq++;
+      batch->bytes.reserve(batch_bytes + content_bytes);
+    }
+
+    batch->offsets.push_back(batch->bytes.size());
+    batch->lengths.push_back(content_bytes);
+    batch->bytes.insert(batch->bytes.end(), content, content + content_bytes);
+
+    if(batch->bytes.size() >= batch_bytes) {
+      return(flush());
+    }
+
+    return(true);
+  }
+
+
+  bool record_splitter::flush() {
+    if(!batch) {
+      return(true);
+    }
+    return(state.batches.push(std::move(batch)));
+  }
+
+
+  bool record_splitter::consume(const uint8_t *data, size_t len) {
+
+    if(!have_header) {
+      shpinfo info;
+      if((len < SHP_HEADER_BYTES) || !parse_shp_header(data, info)) {
+	log_error("couldn't read shapefile header...\n");
+	return(false);
+      }
+
+      state.stype = info.stype;
+      file_bytes = info.file_bytes;
+      have_header = true;
+      position = SHP_HEADER_BYTES;
+      data += SHP_HEADER_BYTES;
+      len -= SHP_HEADER_BYTES;
+    }
+
+    //
+    // never look past the header's file_length
+    //
+    if(position >= file_bytes) {
+      return(true);
+    }
+
+    if((position + len) > file_bytes) {
+      len = file_bytes - position;
+    }
+    position += len;
+
+    while(len > 0) {
+
+      if(!carry.empty() || (len < SHP_RECORD_HEADER_BYTES)) {
+
+	if(carry_total == 0) {
+	  size_t take = std::min(len, (size_t) (SHP_RECORD_HEADER_BYTES - carry.size()));
+	  carry.insert(carry.end(), data, data + take);
+	  data += take;
+	  len -= take;
+	  if(carry.size() < SHP_RECORD_HEADER_BYTES) {
+	    continue;
+	  }
+
+	  int32_t content_length = load_BEint32(carry.data() + sizeof(int32_t));
+	  if(content_length <= 0) {
+	    log_error("bogus record content length: %d\n", content_length);
+	    return(false);
+	  }
+	  carry_total = SHP_RECORD_HEADER_BYTES + (2 * (uint64_t) content_length);
+	}
+
+	size_t take = std::min((uint64_t) len, carry_total - carry.size());
+	carry.insert(carry.end(), data, data + take);
+	data += take;
+	len -= take;
+	if(carry.size() == carry_total) {
+	  if(!add_record(carry.data() + SHP_RECORD_HEADER_BYTES, carry_total - SHP_RECORD_HEADER_BYTES)) {
+	    return(false);
+	  }
+	  carry.clear();
+	  carry_total = 0;
+	}
+	continue;
+      }
+
+      int32_t content_length = load_BEint32(data + sizeof(int32_t));
+      if(content_length <= 0) {
+	log_error("bogus record content length: %d\n", content_length);
+	return(false);
+      }
+
+      uint64_t total = SHP_RECORD_HEADER_BYTES + (2 * (uint64_t) content_length);
+      if(total > len) {
+	carry.assign(data, data + len);
+	carry_total = total;
+	break;
+      }
+
+      if(!add_record(data + SHP_RECORD_HEADER_BYTES, total - SHP_RECORD_HEADER_BYTES)) {
+	return(false);
+      }
+      data += total;
+      len -= total;
+    }
+
+    return(true);
+  }
+
+
+  bool record_splitter::finish() {
+
+    if(!have_header) {
+      log_error("couldn't read shapefile header...\n");
+      return(false);
+    }
+
+    //
+    // a short read or a partial last record is a truncated file, fail as read_shp does
+    //
+    if(!carry.empty() || (position < file_bytes)) {
+      log_error("shapefile stopped at byte %llu of %llu\n", (unsigned long long) (position - carry.size()), (unsigned long long) file_bytes);
+      return(false);
+    }
+
+    return(flush());
+  }
+
+
+  static void split_stage(uint32_t batch_bytes, pipeline_state &state) {
+
+    record_splitter splitter(state, batch_bytes);
+    std::unique_ptr<read_chunk> chunk;
+    while(state.filled_chunks.pop(chunk)) {
+      if(!splitter.consume(chunk->data.data(), chunk->len)) {
+	state.fail();
+	return;
+      }
+
+      if(!state.free_chunks.push(std::move(chunk))) {
+	break;
+      }
+    }
+
+    if(!state.failed && !splitter.finish()) {
+      state.fail();
+      return;
+    }
+
+    state.batches.close();
+  }
+
+
+  static void decode_stage(pipeline_state &state) {
+
+    std::unique_ptr<record_batch> batch;
+    while(!state.failed && state.batches.pop(batch)) {
+
+      decoded_batch decoded;
+      decoded.shapes.reserve(batch->offsets.size());
+      bool ok = true;
+      for(size_t ii=0; ok && (ii < batch->offsets.size()); ++ii) {
+	shape_ptr shp;
+	if(!decode_shape(batch->bytes.data() + batch->offsets[ii], batch->lengths[ii], shp)) {
+	  ok = false;
+	  break;
+	}
+
+	if(shp->stype() == shape_type::null_shape) {
+	  io_stats_add(io_counter::null_shapes, 1);
+	  io_stats_add(io_counter::records_skipped, 1);
+	  continue;
+	}
+
+	if(shp->stype() != state.stype) {
+	  log_error("record shape_type mismatch, expected %d...\n", (int) state.stype);
+	  ok = false;
+	  break;
+	}
+
+	decoded.shapes.push_back(shp);
+	io_stats_add(io_counter::records_decoded, 1);
+      }
+
+      if(!ok) {
+	state.fail();
+	break;
+      }
+
+      std::lock_guard<std::mutex> lock(state.results_mutex);
+      state.results[batch->seq] = std::move(decoded);
+      state.results_cv.notify_all();
+    }
+
+    std::lock_guard<std::mutex> lock(state.results_mutex);
+    state.active_decoders -= 1;
+    state.results_cv.notify_all();
+  }
+
+
+  bool read_shp_pipelined(const std::string &path, shapefile &shpfile, const pipeline_opts &opts_in) {
+
+    shpfile.shapes.clear();
+
+    pipeline_opts opts = opts_in;
+    opts.chunk_bytes = std::max(opts.chunk_bytes, MIN_CHUNK_BYTES);
+    opts.buffers = std::max(opts.buffers, (uint32_t) 2);
+    opts.decode_threads = std::max(opts.decode_threads, (uint32_t) 1);
+
+    shpinfo info;
+    if(!read_shp_info(path, info)) {
+      return(false);
+    }
+
+    if(xy_type(info.stype) == shape_type::null_shape) {
+      log_error("unsupported shape_type: %d\n", (int) info.stype);
+      return(false);
+    }
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+      log_error("couldn't open shapefile: %s\n", path.c_str());
+      return(false);
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    pipeline_state state(opts);
+    state.stype = info.stype;
+    for(uint32_t ii=0; ii < opts.buffers; ++ii) {
+      std::unique_ptr<read_chunk> chunk(new read_chunk);
+      chunk->data.resize(opts.chunk_bytes);
+      chunk->len = 0;
+      state.free_chunks.push(std::move(chunk));
+    }
+
+    std::vector<std::thread> threads;
+    threads.push_back(std::thread(io_stage, fd, opts.chunk_bytes, std::ref(state)));
+    threads.push_back(std::thread(split_stage, opts.batch_bytes, std::ref(state)));
+    for(uint32_t ii=0; ii < opts.decode_threads; ++ii) {
+      threads.push_back(std::thread(decode_stage, std::ref(state)));
+    }
+
+    //
+    // collect the batches back in file order
+    //
+    for(uint64_t seq=0; ; ++seq) {
+      std::unique_lock<std::mutex> lock(state.results_mutex);
+      state.results_cv.wait(lock, [&]() {
+	  return(state.failed || (state.results.count(seq) > 0) || (state.active_decoders == 0));
+	});
+
+      auto it = state.results.find(seq);
+      if(state.failed || (it == state.results.end())) {
+	break;
+      }
+
+      std::vector<shape_ptr> &shapes = it->second.shapes;
+      shpfile.shapes.insert(shpfile.shapes.end(), shapes.begin(), shapes.end());
+      state.results.erase(it);
+    }
+
+    for(std::thread &thread : threads) {
+      thread.join();
+    }
+
+    close(fd);
+
+    if(state.failed) {
+      shpfile.shapes.clear();
+      return(false);
+    }
+
+    return(true);
+  }
+
+} // namespace shputil
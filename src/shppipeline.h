@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include "shputil.h"
+
+namespace shputil {
+
+  //
+  // sequential read split into stages: an i/o thread reads large aligned chunks ahead
+  // into a fixed set of buffers, a splitter cuts them into records using the record
+  // headers, and decode workers turn record batches into shapes. bounded queues between
+  // the stages provide backpressure, shapes come out in file order.
+  //
+  class pipeline_opts {
+  public:
+    pipeline_opts() { chunk_bytes = 4 * 1024 * 1024; buffers = 3; decode_threads = 2; batch_bytes = 256 * 1024; }
+    uint32_t chunk_bytes;    // read size and alignment
+    uint32_t buffers;        // chunks in flight between the i/o thread and the splitter (2 = double buffering)
+    uint32_t decode_threads;
+    uint32_t batch_bytes;    // record bytes handed to a decode worker at once
+  };
+
+  bool read_shp_pipelined(const std::string &path, shapefile &shpfile, const pipeline_opts &opts = pipeline_opts());
+
+} // shputil namespace
@@ -0,0 +1,540 @@
+
+#include "shpraster.h"
+#include "logging.h"
+#include "iostats.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+namespace shputil {
+
+  static const char RASTER_MAGIC[8] = { 'S', 'H', 'P', 'R', 'A', 'S', 'T', '1' };
+  static const uint32_t RASTER_VERSION = 1;
+  static const uint32_t RASTER_BYTE_ORDER = 0x01020304;
+
+  const uint32_t polygon_raster::OUTSIDE;
+  const uint32_t polygon_raster::TAG_MASK;
+  const uint32_t polygon_raster::BOUNDARY;
+  const uint32_t polygon_raster::REFINED;
+
+  struct raster_grid {
+    double x0, y0, cell_w, cell_h;
+    uint32_t nx, ny;
+  };
+
+  struct raster_work {
+    std::vector<uint32_t> mark;   // last polygon whose edges touched the cell
+    std::vector<uint32_t> inside; // lowest polygon holding the whole cell
+    std::vector<std::pair<uint32_t, uint32_t> > boundary; // (cell, polygon)
+    std::vector<double> crossings;
+  };
+
+
+  static bool cell_span(double lo, double hi, double origin, double size, uint32_t count, uint32_t &first, uint32_t &last) {
+    if((hi < origin) || (lo > (origin + (size * count)))) {
+      return(false);
+    }
+
+    first = (lo <= origin) ? 0 : std::min(count - 1, (uint32_t) ((lo - origin) / size));
+    last = (hi <= origin) ? 0 : std::min(count - 1, (uint32_t) ((hi - origin) / size));
+    return(true);
+  }
+
+
+  static bool segment_hits_rect(double ax, double ay, double bx, double by, double rx0, double ry0, double rx1, double ry1) {
+
+    if((std::max(ax, bx) < rx0) || (std::min(ax, bx) > rx1) || (std::max(ay, by) < ry0) || (std::min(ay, by) > ry1)) {
+      return(false);
+    }
+
+    //
+    // bboxes overlap, so the segment misses only if all four corners are strictly on
+    // one side of its line
+    //
+    double dx = bx - ax, dy = by - ay;
+    double s0 = (dx * (ry0 - ay)) - (dy * (rx0 - ax));
+    double s1 = (dx * (ry0 - ay)) - (dy * (rx1 - ax));
+    double s2 = (dx * (ry1 - ay)) - (dy * (rx0 - ax));
+    double s3 = (dx * (ry1 - ay)) - (dy * (rx1 - ax));
+    bool all_pos = (s0 > 0.0) && (s1 > 0.0) && (s2 > 0.0) && (s3 > 0.0);
+    bool all_neg = (s0 < 0.0) && (s1 < 0.0) && (s2 < 0.0) && (s3 < 0.0);
+    return(!all_pos && !all_neg);
+  }
+
+
+  //
+  // classify every cell of grid against polys (ascending). edges mark the cells they
+  // touch (widened by a small margin so rounding in find() can't step past an edge), a
+  // scanline through each row's cell centres fills the cells inside, then each cell
+  // becomes a code. codes for boundary cells point into lists.
+  //
+  static bool classify(const polygon_index &index, const raster_grid &grid, const std::vector<uint32_t> &polys,
+		       raster_work &work, std::vector<uint32_t> &codes, std::vector<uint32_t> &lists) {
+
+    size_t ncells = (size_t) grid.nx * grid.ny;
+    work.mark.assign(ncells, polygon_raster::OUTSIDE);
+    work.inside.assign(ncells, polygon_raster::OUTSIDE);
+    work.boundary.clear();
+
+    double span = fabs(grid.x0) + fabs(grid.y0) + (grid.cell_w * grid.nx) + (grid.cell_h * grid.ny);
+    double ex = (1.0e-6 * grid.cell_w) + (1.0e-13 * span);
+    double ey = (1.0e-6 * grid.cell_h) + (1.0e-13 * span);
+
+    for(uint32_t poly : polys) {
+      const double *bb = &index.bboxes[4 * (size_t) poly];
+      uint32_t ix0, ix1, iy0, iy1;
+      if((bb[0] > bb[2]) || !cell_span(bb[0] - ex, bb[2] + ex, grid.x0, grid.cell_w, grid.nx, ix0, ix1) ||
+	 !cell_span(bb[1] - ey, bb[3] + ey, grid.y0, grid.cell_h, grid.ny, iy0, iy1)) {
+	continue;
+      }
+
+      for(uint32_t ring=index.polygon_rings[poly]; ring < index.polygon_rings[poly + 1]; ++ring) {
+	uint32_t start = index.ring_starts[ring], count = index.ring_starts[ring + 1] - start;
+	const double *pts = &index.xy[2 * (size_t) start];
+	for(uint32_t i=0; i < count; ++i) {
+	  uint32_t j = ((i + 1) < count) ? (i + 1) : 0;
+	  double ax = pts[2 * i], ay = pts[(2 * i) + 1], bx = pts[2 * j], by = pts[(2 * j) + 1];
+	  uint32_t cx0, cx1, cy0, cy1;
+	  if(!cell_span(std::min(ax, bx) - ex, std::max(ax, bx) + ex, grid.x0, grid.cell_w, grid.nx, cx0, cx1) ||
+	     !cell_span(std::min(ay, by) - ey, std::max(ay, by) + ey, grid.y0, grid.cell_h, grid.ny, cy0, cy1)) {
+	    continue;
+	  }
+	  for(uint32_t cy=cy0; cy <= cy1; ++cy) {
+	    double ry0 = grid.y0 + (cy * grid.cell_h);
+	    for(uint32_t cx=cx0; cx <= cx1; ++cx) {
+	      size_t cell = ((size_t) cy * grid.nx) + cx;
+	      double rx0 = grid.x0 + (cx * grid.cell_w);
+	      if((work.mark[cell] != poly) &&
+		 segment_hits_rect(ax, ay, bx, by, rx0 - ex, ry0 - ey, rx0 + grid.cell_w + ex, ry0 + grid.cell_h + ey)) {
+		work.mark[cell] = poly;
+		work.boundary.push_back(std::make_pair((uint32_t) cell, poly));
+	      }
+	    }
+	  }
+	}
+      }
+
+      for(uint32_t iy=iy0; iy <= iy1; ++iy) {
+	double yc = grid.y0 + ((iy + 0.5) * grid.cell_h);
+	work.crossings.clear();
+	for(uint32_t ring=index.polygon_rings[poly]; ring < index.polygon_rings[poly + 1]; ++ring) {
+	  uint32_t start = index.ring_starts[ring], count = index.ring_starts[ring + 1] - start;
+	  const double *pts = &index.xy[2 * (size_t) start];
+	  for(uint32_t i=0, j=count - 1; i < count; j = i++) {
+	    double xi = pts[2 * i], yi = pts[(2 * i) + 1], xj = pts[2 * j], yj = pts[(2 * j) + 1];
+	    if((yi > yc) != (yj > yc)) {
+	      work.crossings.push_back(((xj - xi) * (yc - yi) / (yj - yi)) + xi);
+	    }
+	  }
+	}
+
+	std::sort(work.crossings.begin(), work.crossings.end());
+	for(size_t k=0; (k + 1) < work.crossings.size(); k += 2) {
+	  double first = ceil(((work.crossings[k] - grid.x0) / grid.cell_w) - 0.5);
+	  double last = floor(((work.crossings[k + 1] - grid.x0) / grid.cell_w) - 0.5);
+	  first = std::max(first, (double) ix0);
+	  last = std::min(last, (double) ix1);
+	  for(double ix=first; ix <= last; ix += 1.0) {
+	    size_t cell = ((size_t) iy * grid.nx) + (uint32_t) ix;
+	    if((work.mark[cell] != poly) && (work.inside[cell] == polygon_raster::OUTSIDE)) {
+	      work.inside[cell] = poly;
+	    }
+	  }
+	}
+      }
+    }
+
+    //
+    // a cell inside p only needs the boundary polygons below p, the lowest index wins
+    //
+    codes.assign(work.inside.begin(), work.inside.end());
+    std::sort(work.boundary.begin(), work.boundary.end());
+    for(size_t pos=0; pos < work.boundary.size(); ) {
+      uint32_t cell = work.boundary[pos].first, inside = work.inside[cell];
+      size_t end = pos;
+      while((end < work.boundary.size()) && (work.boundary[end].first == cell)) {
+	++end;
+      }
+
+      size_t below = pos;
+      while((below < end) && (work.boundary[below].second < inside)) {
+	++below;
+      }
+
+      if(below > pos) {
+	if(lists.size() >= polygon_raster::REFINED) {
+	  log_error("polygon raster has too many candidate lists, lower cells or refine\n");
+	  return(false);
+	}
+	codes[cell] = polygon_raster::BOUNDARY | (uint32_t) lists.size();
+	lists.push_back((below - pos) + ((inside != polygon_raster::OUTSIDE) ? 1 : 0));
+	for(size_t idx=pos; idx < below; ++idx) {
+	  lists.push_back(work.boundary[idx].second);
+	}
+	if(inside != polygon_raster::OUTSIDE) {
+	  lists.push_back(inside);
+	}
+      }
+
+      pos = end;
+    }
+
+    return(true);
+  }
+
+
+  bool polygon_raster::build(const shapefile &polygons, const raster_opts &opts) {
+
+    cells.clear();
+    sub_cells.clear();
+    lists.clear();
+    nx = ny = 0;
+    refine = (opts.refine < 2) ? 0 : std::min(opts.refine, 256u);
+
+    if(!geometry.build(polygons)) {
+      return(false);
+    }
+
+    if(geometry.polygon_count() >= REFINED) {
+      log_error("too many polygons to rasterize: %zu\n", geometry.polygon_count());
+      return(false);
+    }
+
+    if(geometry.nx == 0) {
+      return(true); // nothing but null shapes
+    }
+
+    //
+    // same extent as the geometry's own grid, shaped to about opts.cells cells
+    //
+    double width = geometry.cell_w * geometry.nx, height = geometry.cell_h * geometry.ny;
+    double target = std::max(1.0, (double) opts.cells);
+    nx = (uint32_t) std::min(65536.0, std::max(1.0, ceil(sqrt(target * width / height))));
+    ny = (uint32_t) std::min(65536.0, std::max(1.0, ceil(target / nx)));
+    x0 = geometry.x0;
+    y0 = geometry.y0;
+    cell_w = width / nx;
+    cell_h = height / ny;
+
+    std::vector<uint32_t> all(geometry.polygon_count());
+    for(uint32_t poly=0; poly < all.size(); ++poly) {
+      all[poly] = poly;
+    }
+
+    raster_work work;
+    raster_grid grid = { x0, y0, cell_w, cell_h, nx, ny };
+    std::vector<uint32_t> coarse_lists;
+    if(!classify(geometry, grid, all, work, cells, refine ? coarse_lists : lists)) {
+      return(false);
+    }
+
+    if(!refine) {
+      return(true);
+    }
+
+    //
+    // split every boundary cell, its candidates are the only polygons that can matter
+    //
+    std::vector<uint32_t> candidates, codes;
+    for(size_t cell=0; cell < cells.size(); ++cell) {
+      uint32_t code = cells[cell];
+      if((code == OUTSIDE) || ((code & TAG_MASK) != BOUNDARY)) {
+	continue;
+      }
+
+      const uint32_t *list = &coarse_lists[code & ~TAG_MASK];
+      candidates.assign(list + 1, list + 1 + list[0]);
+      raster_grid sub = { x0 + ((cell % nx) * cell_w), y0 + ((cell / nx) * cell_h), cell_w / refine, cell_h / refine, refine, refine };
+      if(!classify(geometry, sub, candidates, work, codes, lists)) {
+	return(false);
+      }
+
+      size_t block = sub_cells.size() / ((size_t) refine * refine);
+      if(block >= REFINED) {
+	log_error("polygon raster has too many boundary cells, lower cells or refine\n");
+	return(false);
+      }
+      cells[cell] = REFINED | (uint32_t) block;
+      sub_cells.insert(sub_cells.end(), codes.begin(), codes.end());
+    }
+
+    log("polygon_raster: %ux%u cells, %zu refined, %llu bytes\n", nx, ny, sub_cells.size() / ((size_t) refine * refine),
+	(unsigned long long) memory_bytes());
+    return(true);
+  }
+
+
+  int32_t polygon_raster::find(double x, double y) const {
+
+    if(nx == 0) {
+      return(-1);
+    }
+
+    double fx = (x - x0) / cell_w, fy = (y - y0) / cell_h;
+    if(!(fx >= 0.0) || !(fy >= 0.0) || (fx > nx) || (fy > ny)) {
+      return(-1); // outside every bbox (or nan)
+    }
+
+    uint32_t ix = std::min(nx - 1, (uint32_t) fx), iy = std::min(ny - 1, (uint32_t) fy);
+    uint32_t code = cells[((size_t) iy * nx) + ix];
+    if((code != OUTSIDE) && ((code & TAG_MASK) == REFINED)) {
+      uint32_t sx = std::min(refine - 1, (uint32_t) ((fx - ix) * refine));
+      uint32_t sy = std::min(refine - 1, (uint32_t) ((fy - iy) * refine));
+      code = sub_cells[((size_t) (code & ~TAG_MASK) * refine * refine) + (sy * refine) + sx];
+    }
+
+    if(code == OUTSIDE) {
+      return(-1);
+    }
+
+    if((code & TAG_MASK) == BOUNDARY) {
+      const uint32_t *list = &lists[code & ~TAG_MASK];
+      for(uint32_t idx=1; idx <= list[0]; ++idx) {
+	if(geometry.contains(list[idx], x, y)) {
+	  return((int32_t) list[idx]);
+	}
+      }
+      return(-1);
+    }
+
+    return((int32_t) code);
+  }
+
+
+  uint64_t polygon_raster::memory_bytes() const {
+    return((sizeof(uint32_t) * (cells.size() + sub_cells.size() + lists.size() + geometry.ring_starts.size() +
+				geometry.polygon_rings.size() + geometry.cell_starts.size() + geometry.cell_ids.size())) +
+	   (sizeof(double) * (geometry.xy.size() + geometry.bboxes.size())));
+  }
+
+
+  template<class T> static bool write_array(FILE *fp, const std::vector<T> &vec) {
+    uint64_t count = vec.size();
+    return((io_fwrite(&count, sizeof(uint64_t), 1, fp) == 1) &&
+	   (vec.empty() || (io_fwrite(vec.data(), sizeof(T), vec.size(), fp) == vec.size())));
+  }
+
+
+  template<class T> static bool read_array(FILE *fp, uint64_t &remaining, std::vector<T> &vec) {
+    uint64_t count = 0;
+    if((remaining < sizeof(uint64_t)) || (io_fread(&count, sizeof(uint64_t), 1, fp) != 1)) {
+      return(false);
+    }
+    remaining -= sizeof(uint64_t);
+    if(count > (remaining / sizeof(T))) {
+      return(false);
+    }
+    vec.resize(count);
+    remaining -= count * sizeof(T);
+    return(vec.empty() || (io_fread(vec.data(), sizeof(T), count, fp) == count));
+  }
+
+
+  class raster_file_header {
+  public:
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t nx, ny, refine, geometry_nx, geometry_ny, reserved;
+    double x0, y0, cell_w, cell_h;
+    double geometry_x0, geometry_y0, geometry_cell_w, geometry_cell_h;
+  };
+
+
+  bool polygon_raster::save(const std::string &path) const {
+
+    raster_file_header header;
+    memset(&header, 0, sizeof(raster_file_header));
+    memcpy(header.magic, RASTER_MAGIC, sizeof(RASTER_MAGIC));
+    header.version = RASTER_VERSION;
+    header.byte_order = RASTER_BYTE_ORDER;
+    header.nx = nx;
+    header.ny = ny;
+    header.refine = refine;
+    header.geometry_nx = geometry.nx;
+    header.geometry_ny = geometry.ny;
+    header.x0 = x0;
+    header.y0 = y0;
+    header.cell_w = cell_w;
+    header.cell_h = cell_h;
+    header.geometry_x0 = geometry.x0;
+    header.geometry_y0 = geometry.y0;
+    header.geometry_cell_w = geometry.cell_w;
+    header.geometry_cell_h = geometry.cell_h;
+
+    FILE *fp = fopen(path.c_str(), "wb");
+    if(!fp) {
+      log_error("couldn't create polygon raster: %s\n", path.c_str());
+      return(false);
+    }
+
+    bool status = (io_fwrite(&header, sizeof(raster_file_header), 1, fp) == 1) &&
+      write_array(fp, cells) && write_array(fp, sub_cells) && write_array(fp, lists) &&
+      write_array(fp, geometry.xy) && write_array(fp, geometry.ring_starts) && write_array(fp, geometry.polygon_rings) &&
+      write_array(fp, geometry.bboxes) && write_array(fp, geometry.cell_starts) && write_array(fp, geometry.cell_ids);
+    status = (fclose(fp) == 0) && status;
+
+    if(!status) {
+      log_error("couldn't write polygon raster: %s\n", path.c_str());
+    }
+    return(status);
+  }
+
+
+  static bool valid_code(uint32_t code, bool sub, uint64_t polygons, uint64_t blocks, const std::vector<uint32_t> &lists) {
+
+    if(code == polygon_raster::OUTSIDE) {
+      return(true);
+    }
+
+    uint32_t value = code & ~polygon_raster::TAG_MASK;
+    switch(code & polygon_raster::TAG_MASK) {
+    case 0:
+      return(value < polygons);
+    case polygon_raster::REFINED:
+      return(!sub && (value < blocks));
+    case polygon_raster::BOUNDARY:
+      if((value >= lists.size()) || (lists[value] > (lists.size() - value - 1))) {
+	return(false);
+      }
+      for(uint32_t idx=1; idx <= lists[value]; ++idx) {
+	if(lists[value + idx] >= polygons) {
+	  return(false);
+	}
+      }
+      return(true);
+    }
+
+    return(false);
+  }
+
+
+  //
+  // a file that fails these checks could make find() read out of bounds
+  //
+  static bool valid_raster(const polygon_raster &raster) {
+
+    const polygon_index &geom = raster.geometry;
+    uint64_t polygons = geom.bboxes.size() / 4;
+    if(((geom.bboxes.size() % 4) != 0) || (geom.polygon_rings.size() != (polygons + 1)) || geom.ring_starts.empty() ||
+       ((geom.xy.size() % 2) != 0) || (geom.polygon_rings[0] != 0) || (geom.ring_starts[0] != 0)) {
+      return(false);
+    }
+
+    for(size_t idx=1; idx < geom.polygon_rings.size(); ++idx) {
+      if((geom.polygon_rings[idx] < geom.polygon_rings[idx - 1]) || (geom.polygon_rings[idx] >= geom.ring_starts.size())) {
+	return(false);
+      }
+    }
+
+    for(size_t idx=1; idx < geom.ring_starts.size(); ++idx) {
+      if((geom.ring_starts[idx] < geom.ring_starts[idx - 1]) || (geom.ring_starts[idx] > (geom.xy.size() / 2))) {
+	return(false);
+      }
+    }
+
+    if(geom.nx != 0) {
+      if((geom.cell_starts.size() != (((size_t) geom.nx * geom.ny) + 1)) || (geom.cell_starts[0] != 0) ||
+	 (geom.cell_starts.back() != geom.cell_ids.size())) {
+	return(false);
+      }
+      for(size_t idx=1; idx < geom.cell_starts.size(); ++idx) {
+	if(geom.cell_starts[idx] < geom.cell_starts[idx - 1]) {
+	  return(false);
+	}
+      }
+      for(uint32_t id : geom.cell_ids) {
+	if(id >= polygons) {
+	  return(false);
+	}
+      }
+    }
+
+    if(raster.cells.size() != ((size_t) raster.nx * raster.ny)) {
+      return(false);
+    }
+
+    uint64_t block_cells = (uint64_t) raster.refine * raster.refine;
+    if((raster.refine == 1) || (raster.refine > 256) || (block_cells ? ((raster.sub_cells.size() % block_cells) != 0) : !raster.sub_cells.empty())) {
+      return(false);
+    }
+
+    uint64_t blocks = block_cells ? (raster.sub_cells.size() / block_cells) : 0;
+    for(uint32_t code : raster.cells) {
+      if(!valid_code(code, false, polygons, blocks, raster.lists)) {
+	return(false);
+      }
+    }
+    for(uint32_t code : raster.sub_cells) {
+      if(!valid_code(code, true, polygons, blocks, raster.lists)) {
+	return(false);
+      }
+    }
+
+    return(true);
+  }
+
+
+  bool polygon_raster::load(const std::string &path) {
+
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(!fp) {
+      log_error("couldn't open polygon raster: %s\n", path.c_str());
+      return(false);
+    }
+
+    raster_file_header header;
+    uint64_t remaining = 0;
+    bool status = (fseek(fp, 0, SEEK_END) == 0);
+    if(status) {
+      long size = ftell(fp);
+      status = (size >= (long) sizeof(raster_file_header)) && (fseek(fp, 0, SEEK_SET) == 0) &&
+	(io_fread(&header, sizeof(raster_file_header), 1, fp) == 1);
+      remaining = status ? (size - sizeof(raster_file_header)) : 0;
+    }
+
+    if(status && ((memcmp(header.magic, RASTER_MAGIC, sizeof(RASTER_MAGIC)) != 0) || (header.version != RASTER_VERSION) ||
+		  (header.byte_order != RASTER_BYTE_ORDER))) {
+      log_error("not a polygon raster for this build: %s\n", path.c_str());
+      fclose(fp);
+      return(false);
+    }
+
+    status = status && read_array(fp, remaining, cells) && read_array(fp, remaining, sub_cells) && read_array(fp, remaining, lists) &&
+      read_array(fp, remaining, geometry.xy) && read_array(fp, remaining, geometry.ring_starts) &&
+      read_array(fp, remaining, geometry.polygon_rings) && read_array(fp, remaining, geometry.bboxes) &&
+      read_array(fp, remaining, geometry.cell_starts) && read_array(fp, remaining, geometry.cell_ids);
+    fclose(fp);
+
+    if(status) {
+      nx = header.nx;
+      ny = header.ny;
+      refine = header.refine;
+      x0 = header.x0;
+      y0 = header.y0;
+      cell_w = header.cell_w;
+      cell_h = header.cell_h;
+      geometry.nx = header.geometry_nx;
+      geometry.ny = header.geometry_ny;
+      geometry.x0 = header.geometry_x0;
+      geometry.y0 = header.geometry_y0;
+      geometry.cell_w = header.geometry_cell_w;
+      geometry.cell_h = header.geometry_cell_h;
+      status = valid_raster(*this);
+    }
+
+    if(!status) {
+      log_error("couldn't read polygon raster: %s\n", path.c_str());
+      cells.clear();
+      sub_cells.clear();
+      lists.clear();
+      nx = ny = 0;
+      geometry = polygon_index();
+      return(false);
+    }
+
+    return(true);
+  }
+
+} // namespace shputil
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include "shputil.h"
+#include "shpjoin.h"
+
+namespace shputil {
+
+  //
+  // a polygon layer rasterized for repeated containment lookups. every cell of a coarse
+  // grid is classified as outside, inside one polygon, or boundary (some ring crosses
+  // it). boundary cells are split once more into refine x refine sub-cells with the same
+  // classes. a boundary (sub-)cell keeps its candidate polygons and find() runs the exact
+  // test against those only, everything else is answered from the cell code.
+  //
+  // cells bounds the memory (4 bytes per cell), refine trades more memory on the
+  // boundaries for fewer exact tests. results match polygon_index::find(), including
+  // the lowest index winning where polygons overlap.
+  //
+  class raster_opts {
+  public:
+    raster_opts() { cells = 1 << 20; refine = 8; }
+    uint32_t cells;   // coarse cells, about
+    uint32_t refine;  // sub-cells per side of a boundary cell, < 2 = no refinement
+  };
+
+  class polygon_raster {
+  public:
+    polygon_raster() { nx = ny = 0; refine = 0; x0 = y0 = 0.0; cell_w = cell_h = 1.0; }
+    bool build(const shapefile &polygons, const raster_opts &opts = raster_opts());
+    int32_t find(double x, double y) const; // polygon index, -1 if none
+    bool save(const std::string &path) const;
+    bool load(const std::string &path);
+    uint64_t memory_bytes() const;
+
+    //
+    // cell codes: OUTSIDE, a polygon index, BOUNDARY | offset into lists (count, ids...),
+    // or REFINED | sub-grid number (refine * refine codes in sub_cells)
+    //
+    static const uint32_t OUTSIDE = 0xffffffff;
+    static const uint32_t TAG_MASK = 0xc0000000;
+    static const uint32_t BOUNDARY = 0x80000000;
+    static const uint32_t REFINED = 0x40000000;
+
+    std::vector<uint32_t> cells;
+    std::vector<uint32_t> sub_cells;
+    std::vector<uint32_t> lists;
+    uint32_t nx, ny, refine;
+    double x0, y0, cell_w, cell_h;
+    polygon_index geometry; // ring coordinates for the exact test
+  };
+
+} // shputil namespace
@@ -0,0 +1,415 @@
+
+#include "shpshard.h"
+#include "logging.h"
+#include "iostats.h"
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <unistd.h>
+
+namespace shputil {
+
+  struct shard_range {
+    size_t begin;  // into the write order
+    size_t end;
+    shpinfo info;  // file_bytes and bbox of the .shp
+  };
+
+
+  static bool shp_stem(const std::string &path, std::string &stem) {
+    if((path.size() <= 4) || (path.compare(path.size() - 4, 4, ".shp") != 0)) {
+      log_error("file must have .shp extension: %s\n", path.c_str());
+      return(false);
+    }
+
+    stem = path.substr(0, path.size() - 4);
+    return(true);
+  }
+
+
+  static std::string shard_stem(const std::string &stem, uint32_t shard) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%04u", shard + 1);
+    return(stem + suffix);
+  }
+
+
+  static std::string base_name(const std::string &path) {
+    size_t slash = path.rfind('/');
+    return((slash == std::string::npos) ? path : path.substr(slash + 1));
+  }
+
+
+  bool manifest_path(const std::string &shp_path, std::string &path) {
+    std::string stem;
+    if(!shp_stem(shp_path, stem)) {
+      return(false);
+    }
+
+    path = stem + ".shards";
+    return(true);
+  }
+
+
+  //
+  // cut the ordered records into shards, a shard is closed as soon as the next record
+  // would push its .shp or .dbf past the limit
+  //
+  static bool plan_shards(const shapefile &shpfile, const std::vector<uint32_t> &order, const dbfutil::dbftable *table,
+			  uint64_t limit, std::vector<shard_range> &shards) {
+
+    shpinfo layer;
+    memset(&layer, 0, sizeof(shpinfo));
+    layer.stype = shape_type::null_shape;
+
+    uint64_t dbf_header_bytes = 0, dbf_record_bytes = 0;
+    if(table) {
+      dbf_header_bytes = 32 + (32 * (uint64_t) table->header.fields.size()) + 1 + 1; // + header terminator + 0x1A
+      dbf_record_bytes = 1;
+      for(const dbfutil::dbffield_def &field : table->header.fields) {
+	dbf_record_bytes += field.field_length;
+      }
+    }
+
+    shards.clear();
+    shard_range shard;
+    shard.begin = shard.end = 0;
+    shard.info = layer;
+    shard.info.file_bytes = SHP_HEADER_BYTES;
+    uint64_t dbf_bytes = dbf_header_bytes;
+    bool first = true;
+
+    for(size_t pos=0; pos < order.size(); ++pos) {
+      const shape_ptr &shp = shpfile.shapes[order[pos]];
+      shape_type st = shp->stype();
+      uint64_t content_bytes = encoded_content_bytes(shp);
+      if(content_bytes == 0) {
+	log_error("unsupported shape_type: %d\n", (int) st);
+	return(false);
+      }
+
+      if(st != shape_type::null_shape) {
+	if((layer.stype != shape_type::null_shape) && (st != layer.stype)) {
+	  log_error("found multiple shape types...\n");
+	  return(false);
+	}
+	layer.stype = st;
+      }
+
+      uint64_t record_bytes = SHP_RECORD_HEADER_BYTES + content_bytes;
+      if(((SHP_HEADER_BYTES + record_bytes) > limit) || ((dbf_header_bytes + dbf_record_bytes) > limit)) {
+	log_error("record %u alone is larger than max_shard_bytes\n", order[pos]);
+	return(false);
+      }
+
+      if((shard.end > shard.begin) &&
+	 (((shard.info.file_bytes + record_bytes) > limit) || (table && ((dbf_bytes + dbf_record_bytes) > limit)))) {
+	shards.push_back(shard);
+	shard.begin = pos;
+	shard.info.file_bytes = SHP_HEADER_BYTES;
+	dbf_bytes = dbf_header_bytes;
+	first = true;
+      }
+
+      shard.end = pos + 1;
+      shard.info.file_bytes += record_bytes;
+      dbf_bytes += dbf_record_bytes;
+
+      double xmin, ymin, xmax, ymax;
+      if(!shape_bounds(shp, xmin, ymin, xmax, ymax)) {
+	continue;
+      }
+      if(first || (xmin < shard.info.xmin)) shard.info.xmin = xmin;
+      if(first || (ymin < shard.info.ymin)) shard.info.ymin = ymin;
+      if(first || (xmax > shard.info.xmax)) shard.info.xmax = xmax;
+      if(first || (ymax > shard.info.ymax)) shard.info.ymax = ymax;
+      first = false;
+    }
+
+    shards.push_back(shard); // an empty layer still gets one (empty) shard
+    for(shard_range &range : shards) {
+      range.info.stype = layer.stype;
+    }
+
+    return(true);
+  }
+
+
+  static bool write_shard(const std::string &stem, const shapefile &shpfile, const std::vector<uint32_t> &order,
+			  const dbfutil::dbftable *table, const shard_range &shard) {
+
+    std::string shppath = stem + ".shp", shxpath = stem + ".shx";
+    FILE *fp = fopen(shppath.c_str(), "wb");
+    if(!fp) {
+      log_error("couldn't create shapefile: %s\n", shppath.c_str());
+      return(false);
+    }
+
+    FILE *shxfp = fopen(shxpath.c_str(), "wb");
+    if(!shxfp) {
+      log_error("couldn't create shx index file: %s\n", shxpath.c_str());
+      fclose(fp);
+      return(false);
+    }
+
+    size_t count = shard.end - shard.begin;
+    uint8_t header[SHP_HEADER_BYTES];
+    shpinfo shxinfo = shard.info;
+    shxinfo.file_bytes = SHP_HEADER_BYTES + (SHP_RECORD_HEADER_BYTES * (uint64_t) count);
+    encode_shp_header(shard.info, header);
+    bool status = (io_fwrite(header, SHP_HEADER_BYTES, 1, fp) == 1);
+    encode_shp_header(shxinfo, header);
+    status = status && (io_fwrite(header, SHP_HEADER_BYTES, 1, shxfp) == 1);
+
+    {
+      io_phase_timer timer(io_phase::records);
+      std::vector<uint8_t> record;
+      std::vector<uint64_t> offsets, content_bytes;
+      uint64_t offset = SHP_HEADER_BYTES;
+      for(size_t pos=shard.begin; status && (pos < shard.end); ++pos) {
+	const shape_ptr &shp = shpfile.shapes[order[pos]];
+	content_bytes.push_back(encoded_content_bytes(shp));
+	offsets.push_back(offset);
+	record.resize(SHP_RECORD_HEADER_BYTES + content_bytes.back());
+	if(!encode_record(shp, (int32_t) (pos - shard.begin + 1), record.data()) ||
+	   (io_fwrite(record.data(), record.size(), 1, fp) != 1)) {
+	  log_error("couldn't write record %u to %s\n", order[pos], shppath.c_str());
+	  status = false;
+	  break;
+	}
+	offset += record.size();
+      }
+
+      if(status && !write_shx(shxfp, offsets, content_bytes)) {
+	log_error("couldn't write %s\n", shxpath.c_str());
+	status = false;
+      }
+    }
+
+    status = (fclose(fp) == 0) && status;
+    status = (fclose(shxfp) == 0) && status;
+    if(!status || !table) {
+      return(status);
+    }
+
+    dbfutil::dbfwriter dbf;
+    if(!dbf.create(stem + ".dbf", table->header)) {
+      return(false);
+    }
+
+    for(size_t pos=shard.begin; pos < shard.end; ++pos) {
+      if(!dbf.write(*table, order[pos])) {
+	return(false);
+      }
+    }
+
+    return(dbf.close());
+  }
+
+
+  static void remove_shard(const std::string &stem) {
+    unlink((stem + ".shp").c_str());
+    unlink((stem + ".shx").c_str());
+    unlink((stem + ".dbf").c_str());
+  }
+
+
+  static std::string staging_stem(const std::string &stem, uint32_t shard) {
+    return(shard_stem(stem, shard) + ".tmp"); // name_0001.tmp.shp, ...
+  }
+
+
+  //
+  // every shard is written under a staging name first and renamed over the old one only
+  // once all of them are complete, so a failed write leaves the previous shards and
+  // manifest untouched. each file the manifest names is always complete, but a reader
+  // opening the layer during the renames can get some shards old and some new.
+  //
+  static bool publish_shards(const std::string &stem, size_t count, bool with_dbf) {
+
+    bool status = true;
+    for(uint32_t shard=0; status && (shard < count); ++shard) {
+      std::string from = staging_stem(stem, shard), to = shard_stem(stem, shard);
+      status = (rename((from + ".shp").c_str(), (to + ".shp").c_str()) == 0) &&
+	(rename((from + ".shx").c_str(), (to + ".shx").c_str()) == 0) &&
+	(!with_dbf || (rename((from + ".dbf").c_str(), (to + ".dbf").c_str()) == 0));
+      if(status && !with_dbf) {
+	unlink((to + ".dbf").c_str()); // a dbf from an earlier write would pair with the wrong records
+      }
+      if(!status) {
+	log_error("couldn't move shard %s into place\n", to.c_str());
+      }
+    }
+
+    for(uint32_t shard=0; shard < count; ++shard) {
+      remove_shard(staging_stem(stem, shard)); // whatever didn't get renamed
+    }
+
+    return(status);
+  }
+
+
+  static bool write_manifest(const std::string &path, const std::vector<std::string> &shard_paths) {
+
+    //
+    // written next to the shards and renamed into place, after the shards it names
+    //
+
+    std::string tmppath = path + ".tmp";
+    FILE *fp = fopen(tmppath.c_str(), "w");
+    if(!fp) {
+      log_error("couldn't create shard manifest: %s\n", tmppath.c_str());
+      return(false);
+    }
+
+    bool status = (fprintf(fp, "# shpdbf shards %zu\n", shard_paths.size()) > 0);
+    for(const std::string &shard : shard_paths) {
+      status = status && (fprintf(fp, "%s\n", base_name(shard).c_str()) > 0);
+    }
+
+    status = (fclose(fp) == 0) && status;
+    if(!status || (rename(tmppath.c_str(), path.c_str()) != 0)) {
+      log_error("couldn't write shard manifest: %s\n", path.c_str());
+      unlink(tmppath.c_str());
+      return(false);
+    }
+
+    return(true);
+  }
+
+
+  bool write_sharded(const std::string &path, const shapefile &shpfile, const dbfutil::dbftable *table,
+		     const shard_opts &opts, std::vector<std::string> &shard_paths) {
+
+    shard_paths.clear();
+
+    std::string stem, manifest;
+    if(!shp_stem(path, stem) || !manifest_path(path, manifest)) {
+      return(false);
+    }
+
+    if(table && (table->rows.size() != shpfile.shapes.size())) {
+      log_error("dbf has %zu rows but the layer has %zu shapes\n", table->rows.size(), shpfile.shapes.size());
+      return(false);
+    }
+
+    if(shpfile.shapes.size() > UINT32_MAX) {
+      log_error("too many shapes: %zu\n", shpfile.shapes.size());
+      return(false);
+    }
+
+    std::vector<uint32_t> order;
+    if(opts.spatial) {
+      hilbert_order(shpfile, order);
+    }
+    else {
+      order.resize(shpfile.shapes.size());
+      for(uint32_t idx=0; idx < order.size(); ++idx) {
+	order[idx] = idx;
+      }
+    }
+
+    uint64_t limit = std::min(opts.max_shard_bytes, (uint64_t) INT32_MAX * 2);
+    std::vector<shard_range> shards;
+    {
+      io_phase_timer timer(io_phase::bbox);
+      if(!plan_shards(shpfile, order, table, limit, shards)) {
+	return(false);
+      }
+    }
+
+    //
+    // shards are independent files, so they're written side by side
+    //
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    auto worker = [&]() {
+      for(size_t shard = next++; ok && (shard < shards.size()); shard = next++) {
+	if(!write_shard(staging_stem(stem, shard), shpfile, order, table, shards[shard])) {
+	  ok = false;
+	}
+      }
+    };
+
+    uint32_t threads = std::max(1u, std::min(opts.threads, (uint32_t) shards.size()));
+    std::vector<std::thread> pool;
+    for(uint32_t t=1; t < threads; ++t) {
+      pool.emplace_back(worker);
+    }
+    worker();
+    for(std::thread &th : pool) {
+      th.join();
+    }
+
+    if(!ok) {
+      for(uint32_t shard=0; shard < shards.size(); ++shard) {
+	remove_shard(staging_stem(stem, shard));
+      }
+      return(false);
+    }
+
+    if(!publish_shards(stem, shards.size(), table != 0)) {
+      return(false);
+    }
+
+    for(uint32_t shard=0; shard < shards.size(); ++shard) {
+      shard_paths.push_back(shard_stem(stem, shard) + ".shp");
+    }
+
+    if(!write_manifest(manifest, shard_paths)) {
+      return(false);
+    }
+
+    for(uint32_t shard=shards.size(); ; ++shard) {
+      std::string old_stem = shard_stem(stem, shard);
+      if(access((old_stem + ".shp").c_str(), F_OK) != 0) {
+	break;
+      }
+      remove_shard(old_stem);
+    }
+
+    log("write_sharded: %zu shape(s) in %zu shard(s)\n", shpfile.shapes.size(), shards.size());
+    return(true);
+  }
+
+
+  bool read_manifest(const std::string &path, std::vector<std::string> &shp_paths) {
+
+    shp_paths.clear();
+
+    FILE *fp = fopen(path.c_str(), "r");
+    if(!fp) {
+      log_error("couldn't open shard manifest: %s\n", path.c_str());
+      return(false);
+    }
+
+    size_t slash = path.rfind('/');
+    std::string directory = (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
+
+    char line[4096];
+    while(fgets(line, sizeof(line), fp)) {
+      std::string entry = line;
+      while(!entry.empty() && ((entry.back() == '\n') || (entry.back() == '\r'))) {
+	entry.pop_back();
+      }
+
+      if(entry.empty() || (entry[0] == '#')) {
+	continue;
+      }
+
+      shp_paths.push_back((entry[0] == '/') ? entry : directory + entry);
+    }
+
+    fclose(fp);
+
+    if(shp_paths.empty()) {
+      log_error("shard manifest lists no shards: %s\n", path.c_str());
+      return(false);
+    }
+
+    return(true);
+  }
+
+} // namespace shputil
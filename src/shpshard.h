@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include "shputil.h"
+#include "dbfutil.h"
+
+namespace shputil {
+
+  //
+  // layers past the single file limits (int32 word offsets in the .shp/.shx, 2 GB for
+  // most readers) go out as numbered shards name_0001.shp/.shx/.dbf, name_0002..., sized
+  // with 64-bit sums so a shard is closed before its .shp or .dbf would pass
+  // max_shard_bytes. with spatial set the records are hilbert ordered first (same order as
+  // hilbert_order()), so every shard covers a compact region and its header bbox prunes.
+  //
+  // the manifest name.shards lists the shards in order, shpdataset::open_manifest() opens
+  // them as one layer. shards left over from an earlier, larger write are removed.
+  // shards are written as name_0001.tmp.shp, ... and renamed in once every one is complete,
+  // a failed write leaves the previous shards and manifest as they were.
+  //
+  class shard_opts {
+  public:
+    shard_opts() { max_shard_bytes = 0x7fffffff; spatial = false; threads = 4; }
+    uint64_t max_shard_bytes; // per .shp and per .dbf, capped at the format limit
+    bool spatial;
+    uint32_t threads;         // shards written at once
+  };
+
+  bool write_sharded(const std::string &path, const shapefile &shpfile, const dbfutil::dbftable *table, // table may be null
+		     const shard_opts &opts, std::vector<std::string> &shard_paths);
+  bool manifest_path(const std::string &shp_path, std::string &path);
+  bool read_manifest(const std::string &path, std::vector<std::string> &shp_paths); // relative entries resolve against the manifest's directory
+
+} // shputil namespace
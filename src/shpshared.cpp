@@ -0,0 +1,99 @@
+
+#include "shpshared.h"
+#include "shpasync.h"
+#include "logging.h"
+#include "iostats.h"
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace shputil {
+
+  static std::atomic<uint32_t> next_layer_id(1);
+
+  
+  shared_shapefile::shared_shapefile() {
+    fd = -1;
+    layer_id = 0;
+  }
+
+
+  shared_shapefile::~shared_shapefile() {
+    close();
+  }
+
+  
+  bool shared_shapefile::open(const std::string &path) {
+
+    close();
+
+    if(!read_shp_info(path, info) || !read_shx(path, index)) {
+      return(false);
+    }
+
+    if(xy_type(info.stype) == shape_type::null_shape) {
+      log_error("unsupported shape_type: %d\n", (int) info.stype);
+      index.clear();
+      return(false);
+    }
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+      log_error("couldn't open shapefile: %s\n", path.c_str());
+      index.clear();
+      return(false);
+    }
+
+#ifdef POSIX_FADV_RANDOM
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+
+    layer_id = next_layer_id++;
+
+    return(true);
+  }
+
+
+  void shared_shapefile::close() {
+    if(fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+
+    index.clear();
+    layer_id = 0;
+  }
+
+
+  bool shp_cursor::read_raw(uint32_t recno, const uint8_t *&content, uint32_t &content_bytes) {
+
+    if((layer.fd < 0) || (recno >= layer.index.size())) {
+      log_error("record %u out of range\n", recno);
+      return(false);
+    }
+
+    const shx_entry &entry = layer.index[recno];
+    if(!read_record_content(layer.fd, entry, buf)) {
+      return(false);
+    }
+
+    content = buf.data() + SHP_RECORD_HEADER_BYTES;
+    content_bytes = entry.content_bytes;
+    return(true);
+  }
+
+  
+  bool shp_cursor::read(uint32_t recno, shape_ptr &shp) {
+
+    const uint8_t *content = 0;
+    uint32_t content_bytes = 0;
+    if(!read_raw(recno, content, content_bytes) ||
+       !decode_shape(content, content_bytes, shp)) {
+      return(false);
+    }
+
+    io_stats_add(io_counter::records_decoded, 1);
+    return(true);
+  }
+
+} // namespace shputil
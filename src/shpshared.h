@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include "shputil.h"
+
+namespace shputil {
+
+  //
+  // one open layer shared by any number of threads. it's immutable once open() returns:
+  // the .shx offsets and header are read up front and records are fetched with pread on
+  // a single descriptor, so there is no file position or lock to share. each thread
+  // reads through its own shp_cursor, which owns the only mutable state (the buffer).
+  //
+  //   shared_shapefile layer;             // once, at startup
+  //   layer.open("roads.shp");
+  //   shp_cursor cursor(layer);           // per thread, cheap
+  //   cursor.read(recno, shp);
+  //
+  class shared_shapefile {
+  public:
+    shared_shapefile();
+    ~shared_shapefile();
+    bool open(const std::string &path);
+    void close(); // not while cursors are reading
+    uint32_t record_count() const { return(index.size()); }
+
+    shpinfo info;
+    std::vector<shx_entry> index;
+    int fd;
+    uint32_t layer_id; // unique per open(), keys caches (shpcache.h)
+
+  private:
+    shared_shapefile(const shared_shapefile &);
+    shared_shapefile &operator=(const shared_shapefile &);
+  };
+
+  class shp_cursor {
+  public:
+    shp_cursor(const shared_shapefile &layer) : layer(layer) { }
+    bool read(uint32_t recno, shape_ptr &shp); // recno is the 0-based record index
+    bool read_raw(uint32_t recno, const uint8_t *&content, uint32_t &content_bytes); // valid until the next read
+
+    const shared_shapefile &layer;
+    std::vector<uint8_t> buf;
+  };
+
+} // shputil namespace
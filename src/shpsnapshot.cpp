@@ -0,0 +1,523 @@
+#include "shpsnapshot.h"
+#include "dbfutil.h"
+#include "logging.h"
+#include "iostats.h"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace shputil {
+
+  static const char SNAPSHOT_MAGIC[8] = { 'S', 'H', 'P', 'S', 'N', 'A', 'P', '1' };
+  static const uint32_t SNAPSHOT_VERSION = 3; // 2: mtimes in nanoseconds, 3: .shx stamp
+  static const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304; // written natively, catches foreign-endian files
+  static const uint64_t SNAPSHOT_ALIGN = 8;
+
+  struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t shape_type;
+    uint32_t field_count;
+    uint64_t record_count;
+    uint64_t part_count;
+    uint64_t point_count;
+    uint64_t shp_bytes;   // source validation
+    int64_t shp_mtime;    // nanoseconds
+    uint64_t shx_bytes;
+    int64_t shx_mtime;
+    uint64_t dbf_bytes;
+    int64_t dbf_mtime;
+    uint64_t record_parts_offset;
+    uint64_t part_points_offset;
+    uint64_t coords_offset;
+    uint64_t bboxes_offset;
+    uint64_t validity_offset;
+    uint64_t fields_offset;
+  };
+
+
+  static bool stat_source(const std::string &path, uint64_t &bytes, int64_t &mtime) {
+    bytes = 0;
+    mtime = 0;
+    if(path.empty()) {
+      return(true);
+    }
+
+    return(dbfutil::file_stamp(path, bytes, mtime));
+  }
+
+
+  static bool write_section(FILE *fp, uint64_t &position, const void *data, uint64_t nbytes, uint64_t &offset) {
+
+    static const uint8_t zeros[SNAPSHOT_ALIGN] = { 0 };
+    uint64_t pad = (SNAPSHOT_ALIGN - (position % SNAPSHOT_ALIGN)) % SNAPSHOT_ALIGN;
+    if(pad && (io_fwrite(zeros, pad, 1, fp) != 1)) {
+      return(false);
+    }
+
+    position += pad;
+    offset = position;
+    if(nbytes && (io_fwrite(data, nbytes, 1, fp) != 1)) {
+      return(false);
+    }
+
+    position += nbytes;
+    return(true);
+  }
+
+
+  static void append_points(const uint8_t *points, uint32_t count, std::vector<double> &chunk, double *bbox, bool &first) {
+
+    for(uint32_t pt=0; pt < count; ++pt) {
+      double x = load_LEdouble(points + (16 * (size_t) pt));
+      double y = load_LEdouble(points + (16 * (size_t) pt) + sizeof(double));
+      chunk.push_back(x);
+      chunk.push_back(y);
+      if(first || (x < bbox[0])) bbox[0] = x;
+      if(first || (y < bbox[1])) bbox[1] = y;
+      if(first || (x > bbox[2])) bbox[2] = x;
+      if(first || (y > bbox[3])) bbox[3] = y;
+      first = false;
+    }
+  }
+
+
+  bool read_snapshot_columns(const std::string &dbf_path, uint64_t record_count, std::vector<uint8_t> &validity, std::vector<snapshot_field> &fields,
+			     std::vector<std::vector<uint8_t> > &column_data, std::vector<std::vector<char> > &column_chars) {
+
+    validity.assign((record_count + 7) / 8, 0xff);
+    fields.clear();
+    column_data.clear();
+    column_chars.clear();
+
+    if(!dbf_path.empty()) {
+      dbfutil::dbfreader reader;
+      if(!reader.open(dbf_path)) {
+	return(false);
+      }
+
+      if(reader.record_count != record_count) {
+	log_error("dbf has %u rows but the shapefile has %llu records\n", reader.record_count, (unsigned long long) record_count);
+	return(false);
+      }
+
+      size_t nfields = reader.header.fields.size();
+      fields.resize(nfields);
+      column_data.resize(nfields);
+      column_chars.resize(nfields);
+      std::vector<std::vector<int32_t> > string_offsets(nfields, std::vector<int32_t>(1, 0));
+      for(size_t col=0; col < nfields; ++col) {
+	const dbfutil::dbffield_def &fdef = reader.header.fields[col];
+	memset(&fields[col], 0, sizeof(snapshot_field));
+	snprintf(fields[col].name, sizeof(fields[col].name), "%.11s", fdef.field_name.c_str());
+	fields[col].type = ((fdef.field_type == "N") || (fdef.field_type == "F")) ? fdef.field_type[0] : 'C';
+	fields[col].length = fdef.field_length;
+	fields[col].decimals = fdef.field_decimal_count;
+	if(fields[col].type != 'C') {
+	  column_data[col].resize(8 * record_count, 0);
+	}
+      }
+
+      dbfutil::dbfrow row;
+      for(uint32_t recno=0; recno < reader.record_count; ++recno) {
+	bool deleted = false;
+	if(!reader.read(recno, row, deleted)) {
+	  return(false);
+	}
+
+	if(deleted) {
+	  validity[recno >> 3] &= ~(1 << (recno & 7));
+	}
+
+	for(size_t col=0; col < nfields; ++col) {
+	  if(fields[col].type == 'C') {
+	    if(!deleted) {
+	      const std::pmr::string &str = row.values[col].value;
+	      column_chars[col].insert(column_chars[col].end(), str.begin(), str.end());
+	    }
+	    if(column_chars[col].size() > (size_t) INT32_MAX) { // offsets are arrow utf8's int32
+	      log_error("field %s has more than 2GB of text\n", fields[col].name);
+	      return(false);
+	    }
+	    string_offsets[col].push_back(column_chars[col].size());
+	    continue;
+	  }
+
+	  if(deleted) {
+	    continue;
+	  }
+
+	  const dbfutil::dbffield_value &val = row.values[col];
+	  uint8_t *dst = column_data[col].data() + (8 * (size_t) recno);
+	  if(fields[col].type == 'N') {
+	    int64_t ival = (val._vtype == dbfutil::dbffield_value::vtype::sint) ? val._s32_val : val._u32_val;
+	    memcpy(dst, &ival, sizeof(int64_t));
+	  }
+	  else {
+	    memcpy(dst, &val._dbl_val, sizeof(double));
+	  }
+	}
+      }
+
+      for(size_t col=0; col < nfields; ++col) {
+	if(fields[col].type == 'C') {
+	  std::vector<int32_t> &offsets = string_offsets[col];
+	  column_data[col].resize(offsets.size() * sizeof(int32_t));
+	  memcpy(column_data[col].data(), offsets.data(), column_data[col].size());
+	}
+      }
+    }
+
+    return(true);
+  }
+
+
+  bool write_snapshot(const std::string &snapshot_path, const std::string &shp_path, const std::string &dbf_path) {
+
+    snapshot_header header;
+    memset(&header, 0, sizeof(snapshot_header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+
+    std::string shxpath;
+    if(!shx_path(shp_path, shxpath) ||
+       !stat_source(shp_path, header.shp_bytes, header.shp_mtime) ||
+       !stat_source(shxpath, header.shx_bytes, header.shx_mtime) ||
+       !stat_source(dbf_path, header.dbf_bytes, header.dbf_mtime)) {
+      return(false);
+    }
+
+    shpinfo info;
+    std::vector<shx_entry> index;
+    if(!read_shp_info(shp_path, info) || !read_shx(shp_path, index)) {
+      return(false);
+    }
+    header.shape_type = (uint32_t) info.stype;
+    header.record_count = index.size();
+
+    //
+    // attributes first: one typed array per column, aligned with the shp records
+    //
+    std::vector<uint8_t> validity;
+    std::vector<snapshot_field> fields;
+    std::vector<std::vector<uint8_t> > column_data;
+    std::vector<std::vector<char> > column_chars;
+    if(!read_snapshot_columns(dbf_path, index.size(), validity, fields, column_data, column_chars)) {
+      return(false);
+    }
+
+    header.field_count = fields.size();
+
+    FILE *fp = fopen(shp_path.c_str(), "rb");
+    if(!fp) {
+      log_error("couldn't open shapefile: %s\n", shp_path.c_str());
+      return(false);
+    }
+
+    //
+    // written to a private temp file and renamed over the target, so a process with the
+    // old snapshot mapped keeps its pages and concurrent builders never interleave
+    //
+    std::string tmppath = snapshot_path + ".tmp.XXXXXX";
+    int tmpfd = mkstemp(&tmppath[0]);
+    FILE *out = (tmpfd >= 0) ? fdopen(tmpfd, "wb") : 0;
+    if(!out) {
+      log_error("couldn't create snapshot: %s\n", tmppath.c_str());
+      if(tmpfd >= 0) {
+	::close(tmpfd);
+	unlink(tmppath.c_str());
+      }
+      fclose(fp);
+      return(false);
+    }
+    fchmod(tmpfd, 0644); // mkstemp creates 0600
+
+    //
+    // geometry: coordinates go straight to the file as the first section, a chunk at a
+    // time, only the per-record and per-part offsets and the bboxes stay in memory
+    //
+    const size_t CHUNK_DOUBLES = 1 << 17;
+    std::vector<int32_t> record_parts(1, 0);
+    std::vector<int32_t> part_points(1, 0);
+    std::vector<double> bboxes(4 * index.size(), 0.0);
+    std::vector<double> chunk;
+    std::vector<uint8_t> content;
+    uint64_t point_count = 0;
+    uint64_t position = sizeof(snapshot_header);
+    header.coords_offset = position;
+    bool status = (fseek(out, position, SEEK_SET) == 0);
+    for(size_t recno=0; status && (recno < index.size()); ++recno) {
+      const shx_entry &entry = index[recno];
+      content.resize(entry.content_bytes);
+      parts_view view;
+      if((fseek(fp, entry.offset + SHP_RECORD_HEADER_BYTES, SEEK_SET) != 0) ||
+	 (io_fread(content.data(), entry.content_bytes, 1, fp) != 1) ||
+	 !parse_record_parts(content.data(), entry.content_bytes, view)) {
+	log_error("couldn't read record %zu for the snapshot\n", recno);
+	status = false;
+	break;
+      }
+
+      if((point_count + view.numpoints) > (uint64_t) INT32_MAX) {
+	log_error("too many points for a snapshot (int32 offsets)\n");
+	status = false;
+	break;
+      }
+
+      double *bbox = &bboxes[4 * recno];
+      bool first = true;
+      for(uint32_t part=0; part < view.numparts; ++part) {
+	append_points(view.part_points(part), view.part_end(part) - view.part_start(part), chunk, bbox, first);
+	part_points.push_back(point_count + view.part_end(part));
+      }
+      point_count += view.numparts ? view.numpoints : 0;
+      record_parts.push_back(part_points.size() - 1);
+
+      if(chunk.size() >= CHUNK_DOUBLES) {
+	status = (io_fwrite(chunk.data(), chunk.size() * sizeof(double), 1, out) == 1);
+	chunk.clear();
+      }
+    }
+
+    fclose(fp);
+    status = status && (chunk.empty() || (io_fwrite(chunk.data(), chunk.size() * sizeof(double), 1, out) == 1));
+    position += point_count * 2 * sizeof(double);
+    header.part_count = part_points.size() - 1;
+    header.point_count = point_count;
+
+    //
+    // header goes last once every section offset is known
+    //
+    status = status && write_section(out, position, record_parts.data(), record_parts.size() * sizeof(int32_t), header.record_parts_offset);
+    status = status && write_section(out, position, part_points.data(), part_points.size() * sizeof(int32_t), header.part_points_offset);
+    status = status && write_section(out, position, bboxes.data(), bboxes.size() * sizeof(double), header.bboxes_offset);
+    status = status && write_section(out, position, validity.data(), validity.size(), header.validity_offset);
+    for(size_t col=0; status && (col < fields.size()); ++col) {
+      status = write_section(out, position, column_data[col].data(), column_data[col].size(), fields[col].data_offset);
+      if(status && (fields[col].type == 'C')) {
+	fields[col].chars_bytes = column_chars[col].size();
+	status = write_section(out, position, column_chars[col].data(), column_chars[col].size(), fields[col].chars_offset);
+      }
+    }
+    status = status && write_section(out, position, fields.data(), fields.size() * sizeof(snapshot_field), header.fields_offset);
+    status = status && (fseek(out, 0, SEEK_SET) == 0) && (io_fwrite(&header, sizeof(snapshot_header), 1, out) == 1);
+    status = status && (fflush(out) == 0) && (fsync(tmpfd) == 0);
+    status = (fclose(out) == 0) && status;
+    status = status && (rename(tmppath.c_str(), snapshot_path.c_str()) == 0);
+
+    if(!status) {
+      log_error("error while writing the snapshot...\n");
+      unlink(tmppath.c_str());
+    }
+
+    return(status);
+  }
+
+
+  layer_snapshot::layer_snapshot() {
+    base = 0;
+    mapped_bytes = 0;
+    fd = -1;
+  }
+
+
+  layer_snapshot::~layer_snapshot() {
+    close();
+  }
+
+
+  static const snapshot_header &header_of(const uint8_t *base) {
+    return(*(const snapshot_header *) base);
+  }
+
+
+  static bool section_fits(uint64_t offset, uint64_t nbytes, uint64_t mapped_bytes) {
+    return((offset <= mapped_bytes) && (nbytes <= (mapped_bytes - offset)));
+  }
+
+
+  bool layer_snapshot::open(const std::string &snapshot_path, const std::string &shp_path, const std::string &dbf_path) {
+
+    close();
+
+    fd = ::open(snapshot_path.c_str(), O_RDONLY);
+    if(fd < 0) {
+      return(false);
+    }
+
+    struct stat st;
+    if((fstat(fd, &st) != 0) || (st.st_size < (off_t) sizeof(snapshot_header))) {
+      close();
+      return(false);
+    }
+
+    void *ptr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(ptr == MAP_FAILED) {
+      log_error("couldn't mmap snapshot: %s\n", snapshot_path.c_str());
+      close();
+      return(false);
+    }
+
+    base = (const uint8_t *) ptr;
+    mapped_bytes = st.st_size;
+
+    const snapshot_header &header = header_of(base);
+    if((memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) ||
+       (header.version != SNAPSHOT_VERSION) || (header.byte_order != SNAPSHOT_BYTE_ORDER)) {
+      log_warn("not a usable snapshot (magic/version/byte order): %s\n", snapshot_path.c_str());
+      close();
+      return(false);
+    }
+
+    std::string shxpath;
+    uint64_t shp_bytes = 0, shx_bytes = 0, dbf_bytes = 0;
+    int64_t shp_mtime = 0, shx_mtime = 0, dbf_mtime = 0;
+    if(!shx_path(shp_path, shxpath) || !stat_source(shp_path, shp_bytes, shp_mtime) ||
+       !stat_source(shxpath, shx_bytes, shx_mtime) || !stat_source(dbf_path, dbf_bytes, dbf_mtime) ||
+       (shp_bytes != header.shp_bytes) || (shp_mtime != header.shp_mtime) ||
+       (shx_bytes != header.shx_bytes) || (shx_mtime != header.shx_mtime) ||
+       (dbf_bytes != header.dbf_bytes) || (dbf_mtime != header.dbf_mtime)) {
+      log_warn("snapshot is stale: %s\n", snapshot_path.c_str());
+      close();
+      return(false);
+    }
+
+    bool fits =
+      section_fits(header.record_parts_offset, (header.record_count + 1) * sizeof(int32_t), mapped_bytes) &&
+      section_fits(header.part_points_offset, (header.part_count + 1) * sizeof(int32_t), mapped_bytes) &&
+      section_fits(header.coords_offset, header.point_count * 2 * sizeof(double), mapped_bytes) &&
+      section_fits(header.bboxes_offset, header.record_count * 4 * sizeof(double), mapped_bytes) &&
+      section_fits(header.validity_offset, (header.record_count + 7) / 8, mapped_bytes) &&
+      section_fits(header.fields_offset, header.field_count * sizeof(snapshot_field), mapped_bytes);
+
+    for(uint32_t col=0; fits && (col < header.field_count); ++col) {
+      const snapshot_field &fld = field(col);
+      if(fld.type == 'C') {
+	fits = section_fits(fld.data_offset, (header.record_count + 1) * sizeof(int32_t), mapped_bytes) &&
+	  section_fits(fld.chars_offset, fld.chars_bytes, mapped_bytes);
+      }
+      else {
+	fits = section_fits(fld.data_offset, header.record_count * 8, mapped_bytes);
+      }
+    }
+
+    if(!fits) {
+      log_error("truncated or corrupt snapshot: %s\n", snapshot_path.c_str());
+      close();
+      return(false);
+    }
+
+    return(true);
+  }
+
+
+  void layer_snapshot::close() {
+    if(base) {
+      munmap((void *) base, mapped_bytes);
+      base = 0;
+      mapped_bytes = 0;
+    }
+
+    if(fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+
+  shputil::shape_type layer_snapshot::stype() const { return((shputil::shape_type) header_of(base).shape_type); }
+  uint64_t layer_snapshot::record_count() const { return(header_of(base).record_count); }
+  uint64_t layer_snapshot::part_count() const { return(header_of(base).part_count); }
+  uint64_t layer_snapshot::point_count() const { return(header_of(base).point_count); }
+  const int32_t *layer_snapshot::record_parts() const { return((const int32_t *) (base + header_of(base).record_parts_offset)); }
+  const int32_t *layer_snapshot::part_points() const { return((const int32_t *) (base + header_of(base).part_points_offset)); }
+  const double *layer_snapshot::coords() const { return((const double *) (base + header_of(base).coords_offset)); }
+  const double *layer_snapshot::record_bboxes() const { return((const double *) (base + header_of(base).bboxes_offset)); }
+  const uint8_t *layer_snapshot::validity() const { return(base + header_of(base).validity_offset); }
+  uint32_t layer_snapshot::field_count() const { return(header_of(base).field_count); }
+
+  const snapshot_field &layer_snapshot::field(uint32_t col) const {
+    return(((const snapshot_field *) (base + header_of(base).fields_offset))[col]);
+  }
+
+  const int64_t *layer_snapshot::int_column(uint32_t col) const {
+    return((field(col).type == 'N') ? (const int64_t *) (base + field(col).data_offset) : 0);
+  }
+
+  const double *layer_snapshot::double_column(uint32_t col) const {
+    return((field(col).type == 'F') ? (const double *) (base + field(col).data_offset) : 0);
+  }
+
+  const int32_t *layer_snapshot::string_offsets(uint32_t col) const {
+    return((field(col).type == 'C') ? (const int32_t *) (base + field(col).data_offset) : 0);
+  }
+
+  const char *layer_snapshot::string_chars(uint32_t col) const {
+    return((field(col).type == 'C') ? (const char *) (base + field(col).chars_offset) : 0);
+  }
+
+
+  shape_ptr layer_snapshot::shape_at(uint64_t recno) const {
+
+    const int32_t *rparts = record_parts();
+    const int32_t *ppoints = part_points();
+    const double *xy = coords();
+    int32_t first_part = rparts[recno];
+    int32_t last_part = rparts[recno + 1];
+    if(first_part == last_part) {
+      return(std::make_shared<shape>());
+    }
+
+    std::pmr::vector<polypart> parts(last_part - first_part);
+    for(int32_t part=first_part; part < last_part; ++part) {
+      std::pmr::vector<pointshape> &points = parts[part - first_part].points;
+      points.reserve(ppoints[part + 1] - ppoints[part]);
+      for(int32_t pt=ppoints[part]; pt < ppoints[part + 1]; ++pt) {
+	points.push_back(pointshape(xy[2 * pt], xy[(2 * pt) + 1]));
+      }
+    }
+
+    switch(xy_type(stype())) {
+    case shape_type::point:
+      return(std::make_shared<pointshape>(parts[0].points[0]));
+    case shape_type::multipoint: {
+      std::shared_ptr<multipointshape> mp = std::make_shared<multipointshape>();
+      mp->points.swap(parts[0].points);
+      return(mp);
+    }
+    case shape_type::polyline: {
+      std::shared_ptr<polyline> pl = std::make_shared<polyline>();
+      pl->parts.swap(parts);
+      return(pl);
+    }
+    case shape_type::polygon: {
+      std::shared_ptr<polygon> pg = std::make_shared<polygon>();
+      pg->rings.swap(parts);
+      return(pg);
+    }
+    default:
+      break;
+    }
+
+    return(std::make_shared<shape>());
+  }
+
+
+  bool open_or_build_snapshot(const std::string &snapshot_path, const std::string &shp_path, const std::string &dbf_path, layer_snapshot &snapshot) {
+
+    if(snapshot.open(snapshot_path, shp_path, dbf_path)) {
+      return(true);
+    }
+
+    if(!write_snapshot(snapshot_path, shp_path, dbf_path)) {
+      return(false);
+    }
+
+    return(snapshot.open(snapshot_path, shp_path, dbf_path));
+  }
+
+} // namespace shputil
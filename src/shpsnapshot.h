@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "shputil.h"
+
+namespace shputil {
+
+  //
+  // decoded shp + dbf in a versioned, pointer-free, native-endian file that is opened
+  // with mmap and used in place. every .shp record is kept (null records have no parts)
+  // so record i lines up with dbf row i, deleted rows are cleared in the validity bitmap.
+  //
+  //   records --record_parts--> parts --part_points--> points (interleaved x,y)
+  //
+  // offsets are int32 (arrow list layout), so a layer holds at most 2^31 - 1 points.
+  // z/m layers are kept as xy, stype() still reports the source type.
+  //
+  // a snapshot is stale once the .shp, .shx or .dbf size or mtime differs from when it
+  // was built. building streams the coordinates to the file, what it holds in memory is
+  // 36 bytes per record and 4 per part for the offsets and bboxes, plus the dbf columns
+  // (8 bytes per numeric cell, text at its length, 4 per text cell).
+  //
+  class snapshot_field {
+  public:
+    char name[12];
+    char type;              // 'C', 'N', 'F'
+    uint8_t length;
+    uint8_t decimals;
+    uint8_t reserved[5];
+    uint64_t data_offset;   // int64_t[rows] for 'N', double[rows] for 'F', int32_t[rows+1] string offsets for 'C'
+    uint64_t chars_offset;  // 'C' only, string bytes
+    uint64_t chars_bytes;
+  };
+
+  class layer_snapshot {
+  public:
+    layer_snapshot();
+    ~layer_snapshot();
+    bool open(const std::string &snapshot_path, const std::string &shp_path, const std::string &dbf_path); // false if stale
+    void close();
+
+    shputil::shape_type stype() const;
+    uint64_t record_count() const;
+    uint64_t part_count() const;
+    uint64_t point_count() const;
+    const int32_t *record_parts() const; // record_count + 1
+    const int32_t *part_points() const;  // part_count + 1
+    const double *coords() const;        // 2 * point_count
+    const double *record_bboxes() const; // xmin, ymin, xmax, ymax per record
+    const uint8_t *validity() const;     // bit per record, lsb first, 0 = deleted dbf row
+    bool row_valid(uint64_t recno) const { return((validity()[recno >> 3] >> (recno & 7)) & 1); }
+
+    uint32_t field_count() const;
+    const snapshot_field &field(uint32_t col) const;
+    const int64_t *int_column(uint32_t col) const;
+    const double *double_column(uint32_t col) const;
+    const int32_t *string_offsets(uint32_t col) const;
+    const char *string_chars(uint32_t col) const;
+
+    shape_ptr shape_at(uint64_t recno) const; // materializes one record (xy base class)
+
+    const uint8_t *base;
+    uint64_t mapped_bytes;
+    int fd;
+  };
+
+  //
+  // the dbf as snapshot columns: int64 / double / int32 string offsets + chars per field,
+  // record_count rows, deleted rows cleared in validity. dbf_path may be empty (no fields)
+  //
+  bool read_snapshot_columns(const std::string &dbf_path, uint64_t record_count, std::vector<uint8_t> &validity, std::vector<snapshot_field> &fields,
+			     std::vector<std::vector<uint8_t> > &column_data, std::vector<std::vector<char> > &column_chars);
+
+  bool write_snapshot(const std::string &snapshot_path, const std::string &shp_path, const std::string &dbf_path); // dbf_path may be empty
+  bool open_or_build_snapshot(const std::string &snapshot_path, const std::string &shp_path, const std::string &dbf_path, layer_snapshot &snapshot);
+
+} // shputil namespace
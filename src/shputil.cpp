@@ -1,9 +1,13 @@
 
 #include "shputil.h"
 #include "logging.h"
+#include "iostats.h"
 #include <time.h>
+#include <unistd.h>
 #include <iostream>
-#include <regex>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 
 #ifdef __APPLE__
   #include <machine/endian.h>
@@ -48,10 +52,11 @@ namespace shputil {
 
   
   struct shapefile_record_reader {
-    uint32_t file_length_bytes;
-    uint32_t total_bytes_read;
+    uint64_t file_length_bytes;
+    uint64_t total_bytes_read;
     uint32_t alloc_size;
     uint8_t *record_buf;
+    std::pmr::memory_resource *mr; // record_buf comes from here
     uint32_t current_content_bytes;
     shapefile_record_header current_record_header;
     FILE *fp;
@@ -61,9 +66,10 @@ namespace shputil {
   static void init_record_reader(FILE *fp, const shapefile_main_header_base &header_base, shapefile_record_reader &reader) {
     reader.alloc_size = 0;
     reader.record_buf = 0;
+    reader.mr = std::pmr::get_default_resource();
     reader.current_content_bytes = 0;
     reader.total_bytes_read = sizeof(shapefile_main_header_base) + sizeof(shapefile_main_header_boundingbox);
-    reader.file_length_bytes = 2 * header_base.file_length; // 2x since file_length is the # of 16-bit words
+    reader.file_length_bytes = 2 * (uint64_t) (uint32_t) header_base.file_length; // 2x since file_length is the # of 16-bit words
     reader.fp = fp;
   }
 
@@ -125,8 +131,8 @@ namespace shputil {
     memset(&header_base, 0, sizeof(shapefile_main_header_base));
     memset(&header_bb, 0, sizeof(shapefile_main_header_boundingbox));
 
-    if((fread(&header_base, sizeof(shapefile_main_header_base), 1, fp) != 1) ||
-       (fread(&header_bb, sizeof(shapefile_main_header_boundingbox), 1, fp) != 1)) {
+    if((io_fread(&header_base, sizeof(shapefile_main_header_base), 1, fp) != 1) ||
+       (io_fread(&header_bb, sizeof(shapefile_main_header_boundingbox), 1, fp) != 1)) {
       log_error("couldn't read shapefile header...\n");
       return(false);
     }
@@ -141,6 +147,12 @@ namespace shputil {
       log_error("invalid shapefile version... fatal\n");
       return(false);
     }
+
+    return(true);
+  }
+
+  
+  static void log_main_header(const shapefile_main_header_base &header_base, const shapefile_main_header_boundingbox &header_bb) {
     
     log("file_code: %d\n", header_base.file_code);
     log("file_length: %d\n", header_base.file_length);
@@ -154,14 +166,12 @@ namespace shputil {
     log("zmax: %f\n", header_bb.zmax);
     log("mmin: %f\n", header_bb.mmin);
     log("mmax: %f\n", header_bb.mmax);
-
-    return(true);
   }
 
   
   static bool read_record_header(FILE *fp, shapefile_record_header &record_header) {
 
-    if(fread(&record_header, sizeof(shapefile_record_header), 1, fp) != 1) {
+    if(io_fread(&record_header, sizeof(shapefile_record_header), 1, fp) != 1) {
       log_error("couldn't read the record header...\n");
       return(false);
     }
@@ -195,11 +205,19 @@ namespace shputil {
     if(reader.current_content_bytes > reader.alloc_size) {
 
       if(reader.record_buf) {
-	free(reader.record_buf);
+	reader.mr->deallocate(reader.record_buf, reader.alloc_size, alignof(double));
+	reader.record_buf = 0;
+	reader.alloc_size = 0;
       }
 	
-      reader.record_buf = (uint8_t *) malloc(reader.current_content_bytes);
-      reader.alloc_size = reader.current_content_bytes;
+      try {
+	reader.record_buf = (uint8_t *) reader.mr->allocate(reader.current_content_bytes, alignof(double));
+	reader.alloc_size = reader.current_content_bytes;
+      }
+      catch(const std::bad_alloc &) {
+	reader.record_buf = 0;
+      }
+      io_stats_add(io_counter::allocations, 1);
 	
     }
       
@@ -208,7 +226,7 @@ namespace shputil {
       return(false);
     }
 
-    if(fread(reader.record_buf, reader.current_content_bytes, 1, reader.fp) != 1) {
+    if(io_fread(reader.record_buf, reader.current_content_bytes, 1, reader.fp) != 1) {
       log_error("couldn't read record content\n");
       return(false);
     }
@@ -219,21 +237,35 @@ namespace shputil {
   }
 
   
+  //
+  // read_shape_record is false at the end of the file and on a read or allocation error,
+  // only having consumed file_length tells the two apart
+  //
+  static bool reached_end(const shapefile_record_reader &reader) {
+    if(reader.total_bytes_read < reader.file_length_bytes) {
+      log_error("shapefile stopped at byte %llu of %llu\n", (unsigned long long) reader.total_bytes_read, (unsigned long long) reader.file_length_bytes);
+      return(false);
+    }
+    return(true);
+  }
+
+
   static void close_record_reader(shapefile_record_reader &reader) {
     if(reader.record_buf) {
-      free(reader.record_buf);
+      reader.mr->deallocate(reader.record_buf, reader.alloc_size, alignof(double));
       reader.record_buf = 0;
+      reader.alloc_size = 0;
     }
   }
 
       
-  static int32_t fetch_LEint32(uint8_t *content) {
+  static int32_t fetch_LEint32(const uint8_t *content) {
     
     if(!content) {
       return(0);
     }
 
-    int32_t *ptr = (int32_t *)content;
+    const int32_t *ptr = (const int32_t *)content;
     int32_t val = *ptr;
     #if BYTE_ORDER == BIG_ENDIAN
       val =  __builtin_bswap32(val);
@@ -242,13 +274,13 @@ namespace shputil {
     return(val);
   }
 
-  static double fetch_LEdouble(uint8_t *content) {
+  static double fetch_LEdouble(const uint8_t *content) {
 
     if(!content) {
       return(0.0);
     }
 
-    double *ptr = (double *)content;
+    const double *ptr = (const double *)content;
     double val = *ptr;
 #if BYTE_ORDER == BIG_ENDIAN
     val = swap_endianness_dbl(val);
@@ -258,229 +290,641 @@ namespace shputil {
   }
 
   
-  static bool read_point_shapes(shapefile_record_reader &reader, shapefile &shpfile) {
+  static bool decode_point_record(const uint8_t *content, uint32_t content_bytes, pointshape &pt) {
 
-    while(read_shape_record(reader)) {
-      
-      log("point record header: recnum %d, content len %d\n",
-	  reader.current_record_header.record_number,
-	  reader.current_record_header.content_length);
+    if(content_bytes < 20) { // z/m follow x,y in pointz/pointm records
+      log_error("invalid point record size...\n");
+      return(false);
+    }
 
-      if(reader.current_record_header.content_length != 10) {
-	log_error("invalid point record size...\n");
-	return(false);
-      }
+    pt.x = fetch_LEdouble(content + sizeof(int32_t));
+    pt.y = fetch_LEdouble(content + sizeof(int32_t) + sizeof(double));
 
-      int32_t stype = fetch_LEint32(reader.record_buf);
-      if((shputil::shape_type)stype == shape_type::null_shape) {
-	log("found null shape... skipping\n");
-	continue;
-      }
-      
-      if((shputil::shape_type)stype != shputil::shape_type::point) {
-	log_error("invalid shape_type, expected point\n");
-	return(false);
-      }
+    io_stats_add(io_counter::vertices, 1);
+    return(true);
+  }
 
-      double x = fetch_LEdouble(reader.record_buf + sizeof(int32_t));
-      double y = fetch_LEdouble(reader.record_buf + sizeof(int32_t) + sizeof(double));
-      log("x,y = %.6f, %.6f\n", x, y);
+  
+  static bool decode_multipoint_record(const uint8_t *content, uint32_t content_bytes, std::pmr::vector<pointshape> &points) {
 
-      shpfile.shapes.push_back(std::make_shared<pointshape>(x, y));
+    uint32_t offset = sizeof(int32_t) + (4 * sizeof(double)); // shape_type + 4 bb doubles
+    if(content_bytes < (offset + sizeof(int32_t))) {
+      log_error("multipoint record too short...\n");
+      return(false);
     }
     
+    int32_t num_points = fetch_LEint32(content + offset);
+    offset += sizeof(int32_t);
+
+    if((num_points < 0) || (content_bytes < (offset + (2 * sizeof(double) * (uint64_t) num_points)))) {
+      log_error("bogus multipoint num_points: %d\n", num_points);
+      return(false);
+    }
+
+    points.reserve(num_points);
+    for(int ii=0; ii < num_points; ++ii) {
+      double x = fetch_LEdouble(content + offset);
+      double y = fetch_LEdouble(content + offset + sizeof(double));
+      points.push_back(pointshape(x, y));
+      offset += (2 * sizeof(double));
+    }
+
+    io_stats_add(io_counter::vertices, num_points);
     return(true);
   }
 
   
-  static bool read_polyline_shapes(shapefile_record_reader &reader, shapefile &shpfile) {
+  static bool decode_polypart_record(const uint8_t *content, uint32_t content_bytes, std::pmr::vector<polypart> &parts) {
 
-    while(read_shape_record(reader)) {
-      
-      log("polyline record header: recnum %d, content len %d\n",
-	  reader.current_record_header.record_number,
-	  reader.current_record_header.content_length);
-      
-      int32_t stype = fetch_LEint32(reader.record_buf);
-      if((shputil::shape_type)stype == shape_type::null_shape) {
-	log("found null shape... skipping\n");
-	continue;
-      }
-      
-      if((shputil::shape_type)stype != shape_type::polyline) {
-	log_error("record shape_type mismatch, expected polyline...\n");
+    //
+    // shared by polyline (parts) and polygon (rings)
+    //
+    
+    uint32_t offset = sizeof(int32_t) + (4 * sizeof(double)); // shape_type + 4 bb doubles
+    if(content_bytes < (offset + (2 * sizeof(int32_t)))) {
+      log_error("polypart record too short...\n");
+      return(false);
+    }
+    
+    int32_t num_parts = fetch_LEint32(content + offset);
+    offset += sizeof(int32_t);
+    int32_t num_points = fetch_LEint32(content + offset);
+    offset += sizeof(int32_t);
+
+    uint32_t parts_offset = offset;
+    uint64_t points_offset = parts_offset + ((uint64_t) num_parts * sizeof(int32_t));
+    if((num_parts < 1) || (num_points < 0) ||
+       (content_bytes < (points_offset + (2 * sizeof(double) * (uint64_t) num_points)))) {
+      log_error("bogus polypart counts: %d parts, %d points\n", num_parts, num_points);
+      return(false);
+    }
+
+    //
+    // check every part start first, then decode each part straight into its own
+    // vector (parts hands its allocator to the new polypart)
+    //
+    int32_t prev_part_start = 0;
+    for(int32_t idx=1; idx < num_parts; ++idx) { // the first part always starts at 0
+      int32_t part_start = fetch_LEint32(content + parts_offset + (idx * sizeof(int32_t)));
+      if((part_start < prev_part_start) || (part_start > num_points)) {
+	log_error("bogus part start index: %d\n", part_start);
 	return(false);
       }
-      
-      uint32_t offset = sizeof(int32_t) + (4 * sizeof(double)); // shape_type + 4 bb doubles
-      int32_t num_parts = fetch_LEint32(reader.record_buf + offset);
-      offset += sizeof(int32_t);
-      int32_t num_points = fetch_LEint32(reader.record_buf + offset);
-      offset += sizeof(int32_t);
-
-      log("num_parts: %d\n", num_parts);
-      log("num_points: %d\n\n", num_points);
-
-      uint32_t parts_offset = offset;
-      uint32_t points_offset = parts_offset + (num_parts * sizeof(int32_t));
-
-      polypart allparts;
-      uint8_t *part_points_start = (reader.record_buf + points_offset);
-      uint32_t part_points_offset = 0;
-      for(int point_idx = 0; point_idx < num_points; ++point_idx) {
-	double x = fetch_LEdouble(part_points_start + part_points_offset);
-	double y = fetch_LEdouble(part_points_start + part_points_offset + sizeof(double));
-	//log("x,y = %.3f, %.3f\n", x, y);
-	part_points_offset += (2 * sizeof(double));
-	allparts.points.push_back(pointshape(x, y));
-      }
-      
-      polyline pl;
-      if(num_parts == 1) {
-	pl.parts.push_back(allparts);
-      }
-      else {
-	int32_t prev_part_start = 0;
-	for(int32_t idx=1; idx < num_parts; ++idx) {
-	  polypart part;
-	  int32_t part_start = fetch_LEint32(reader.record_buf + parts_offset + (idx * sizeof(int32_t)));
-	  //log("part_start = %d\n", part_start);
-	  std::vector<pointshape>::const_iterator first = allparts.points.begin() + prev_part_start;
-	  std::vector<pointshape>::const_iterator last = allparts.points.begin() + part_start;
-	  part.points = {first, last};
-	  prev_part_start = part_start;
-	  pl.parts.push_back(part);
-	}
+      prev_part_start = part_start;
+    }
 
-	polypart final_part;
-	std::vector<pointshape>::const_iterator first = allparts.points.begin() + prev_part_start;
-	std::vector<pointshape>::const_iterator last = allparts.points.end();
-	final_part.points = {first, last};
-	pl.parts.push_back(final_part);
-	
+    parts.reserve(parts.size() + num_parts);
+    const uint8_t *part_points_start = (content + points_offset);
+    for(int32_t idx=0; idx < num_parts; ++idx) {
+      int32_t part_start = (idx == 0) ? 0 : fetch_LEint32(content + parts_offset + (idx * sizeof(int32_t)));
+      int32_t part_end = ((idx + 1) < num_parts) ? fetch_LEint32(content + parts_offset + ((idx + 1) * sizeof(int32_t))) : num_points;
+      parts.emplace_back();
+      std::pmr::vector<pointshape> &points = parts.back().points;
+      points.reserve(part_end - part_start);
+      for(int32_t point_idx = part_start; point_idx < part_end; ++point_idx) {
+	const uint8_t *xy = part_points_start + (point_idx * 2 * sizeof(double));
+	points.push_back(pointshape(fetch_LEdouble(xy), fetch_LEdouble(xy + sizeof(double))));
       }
-      
-      shpfile.shapes.push_back(std::make_shared<polyline>(pl));
+    }
+
+    io_stats_add(io_counter::vertices, num_points);
+    return(true);
+  }
+
+  
+  static uint8_t *store_points(uint8_t *dst, const std::pmr::vector<pointshape> &points) {
+    for(const pointshape &pt : points) {
+      store_LEdouble(dst, pt.x);
+      store_LEdouble(dst + sizeof(double), pt.y);
+      dst += 2 * sizeof(double);
+    }
+    return(dst);
+  }
+
+  static uint8_t *store_bbox(uint8_t *dst, double xmin, double ymin, double xmax, double ymax) {
+    store_LEdouble(dst, xmin);
+    store_LEdouble(dst + sizeof(double), ymin);
+    store_LEdouble(dst + (2 * sizeof(double)), xmax);
+    store_LEdouble(dst + (3 * sizeof(double)), ymax);
+    return(dst + (4 * sizeof(double)));
+  }
+
+
+  static void extend_bounds(const std::pmr::vector<pointshape> &points, double &xmin, double &ymin, double &xmax, double &ymax, bool &first) {
+    for(const pointshape &pt : points) {
+      if(first || (pt.x < xmin)) xmin = pt.x;
+      if(first || (pt.y < ymin)) ymin = pt.y;
+      if(first || (pt.x > xmax)) xmax = pt.x;
+      if(first || (pt.y > ymax)) ymax = pt.y;
+      first = false;
+    }
+  }
+
+
+  static bool parts_bounds(const std::pmr::vector<polypart> &parts, double &xmin, double &ymin, double &xmax, double &ymax) {
+    bool first = true;
+    for(const polypart &part : parts) {
+      extend_bounds(part.points, xmin, ymin, xmax, ymax, first);
+    }
+    return(!first);
+  }
+
+
+  bool shape_bounds(const pointshape &pt, double &xmin, double &ymin, double &xmax, double &ymax) {
+    xmin = xmax = pt.x;
+    ymin = ymax = pt.y;
+    return(true);
+  }
+
+  bool shape_bounds(const multipointshape &mp, double &xmin, double &ymin, double &xmax, double &ymax) {
+    bool first = true;
+    extend_bounds(mp.points, xmin, ymin, xmax, ymax, first);
+    return(!first);
+  }
+
+  bool shape_bounds(const polyline &pl, double &xmin, double &ymin, double &xmax, double &ymax) {
+    return(parts_bounds(pl.parts, xmin, ymin, xmax, ymax));
+  }
+
+  bool shape_bounds(const polygon &pg, double &xmin, double &ymin, double &xmax, double &ymax) {
+    return(parts_bounds(pg.rings, xmin, ymin, xmax, ymax));
+  }
+
+
+  static uint64_t parts_content_bytes(const std::pmr::vector<polypart> &parts) {
+    uint64_t bytes = POLY_BASE_RECORD_SIZE + (sizeof(int32_t) * parts.size());
+    for(const polypart &part : parts) {
+      bytes += 2 * sizeof(double) * part.points.size();
+    }
+    return(bytes);
+  }
+
+
+  uint64_t encoded_content_bytes(const pointshape &) {
+    return(sizeof(int32_t) + (2 * sizeof(double)));
+  }
+
+  uint64_t encoded_content_bytes(const multipointshape &mp) {
+    return(sizeof(int32_t) + (4 * sizeof(double)) + sizeof(int32_t) + (2 * sizeof(double) * mp.points.size()));
+  }
+
+  uint64_t encoded_content_bytes(const polyline &pl) {
+    return(parts_content_bytes(pl.parts));
+  }
+
+  uint64_t encoded_content_bytes(const polygon &pg) {
+    return(parts_content_bytes(pg.rings));
+  }
+
+  
+  uint64_t encoded_content_bytes(const shape_ptr &shp) {
+
+    switch(shp->stype()) {
+    case shape_type::null_shape: return(sizeof(int32_t));
+    case shape_type::point: return(encoded_content_bytes(*(const pointshape *) shp.get()));
+    case shape_type::multipoint: return(encoded_content_bytes(*(const multipointshape *) shp.get()));
+    case shape_type::polyline: return(encoded_content_bytes(*(const polyline *) shp.get()));
+    case shape_type::polygon: return(encoded_content_bytes(*(const polygon *) shp.get()));
+    default:
+      break;
+    }
+
+    return(0);
+  }
+
+
+  //
+  // record header plus the type, returns where the rest of the content goes. 0 if the
+  // content is too long for the header's 16-bit word count
+  //
+  static uint8_t *store_record_start(uint8_t *record, int32_t record_number, uint64_t content_bytes, shape_type stype) {
+
+    if((content_bytes / 2) > (uint64_t) INT32_MAX) {
+      log_error("can't encode record %d (shape_type %d)\n", record_number, (int) stype);
+      return(0);
+    }
+
+    shapefile_record_header rh;
+    rh.record_number = record_number;
+    rh.content_length = content_bytes / 2; // # 16-bit words
+    handle_endianness(rh);
+    memcpy(record, &rh, sizeof(shapefile_record_header));
+
+    uint8_t *dst = record + sizeof(shapefile_record_header);
+    store_LEint32(dst, (int32_t) stype);
+    return(dst + sizeof(int32_t));
+  }
+
+
+  static void store_parts(uint8_t *dst, const std::pmr::vector<polypart> &parts) {
+
+    double xmin = 0.0, ymin = 0.0, xmax = 0.0, ymax = 0.0;
+    parts_bounds(parts, xmin, ymin, xmax, ymax);
+    dst = store_bbox(dst, xmin, ymin, xmax, ymax);
+    int32_t numpoints = 0;
+    for(const polypart &part : parts) {
+      numpoints += part.points.size();
+    }
+    store_LEint32(dst, parts.size());
+    store_LEint32(dst + sizeof(int32_t), numpoints);
+    dst += 2 * sizeof(int32_t);
+
+    int32_t start_idx = 0;
+    for(const polypart &part : parts) {
+      store_LEint32(dst, start_idx);
+      dst += sizeof(int32_t);
+      start_idx += part.points.size();
+    }
+
+    for(const polypart &part : parts) {
+      dst = store_points(dst, part.points);
+    }
+  }
+
+
+  bool encode_record(const pointshape &pt, int32_t record_number, uint8_t *record) {
+    uint8_t *dst = store_record_start(record, record_number, encoded_content_bytes(pt), shape_type::point);
+    store_LEdouble(dst, pt.x);
+    store_LEdouble(dst + sizeof(double), pt.y);
+    return(true);
+  }
 
+  bool encode_record(const multipointshape &mp, int32_t record_number, uint8_t *record) {
+    uint8_t *dst = store_record_start(record, record_number, encoded_content_bytes(mp), shape_type::multipoint);
+    if(!dst) {
+      return(false);
     }
+    double xmin = 0.0, ymin = 0.0, xmax = 0.0, ymax = 0.0;
+    shape_bounds(mp, xmin, ymin, xmax, ymax);
+    dst = store_bbox(dst, xmin, ymin, xmax, ymax);
+    store_LEint32(dst, mp.points.size());
+    store_points(dst + sizeof(int32_t), mp.points);
+    return(true);
+  }
 
+  bool encode_record(const polyline &pl, int32_t record_number, uint8_t *record) {
+    uint8_t *dst = store_record_start(record, record_number, encoded_content_bytes(pl), shape_type::polyline);
+    if(!dst) {
+      return(false);
+    }
+    store_parts(dst, pl.parts);
+    return(true);
+  }
+
+  bool encode_record(const polygon &pg, int32_t record_number, uint8_t *record) {
+    uint8_t *dst = store_record_start(record, record_number, encoded_content_bytes(pg), shape_type::polygon);
+    if(!dst) {
+      return(false);
+    }
+    store_parts(dst, pg.rings);
     return(true);
   }
 
   
-  static bool read_polygon_shapes(shapefile_record_reader &reader, shapefile &shpfile) {
+  bool encode_record(const shape_ptr &shp, int32_t record_number, uint8_t *record) {
+
+    switch(shp->stype()) {
+    case shape_type::null_shape:
+      store_record_start(record, record_number, sizeof(int32_t), shape_type::null_shape);
+      return(true);
+    case shape_type::point: return(encode_record(*(const pointshape *) shp.get(), record_number, record));
+    case shape_type::multipoint: return(encode_record(*(const multipointshape *) shp.get(), record_number, record));
+    case shape_type::polyline: return(encode_record(*(const polyline *) shp.get(), record_number, record));
+    case shape_type::polygon: return(encode_record(*(const polygon *) shp.get(), record_number, record));
+    default:
+      log_error("can't encode record %d (shape_type %d)\n", record_number, (int) shp->stype());
+      break;
+    }
+
+    return(false);
+  }
+
+  
+  //
+  // the shape, its shared_ptr control block and its vectors all come from mr
+  //
+  template <class shapeclass, class... args>
+  static std::shared_ptr<shapeclass> allocate_shape(std::pmr::memory_resource *mr, args&&... ctor_args) {
+    return(std::allocate_shared<shapeclass>(std::pmr::polymorphic_allocator<shapeclass>(mr), std::forward<args>(ctor_args)...));
+  }
+
+  template <class pointclass>
+  static bool decode_point_shape(const uint8_t *content, uint32_t content_bytes, shape_ptr &shp, std::pmr::memory_resource *mr) {
+    std::shared_ptr<pointclass> pt = allocate_shape<pointclass>(mr);
+    shp = pt;
+    return(decode_point_record(content, content_bytes, *pt));
+  }
+
+  template <class multipointclass>
+  static bool decode_multipoint_shape(const uint8_t *content, uint32_t content_bytes, shape_ptr &shp, std::pmr::memory_resource *mr) {
+    std::shared_ptr<multipointclass> mp = allocate_shape<multipointclass>(mr, mr);
+    shp = mp;
+    return(decode_multipoint_record(content, content_bytes, mp->points));
+  }
+
+  template <class polylineclass>
+  static bool decode_polyline_shape(const uint8_t *content, uint32_t content_bytes, shape_ptr &shp, std::pmr::memory_resource *mr) {
+    std::shared_ptr<polylineclass> pl = allocate_shape<polylineclass>(mr, mr);
+    shp = pl;
+    return(decode_polypart_record(content, content_bytes, pl->parts));
+  }
+
+  template <class polygonclass>
+  static bool decode_polygon_shape(const uint8_t *content, uint32_t content_bytes, shape_ptr &shp, std::pmr::memory_resource *mr) {
+    std::shared_ptr<polygonclass> pg = allocate_shape<polygonclass>(mr, mr);
+    shp = pg;
+    return(decode_polypart_record(content, content_bytes, pg->rings));
+  }
+
+  
+  bool decode_shape(const uint8_t *content, uint32_t content_bytes, shape_ptr &shp, std::pmr::memory_resource *mr) {
+
+    if(!content || (content_bytes < sizeof(int32_t))) {
+      log_error("record content too short...\n");
+      return(false);
+    }
     
-    while(read_shape_record(reader)) {
-      
-      log("polygon record header: recnum %d, content len %d\n",
-	  reader.current_record_header.record_number,
-	  reader.current_record_header.content_length);
-      
-      int32_t stype = fetch_LEint32(reader.record_buf);
-      if((shputil::shape_type)stype == shape_type::null_shape) {
-	log("found null shape... skipping\n");
-	continue;
+    shputil::shape_type stype = (shputil::shape_type) fetch_LEint32(content);
+    switch(stype) {
+    case shape_type::null_shape:
+      shp = allocate_shape<shape>(mr);
+      return(true);
+    case shape_type::point: return(decode_point_shape<pointshape>(content, content_bytes, shp, mr));
+    case shape_type::pointz: return(decode_point_shape<pointzshape>(content, content_bytes, shp, mr));
+    case shape_type::pointm: return(decode_point_shape<pointmshape>(content, content_bytes, shp, mr));
+    case shape_type::multipoint: return(decode_multipoint_shape<multipointshape>(content, content_bytes, shp, mr));
+    case shape_type::multipointz: return(decode_multipoint_shape<multipointzshape>(content, content_bytes, shp, mr));
+    case shape_type::multipointm: return(decode_multipoint_shape<multipointmshape>(content, content_bytes, shp, mr));
+    case shape_type::polyline: return(decode_polyline_shape<polyline>(content, content_bytes, shp, mr));
+    case shape_type::polylinez: return(decode_polyline_shape<polylinez>(content, content_bytes, shp, mr));
+    case shape_type::polylinem: return(decode_polyline_shape<polylinem>(content, content_bytes, shp, mr));
+    case shape_type::polygon: return(decode_polygon_shape<polygon>(content, content_bytes, shp, mr));
+    case shape_type::polygonz: return(decode_polygon_shape<polygonz>(content, content_bytes, shp, mr));
+    case shape_type::polygonm: return(decode_polygon_shape<polygonm>(content, content_bytes, shp, mr));
+    default:
+      log_error("unsupported record shape_type: %d\n", (int) stype);
+      break;
+    }
+
+    return(false);
+  }
+
+  
+  //
+  // the record's type tag against the one the caller's class expects, z/m variants pass
+  //
+  static bool check_record_type(const uint8_t *content, uint32_t content_bytes, shape_type expected) {
+
+    if(!content || (content_bytes < sizeof(int32_t))) {
+      log_error("record content too short...\n");
+      return(false);
+    }
+
+    int32_t stype = fetch_LEint32(content);
+    if(xy_type((shape_type) stype) != expected) {
+      log_error("record shape_type %d where %d was expected\n", stype, (int) expected);
+      return(false);
+    }
+
+    return(true);
+  }
+
+
+  bool decode_record(const uint8_t *content, uint32_t content_bytes, pointshape &pt) {
+    return(check_record_type(content, content_bytes, shape_type::point) && decode_point_record(content, content_bytes, pt));
+  }
+
+  bool decode_record(const uint8_t *content, uint32_t content_bytes, multipointshape &mp) {
+    mp.points.clear();
+    return(check_record_type(content, content_bytes, shape_type::multipoint) && decode_multipoint_record(content, content_bytes, mp.points));
+  }
+
+  bool decode_record(const uint8_t *content, uint32_t content_bytes, polyline &pl) {
+    pl.parts.clear();
+    return(check_record_type(content, content_bytes, shape_type::polyline) && decode_polypart_record(content, content_bytes, pl.parts));
+  }
+
+  bool decode_record(const uint8_t *content, uint32_t content_bytes, polygon &pg) {
+    pg.rings.clear();
+    return(check_record_type(content, content_bytes, shape_type::polygon) && decode_polypart_record(content, content_bytes, pg.rings));
+  }
+
+
+  shputil::shape_type xy_type(shputil::shape_type stype) {
+    switch(stype) {
+    case shape_type::point:
+    case shape_type::pointz:
+    case shape_type::pointm:
+      return(shape_type::point);
+    case shape_type::multipoint:
+    case shape_type::multipointz:
+    case shape_type::multipointm:
+      return(shape_type::multipoint);
+    case shape_type::polyline:
+    case shape_type::polylinez:
+    case shape_type::polylinem:
+      return(shape_type::polyline);
+    case shape_type::polygon:
+    case shape_type::polygonz:
+    case shape_type::polygonm:
+      return(shape_type::polygon);
+    default:
+      break;
+    }
+
+    return(shape_type::null_shape);
+  }
+
+
+  bool has_z(shputil::shape_type stype) {
+    return((stype == shape_type::pointz) || (stype == shape_type::multipointz) ||
+	   (stype == shape_type::polylinez) || (stype == shape_type::polygonz));
+  }
+
+
+  static void append_doubles(const uint8_t *content, uint32_t count, std::vector<double> &values) {
+    for(uint32_t idx=0; idx < count; ++idx) {
+      values.push_back(fetch_LEdouble(content + (idx * sizeof(double))));
+    }
+  }
+
+  
+  bool decode_zm(const uint8_t *content, uint32_t content_bytes, std::vector<double> *z, std::vector<double> *m, uint32_t &num_points) {
+
+    num_points = 0;
+    if(!content || (content_bytes < sizeof(int32_t))) {
+      log_error("record content too short...\n");
+      return(false);
+    }
+
+    shputil::shape_type stype = (shputil::shape_type) fetch_LEint32(content);
+    shputil::shape_type xytype = xy_type(stype);
+    bool zrecord = has_z(stype);
+    bool mrecord = (xytype != stype) && !zrecord;
+
+    //
+    // find the end of the xy block, z (with its range) and then m (with its range) follow,
+    // point records carry bare values without ranges
+    //
+    uint64_t xy_end = 0;
+    uint64_t range_bytes = 2 * sizeof(double);
+    if(xytype == shape_type::point) {
+      num_points = 1;
+      xy_end = sizeof(int32_t) + (2 * sizeof(double));
+      range_bytes = 0;
+    }
+    else if(xytype == shape_type::multipoint) {
+      uint32_t offset = sizeof(int32_t) + (4 * sizeof(double));
+      if(content_bytes < (offset + sizeof(int32_t))) {
+	log_error("multipoint record too short...\n");
+	return(false);
       }
-      
-      if((shputil::shape_type)stype != shape_type::polygon) {
-	log_error("record shape_type mismatch..., expected polygon\n");
+      int32_t count = fetch_LEint32(content + offset);
+      if(count < 0) {
+	log_error("bogus multipoint num_points: %d\n", count);
 	return(false);
       }
-      
-      uint32_t offset = sizeof(int32_t) + (4 * sizeof(double)); // shape_type + 4 bb doubles
-      int32_t num_rings = fetch_LEint32(reader.record_buf + offset);
-      offset += sizeof(int32_t);
-      int32_t num_points = fetch_LEint32(reader.record_buf + offset);
-      offset += sizeof(int32_t);
-
-      log("num_rings: %d\n", num_rings);
-      log("num_points: %d\n\n", num_points);
-
-      uint32_t rings_offset = offset;
-      uint32_t points_offset = rings_offset + (num_rings * sizeof(int32_t));
-
-      polypart allparts;
-      uint8_t *ring_points_start = (reader.record_buf + points_offset);
-      uint32_t ring_points_offset = 0;
-      for(int point_idx = 0; point_idx < num_points; ++point_idx) {
-	double x = fetch_LEdouble(ring_points_start + ring_points_offset);
-	double y = fetch_LEdouble(ring_points_start + ring_points_offset + sizeof(double));
-	//log("x,y = %.3f, %.3f\n", x, y);
-	ring_points_offset += (2 * sizeof(double));
-	allparts.points.push_back(pointshape(x, y));
-      }
-
-      //log("allparts size = %d\n", allparts.points.size());
-      
-      polygon pg;
-      if(num_rings == 1) {
-	pg.rings.push_back(allparts);
+      num_points = count;
+      xy_end = offset + sizeof(int32_t) + (2 * sizeof(double) * (uint64_t) num_points);
+    }
+    else if((xytype == shape_type::polyline) || (xytype == shape_type::polygon)) {
+      uint32_t offset = sizeof(int32_t) + (4 * sizeof(double));
+      if(content_bytes < (offset + (2 * sizeof(int32_t)))) {
+	log_error("polypart record too short...\n");
+	return(false);
       }
-      else {
-	int32_t prev_part_start = 0;
-	for(int32_t idx=1; idx < num_rings; ++idx) {
-	  polypart part;
-	  int32_t part_start = fetch_LEint32(reader.record_buf + rings_offset + (idx * sizeof(int32_t)));
-	  //log("part_start = %d\n", part_start);
-	  std::vector<pointshape>::const_iterator first = allparts.points.begin() + prev_part_start;
-	  std::vector<pointshape>::const_iterator last = allparts.points.begin() + part_start;
-	  part.points = {first, last};
-	  prev_part_start = part_start;
-	  pg.rings.push_back(part);
-	}
+      int32_t num_parts = fetch_LEint32(content + offset);
+      int32_t count = fetch_LEint32(content + offset + sizeof(int32_t));
+      if((num_parts < 0) || (count < 0)) {
+	log_error("bogus polypart counts: %d parts, %d points\n", num_parts, count);
+	return(false);
+      }
+      num_points = count;
+      xy_end = offset + (2 * sizeof(int32_t)) + ((uint64_t) num_parts * sizeof(int32_t)) + (2 * sizeof(double) * (uint64_t) num_points);
+    }
+    else {
+      return(stype == shape_type::null_shape);
+    }
 
-	polypart final_part;
-	std::vector<pointshape>::const_iterator first = allparts.points.begin() + prev_part_start;
-	std::vector<pointshape>::const_iterator last = allparts.points.end();
-	final_part.points = {first, last};
-	pg.rings.push_back(final_part);
-	
+    uint64_t values_bytes = sizeof(double) * (uint64_t) num_points;
+    uint64_t m_start = xy_end;
+    if(zrecord) {
+      if(content_bytes < (xy_end + range_bytes + values_bytes)) {
+	log_error("z record too short...\n");
+	return(false);
       }
-      
-      shpfile.shapes.push_back(std::make_shared<polygon>(pg));
+      if(z) {
+	append_doubles(content + xy_end + range_bytes, num_points, *z);
+      }
+      m_start = xy_end + range_bytes + values_bytes;
+    }
 
+    if(m) {
+      bool present = (zrecord || mrecord) && (content_bytes >= (m_start + range_bytes + values_bytes));
+      if(present) {
+	append_doubles(content + m_start + range_bytes, num_points, *m);
+      }
+      else {
+	m->insert(m->end(), num_points, NAN);
+      }
     }
 
     return(true);
   }
 
-  
-  static bool read_multipoint_shapes(shapefile_record_reader &reader, shapefile &shpfile) {
 
-    while(read_shape_record(reader)) {
-      
-      log("multipoint record header: recnum %d, content len %d\n",
-	  reader.current_record_header.record_number,
-	  reader.current_record_header.content_length);
+  bool read_zm(const std::string &path, zmcolumns &columns, bool want_z, bool want_m) {
 
-      int32_t stype = fetch_LEint32(reader.record_buf);
-      if((shputil::shape_type)stype == shape_type::null_shape) {
-	log("found null shape... skipping\n");
-	continue;
-      }
-      
-      if((shputil::shape_type)stype != shputil::shape_type::multipoint) {
-	log_error("invalid shape_type, expected multipoint\n");
-	return(false);
-      }
+    columns.record_points.assign(1, 0);
+    columns.z.clear();
+    columns.m.clear();
+
+    shpinfo info;
+    if(!read_shp_info(path, info)) {
+      return(false);
+    }
+
+    if(xy_type(info.stype) == shape_type::null_shape) {
+      log_error("unsupported shape_type: %d\n", (int) info.stype);
+      return(false);
+    }
+
+    bool zlayer = has_z(info.stype);
+    bool mlayer = want_m && (info.stype != xy_type(info.stype));
+    std::vector<double> *z = (want_z && zlayer) ? &columns.z : 0;
+    std::vector<double> *m = mlayer ? &columns.m : 0;
+
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(!fp) {
+      log_error("couldn't open shapefile: %s\n", path.c_str());
+      return(false);
+    }
 
-      uint32_t offset = sizeof(int32_t) + (4 * sizeof(double)); // shape_type + 4 bb doubles
-      int32_t num_points = fetch_LEint32(reader.record_buf + offset);
-      offset += sizeof(int32_t);
+    shapefile_main_header_base header_base;
+    shapefile_main_header_boundingbox header_bb;
+    if(!read_main_header(fp, header_base, header_bb)) {
+      fclose(fp);
+      return(false);
+    }
 
-      multipointshape mpshape;
-      for(int ii=0; ii < num_points; ++ii) {
-	double x = fetch_LEdouble(reader.record_buf + offset);
-	double y = fetch_LEdouble(reader.record_buf + offset + sizeof(double));
-	log("x,y = %.6f, %.6f\n", x, y);
-	mpshape.points.push_back(pointshape(x, y));
-	offset += (2 * sizeof(double));
+    shapefile_record_reader reader;
+    init_record_reader(fp, header_base, reader);
+
+    bool status = true;
+    bool any_m = false;
+    while(status && read_shape_record(reader)) {
+      uint32_t num_points = 0;
+      size_t m_before = columns.m.size();
+      status = decode_zm(reader.record_buf, reader.current_content_bytes, z, m, num_points);
+      for(size_t idx=m_before; !any_m && (idx < columns.m.size()); ++idx) {
+	any_m = !std::isnan(columns.m[idx]);
       }
+      columns.record_points.push_back(columns.record_points.back() + num_points);
+    }
+    status = status && reached_end(reader);
 
-      shpfile.shapes.push_back(std::make_shared<multipointshape>(mpshape));
+    close_record_reader(reader);
+    fclose(fp);
+
+    if(!any_m) {
+      columns.m.clear(); // z layer written without m
     }
-    
-    return(true);
+
+    return(status);
+  }
+
+  
+  static bool read_shapes(shapefile_record_reader &reader, shputil::shape_type header_type, shapefile &shpfile) {
+
+    try {
+      while(read_shape_record(reader)) {
+	shape_ptr shp;
+	if(!decode_shape(reader.record_buf, reader.current_content_bytes, shp, shpfile.shapes.get_allocator().resource())) {
+	  return(false);
+	}
+
+	if(shp->stype() == shape_type::null_shape) {
+	  io_stats_add(io_counter::null_shapes, 1);
+	  io_stats_add(io_counter::records_skipped, 1);
+	  continue;
+	}
+
+	if(shp->stype() != header_type) {
+	  log_error("record shape_type mismatch, expected %d...\n", (int) header_type);
+	  return(false);
+	}
+
+	shpfile.shapes.push_back(shp);
+	io_stats_add(io_counter::records_decoded, 1);
+	io_stats_add(io_counter::allocations, 1);
+      }
+    }
+    catch(const std::bad_alloc &) {
+      log_error("out of memory decoding record %zu\n", shpfile.shapes.size());
+      return(false);
+    }
+
+    return(reached_end(reader));
   }
 
   
@@ -496,37 +940,204 @@ namespace shputil {
     
     shapefile_main_header_base header_base;
     shapefile_main_header_boundingbox header_bb;
-    if(!read_main_header(fp, header_base, header_bb)) {
-      fclose(fp);
-      return(false);
+    {
+      io_phase_timer timer(io_phase::header);
+      if(!read_main_header(fp, header_base, header_bb)) {
+	fclose(fp);
+	return(false);
+      }
+      log_main_header(header_base, header_bb);
     }
     
     shapefile_record_reader reader;
     init_record_reader(fp, header_base, reader);
+    reader.mr = shpfile.shapes.get_allocator().resource();
 		       
+    io_phase_timer timer(io_phase::records);
     bool status = false;
-    switch((shape_type)header_base.shape_type) {
-    case shape_type::point: status = read_point_shapes(reader, shpfile); break;
-    case shape_type::polyline: status = read_polyline_shapes(reader, shpfile); break;
-    case shape_type::polygon: status = read_polygon_shapes(reader, shpfile); break;
-    case shape_type::multipoint: status = read_multipoint_shapes(reader, shpfile); break;
-    default:
+    if(xy_type((shape_type)header_base.shape_type) != shape_type::null_shape) {
+      status = read_shapes(reader, (shape_type)header_base.shape_type, shpfile);
+    }
+    else {
       log_error("unsupported shape_type: %d\n", header_base.shape_type);
-      break;
     }
 
-    close_record_reader(reader);
-    
-    if(!status) {
-      return(false);
-    }
-    
-    fclose(fp);
-    
+    close_record_reader(reader);
+    fclose(fp);
+
+    return(status);
+  }
+
+
+  static void to_shpinfo(const shapefile_main_header_base &header_base, const shapefile_main_header_boundingbox &header_bb, shpinfo &info) {
+    info.stype = (shputil::shape_type) header_base.shape_type;
+    info.file_bytes = 2 * (uint64_t) (uint32_t) header_base.file_length;
+    info.xmin = header_bb.xmin;
+    info.ymin = header_bb.ymin;
+    info.xmax = header_bb.xmax;
+    info.ymax = header_bb.ymax;
+    info.zmin = header_bb.zmin;
+    info.zmax = header_bb.zmax;
+    info.mmin = header_bb.mmin;
+    info.mmax = header_bb.mmax;
+  }
+
+  
+  bool parse_shp_header(const uint8_t *header, shpinfo &info) {
+
+    shapefile_main_header_base header_base;
+    shapefile_main_header_boundingbox header_bb;
+    memcpy(&header_base, header, sizeof(shapefile_main_header_base));
+    memcpy(&header_bb, header + sizeof(shapefile_main_header_base), sizeof(shapefile_main_header_boundingbox));
+    handle_endianness(header_base, header_bb);
+
+    if((header_base.file_code != SHAPEFILE_FILE_CODE) || (header_base.version != SHAPEFILE_VERSION)) {
+      log_error("invalid shapefile file_code/version... fatal\n");
+      return(false);
+    }
+
+    to_shpinfo(header_base, header_bb, info);
+    return(true);
+  }
+
+  
+  void encode_shp_header(const shpinfo &info, uint8_t *header) {
+
+    shapefile_main_header_base header_base;
+    shapefile_main_header_boundingbox header_bb;
+    memset(&header_base, 0, sizeof(shapefile_main_header_base));
+    header_base.file_code = SHAPEFILE_FILE_CODE;
+    header_base.version = SHAPEFILE_VERSION;
+    header_base.shape_type = (int32_t) info.stype;
+    header_base.file_length = info.file_bytes / 2;
+    header_bb.xmin = info.xmin;
+    header_bb.ymin = info.ymin;
+    header_bb.xmax = info.xmax;
+    header_bb.ymax = info.ymax;
+    header_bb.zmin = info.zmin;
+    header_bb.zmax = info.zmax;
+    header_bb.mmin = info.mmin;
+    header_bb.mmax = info.mmax;
+    handle_endianness(header_base, header_bb);
+
+    memcpy(header, &header_base, sizeof(shapefile_main_header_base));
+    memcpy(header + sizeof(shapefile_main_header_base), &header_bb, sizeof(shapefile_main_header_boundingbox));
+  }
+
+  
+  bool read_shp_info(const std::string &path, shpinfo &info) {
+
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(!fp) {
+      log_error("couldn't open shapefile: %s\n", path.c_str());
+      return(false);
+    }
+
+    shapefile_main_header_base header_base;
+    shapefile_main_header_boundingbox header_bb;
+    bool status = read_main_header(fp, header_base, header_bb);
+    fclose(fp);
+
+    if(status) {
+      to_shpinfo(header_base, header_bb, info);
+    }
+    
+    return(status);
+  }
+
+  
+  bool shx_path(const std::string &shp_path, std::string &shxpath) {
+    
+    // the last literal ".shp" (x.shp.vacuum -> x.shx.vacuum), nothing in the directories
+    size_t pos = shp_path.rfind(".shp");
+    if(pos == std::string::npos) {
+      log_error("file must have .shp extension\n");
+      return(false);
+    }
+
+    shxpath = shp_path;
+    shxpath.replace(pos, 4, ".shx");
+    return(true);
+  }
+
+  
+  bool read_shx(const std::string &shp_path, std::vector<shx_entry> &entries) {
+
+    entries.clear();
+    
+    std::string shxpath;
+    if(!shx_path(shp_path, shxpath)) {
+      return(false);
+    }
+    
+    FILE *fp = fopen(shxpath.c_str(), "rb");
+    if(!fp) {
+      log_error("couldn't open shx index: %s\n", shxpath.c_str());
+      return(false);
+    }
+
+    shapefile_main_header_base header_base;
+    shapefile_main_header_boundingbox header_bb;
+    if(!read_main_header(fp, header_base, header_bb)) {
+      fclose(fp);
+      return(false);
+    }
+
+    uint32_t header_bytes = sizeof(shapefile_main_header_base) + sizeof(shapefile_main_header_boundingbox);
+    uint64_t file_bytes = 2 * (uint64_t) (uint32_t) header_base.file_length;
+    uint64_t num_records = (file_bytes > header_bytes) ? ((file_bytes - header_bytes) / sizeof(shapefile_record_header)) : 0;
+
+    std::vector<shapefile_record_header> raw(num_records);
+    if(num_records && (io_fread(raw.data(), sizeof(shapefile_record_header), num_records, fp) != num_records)) {
+      log_error("couldn't read shx records...\n");
+      fclose(fp);
+      return(false);
+    }
+
+    fclose(fp);
+
+    //
+    // the shx reuses the record header layout: record_number holds the offset, both in 16-bit words
+    //
+    entries.resize(num_records);
+    for(uint64_t ii=0; ii < num_records; ++ii) {
+      handle_endianness(raw[ii]);
+      entries[ii].offset = 2 * (uint64_t) (uint32_t) raw[ii].record_number;
+      entries[ii].content_bytes = 2 * (uint32_t) raw[ii].content_length;
+    }
+    
+    return(true);
+  }
+
+
+  bool write_shx(FILE *fp, const std::vector<uint64_t> &offsets, const std::vector<uint64_t> &content_bytes) {
+
+    const size_t CHUNK_ENTRIES = 8192;
+    std::vector<uint8_t> chunk;
+    chunk.reserve(CHUNK_ENTRIES * SHP_RECORD_HEADER_BYTES);
+    for(size_t idx=0; idx < content_bytes.size(); ++idx) {
+      if(((offsets[idx] / 2) > (uint64_t) INT32_MAX) || ((content_bytes[idx] / 2) > (uint64_t) INT32_MAX)) {
+	log_error("record %zu is past the shx offset limit\n", idx + 1);
+	return(false);
+      }
+
+      size_t pos = chunk.size();
+      chunk.resize(pos + SHP_RECORD_HEADER_BYTES);
+      store_BEint32(&chunk[pos], offsets[idx] / 2); // offset and length in 16-bit words
+      store_BEint32(&chunk[pos + sizeof(int32_t)], content_bytes[idx] / 2);
+      if((chunk.size() == chunk.capacity()) || ((idx + 1) == content_bytes.size())) {
+	if(io_fwrite(chunk.data(), chunk.size(), 1, fp) != 1) {
+	  log_error("couldn't write shx index\n");
+	  return(false);
+	}
+	chunk.clear();
+      }
+    }
+
     return(true);
   }
 
-
+  
   static shputil::shape_type determine_shape_type(const shapefile &shpfile) {
 
     shputil::shape_type stype = shputil::shape_type::null_shape;
@@ -560,8 +1171,8 @@ namespace shputil {
     shapefile_main_header_boundingbox header_bb = header_bb_in;
     handle_endianness(header_base, header_bb);
 	
-    if((fwrite(&header_base, sizeof(shapefile_main_header_base), 1, fp) != 1) ||
-       (fwrite(&header_bb, sizeof(shapefile_main_header_boundingbox), 1, fp) != 1)) {
+    if((io_fwrite(&header_base, sizeof(shapefile_main_header_base), 1, fp) != 1) ||
+       (io_fwrite(&header_bb, sizeof(shapefile_main_header_boundingbox), 1, fp) != 1)) {
       log_error("couldn't write shapefile header...\n");
       return(false);
     }
@@ -603,6 +1214,25 @@ namespace shputil {
   }
 
   
+  static bool set_file_length(shapefile_main_header_base &header_base, uint64_t record_bytes) {
+
+    //
+    // file_length (and every .shx offset) is a signed count of 16-bit words, so a single
+    // .shp tops out just under 4 GB. refuse up front instead of writing a wrapped header,
+    // write_sharded() splits larger layers.
+    //
+    
+    uint64_t file_bytes = sizeof(shapefile_main_header_base) + sizeof(shapefile_main_header_boundingbox) + record_bytes;
+    if((file_bytes / 2) > (uint64_t) INT32_MAX) {
+      log_error("shapefile would be %llu bytes, over the format limit (use write_sharded)\n", (unsigned long long) file_bytes);
+      return(false);
+    }
+
+    header_base.file_length = file_bytes / 2; // reported as the # of 16-bit words
+    return(true);
+  }
+
+  
   static bool write_point_shapes(FILE *fp, FILE *shxfp, const shapefile &shpfile) {
 
     log("write_point_shapes: %d point(s)\n", shpfile.shapes.size());
@@ -614,10 +1244,13 @@ namespace shputil {
     header_base.file_code = SHAPEFILE_FILE_CODE;
     header_base.version = SHAPEFILE_VERSION;
     header_base.shape_type = (int32_t) shape_type::point;
-    header_base.file_length = sizeof(shapefile_main_header_base) + sizeof(shapefile_main_header_boundingbox) +
-      (shpfile.shapes.size() * (POINT_RECORD_SIZE + sizeof(shapefile_record_header)));
-    header_base.file_length = header_base.file_length / 2; // reported as the # of 16-bit words
-    determine_point_shape_bb(shpfile, header_bb);
+    if(!set_file_length(header_base, (uint64_t) shpfile.shapes.size() * (POINT_RECORD_SIZE + sizeof(shapefile_record_header)))) {
+      return(false);
+    }
+    {
+      io_phase_timer timer(io_phase::bbox);
+      determine_point_shape_bb(shpfile, header_bb);
+    }
     
     if(!write_main_header(fp, header_base, header_bb)) {
       log_error("couldn't write shapefile main header\n");
@@ -653,13 +1286,13 @@ namespace shputil {
       shx_rh.content_length = rh.content_length;  // shx reports the same content_length
 
       handle_endianness(shx_rh);
-      if(fwrite(&shx_rh, sizeof(shapefile_record_header), 1, shxfp) != 1) {
+      if(io_fwrite(&shx_rh, sizeof(shapefile_record_header), 1, shxfp) != 1) {
 	log_error("couldn't write point shx record\n");
 	return(false);
       }
       
       handle_endianness(rh);
-      if(fwrite(&rh, sizeof(shapefile_record_header), 1, fp) != 1) {
+      if(io_fwrite(&rh, sizeof(shapefile_record_header), 1, fp) != 1) {
 	log_error("couldn't write point record header\n");
 	return(false);
       }
@@ -673,7 +1306,7 @@ namespace shputil {
 #endif
       memcpy(record_content + sizeof(int32_t), &x, sizeof(double));
       memcpy(record_content + sizeof(int32_t) + sizeof(double), &y, sizeof(double));
-      if(fwrite(record_content, POINT_RECORD_SIZE, 1, fp) != 1) {
+      if(io_fwrite(record_content, POINT_RECORD_SIZE, 1, fp) != 1) {
 	log_error("couldn't write point shape record\n");
 	return(false);
       }
@@ -683,7 +1316,7 @@ namespace shputil {
   }
 
 
-  static void determine_multipoint_bb(const std::vector<pointshape> &points, shapefile_main_header_boundingbox &header_bb) {
+  static void determine_multipoint_bb(const std::pmr::vector<pointshape> &points, shapefile_main_header_boundingbox &header_bb) {
     memset(&header_bb, 0, sizeof(shapefile_main_header_boundingbox));
     bool first = true;
     for(const pointshape &ps : points) {
@@ -708,14 +1341,14 @@ namespace shputil {
   }
 
   
-  static int32_t determine_multipoint_shape_bb(const shapefile &shpfile, shapefile_main_header_boundingbox &header_bb) {
+  static uint64_t determine_multipoint_shape_bb(const shapefile &shpfile, shapefile_main_header_boundingbox &header_bb) {
 
     //
     // returns the number of points within all the multipoint shapes
     //
    
-    int32_t numpoints = 0;
-    std::vector<pointshape> points;
+    uint64_t numpoints = 0;
+    std::pmr::vector<pointshape> points;
     
     for(auto &ptr : shpfile.shapes) {
 
@@ -742,14 +1375,18 @@ namespace shputil {
     const int32_t MULTIPOINT_BASE_SIZE = 40; // in bytes: int32_t shapetype + double bb[4] + int32_t numpoints
     shapefile_main_header_base header_base;
     shapefile_main_header_boundingbox header_bb;
-    int32_t numpoints = determine_multipoint_shape_bb(shpfile, header_bb);
+    uint64_t numpoints = 0;
+    {
+      io_phase_timer timer(io_phase::bbox);
+      numpoints = determine_multipoint_shape_bb(shpfile, header_bb);
+    }
     memset(&header_base, 0, sizeof(shapefile_main_header_base));
     header_base.file_code = SHAPEFILE_FILE_CODE;
     header_base.version = SHAPEFILE_VERSION;
     header_base.shape_type = (int32_t) shape_type::multipoint;
-    header_base.file_length = sizeof(shapefile_main_header_base) + sizeof(shapefile_main_header_boundingbox) +
-      (shpfile.shapes.size() * (MULTIPOINT_BASE_SIZE + sizeof(shapefile_record_header))) + (numpoints * 2 * sizeof(double));
-    header_base.file_length = header_base.file_length / 2; // reported as the # of 16-bit words
+    if(!set_file_length(header_base, ((uint64_t) shpfile.shapes.size() * (MULTIPOINT_BASE_SIZE + sizeof(shapefile_record_header))) + (numpoints * 2 * sizeof(double)))) {
+      return(false);
+    }
 
     if(!write_main_header(fp, header_base, header_bb)) {
       log_error("couldn't write shapefile main header\n");
@@ -787,13 +1424,13 @@ namespace shputil {
       shx_rh.content_length = rh.content_length;  // shx reports the same content_length
 
       handle_endianness(shx_rh);
-      if(fwrite(&shx_rh, sizeof(shapefile_record_header), 1, shxfp) != 1) {
+      if(io_fwrite(&shx_rh, sizeof(shapefile_record_header), 1, shxfp) != 1) {
 	log_error("couldn't write multipoint shx record\n");
 	return(false);
       }
       
       handle_endianness(rh);
-      if(fwrite(&rh, sizeof(shapefile_record_header), 1, fp) != 1) {
+      if(io_fwrite(&rh, sizeof(shapefile_record_header), 1, fp) != 1) {
 	log_error("couldn't write multipoint record header\n");
 	return(false);
       }
@@ -806,17 +1443,17 @@ namespace shputil {
       numpoints = __builtin_bswap32(numpoints);
 #endif
 
-      if(fwrite(&stype, sizeof(int32_t), 1, fp) != 1) {
+      if(io_fwrite(&stype, sizeof(int32_t), 1, fp) != 1) {
 	log_error("couldn't write multipoint stype\n");
 	return(false);
       }
       
-      if(fwrite(&shape_bb, sizeof(double) * 4, 1, fp) != 1) {
+      if(io_fwrite(&shape_bb, sizeof(double) * 4, 1, fp) != 1) {
 	log_error("couldn't write multipoint bb\n");
 	return(false);
       }
 
-      if(fwrite(&numpoints, sizeof(int32_t), 1, fp) != 1) {
+      if(io_fwrite(&numpoints, sizeof(int32_t), 1, fp) != 1) {
 	log_error("couldn't write multipoint numpoints\n");
 	return(false);
       }
@@ -829,8 +1466,8 @@ namespace shputil {
 	y = swap_endianness_dbl(y);
 #endif
 
-	if((fwrite(&x, sizeof(double), 1, fp) != 1) ||
-	   (fwrite(&y, sizeof(double), 1, fp) != 1)) {
+	if((io_fwrite(&x, sizeof(double), 1, fp) != 1) ||
+	   (io_fwrite(&y, sizeof(double), 1, fp) != 1)) {
 	  log_error("couldn't write multipoint x,y\n");
 	  return(false);
 	}
@@ -843,13 +1480,13 @@ namespace shputil {
   }
 
   
-  static int32_t determine_polypart_bb(const std::vector<polypart> &parts, shapefile_main_header_boundingbox &header_bb) {
+  static uint64_t determine_polypart_bb(const std::pmr::vector<polypart> &parts, shapefile_main_header_boundingbox &header_bb) {
 
     //
     // returns the number of points within all the polyparts
     //
 
-    int32_t numpoints = 0;
+    uint64_t numpoints = 0;
     
     memset(&header_bb, 0, sizeof(shapefile_main_header_boundingbox));
     bool first = true;
@@ -884,13 +1521,13 @@ namespace shputil {
   }
 
   
-  static int32_t determine_polypart_bb(const shapefile &shpfile, shapefile_main_header_boundingbox &header_bb) {
+  static uint64_t determine_polypart_bb(const shapefile &shpfile, shapefile_main_header_boundingbox &header_bb) {
 
     //
     // returns the number of bytes required to store this polyline/polygon
     //
     
-    std::vector<polypart> parts;
+    std::pmr::vector<polypart> parts;
     for(auto &ptr : shpfile.shapes) {
       
       if(ptr->stype() == shape_type::polyline) {
@@ -904,9 +1541,9 @@ namespace shputil {
 
     }
     
-    int32_t numpoints = determine_polypart_bb(parts, header_bb);
-    int32_t bytes_required = (shpfile.shapes.size() * (POLY_BASE_RECORD_SIZE + sizeof(shapefile_record_header))) +
-			      (sizeof(int32_t) * parts.size()) + (2 * sizeof(double) * numpoints);    
+    uint64_t numpoints = determine_polypart_bb(parts, header_bb);
+    uint64_t bytes_required = ((uint64_t) shpfile.shapes.size() * (POLY_BASE_RECORD_SIZE + sizeof(shapefile_record_header))) +
+			      (sizeof(int32_t) * (uint64_t) parts.size()) + (2 * sizeof(double) * numpoints);    
     
     return(bytes_required);
   }
@@ -920,9 +1557,14 @@ namespace shputil {
     header_base.file_code = SHAPEFILE_FILE_CODE;
     header_base.version = SHAPEFILE_VERSION;
     header_base.shape_type = (int32_t) shape_type;
-    int32_t bytes_required = determine_polypart_bb(shpfile, header_bb);
-    header_base.file_length = sizeof(shapefile_main_header_base) + sizeof(shapefile_main_header_boundingbox) + bytes_required;
-    header_base.file_length = header_base.file_length / 2; // reported as the # of 16-bit words
+    uint64_t bytes_required = 0;
+    {
+      io_phase_timer timer(io_phase::bbox);
+      bytes_required = determine_polypart_bb(shpfile, header_bb);
+    }
+    if(!set_file_length(header_base, bytes_required)) {
+      return(false);
+    }
     
     if(!write_main_header(fp, header_base, header_bb)) {
       log_error("couldn't write shapefile main header\n");
@@ -946,7 +1588,7 @@ namespace shputil {
     
     for(auto &ptr : shpfile.shapes) {
 
-      const std::vector<polypart> &parts = (shape_type == shape_type::polyline) ? ((polyline *)ptr.get())->parts : ((polygon *)ptr.get())->rings;
+      const std::pmr::vector<polypart> &parts = (shape_type == shape_type::polyline) ? ((polyline *)ptr.get())->parts : ((polygon *)ptr.get())->rings;
       shapefile_main_header_boundingbox shape_bb; // used here just for bbox computation
       int numpoints = determine_polypart_bb(parts, shape_bb);
       int numparts = parts.size();
@@ -961,13 +1603,13 @@ namespace shputil {
       shx_rh.content_length = rh.content_length;  // shx reports the same content_length
 
       handle_endianness(shx_rh);
-      if(fwrite(&shx_rh, sizeof(shapefile_record_header), 1, shxfp) != 1) {
+      if(io_fwrite(&shx_rh, sizeof(shapefile_record_header), 1, shxfp) != 1) {
 	log_error("couldn't write polypart shx record\n");
 	return(false);
       }
 
       handle_endianness(rh);
-      if(fwrite(&rh, sizeof(shapefile_record_header), 1, fp) != 1) {
+      if(io_fwrite(&rh, sizeof(shapefile_record_header), 1, fp) != 1) {
 	log_error("couldn't write polypart record header\n");
 	return(false);
       }
@@ -981,22 +1623,22 @@ namespace shputil {
       numpoints = __builtin_bswap32(numpoints);
 #endif
 
-      if(fwrite(&stype, sizeof(int32_t), 1, fp) != 1) {
+      if(io_fwrite(&stype, sizeof(int32_t), 1, fp) != 1) {
 	log_error("couldn't write polypart stype\n");
 	return(false);
       }
       
-      if(fwrite(&shape_bb, sizeof(double) * 4, 1, fp) != 1) {
+      if(io_fwrite(&shape_bb, sizeof(double) * 4, 1, fp) != 1) {
 	log_error("couldn't write polypart bb\n");
 	return(false);
       }
 
-      if(fwrite(&numparts, sizeof(int32_t), 1, fp) != 1) {
+      if(io_fwrite(&numparts, sizeof(int32_t), 1, fp) != 1) {
 	log_error("couldn't write polypart numparts\n");
 	return(false);
       }
 
-      if(fwrite(&numpoints, sizeof(int32_t), 1, fp) != 1) {
+      if(io_fwrite(&numpoints, sizeof(int32_t), 1, fp) != 1) {
 	log_error("couldn't write polypart numpoints\n");
 	return(false);
       }
@@ -1012,7 +1654,7 @@ namespace shputil {
 	idxtowrite = __builtin_bswap32(idxtowrite);
 #endif
 
-	if(fwrite(&idxtowrite, sizeof(int32_t), 1, fp) != 1) {
+	if(io_fwrite(&idxtowrite, sizeof(int32_t), 1, fp) != 1) {
 	  log_error("couldn't write polypart part idx\n");
 	  return(false);
 	}
@@ -1031,8 +1673,8 @@ namespace shputil {
 	  x = swap_endianness_dbl(x);
 	  y = swap_endianness_dbl(y);
 #endif
-	  if((fwrite(&x, sizeof(double), 1, fp) != 1) ||
-	     (fwrite(&y, sizeof(double), 1, fp) != 1)) {
+	  if((io_fwrite(&x, sizeof(double), 1, fp) != 1) ||
+	     (io_fwrite(&y, sizeof(double), 1, fp) != 1)) {
 	    log_error("couldn't write polyline x,y\n");
 	    return(false);
 	  }
@@ -1059,9 +1701,8 @@ namespace shputil {
     
   bool write_shp(const std::string &path, const shapefile &shpfile) {
 
-    std::string shxpath = std::regex_replace(path, std::regex(".shp"), ".shx");
-    if(shxpath == path) {
-      log_error("file must have .shp extension\n");
+    std::string shxpath;
+    if(!shx_path(path, shxpath)) {
       return(false);
     }
         
@@ -1080,6 +1721,7 @@ namespace shputil {
     
     shputil::shape_type stype = determine_shape_type(shpfile);
 
+    io_phase_timer timer(io_phase::records);
     bool status = false;
     switch(stype) {
     case shape_type::point: status = write_point_shapes(fp, shxfp, shpfile); break;
@@ -1096,5 +1738,507 @@ namespace shputil {
     
     return(status);
   }
+
+
+  static bool patch_header(FILE *fp, const shpinfo &info) {
+    uint8_t header[SHP_HEADER_BYTES];
+    encode_shp_header(info, header);
+    return((fseek(fp, 0, SEEK_SET) == 0) && (io_fwrite(header, SHP_HEADER_BYTES, 1, fp) == 1));
+  }
+
+  
+  bool append_shp(const std::string &path, const shapefile &shpfile) {
+
+    std::string shxpath;
+    shpinfo info;
+    if(!shx_path(path, shxpath) || !read_shp_info(path, info)) {
+      return(false);
+    }
+
+    if((xy_type(info.stype) != info.stype) || (info.stype == shape_type::null_shape)) {
+      log_error("can't append to shape_type: %d\n", (int) info.stype);
+      return(false);
+    }
+
+    FILE *fp = fopen(path.c_str(), "r+b");
+    FILE *shxfp = fopen(shxpath.c_str(), "r+b");
+    if(!fp || !shxfp) {
+      log_error("couldn't open %s/.shx for appending\n", path.c_str());
+      if(fp) fclose(fp);
+      if(shxfp) fclose(shxfp);
+      return(false);
+    }
+
+    //
+    // the headers' lengths must agree with the files, otherwise the tail isn't where we think
+    //
+    uint8_t shxheader[SHP_HEADER_BYTES];
+    shpinfo shxinfo;
+    bool status = (fseek(fp, 0, SEEK_END) == 0) && ((uint64_t) ftell(fp) == info.file_bytes) &&
+      (io_fread(shxheader, SHP_HEADER_BYTES, 1, shxfp) == 1) && parse_shp_header(shxheader, shxinfo) &&
+      (fseek(shxfp, 0, SEEK_END) == 0) && ((uint64_t) ftell(shxfp) == shxinfo.file_bytes) &&
+      (((shxinfo.file_bytes - SHP_HEADER_BYTES) % SHP_RECORD_HEADER_BYTES) == 0);
+    if(!status) {
+      log_error("shp/shx lengths don't match their headers: %s\n", path.c_str());
+    }
+
+    for(size_t idx=0; status && (idx < shpfile.shapes.size()); ++idx) {
+      shputil::shape_type st = shpfile.shapes[idx]->stype();
+      if((st != info.stype) && (st != shape_type::null_shape)) {
+	log_error("record shape_type mismatch, expected %d...\n", (int) info.stype);
+	status = false;
+      }
+    }
+
+    bool appending = status;
+    uint64_t shp_bytes = info.file_bytes;
+    uint64_t shx_bytes = shxinfo.file_bytes;
+    uint64_t existing = status ? (shxinfo.file_bytes - SHP_HEADER_BYTES) / SHP_RECORD_HEADER_BYTES : 0;
+    bool first = (existing == 0);
+    std::vector<uint8_t> record;
+    std::vector<uint64_t> offsets, content_sizes;
+    for(size_t idx=0; status && (idx < shpfile.shapes.size()); ++idx) {
+      const shape_ptr &shp = shpfile.shapes[idx];
+      uint64_t content_bytes = encoded_content_bytes(shp);
+      uint64_t record_bytes = SHP_RECORD_HEADER_BYTES + content_bytes;
+      if(((info.file_bytes + record_bytes) / 2) > (uint64_t) INT32_MAX) {
+	log_error("append would exceed the shapefile size limit\n");
+	status = false;
+	break;
+      }
+
+      record.resize(record_bytes);
+      if(!encode_record(shp, existing + idx + 1, record.data())) {
+	status = false;
+	break;
+      }
+
+      if(io_fwrite(record.data(), record_bytes, 1, fp) != 1) {
+	log_error("couldn't append record\n");
+	status = false;
+	break;
+      }
+
+      offsets.push_back(info.file_bytes);
+      content_sizes.push_back(content_bytes);
+      info.file_bytes += record_bytes;
+      shxinfo.file_bytes += SHP_RECORD_HEADER_BYTES;
+
+      double xmin, ymin, xmax, ymax;
+      if(shape_bounds(shp, xmin, ymin, xmax, ymax)) {
+	if(first || (xmin < info.xmin)) info.xmin = xmin;
+	if(first || (ymin < info.ymin)) info.ymin = ymin;
+	if(first || (xmax > info.xmax)) info.xmax = xmax;
+	if(first || (ymax > info.ymax)) info.ymax = ymax;
+	first = false;
+      }
+    }
+
+    //
+    // records are in place, now their .shx entries and the headers
+    //
+    status = status && write_shx(shxfp, offsets, content_sizes);
+    if(status) {
+      shxinfo.xmin = info.xmin;
+      shxinfo.ymin = info.ymin;
+      shxinfo.xmax = info.xmax;
+      shxinfo.ymax = info.ymax;
+      status = patch_header(fp, info) && patch_header(shxfp, shxinfo);
+      if(!status) {
+	log_error("couldn't update the shp/shx headers\n");
+      }
+    }
+    else if(appending) {
+      // drop the partial tail, the old headers still describe the old lengths
+      fflush(fp);
+      fflush(shxfp);
+      if((ftruncate(fileno(fp), shp_bytes) != 0) || (ftruncate(fileno(shxfp), shx_bytes) != 0)) {
+	log_error("couldn't roll back the partial append: %s\n", path.c_str());
+      }
+    }
+
+    fclose(fp);
+    fclose(shxfp);
+    return(status);
+  }
+
+  
+  bool null_records(const std::string &path, const std::vector<uint32_t> &recnos) {
+
+    std::vector<shx_entry> index;
+    if(!read_shx(path, index)) {
+      return(false);
+    }
+
+    for(uint32_t recno : recnos) {
+      if(recno >= index.size()) {
+	log_error("record %u out of range\n", recno); // before any write, as in mark_deleted
+	return(false);
+      }
+    }
+
+    FILE *fp = fopen(path.c_str(), "r+b");
+    if(!fp) {
+      log_error("couldn't open shapefile for update: %s\n", path.c_str());
+      return(false);
+    }
+
+    bool status = true;
+    uint8_t null_type[sizeof(int32_t)];
+    store_LEint32(null_type, (int32_t) shape_type::null_shape);
+    for(uint32_t recno : recnos) {
+      if((fseek(fp, index[recno].offset + SHP_RECORD_HEADER_BYTES, SEEK_SET) != 0) ||
+	 (io_fwrite(null_type, sizeof(null_type), 1, fp) != 1)) {
+	log_error("couldn't null record %u\n", recno);
+	status = false;
+	break;
+      }
+    }
+
+    if(fclose(fp) != 0) {
+      status = false;
+    }
+    
+    return(status);
+  }
+
+
+  bool record_bounds(const uint8_t *content, uint32_t content_bytes, double *bb) {
+
+    shputil::shape_type stype = xy_type((shputil::shape_type) fetch_LEint32(content));
+    if(stype == shape_type::point) {
+      if(content_bytes < 20) {
+	return(false);
+      }
+      bb[0] = bb[2] = fetch_LEdouble(content + sizeof(int32_t));
+      bb[1] = bb[3] = fetch_LEdouble(content + sizeof(int32_t) + sizeof(double));
+      return(true);
+    }
+
+    if((stype == shape_type::null_shape) || (content_bytes < (sizeof(int32_t) + (4 * sizeof(double))))) {
+      return(false);
+    }
+
+    for(int idx=0; idx < 4; ++idx) {
+      bb[idx] = fetch_LEdouble(content + sizeof(int32_t) + (idx * sizeof(double)));
+    }
+    return(true);
+  }
+
+
+  bool parse_record_parts(const uint8_t *content, uint32_t content_bytes, parts_view &view) {
+
+    view.numparts = 0;
+    view.numpoints = 0;
+    view.parts = 0;
+    view.points = 0;
+    if(content_bytes < sizeof(int32_t)) {
+      return(false);
+    }
+
+    const uint32_t BB_END = sizeof(int32_t) + (4 * sizeof(double));
+    view.stype = xy_type((shape_type) load_LEint32(content));
+    switch(view.stype) {
+    case shape_type::null_shape:
+      return(true);
+
+    case shape_type::point:
+      if(content_bytes < (sizeof(int32_t) + 16)) {
+	return(false);
+      }
+      view.numparts = 1;
+      view.numpoints = 1;
+      view.points = content + sizeof(int32_t);
+      return(true);
+
+    case shape_type::multipoint: {
+      if(content_bytes < (BB_END + sizeof(int32_t))) {
+	return(false);
+      }
+      uint32_t count = load_LEint32(content + BB_END);
+      if(((content_bytes - BB_END - sizeof(int32_t)) / 16) < count) {
+	return(false);
+      }
+      view.numparts = 1;
+      view.numpoints = count;
+      view.points = content + BB_END + sizeof(int32_t);
+      return(true);
+    }
+
+    case shape_type::polyline:
+    case shape_type::polygon: {
+      if(content_bytes < (BB_END + (2 * sizeof(int32_t)))) {
+	return(false);
+      }
+      uint64_t numparts = (uint32_t) load_LEint32(content + BB_END);
+      uint64_t numpoints = (uint32_t) load_LEint32(content + BB_END + sizeof(int32_t));
+      uint64_t parts_offset = BB_END + (2 * sizeof(int32_t));
+      uint64_t points_offset = parts_offset + (sizeof(int32_t) * numparts);
+      if((points_offset + (16 * numpoints)) > content_bytes) {
+	return(false);
+      }
+
+      uint32_t prev = 0;
+      for(uint64_t part=0; part < numparts; ++part) {
+	uint32_t start = load_LEint32(content + parts_offset + (sizeof(int32_t) * part));
+	if((part == 0) ? (start != 0) : ((start < prev) || (start > numpoints))) {
+	  return(false);
+	}
+	prev = start;
+      }
+
+      view.numparts = numparts;
+      view.numpoints = numpoints;
+      view.parts = content + parts_offset;
+      view.points = content + points_offset;
+      return(true);
+    }
+
+    default:
+      break;
+    }
+
+    return(false);
+  }
+
+  
+  bool write_compacted_shp(const std::string &path, const std::vector<bool> &keep, const std::string &out_path) {
+
+    std::string tmppath = out_path, tmpshxpath;
+    if(!shx_path(out_path, tmpshxpath)) {
+      return(false);
+    }
+
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(!fp) {
+      log_error("couldn't open shapefile: %s\n", path.c_str());
+      return(false);
+    }
+
+    shapefile_main_header_base header_base;
+    shapefile_main_header_boundingbox header_bb;
+    if(!read_main_header(fp, header_base, header_bb)) {
+      fclose(fp);
+      return(false);
+    }
+
+    shpinfo info;
+    to_shpinfo(header_base, header_bb, info);
+
+    FILE *outfp = fopen(tmppath.c_str(), "wb");
+    FILE *shxfp = fopen(tmpshxpath.c_str(), "wb");
+    if(!outfp || !shxfp) {
+      log_error("couldn't create %s\n", tmppath.c_str());
+      fclose(fp);
+      if(outfp) fclose(outfp);
+      if(shxfp) fclose(shxfp);
+      return(false);
+    }
+
+    //
+    // one record in memory at a time, headers are rewritten once the totals are known
+    //
+    uint8_t placeholder[SHP_HEADER_BYTES];
+    memset(placeholder, 0, SHP_HEADER_BYTES);
+    bool status = (io_fwrite(placeholder, SHP_HEADER_BYTES, 1, outfp) == 1) &&
+      (io_fwrite(placeholder, SHP_HEADER_BYTES, 1, shxfp) == 1);
+
+    shapefile_record_reader reader;
+    init_record_reader(fp, header_base, reader);
+    uint64_t recno = 0;
+    int32_t kept = 0;
+    uint64_t out_bytes = SHP_HEADER_BYTES;
+    bool first = true;
+    while(status && read_shape_record(reader)) {
+      bool keep_record = (recno < keep.size()) && keep[recno];
+      recno += 1;
+      if(!keep_record) {
+	continue;
+      }
+
+      shapefile_record_header rh;
+      rh.record_number = ++kept;
+      rh.content_length = reader.current_content_bytes / 2;
+      shapefile_record_header shx_rh;
+      shx_rh.record_number = out_bytes / 2;
+      shx_rh.content_length = rh.content_length;
+      handle_endianness(rh);
+      handle_endianness(shx_rh);
+      if((io_fwrite(&rh, sizeof(shapefile_record_header), 1, outfp) != 1) ||
+	 (io_fwrite(reader.record_buf, reader.current_content_bytes, 1, outfp) != 1) ||
+	 (io_fwrite(&shx_rh, sizeof(shapefile_record_header), 1, shxfp) != 1)) {
+	log_error("couldn't write compacted record\n");
+	status = false;
+	break;
+      }
+      out_bytes += sizeof(shapefile_record_header) + reader.current_content_bytes;
+
+      double bb[4];
+      if(record_bounds(reader.record_buf, reader.current_content_bytes, bb)) {
+	if(first || (bb[0] < info.xmin)) info.xmin = bb[0];
+	if(first || (bb[1] < info.ymin)) info.ymin = bb[1];
+	if(first || (bb[2] > info.xmax)) info.xmax = bb[2];
+	if(first || (bb[3] > info.ymax)) info.ymax = bb[3];
+	first = false;
+      }
+    }
+    status = status && reached_end(reader);
+
+    close_record_reader(reader);
+    fclose(fp);
+
+    if(first) {
+      info.xmin = info.ymin = info.xmax = info.ymax = 0.0;
+    }
+
+    if(status) {
+      shpinfo shxinfo = info;
+      info.file_bytes = out_bytes;
+      shxinfo.file_bytes = SHP_HEADER_BYTES + (SHP_RECORD_HEADER_BYTES * (uint64_t) kept);
+      status = patch_header(outfp, info) && patch_header(shxfp, shxinfo);
+    }
+
+    status = (fclose(outfp) == 0) && status;
+    status = (fclose(shxfp) == 0) && status;
+    if(!status) {
+      remove(tmppath.c_str());
+      remove(tmpshxpath.c_str());
+    }
+
+    return(status);
+  }
+
+
+  bool compact_shp(const std::string &path, const std::vector<bool> &keep) {
+
+    std::string shxpath, tmpshxpath;
+    std::string tmppath = path + ".vacuum";
+    if(!shx_path(path, shxpath) || !shx_path(tmppath, tmpshxpath) || !write_compacted_shp(path, keep, tmppath)) {
+      return(false);
+    }
+
+    if((rename(tmppath.c_str(), path.c_str()) != 0) || (rename(tmpshxpath.c_str(), shxpath.c_str()) != 0)) {
+      log_error("couldn't replace %s with its compacted copy\n", path.c_str());
+      remove(tmppath.c_str());
+      remove(tmpshxpath.c_str());
+      return(false);
+    }
+
+    return(true);
+  }
+
+  
+  bool shape_bounds(const shape_ptr &shp, double &xmin, double &ymin, double &xmax, double &ymax) {
+
+    switch(xy_type(shp->stype())) {
+    case shape_type::point: return(shape_bounds(*(const pointshape *) shp.get(), xmin, ymin, xmax, ymax));
+    case shape_type::multipoint: return(shape_bounds(*(const multipointshape *) shp.get(), xmin, ymin, xmax, ymax));
+    case shape_type::polyline: return(shape_bounds(*(const polyline *) shp.get(), xmin, ymin, xmax, ymax));
+    case shape_type::polygon: return(shape_bounds(*(const polygon *) shp.get(), xmin, ymin, xmax, ymax));
+    default:
+      break;
+    }
+
+    return(false);
+  }
+
+
+  uint32_t hilbert_key(uint32_t x, uint32_t y) {
+
+    // classic xy -> d walk, rotating the quadrant at every level
+    uint32_t d = 0;
+    for(uint32_t s = (1 << 15); s > 0; s >>= 1) {
+      uint32_t rx = (x & s) ? 1 : 0;
+      uint32_t ry = (y & s) ? 1 : 0;
+      d += s * s * ((3 * rx) ^ ry);
+      if(ry == 0) {
+	if(rx == 1) {
+	  x = (s - 1) - (x & (s - 1));
+	  y = (s - 1) - (y & (s - 1));
+	}
+	uint32_t t = x;
+	x = y;
+	y = t;
+      }
+      x &= (s - 1);
+      y &= (s - 1);
+    }
+
+    return(d);
+  }
+
+
+  static uint32_t grid_cell(double v, double vmin, double vmax) {
+    if(!(vmax > vmin)) {
+      return(0);
+    }
+    double cell = ((v - vmin) / (vmax - vmin)) * 65535.0;
+    return((cell <= 0.0) ? 0 : ((cell >= 65535.0) ? 65535 : (uint32_t) cell));
+  }
+
+  
+  void hilbert_order(const shapefile &shpfile, std::vector<uint32_t> &order) {
+
+    size_t count = shpfile.shapes.size();
+    std::vector<double> centers(2 * count, 0.0);
+    std::vector<bool> present(count, false);
+    double xmin = 0.0, ymin = 0.0, xmax = 0.0, ymax = 0.0;
+    bool first = true;
+    for(size_t idx=0; idx < count; ++idx) {
+      double bxmin, bymin, bxmax, bymax;
+      if(!shape_bounds(shpfile.shapes[idx], bxmin, bymin, bxmax, bymax)) {
+	continue;
+      }
+
+      double cx = 0.5 * (bxmin + bxmax);
+      double cy = 0.5 * (bymin + bymax);
+      centers[2 * idx] = cx;
+      centers[(2 * idx) + 1] = cy;
+      present[idx] = true;
+      if(first || (cx < xmin)) xmin = cx;
+      if(first || (cy < ymin)) ymin = cy;
+      if(first || (cx > xmax)) xmax = cx;
+      if(first || (cy > ymax)) ymax = cy;
+      first = false;
+    }
+
+    // null shapes get a key past every 32 bit hilbert key
+    std::vector<uint64_t> keys(count, ((uint64_t) 1) << 32);
+    for(size_t idx=0; idx < count; ++idx) {
+      if(present[idx]) {
+	keys[idx] = hilbert_key(grid_cell(centers[2 * idx], xmin, xmax), grid_cell(centers[(2 * idx) + 1], ymin, ymax));
+      }
+    }
+
+    order.resize(count);
+    for(size_t idx=0; idx < count; ++idx) {
+      order[idx] = idx;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&keys](uint32_t a, uint32_t b) { return(keys[a] < keys[b]); });
+  }
+
+
+  bool write_shp(const std::string &path, const shapefile &shpfile, const write_opts &opts, std::vector<uint32_t> &order) {
+
+    if(!opts.hilbert_order) {
+      order.resize(shpfile.shapes.size());
+      for(size_t idx=0; idx < order.size(); ++idx) {
+	order[idx] = idx;
+      }
+      return(write_shp(path, shpfile));
+    }
+
+    hilbert_order(shpfile, order);
+
+    // shared pointers only, the geometry itself isn't copied
+    shapefile sorted;
+    sorted.shapes.reserve(order.size());
+    for(uint32_t idx : order) {
+      sorted.shapes.push_back(shpfile.shapes[idx]);
+    }
+
+    return(write_shp(path, sorted));
+  }
   
 } // namespace shputil
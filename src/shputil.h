@@ -2,16 +2,25 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
 #include <vector>
 #include <string>
 #include <memory>
+#include <memory_resource>
+#include <cstring>
+
+#ifdef __APPLE__
+  #include <machine/endian.h>
+#else
+  #include <endian.h>
+#endif
 
 namespace shputil {
 
   enum class shape_type {
     null_shape=0, point=1, polyline=3, polygon=5, multipoint=8,
     pointz=11, polylinez=13, polygonz=15, multipointz=18,
-    pointm=21, polylinem=23, multipointm=28, multipatch=31
+    pointm=21, polylinem=23, polygonm=25, multipointm=28, multipatch=31
   };
   
   class shape {
@@ -29,41 +38,281 @@ namespace shputil {
     double y;
   };
 
+  //
+  // every container below is a std::pmr one. a default constructed shape uses the default
+  // resource (plain new/delete); the memory_resource constructors, and the pmr vectors
+  // holding polyparts, put the whole shape in one resource. read_shp decodes into the
+  // resource of shpfile.shapes, so a layer loaded into a monotonic_buffer_resource is
+  // released in one shot:
+  //
+  //   std::pmr::monotonic_buffer_resource arena(1 << 20);
+  //   shapefile shpfile(&arena); // destroy it (and every shape_ptr) before the arena
+  //   read_shp(path, shpfile);
+  //
   class multipointshape : public shape {
   public:
+    multipointshape() { }
+    explicit multipointshape(std::pmr::memory_resource *mr) : points(mr) { }
     shputil::shape_type stype() { return(shputil::shape_type::multipoint); }
-    std::vector<pointshape> points;
+    std::pmr::vector<pointshape> points;
   };
 
   class polypart {
   public:
-    std::vector<pointshape> points;
+    typedef std::pmr::polymorphic_allocator<polypart> allocator_type;
+    polypart() { }
+    polypart(const polypart &other) = default;
+    polypart(polypart &&other) = default;
+    explicit polypart(const allocator_type &alloc) : points(alloc) { }
+    polypart(const polypart &other, const allocator_type &alloc) : points(other.points, alloc) { }
+    polypart(polypart &&other, const allocator_type &alloc) : points(std::move(other.points), alloc) { }
+    polypart &operator=(const polypart &other) = default;
+    polypart &operator=(polypart &&other) = default;
+    std::pmr::vector<pointshape> points;
   };
   
   class polyline : public shape {
   public:
     polyline() { }
+    explicit polyline(std::pmr::memory_resource *mr) : parts(mr) { }
     polyline(const polypart &line) { parts.push_back(line); }
     shputil::shape_type stype() { return(shputil::shape_type::polyline); }
-    std::vector<polypart> parts;
+    std::pmr::vector<polypart> parts;
   };
 
   class polygon : public shape {
   public:
     polygon() { }
+    explicit polygon(std::pmr::memory_resource *mr) : rings(mr) { }
     polygon(const polypart &ring) { rings.push_back(ring); }
     shputil::shape_type stype() { return(shputil::shape_type::polygon); }
-    std::vector<polypart> rings;
+    std::pmr::vector<polypart> rings;
   };
 
+  //
+  // z and m records decode into their xy base class, so 2d code can cast them the same
+  // way. only stype() tells them apart, the z/m arrays in the record are never touched,
+  // read_zm decodes them into columns when they're wanted.
+  //
+  template <class base, shputil::shape_type zmtype>
+  class zmshape : public base {
+  public:
+    using base::base;
+    shputil::shape_type stype() { return(zmtype); }
+  };
+
+  typedef zmshape<pointshape, shape_type::pointz> pointzshape;
+  typedef zmshape<pointshape, shape_type::pointm> pointmshape;
+  typedef zmshape<multipointshape, shape_type::multipointz> multipointzshape;
+  typedef zmshape<multipointshape, shape_type::multipointm> multipointmshape;
+  typedef zmshape<polyline, shape_type::polylinez> polylinez;
+  typedef zmshape<polyline, shape_type::polylinem> polylinem;
+  typedef zmshape<polygon, shape_type::polygonz> polygonz;
+  typedef zmshape<polygon, shape_type::polygonm> polygonm;
+
+  shputil::shape_type xy_type(shputil::shape_type stype); // point for pointz/pointm etc, null_shape if unreadable (multipatch)
+  bool has_z(shputil::shape_type stype);
+  
   using shape_ptr = std::shared_ptr<shape>;
   
   class shapefile {
   public:
-    std::vector<shape_ptr> shapes;
+    shapefile() { }
+    explicit shapefile(std::pmr::memory_resource *mr) : shapes(mr) { }
+    std::pmr::vector<shape_ptr> shapes;
   };
   
   bool read_shp(const std::string &path, shapefile &shpfile);
   bool write_shp(const std::string &path, const shapefile &shpfile);
+
+  //
+  // opt-in spatial ordering at write time: records are sorted by the hilbert key of their
+  // bbox center, so nearby features land in nearby pages. order[i] is the shpfile.shapes
+  // index written as record i, hand it to dbfutil::write_dbf to keep the rows aligned.
+  //
+  class write_opts {
+  public:
+    write_opts() { hilbert_order = false; }
+    bool hilbert_order;
+  };
+
+  bool write_shp(const std::string &path, const shapefile &shpfile, const write_opts &opts, std::vector<uint32_t> &order);
+
+  //
+  // adds records after the existing ones in the .shp/.shx, then patches only the headers
+  // (file_length and bbox). shapes must match the layer's type. a failed append truncates
+  // back to the original records, append_layer (shpedit.h) does the .dbf in step.
+  //
+  bool append_shp(const std::string &path, const shapefile &shpfile);
+
+  //
+  // deletes: null_records overwrites each record's shape type with null in place (its
+  // length is kept, so offsets don't move), after checking every recno. compact_shp is a
+  // full streamed rewrite rather than an in-place one: the kept records go into a new
+  // .shp/.shx (renumbered, bbox recomputed) that is renamed over the old pair.
+  //
+  bool null_records(const std::string &path, const std::vector<uint32_t> &recnos); // 0-based
+  bool compact_shp(const std::string &path, const std::vector<bool> &keep); // keep[recno]
+  bool write_compacted_shp(const std::string &path, const std::vector<bool> &keep, const std::string &out_path); // the copy alone, to out_path and its .shx
+  bool shape_bounds(const shape_ptr &shp, double &xmin, double &ymin, double &xmax, double &ymax); // false for null/empty shapes
+  bool shape_bounds(const pointshape &pt, double &xmin, double &ymin, double &xmax, double &ymax);
+  bool shape_bounds(const multipointshape &mp, double &xmin, double &ymin, double &xmax, double &ymax);
+  bool shape_bounds(const polyline &pl, double &xmin, double &ymin, double &xmax, double &ymax);
+  bool shape_bounds(const polygon &pg, double &xmin, double &ymin, double &xmax, double &ymax);
+  uint32_t hilbert_key(uint32_t x, uint32_t y); // x, y in [0, 65535]
+  void hilbert_order(const shapefile &shpfile, std::vector<uint32_t> &order); // null shapes sort last, ties keep input order
+
+  //
+  // the fixed 100 byte main header, without touching any records
+  //
+  class shpinfo {
+  public:
+    shputil::shape_type stype;
+    uint64_t file_bytes; // from the header's file_length
+    double xmin, ymin, xmax, ymax, zmin, zmax, mmin, mmax;
+  };
+
+  static const uint32_t SHP_HEADER_BYTES = 100;
+  static const uint32_t SHP_RECORD_HEADER_BYTES = 8;
+  
+  bool parse_shp_header(const uint8_t *header, shpinfo &info); // SHP_HEADER_BYTES
+  void encode_shp_header(const shpinfo &info, uint8_t *header);  // SHP_HEADER_BYTES, same layout for the .shx
+  bool read_shp_info(const std::string &path, shpinfo &info);
+
+  //
+  // record level access, the .shx gives every record's offset and size
+  //
+  class shx_entry {
+  public:
+    uint64_t offset;        // byte offset of the record header within the .shp
+    uint32_t content_bytes; // excludes the 8 byte record header
+  };
+
+  bool shx_path(const std::string &shp_path, std::string &shxpath);
+  bool read_shx(const std::string &shp_path, std::vector<shx_entry> &entries);
+  // .shx entries for records whose headers start at offsets[idx] in the .shp with
+  // content_bytes[idx] after them, written at fp's position: after encode_shp_header's
+  // header for a new index, at the end for an append. offsets may hold a trailing end offset
+  bool write_shx(FILE *fp, const std::vector<uint64_t> &offsets, const std::vector<uint64_t> &content_bytes);
+  bool decode_shape(const uint8_t *content, uint32_t content_bytes, shape_ptr &shp,
+		    std::pmr::memory_resource *mr = std::pmr::get_default_resource()); // null records decode to a plain shape
+  bool record_bounds(const uint8_t *content, uint32_t content_bytes, double *bb); // xmin, ymin, xmax, ymax without decoding, false for null
+
+  //
+  // fixed byte order fields at any alignment: record headers and the .shx are big-endian,
+  // record content little-endian
+  //
+  inline int32_t load_BEint32(const uint8_t *src) {
+    int32_t val;
+    memcpy(&val, src, sizeof(int32_t));
+#if BYTE_ORDER == LITTLE_ENDIAN
+    val = __builtin_bswap32(val);
+#endif
+    return(val);
+  }
+
+  inline int32_t load_LEint32(const uint8_t *src) {
+    int32_t val;
+    memcpy(&val, src, sizeof(int32_t));
+#if BYTE_ORDER == BIG_ENDIAN
+    val = __builtin_bswap32(val);
+#endif
+    return(val);
+  }
+
+  inline double load_LEdouble(const uint8_t *src) {
+    uint64_t bits;
+    memcpy(&bits, src, sizeof(uint64_t));
+#if BYTE_ORDER == BIG_ENDIAN
+    bits = __builtin_bswap64(bits);
+#endif
+    double val;
+    memcpy(&val, &bits, sizeof(double));
+    return(val);
+  }
+
+  inline void store_BEint32(uint8_t *dst, int32_t val) {
+#if BYTE_ORDER == LITTLE_ENDIAN
+    val = __builtin_bswap32(val);
+#endif
+    memcpy(dst, &val, sizeof(int32_t));
+  }
+
+  inline void store_LEint32(uint8_t *dst, int32_t val) {
+#if BYTE_ORDER == BIG_ENDIAN
+    val = __builtin_bswap32(val);
+#endif
+    memcpy(dst, &val, sizeof(int32_t));
+  }
+
+  inline void store_LEdouble(uint8_t *dst, double val) {
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(double));
+#if BYTE_ORDER == BIG_ENDIAN
+    bits = __builtin_bswap64(bits);
+#endif
+    memcpy(dst, &bits, sizeof(uint64_t));
+  }
+
+  //
+  // the parts and points of a raw record without decoding, for code that walks records
+  // in place. parse_record_parts() checks the layout once: the point run fits the
+  // content and the part starts ascend from 0 within it, so the accessors need no checks.
+  // points are little-endian x,y pairs, 16 bytes each. a point or multipoint is one part,
+  // a null record (or one xy_type() can't read) has none.
+  //
+  class parts_view {
+  public:
+    shape_type stype;       // xy type
+    uint32_t numparts;
+    uint32_t numpoints;
+    const uint8_t *parts;   // numparts little-endian starts, null for points/multipoints
+    const uint8_t *points;
+    uint32_t part_start(uint32_t part) const { return(parts ? (uint32_t) load_LEint32(parts + (sizeof(int32_t) * part)) : 0); }
+    uint32_t part_end(uint32_t part) const { return(((part + 1) < numparts) ? part_start(part + 1) : numpoints); }
+    const uint8_t *part_points(uint32_t part) const { return(points + (16 * (uint64_t) part_start(part))); }
+  };
+
+  bool parse_record_parts(const uint8_t *content, uint32_t content_bytes, parts_view &view); // false if malformed
+
+  //
+  // the inverse, for writers that place records themselves. sizes depend only on part and
+  // point counts, so offsets can be laid out before anything is encoded. xy types only.
+  //
+  uint64_t encoded_content_bytes(const shape_ptr &shp); // excludes the record header, 0 if not encodable
+  bool encode_record(const shape_ptr &shp, int32_t record_number, uint8_t *record); // header + content, 1-based record_number
+
+  //
+  // the same codecs resolved at compile time, for code that knows its shape class
+  // (shplayer.h): no shape_ptr, no stype(). decode_record accepts the class's z/m record
+  // types too and fails on anything else, null records included. encode writes the xy type.
+  //
+  bool decode_record(const uint8_t *content, uint32_t content_bytes, pointshape &pt);
+  bool decode_record(const uint8_t *content, uint32_t content_bytes, multipointshape &mp);
+  bool decode_record(const uint8_t *content, uint32_t content_bytes, polyline &pl);
+  bool decode_record(const uint8_t *content, uint32_t content_bytes, polygon &pg);
+  uint64_t encoded_content_bytes(const pointshape &pt);
+  uint64_t encoded_content_bytes(const multipointshape &mp);
+  uint64_t encoded_content_bytes(const polyline &pl);
+  uint64_t encoded_content_bytes(const polygon &pg);
+  bool encode_record(const pointshape &pt, int32_t record_number, uint8_t *record);
+  bool encode_record(const multipointshape &mp, int32_t record_number, uint8_t *record);
+  bool encode_record(const polyline &pl, int32_t record_number, uint8_t *record);
+  bool encode_record(const polygon &pg, int32_t record_number, uint8_t *record);
+
+  //
+  // z/m on demand, one value per point in file order. records are physical (null records
+  // included, with no points), so record i's values are [record_points[i], record_points[i+1]).
+  // m is optional in the format, records without it get NaN.
+  //
+  class zmcolumns {
+  public:
+    std::vector<uint64_t> record_points;
+    std::vector<double> z; // empty unless requested and the layer has z
+    std::vector<double> m; // empty unless requested and some record carries m
+  };
+
+  bool decode_zm(const uint8_t *content, uint32_t content_bytes, std::vector<double> *z, std::vector<double> *m, uint32_t &num_points); // appends, z/m may be null
+  bool read_zm(const std::string &path, zmcolumns &columns, bool want_z = true, bool want_m = true);
   
 } // shputil namespace
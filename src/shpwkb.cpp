@@ -0,0 +1,764 @@
+
+#include "shpwkb.h"
+#include "shpshared.h"
+#include "logging.h"
+#include "iostats.h"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+
+#ifdef __APPLE__
+  #include <machine/endian.h>
+#else
+  #include <endian.h>
+#endif
+
+namespace shputil {
+
+  static const bool HOST_LITTLE_ENDIAN = (BYTE_ORDER == LITTLE_ENDIAN);
+
+  enum wkb_type : uint32_t { wkb_point = 1, wkb_linestring = 2, wkb_polygon = 3, wkb_multipoint = 4,
+			     wkb_multilinestring = 5, wkb_multipolygon = 6 };
+
+  static const uint32_t EWKB_SRID_FLAG = 0x20000000;
+  static const uint32_t EWKB_ZM_FLAGS = 0xc0000000;
+
+
+  static uint32_t load_u32(const uint8_t *ptr, bool little_endian) {
+    uint32_t val;
+    memcpy(&val, ptr, sizeof(uint32_t));
+    return((little_endian == HOST_LITTLE_ENDIAN) ? val : __builtin_bswap32(val));
+  }
+
+
+  static double load_dbl(const uint8_t *ptr, bool little_endian) {
+    uint64_t bits;
+    memcpy(&bits, ptr, sizeof(uint64_t));
+    if(little_endian != HOST_LITTLE_ENDIAN) {
+      bits = __builtin_bswap64(bits);
+    }
+    double val;
+    memcpy(&val, &bits, sizeof(double));
+    return(val);
+  }
+
+
+  static uint8_t *store_u32(uint8_t *ptr, uint32_t val, bool little_endian) {
+    if(little_endian != HOST_LITTLE_ENDIAN) {
+      val = __builtin_bswap32(val);
+    }
+    memcpy(ptr, &val, sizeof(uint32_t));
+    return(ptr + sizeof(uint32_t));
+  }
+
+
+  static uint8_t *store_dbl(uint8_t *ptr, double val, bool little_endian) {
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(double));
+    if(little_endian != HOST_LITTLE_ENDIAN) {
+      bits = __builtin_bswap64(bits);
+    }
+    memcpy(ptr, &bits, sizeof(uint64_t));
+    return(ptr + sizeof(uint64_t));
+  }
+
+
+  //
+  // ring points out as little-endian x,y. the common case (little-endian, right
+  // orientation) is a single memcpy
+  //
+  static uint8_t *copy_points(uint8_t *dst, const wkb_converter::ring &ring) {
+
+    if(ring.little_endian && !ring.reverse) {
+      memcpy(dst, ring.points, 16 * (size_t) ring.count);
+      return(dst + (16 * (size_t) ring.count));
+    }
+
+    for(uint32_t idx=0; idx < ring.count; ++idx) {
+      const uint8_t *src = ring.points + (16 * (size_t) (ring.reverse ? (ring.count - 1 - idx) : idx));
+      if(ring.little_endian) {
+	memcpy(dst, src, 16);
+	dst += 16;
+      }
+      else {
+	dst = store_dbl(dst, load_dbl(src, false), true);
+	dst = store_dbl(dst, load_dbl(src + sizeof(double), false), true);
+      }
+    }
+
+    return(dst);
+  }
+
+
+  static void ring_stats(wkb_converter::ring &ring) {
+
+    ring.area2 = 0.0;
+    ring.bb[0] = ring.bb[1] = HUGE_VAL;
+    ring.bb[2] = ring.bb[3] = -HUGE_VAL;
+    if(ring.count == 0) {
+      return;
+    }
+
+    double ox = load_dbl(ring.points, ring.little_endian), oy = load_dbl(ring.points + sizeof(double), ring.little_endian);
+    double px = 0.0, py = 0.0;
+    for(uint32_t idx=0; idx < ring.count; ++idx) {
+      double x = load_dbl(ring.points + (16 * (size_t) idx), ring.little_endian);
+      double y = load_dbl(ring.points + (16 * (size_t) idx) + sizeof(double), ring.little_endian);
+      ring.bb[0] = std::min(ring.bb[0], x);
+      ring.bb[1] = std::min(ring.bb[1], y);
+      ring.bb[2] = std::max(ring.bb[2], x);
+      ring.bb[3] = std::max(ring.bb[3], y);
+      x -= ox;
+      y -= oy;
+      ring.area2 += (px * y) - (x * py);
+      px = x;
+      py = y;
+    }
+    // closing edge back to the origin (0, 0) adds nothing
+  }
+
+
+  static bool ring_contains(const wkb_converter::ring &ring, double x, double y) {
+    bool inside = false;
+    for(uint32_t i=0, j=ring.count - 1; i < ring.count; j = i++) {
+      double xi = load_dbl(ring.points + (16 * (size_t) i), ring.little_endian);
+      double yi = load_dbl(ring.points + (16 * (size_t) i) + sizeof(double), ring.little_endian);
+      double xj = load_dbl(ring.points + (16 * (size_t) j), ring.little_endian);
+      double yj = load_dbl(ring.points + (16 * (size_t) j) + sizeof(double), ring.little_endian);
+      if(((yi > y) != (yj > y)) && (x < (((xj - xi) * (y - yi) / (yj - yi)) + xi))) {
+	inside = !inside;
+      }
+    }
+    return(inside);
+  }
+
+
+  //
+  // shapefile ring list -> polygons: clockwise rings are outers, every counter-clockwise
+  // ring goes to the smallest outer holding its first point
+  //
+  static void group_rings(std::vector<wkb_converter::ring> &rings, std::vector<uint32_t> &order, uint32_t &polygons) {
+
+    for(wkb_converter::ring &ring : rings) {
+      ring_stats(ring);
+      ring.owner = -1;
+    }
+
+    for(uint32_t hole=0; hole < rings.size(); ++hole) {
+      wkb_converter::ring &ring = rings[hole];
+      if((ring.area2 <= 0.0) || (ring.count == 0)) {
+	continue;
+      }
+
+      double x = load_dbl(ring.points, ring.little_endian), y = load_dbl(ring.points + sizeof(double), ring.little_endian);
+      double best = HUGE_VAL;
+      for(uint32_t outer=0; outer < rings.size(); ++outer) {
+	const wkb_converter::ring &candidate = rings[outer];
+	if((candidate.area2 >= 0.0) || (-candidate.area2 >= best) ||
+	   (x < candidate.bb[0]) || (x > candidate.bb[2]) || (y < candidate.bb[1]) || (y > candidate.bb[3]) ||
+	   !ring_contains(candidate, x, y)) {
+	  continue;
+	}
+	best = -candidate.area2;
+	ring.owner = outer;
+      }
+    }
+
+    //
+    // outers in ring order, each followed by its holes. an outer is reversed if it's
+    // clockwise, a hole if it's counter-clockwise (they all are, in a valid file)
+    //
+    std::vector<uint32_t> holes_of(rings.size() + 1, 0);
+    for(const wkb_converter::ring &ring : rings) {
+      if(ring.owner >= 0) {
+	holes_of[ring.owner + 1] += 1;
+      }
+    }
+    for(size_t idx=1; idx < holes_of.size(); ++idx) {
+      holes_of[idx] += holes_of[idx - 1];
+    }
+
+    std::vector<uint32_t> holes(holes_of.back());
+    std::vector<uint32_t> fill(holes_of.begin(), holes_of.end() - 1);
+    for(uint32_t idx=0; idx < rings.size(); ++idx) {
+      if(rings[idx].owner >= 0) {
+	holes[fill[rings[idx].owner]++] = idx;
+      }
+    }
+
+    order.clear();
+    polygons = 0;
+    for(uint32_t idx=0; idx < rings.size(); ++idx) {
+      wkb_converter::ring &ring = rings[idx];
+      if(ring.owner >= 0) {
+	ring.reverse = (ring.area2 > 0.0);
+	continue;
+      }
+      ring.reverse = (ring.area2 < 0.0);
+      order.push_back(idx);
+      polygons += 1;
+      for(uint32_t pos=holes_of[idx]; pos < holes_of[idx + 1]; ++pos) {
+	order.push_back(holes[pos]);
+      }
+    }
+  }
+
+
+  static void parts_of_record(const parts_view &view, std::vector<wkb_converter::ring> &rings) {
+
+    rings.clear();
+    for(uint32_t part=0; part < view.numparts; ++part) {
+      wkb_converter::ring ring;
+      ring.points = view.part_points(part);
+      ring.count = view.part_end(part) - view.part_start(part);
+      ring.little_endian = true;
+      ring.reverse = false;
+      ring.owner = -1;
+      rings.push_back(ring);
+    }
+  }
+
+
+  static uint8_t *wkb_header(uint8_t *ptr, uint32_t type) {
+    *ptr++ = 1; // little-endian
+    return(store_u32(ptr, type, true));
+  }
+
+
+  bool wkb_converter::to_wkb(const uint8_t *content, uint32_t content_bytes, uint8_t *wkb, uint64_t capacity, uint64_t &bytes) {
+
+    bytes = 0;
+    parts_view view;
+    if(!parse_record_parts(content, content_bytes, view)) {
+      return(false);
+    }
+
+    uint64_t need = 0;
+    uint32_t polygons = 0;
+    switch(view.stype) {
+    case shape_type::null_shape:
+      return(true);
+
+    case shape_type::point:
+      need = 5 + 16;
+      break;
+
+    case shape_type::multipoint:
+      need = 9 + ((5 + 16) * (uint64_t) view.numpoints);
+      break;
+
+    case shape_type::polyline:
+      parts_of_record(view, rings);
+      need = (rings.size() == 1) ? 9 : (9 + (9 * (uint64_t) rings.size()));
+      for(const ring &part : rings) {
+	need += 16 * (uint64_t) part.count;
+      }
+      break;
+
+    case shape_type::polygon:
+      parts_of_record(view, rings);
+      group_rings(rings, order, polygons);
+      need = (polygons == 1) ? 0 : 9;
+      need += 9 * (uint64_t) polygons;
+      for(const ring &part : rings) {
+	need += 4 + (16 * (uint64_t) part.count);
+      }
+      break;
+
+    default:
+      return(false);
+    }
+
+    bytes = need;
+    if(capacity < need) {
+      return(false);
+    }
+
+    uint8_t *ptr = wkb;
+    if(view.stype == shape_type::point) {
+      ptr = wkb_header(ptr, wkb_point);
+      memcpy(ptr, view.points, 16);
+    }
+    else if(view.stype == shape_type::multipoint) {
+      ptr = store_u32(wkb_header(ptr, wkb_multipoint), view.numpoints, true);
+      for(uint32_t idx=0; idx < view.numpoints; ++idx) {
+	ptr = wkb_header(ptr, wkb_point);
+	memcpy(ptr, view.points + (16 * (size_t) idx), 16);
+	ptr += 16;
+      }
+    }
+    else if(view.stype == shape_type::polyline) {
+      if(rings.size() != 1) {
+	ptr = store_u32(wkb_header(ptr, wkb_multilinestring), rings.size(), true);
+      }
+      for(const ring &part : rings) {
+	ptr = store_u32(wkb_header(ptr, wkb_linestring), part.count, true);
+	ptr = copy_points(ptr, part);
+      }
+    }
+    else {
+      if(polygons != 1) {
+	ptr = store_u32(wkb_header(ptr, wkb_multipolygon), polygons, true);
+      }
+      for(size_t pos=0; pos < order.size(); ) {
+	size_t end = pos + 1;
+	while((end < order.size()) && (rings[order[end]].owner >= 0)) {
+	  ++end;
+	}
+	ptr = store_u32(wkb_header(ptr, wkb_polygon), end - pos, true);
+	for(; pos < end; ++pos) {
+	  const ring &part = rings[order[pos]];
+	  ptr = store_u32(ptr, part.count, true);
+	  ptr = copy_points(ptr, part);
+	}
+      }
+    }
+
+    return(true);
+  }
+
+
+  class wkb_cursor {
+  public:
+    wkb_cursor(const uint8_t *ptr, uint64_t left) : ptr(ptr), left(left) { }
+    const uint8_t *take(uint64_t count) {
+      if(count > left) {
+	return(0);
+      }
+      const uint8_t *at = ptr;
+      ptr += count;
+      left -= count;
+      return(at);
+    }
+    bool u32(bool little_endian, uint32_t &val) {
+      const uint8_t *at = take(sizeof(uint32_t));
+      if(at) {
+	val = load_u32(at, little_endian);
+      }
+      return(at != 0);
+    }
+    bool header(uint32_t &type, bool &little_endian) {
+      const uint8_t *order = take(1);
+      if(!order || (*order > 1) || !u32(little_endian = (*order == 1), type)) {
+	return(false);
+      }
+      if((type & EWKB_ZM_FLAGS) || ((type & 0x0fffffff) > 7)) {
+	log_error("unsupported wkb geometry type: 0x%x\n", type);
+	return(false);
+      }
+      uint32_t srid = 0;
+      if((type & EWKB_SRID_FLAG) && !u32(little_endian, srid)) {
+	return(false);
+      }
+      type &= 0x0fffffff;
+      return(true);
+    }
+    const uint8_t *ptr;
+    uint64_t left;
+  };
+
+
+  static bool read_ring(wkb_cursor &cursor, bool little_endian, int32_t owner, std::vector<wkb_converter::ring> &rings) {
+    uint32_t count = 0;
+    if(!cursor.u32(little_endian, count)) {
+      return(false);
+    }
+    wkb_converter::ring ring;
+    ring.points = cursor.take(16 * (uint64_t) count);
+    ring.count = count;
+    ring.little_endian = little_endian;
+    ring.reverse = false;
+    ring.owner = owner;
+    if(!ring.points) {
+      return(false);
+    }
+    rings.push_back(ring);
+    return(true);
+  }
+
+
+  static bool read_polygon(wkb_cursor &cursor, bool little_endian, std::vector<wkb_converter::ring> &rings) {
+    uint32_t count = 0;
+    if(!cursor.u32(little_endian, count)) {
+      return(false);
+    }
+    for(uint32_t idx=0; idx < count; ++idx) {
+      if(!read_ring(cursor, little_endian, (idx == 0) ? -1 : 0, rings)) { // owner only marks outer vs hole here
+	return(false);
+      }
+    }
+    return(true);
+  }
+
+
+  bool wkb_converter::to_record(const uint8_t *wkb, uint64_t wkb_bytes, uint8_t *content, uint64_t capacity, uint64_t &bytes) {
+
+    bytes = 0;
+    rings.clear();
+    wkb_cursor cursor(wkb, wkb_bytes);
+    uint32_t type = 0;
+    bool little_endian = true;
+    if(!cursor.header(type, little_endian)) {
+      return(false);
+    }
+
+    //
+    // collect the point runs, the sizes follow from them
+    //
+    shape_type stype = shape_type::null_shape;
+    bool ok = true;
+    uint32_t count = 0;
+    switch(type) {
+    case wkb_point:
+      stype = shape_type::point;
+      ok = (cursor.left >= 16);
+      if(ok) {
+	ring point = { cursor.take(16), 1, little_endian, false, -1, 0.0, { 0.0, 0.0, 0.0, 0.0 } };
+	rings.push_back(point);
+      }
+      break;
+
+    case wkb_linestring:
+      stype = shape_type::polyline;
+      ok = read_ring(cursor, little_endian, -1, rings);
+      break;
+
+    case wkb_polygon:
+      stype = shape_type::polygon;
+      ok = read_polygon(cursor, little_endian, rings);
+      break;
+
+    case wkb_multipoint:
+    case wkb_multilinestring:
+    case wkb_multipolygon:
+      stype = (type == wkb_multipoint) ? shape_type::multipoint : ((type == wkb_multilinestring) ? shape_type::polyline : shape_type::polygon);
+      ok = cursor.u32(little_endian, count);
+      for(uint32_t idx=0; ok && (idx < count); ++idx) {
+	uint32_t element = 0;
+	bool element_le = true;
+	ok = cursor.header(element, element_le) && (element == (type - 3));
+	if(!ok) {
+	  break;
+	}
+	if(type == wkb_multipoint) {
+	  ring point = { cursor.take(16), 1, element_le, false, -1, 0.0, { 0.0, 0.0, 0.0, 0.0 } };
+	  ok = (point.points != 0);
+	  rings.push_back(point);
+	}
+	else if(type == wkb_multilinestring) {
+	  ok = read_ring(cursor, element_le, -1, rings);
+	}
+	else {
+	  ok = read_polygon(cursor, element_le, rings);
+	}
+      }
+      break;
+
+    default:
+      log_error("unsupported wkb geometry type: %u\n", type);
+      return(false);
+    }
+
+    if(!ok) {
+      return(false);
+    }
+
+    uint64_t numpoints = 0;
+    bool first = true;
+    double bb[4] = { 0.0, 0.0, 0.0, 0.0 };
+    for(ring &part : rings) {
+      ring_stats(part);
+      numpoints += part.count;
+      if(part.count == 0) {
+	continue;
+      }
+      if(first || (part.bb[0] < bb[0])) bb[0] = part.bb[0];
+      if(first || (part.bb[1] < bb[1])) bb[1] = part.bb[1];
+      if(first || (part.bb[2] > bb[2])) bb[2] = part.bb[2];
+      if(first || (part.bb[3] > bb[3])) bb[3] = part.bb[3];
+      first = false;
+      if(stype == shape_type::polygon) {
+	part.reverse = (part.owner < 0) ? (part.area2 > 0.0) : (part.area2 < 0.0); // outers clockwise, holes counter-clockwise
+      }
+    }
+
+    bool empty = (numpoints == 0) || ((stype == shape_type::point) && std::isnan(bb[0]));
+    if(empty) {
+      stype = shape_type::null_shape;
+    }
+
+    const uint32_t BB_END = sizeof(int32_t) + (4 * sizeof(double));
+    uint64_t need = sizeof(int32_t);
+    if(stype == shape_type::point) {
+      need = sizeof(int32_t) + 16;
+    }
+    else if(stype == shape_type::multipoint) {
+      need = BB_END + sizeof(int32_t) + (16 * numpoints);
+    }
+    else if(stype != shape_type::null_shape) {
+      need = BB_END + (2 * sizeof(int32_t)) + (sizeof(int32_t) * (uint64_t) rings.size()) + (16 * numpoints);
+    }
+
+    if(((need / 2) > (uint64_t) INT32_MAX) || (numpoints > (uint64_t) INT32_MAX)) {
+      log_error("geometry is too large for a shapefile record\n");
+      return(false);
+    }
+
+    bytes = need;
+    if(capacity < need) {
+      return(false);
+    }
+
+    uint8_t *ptr = store_u32(content, (uint32_t) stype, true);
+    if(stype == shape_type::null_shape) {
+      return(true);
+    }
+
+    if(stype == shape_type::point) {
+      copy_points(ptr, rings[0]);
+      return(true);
+    }
+
+    for(int idx=0; idx < 4; ++idx) {
+      ptr = store_dbl(ptr, bb[idx], true);
+    }
+
+    if(stype == shape_type::multipoint) {
+      ptr = store_u32(ptr, numpoints, true);
+    }
+    else {
+      ptr = store_u32(ptr, rings.size(), true);
+      ptr = store_u32(ptr, numpoints, true);
+      uint32_t start = 0;
+      for(const ring &part : rings) {
+	ptr = store_u32(ptr, start, true);
+	start += part.count;
+      }
+    }
+
+    for(const ring &part : rings) {
+      ptr = copy_points(ptr, part);
+    }
+
+    return(true);
+  }
+
+
+  bool copy_writer::open(const std::string &copy_path, const dbfutil::dbfheader &dbf_header, bool text_is_utf8) {
+
+    abandon();
+
+    if(dbf_header.fields.size() >= 32767) {
+      log_error("too many fields for a copy row: %zu\n", dbf_header.fields.size());
+      return(false);
+    }
+
+    fp = fopen(copy_path.c_str(), "wb");
+    if(!fp) {
+      log_error("couldn't create copy stream: %s\n", copy_path.c_str());
+      return(false);
+    }
+
+    path = copy_path;
+    header = dbf_header;
+    utf8_text = text_is_utf8;
+    rows = 0;
+
+    static const uint8_t signature[11] = { 'P', 'G', 'C', 'O', 'P', 'Y', '\n', 0xff, '\r', '\n', 0 };
+    uint8_t head[19];
+    memcpy(head, signature, sizeof(signature));
+    store_u32(head + 11, 0, false); // flags
+    store_u32(head + 15, 0, false); // header extension length
+    if(io_fwrite(head, sizeof(head), 1, fp) != 1) {
+      log_error("couldn't write copy header: %s\n", path.c_str());
+      abandon();
+      return(false);
+    }
+
+    return(true);
+  }
+
+
+  bool copy_writer::write(const uint8_t *wkb, uint64_t wkb_bytes, const dbfutil::dbfrow &row) {
+
+    if(!fp) {
+      return(false);
+    }
+
+    if((row.values.size() != header.fields.size()) || (wkb_bytes > (uint64_t) INT32_MAX)) {
+      log_error("copy row doesn't match the header\n");
+      return(false);
+    }
+
+    //
+    // network byte order: int16 field count, then int32 length + bytes per field
+    //
+    buf.resize(2);
+    uint16_t fields = 1 + header.fields.size();
+    buf[0] = fields >> 8;
+    buf[1] = fields & 0xff;
+
+    uint8_t scratch[8];
+    store_u32(scratch, wkb_bytes ? (uint32_t) wkb_bytes : 0xffffffff, false); // -1 = NULL
+    buf.insert(buf.end(), scratch, scratch + 4);
+    buf.insert(buf.end(), wkb, wkb + wkb_bytes);
+
+    for(size_t col=0; col < header.fields.size(); ++col) {
+      const dbfutil::dbffield_def &field = header.fields[col];
+      const dbfutil::dbffield_value &val = row.values[col];
+      if(field.field_type == "N") {
+	int64_t ival = 0;
+	if(val._vtype == dbfutil::dbffield_value::vtype::sint) {
+	  ival = val._s32_val;
+	}
+	else if(val._vtype == dbfutil::dbffield_value::vtype::uint) {
+	  ival = val._u32_val;
+	}
+	else {
+	  log_error("field value type mismatch at column %s (expected sint/uint)\n", field.field_name.c_str());
+	  return(false);
+	}
+	store_u32(scratch, 8, false);
+	buf.insert(buf.end(), scratch, scratch + 4);
+	store_u32(scratch, (uint64_t) ival >> 32, false);
+	store_u32(scratch + 4, (uint64_t) ival & 0xffffffff, false);
+	buf.insert(buf.end(), scratch, scratch + 8);
+      }
+      else if(field.field_type == "F") {
+	if(val._vtype != dbfutil::dbffield_value::vtype::dbl) {
+	  log_error("field value type mismatch at column %s (expected dbl)\n", field.field_name.c_str());
+	  return(false);
+	}
+	store_u32(scratch, 8, false);
+	buf.insert(buf.end(), scratch, scratch + 4);
+	store_dbl(scratch, val._dbl_val, false);
+	buf.insert(buf.end(), scratch, scratch + 8);
+      }
+      else {
+	store_u32(scratch, val.value.size(), false);
+	buf.insert(buf.end(), scratch, scratch + 4);
+	buf.insert(buf.end(), val.value.begin(), val.value.end());
+      }
+    }
+
+    if(io_fwrite(buf.data(), buf.size(), 1, fp) != 1) {
+      log_error("couldn't write copy row\n");
+      return(false);
+    }
+
+    rows += 1;
+    return(true);
+  }
+
+
+  bool copy_writer::close() {
+
+    if(!fp) {
+      return(true);
+    }
+
+    uint8_t trailer[2] = { 0xff, 0xff }; // int16 -1
+    bool status = (io_fwrite(trailer, sizeof(trailer), 1, fp) == 1);
+    status = (fclose(fp) == 0) && status;
+    fp = 0;
+    if(!status) {
+      log_error("couldn't finish copy stream\n");
+      unlink(path.c_str());
+    }
+    return(status);
+  }
+
+
+  void copy_writer::abandon() {
+
+    if(!fp) {
+      return;
+    }
+
+    fclose(fp);
+    fp = 0;
+    unlink(path.c_str());
+  }
+
+
+  std::string copy_columns(const dbfutil::dbfheader &header, bool utf8_text) {
+
+    std::string columns = "geom geometry";
+    for(const dbfutil::dbffield_def &field : header.fields) {
+      const char *type = (field.field_type == "N") ? "int8" : (field.field_type == "F") ? "float8" : utf8_text ? "text" : "bytea";
+      columns += ", " + field.field_name + " " + type;
+    }
+    return(columns);
+  }
+
+
+  bool write_copy(const std::string &shp_path, const std::string &dbf_path, const std::string &copy_path) {
+
+    shared_shapefile layer;
+    if(!layer.open(shp_path)) {
+      return(false);
+    }
+
+    dbfutil::dbfreader dbf;
+    if(!dbf_path.empty()) {
+      if(!dbf.open(dbf_path)) {
+	return(false);
+      }
+      if(dbf.record_count != layer.record_count()) {
+	log_error("dbf has %u rows but %s has %u records\n", dbf.record_count, shp_path.c_str(), layer.record_count());
+	return(false);
+      }
+    }
+
+    //
+    // every early return below runs ~copy_writer, which removes the partial stream
+    //
+    copy_writer writer;
+    bool utf8_text = !dbf_path.empty() && dbfutil::dbf_text_is_utf8(dbf_path);
+    if(!writer.open(copy_path, dbf.header, utf8_text)) {
+      return(false);
+    }
+
+    shp_cursor cursor(layer);
+    wkb_converter converter;
+    std::vector<uint8_t> wkb(4096);
+    dbfutil::dbfrow row;
+    for(uint32_t recno=0; recno < layer.record_count(); ++recno) {
+      bool deleted = false;
+      if(!dbf_path.empty() && !dbf.read(recno, row, deleted)) {
+	return(false);
+      }
+      if(deleted) {
+	continue;
+      }
+
+      const uint8_t *content = 0;
+      uint32_t content_bytes = 0;
+      if(!cursor.read_raw(recno, content, content_bytes)) {
+	return(false);
+      }
+
+      uint64_t bytes = 0;
+      while(!converter.to_wkb(content, content_bytes, wkb.data(), wkb.size(), bytes)) {
+	if(bytes <= wkb.size()) {
+	  log_error("malformed record %u in %s\n", recno, shp_path.c_str());
+	  return(false);
+	}
+	wkb.resize(bytes);
+      }
+
+      if(!writer.write(wkb.data(), bytes, row)) {
+	return(false);
+      }
+    }
+
+    if(!writer.close()) {
+      return(false);
+    }
+
+    log("write_copy: %llu row(s), target table (%s)\n", (unsigned long long) writer.rows, copy_columns(dbf.header, utf8_text).c_str());
+    return(true);
+  }
+
+} // namespace shputil
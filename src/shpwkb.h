@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include "shputil.h"
+#include "dbfutil.h"
+
+namespace shputil {
+
+  //
+  // encoded .shp record content <-> little-endian WKB, buffer to buffer. coordinates are
+  // little-endian doubles on both sides, so runs of points are copied as bytes and only
+  // the headers are rewritten, no shape objects are built.
+  //
+  // shapefile polygons are a flat ring list (outer clockwise, holes counter-clockwise),
+  // WKB wants rings grouped per polygon with the outer counter-clockwise. holes go to the
+  // smallest outer ring holding them (a hole with no outer becomes an outer), and each
+  // ring is copied reversed when its orientation is wrong for the target. one part/outer
+  // ring gives LineString/Polygon, more give MultiLineString/MultiPolygon.
+  //
+  // z/m records are written as xy. WKB input may be either byte order and EWKB with an
+  // SRID; z/m and GeometryCollection aren't accepted. empty geometries become null records.
+  //
+  // both calls return false with bytes > capacity when the buffer is too small (grow it
+  // and call again), false with bytes == 0 on malformed input. a null record converts
+  // to 0 bytes of WKB (a NULL column).
+  //
+  class wkb_converter {
+  public:
+    bool to_wkb(const uint8_t *content, uint32_t content_bytes, uint8_t *wkb, uint64_t capacity, uint64_t &bytes);
+    bool to_record(const uint8_t *wkb, uint64_t wkb_bytes, uint8_t *content, uint64_t capacity, uint64_t &bytes);
+
+    class ring {
+    public:
+      const uint8_t *points; // 16 bytes per point
+      uint32_t count;
+      bool little_endian;
+      bool reverse;          // copy back to front
+      int32_t owner;         // outer ring index for holes, -1 for outers
+      double area2;          // twice the signed area
+      double bb[4];
+    };
+
+    std::vector<ring> rings;      // scratch, reused between calls
+    std::vector<uint32_t> order;  // rings in output order
+  };
+
+  //
+  // PostgreSQL binary COPY (COPY ... FROM STDIN WITH (FORMAT binary)). each row is the
+  // WKB geometry (NULL for null records) followed by the dbf fields: 'N' as int8, 'F' as
+  // float8 and 'C' as the raw dbf bytes, which go into a text column only when they're
+  // known to be UTF-8 (utf8_text, see dbfutil::dbf_text_is_utf8) and a bytea column
+  // otherwise. copy_columns() spells out the target table. rows hold every field,
+  // resolve a dictionary encoded table's coded fields with dbftable::value() first.
+  //
+  // only close() writes the trailer: a stream that fails, or a writer destroyed without
+  // close(), is removed rather than left as a shorter stream COPY would load.
+  //
+  class copy_writer {
+  public:
+    copy_writer() { fp = 0; rows = 0; utf8_text = false; }
+    ~copy_writer() { abandon(); }
+    bool open(const std::string &path, const dbfutil::dbfheader &header, bool utf8_text);
+    bool write(const uint8_t *wkb, uint64_t wkb_bytes, const dbfutil::dbfrow &row);
+    bool close(); // writes the trailer
+    void abandon(); // closes and unlinks
+    std::string path;
+    dbfutil::dbfheader header;
+    bool utf8_text;
+    uint64_t rows;
+    std::vector<uint8_t> buf;
+    FILE *fp;
+  };
+
+  std::string copy_columns(const dbfutil::dbfheader &header, bool utf8_text); // "geom geometry, NAME text, ..."
+
+  // a whole layer in record order, deleted dbf rows are left out. dbf_path may be empty
+  bool write_copy(const std::string &shp_path, const std::string &dbf_path, const std::string &copy_path);
+
+} // shputil namespace